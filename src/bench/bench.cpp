@@ -0,0 +1,679 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: bench.cpp
+// Entry point for ariel_bench, canned scene runs and kernel microbenchmarks with thread scaling
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <random>
+#include "../grid/particlegrid.hpp"
+#include "../grid/particlepool.hpp"
+#include "../grid/levelset.hpp"
+#include "../geom/spheregen.hpp"
+#include "../spatial/bvh.hpp"
+#include "../sim/flip.hpp"
+#include "../math/kernels.inl"
+#include "../sim/particlegridoperations.inl"
+#include "../sim/solver.inl"
+#include "../scene/sceneloader.hpp"
+#include "../utilities/threadpinner.hpp"
+
+using namespace std;
+
+//====================================
+// Struct Declarations
+//====================================
+
+//One benchmark at one resolution and thread count. Seconds is the fastest repetition and items
+//is the work done per repetition, so throughput is items/seconds in units per second
+struct BenchResult{
+    string              m_name;
+    string              m_unit;
+    int                 m_resolution;
+    int                 m_threads;
+    int                 m_repetitions;
+    double              m_seconds;
+    double              m_items;
+    double              m_speedup;      //against the same benchmark at the lowest thread count
+    double              m_efficiency;   //speedup per multiple of the lowest thread count
+};
+
+struct BenchSettings{
+    vector<int>         m_resolutions;
+    vector<int>         m_threads;
+    int                 m_frames;       //frames per canned scene run
+    double              m_minTime;      //seconds each kernel keeps repeating for
+    bool                m_scenes;
+    bool                m_kernels;
+    string              m_sceneDir;     //where the canned scene files are written
+    bool                m_pinThreads;   //pin scheduler threads to cores, filling sockets in order
+};
+
+//====================================
+// Helpers
+//====================================
+
+//Integer hash mapped to [0,1), so every input is reproducible and can be built in parallel
+inline float HashToUnit(unsigned int n){
+    n = (n ^ 61) ^ (n >> 16);
+    n = n + (n << 3);
+    n = n ^ (n >> 4);
+    n = n * 0x27d4eb2d;
+    n = n ^ (n >> 15);
+    return (n & 0xffffff)/16777216.0f;
+}
+
+inline glm::vec3 HashToSphere(const unsigned int& n){
+    float z = HashToUnit(2*n)*2.0f - 1.0f;
+    float phi = HashToUnit(2*n+1)*2.0f*PI;
+    float r = sqrt(1.0f - z*z);
+    return glm::vec3(r*cos(phi), r*sin(phi), z);
+}
+
+vector<int> ParseList(const string& data){
+    vector<int> list;
+    vector<string> tokens = utilityCore::tokenizeString(data, ",");
+    for(unsigned int i=0; i<tokens.size(); i++){
+        if(atoi(tokens[i].c_str())>0){
+            list.push_back(atoi(tokens[i].c_str()));
+        }
+    }
+    return list;
+}
+
+//Runs setup untimed and then kernel timed, after one warmup, until minTime has passed and at
+//least three repetitions are in. Returns the fastest repetition
+template <typename S, typename K> double TimeKernel(const S& setup, const K& kernel,
+                                                    const double& minTime, int& repetitions){
+    setup();
+    kernel();
+    double best = 0.0;
+    double total = 0.0;
+    repetitions = 0;
+    while(repetitions<3 || total<minTime){
+        setup();
+        tbb::tick_count start = tbb::tick_count::now();
+        kernel();
+        double seconds = (tbb::tick_count::now()-start).seconds();
+        best = (repetitions==0 || seconds<best) ? seconds : best;
+        total += seconds;
+        repetitions++;
+    }
+    return best;
+}
+
+//Times a kernel once per thread count, each time inside an arena of exactly that many threads
+//so every parallel loop the kernel reaches is capped the same way
+template <typename S, typename K> void RunKernel(const BenchSettings& settings,
+                                                 vector<BenchResult>& results, const string& name,
+                                                 const string& unit, const int& resolution,
+                                                 const double& items, const S& setup,
+                                                 const K& kernel){
+    for(unsigned int t=0; t<settings.m_threads.size(); t++){
+        BenchResult result;
+        result.m_name = name;
+        result.m_unit = unit;
+        result.m_resolution = resolution;
+        result.m_threads = settings.m_threads[t];
+        result.m_items = items;
+        result.m_speedup = 1.0;
+        result.m_efficiency = 1.0;
+        tbb::task_arena arena(result.m_threads);
+        arena.execute([&]{
+            result.m_seconds = TimeKernel(setup, kernel, settings.m_minTime,
+                                          result.m_repetitions);
+        });
+        cout << "Bench: " << name << " " << resolution << "^3, " << result.m_threads
+             << " threads: " << items/result.m_seconds << " " << unit << "/s" << endl;
+        results.push_back(result);
+    }
+}
+
+//====================================
+// Canned Scenes
+//====================================
+
+enum BenchScene{BENCH_DAMBREAK=0, BENCH_EMITTER, BENCH_COLLIDER, BENCH_SCENES};
+
+static const char* benchSceneNames[BENCH_SCENES] = {"dambreak", "emitter", "collider"};
+
+string JsonVec(const glm::vec3& v){
+    ostringstream s;
+    s << "{\"x\": " << v.x << ", \"y\": " << v.y << ", \"z\": " << v.z << "}";
+    return s.str();
+}
+
+string JsonTransform(const string& id, const glm::vec3& translation){
+    return "{\"id\": \"" + id + "\", \"translation\": " + JsonVec(translation) +
+           ", \"rotation\": " + JsonVec(glm::vec3(0)) + ", \"scale\": " + JsonVec(glm::vec3(1)) +
+           "}";
+}
+
+string JsonGeom(const string& id, const vector<string>& meshes, const vector<string>& transforms,
+                const int& interval, const bool& persist){
+    ostringstream s;
+    s << "{\"id\": \"" << id << "\", \"type\": \"mesh\", \"geom_frames\": [";
+    for(unsigned int i=0; i<meshes.size(); i++){
+        s << (i>0 ? ", " : "") << "\"" << meshes[i] << "\"";
+    }
+    s << "], \"transform_frames\": [";
+    for(unsigned int i=0; i<transforms.size(); i++){
+        s << (i>0 ? ", " : "") << "\"" << transforms[i] << "\"";
+    }
+    s << "], \"frame_interval\": " << interval << ", \"frame_offset\": 0, "
+      << "\"pre_persist\": false, \"post_persist\": " << (persist ? "true" : "false") << "}";
+    return s.str();
+}
+
+//FNV-1a over particle positions and velocities in vector order
+unsigned int HashParticles(const vector<fluidCore::Particle*>& particles){
+    unsigned int hash = 2166136261u;
+    for(unsigned int i=0; i<particles.size(); i++){
+        const float values[6] = {particles[i]->m_p.x, particles[i]->m_p.y, particles[i]->m_p.z,
+                                 particles[i]->m_u.x, particles[i]->m_u.y, particles[i]->m_u.z};
+        const unsigned char* bytes = (const unsigned char*)values;
+        for(unsigned int c=0; c<sizeof(values); c++){
+            hash = (hash^bytes[c])*16777619u;
+        }
+    }
+    return hash;
+}
+
+//Builds a scene file for a cubic domain of the given resolution. Geometry is laid out in
+//fractions of the domain so every resolution runs the same shot
+string BuildSceneJson(const BenchScene& scene, const int& resolution, const bool& deterministic){
+    float n = resolution;
+    vector<string> transforms;
+    vector<string> meshfiles;
+    vector<string> geoms;
+    vector<string> sims;
+    transforms.push_back(JsonTransform("identity", glm::vec3(0)));
+    vector<string> identity(1, "identity");
+    if(scene==BENCH_DAMBREAK){
+        //a column of water released in one corner
+        meshfiles.push_back("{\"id\": \"column\", \"mesh_gen\": \"box\", \"point0\": " +
+                            JsonVec(glm::vec3(0)) + ", \"point1\": " +
+                            JsonVec(glm::vec3(0.4f*n, 0.7f*n, 0.4f*n)) + "}");
+        geoms.push_back(JsonGeom("column", vector<string>(1, "column"), identity, 1, false));
+        sims.push_back("{\"geom\": \"column\", \"type\": \"liquid\"}");
+    }else if(scene==BENCH_EMITTER){
+        //a shallow tank with a persistent emitter pouring into it from above
+        meshfiles.push_back("{\"id\": \"tank\", \"mesh_gen\": \"box\", \"point0\": " +
+                            JsonVec(glm::vec3(0)) + ", \"point1\": " +
+                            JsonVec(glm::vec3(n, 0.25f*n, n)) + "}");
+        meshfiles.push_back("{\"id\": \"emitter\", \"mesh_gen\": \"sphere\", \"center\": " +
+                            JsonVec(glm::vec3(0.5f*n, 0.75f*n, 0.5f*n)) + ", \"radius\": " +
+                            utilityCore::convertIntToString(glm::max(2, resolution/12)) + "}");
+        geoms.push_back(JsonGeom("tank", vector<string>(1, "tank"), identity, 1, false));
+        geoms.push_back(JsonGeom("emitter", vector<string>(1, "emitter"), identity, 1, true));
+        sims.push_back("{\"geom\": \"tank\", \"type\": \"liquid\"}");
+        sims.push_back("{\"geom\": \"emitter\", \"type\": \"liquid\", \"velocity\": " +
+                       JsonVec(glm::vec3(0.0f, -1.0f, 0.0f)) + "}");
+    }else{
+        //a sphere dragged through a pool along keyframed transforms
+        meshfiles.push_back("{\"id\": \"pool\", \"mesh_gen\": \"box\", \"point0\": " +
+                            JsonVec(glm::vec3(0)) + ", \"point1\": " +
+                            JsonVec(glm::vec3(n, 0.4f*n, n)) + "}");
+        meshfiles.push_back("{\"id\": \"ball\", \"mesh_gen\": \"sphere\", \"center\": " +
+                            JsonVec(glm::vec3(0)) + ", \"radius\": " +
+                            utilityCore::convertIntToString(glm::max(2, resolution/7)) + "}");
+        transforms.push_back(JsonTransform("ball0", glm::vec3(0.2f*n, 0.45f*n, 0.5f*n)));
+        transforms.push_back(JsonTransform("ball1", glm::vec3(0.5f*n, 0.3f*n, 0.5f*n)));
+        transforms.push_back(JsonTransform("ball2", glm::vec3(0.8f*n, 0.45f*n, 0.5f*n)));
+        vector<string> keys;
+        keys.push_back("ball0");
+        keys.push_back("ball1");
+        keys.push_back("ball2");
+        geoms.push_back(JsonGeom("pool", vector<string>(1, "pool"), identity, 1, false));
+        geoms.push_back(JsonGeom("ball", vector<string>(3, "ball"), keys, 4, true));
+        sims.push_back("{\"geom\": \"pool\", \"type\": \"liquid\"}");
+        sims.push_back("{\"geom\": \"ball\", \"type\": \"solid\"}");
+    }
+
+    ostringstream s;
+    s << "{\n\"settings\": [{\"density\": 0.5, \"step_size\": 0.005, \"dim\": "
+      << JsonVec(glm::vec3(n)) << ", \"deterministic\": " << (deterministic ? "true" : "false")
+      << "}],\n";
+    s << "\"globalforces\": [" << JsonVec(glm::vec3(0.0f, -9.8f, 0.0f)) << "],\n";
+    string groups[4] = {"transforms", "meshfiles", "geoms", "sim"};
+    vector<string>* lists[4] = {&transforms, &meshfiles, &geoms, &sims};
+    for(unsigned int g=0; g<4; g++){
+        s << "\"" << groups[g] << "\": [\n";
+        for(unsigned int i=0; i<lists[g]->size(); i++){
+            s << "    " << (*lists[g])[i] << (i+1<lists[g]->size() ? ",\n" : "\n");
+        }
+        s << "]" << (g<3 ? ",\n" : "\n");
+    }
+    s << "}\n";
+    return s.str();
+}
+
+//Loads and inits outside the clock, then times frames 1 through the frame count. Reports
+//particle updates and cell updates per second from the same run. Every scene also runs in
+//deterministic mode to measure its overhead, and checks that mode's final particle positions
+//hash the same at every thread count
+void RunSceneBenchmarks(const BenchSettings& settings, vector<BenchResult>& results){
+    for(unsigned int r=0; r<settings.m_resolutions.size(); r++){
+        int resolution = settings.m_resolutions[r];
+        for(unsigned int b=0; b<BENCH_SCENES*2; b++){
+            bool deterministic = b>=BENCH_SCENES;
+            BenchScene scene = (BenchScene)(b%BENCH_SCENES);
+            string name = string("scene_") + benchSceneNames[scene] +
+                          (deterministic ? "_deterministic" : "");
+            string filename = settings.m_sceneDir + "/bench_" + benchSceneNames[scene] +
+                              (deterministic ? "_deterministic_" : "_") +
+                              utilityCore::convertIntToString(resolution) + ".json";
+            ofstream file(filename.c_str());
+            if(!file.is_open()){
+                cout << "Error: Unable to write bench scene " << filename << endl;
+                continue;
+            }
+            file << BuildSceneJson(scene, resolution, deterministic);
+            file.close();
+
+            unsigned int firstHash = 0;
+            for(unsigned int t=0; t<settings.m_threads.size(); t++){
+                int threads = settings.m_threads[t];
+                double seconds = 0.0;
+                double particles = 0.0;
+                unsigned int hash = 0;
+                tbb::task_arena arena(threads);
+                arena.execute([&]{
+                    sceneCore::SceneLoader* sloader = new sceneCore::SceneLoader(filename);
+                    fluidCore::FlipSim* sim = new fluidCore::FlipSim(sloader->GetDimensions(),
+                                                                     sloader->GetDensity(),
+                                                                     sloader->GetStepsize(),
+                                                                     sloader->GetScene(),
+                                                                     sloader->GetFlipSettings(),
+                                                                     false);
+                    sim->Init();
+                    tbb::tick_count start = tbb::tick_count::now();
+                    for(int f=0; f<settings.m_frames; f++){
+                        sim->Step(false, false, false);
+                        particles += sim->GetParticles()->size();
+                    }
+                    seconds = (tbb::tick_count::now()-start).seconds();
+                    hash = HashParticles(*sim->GetParticles());
+                    delete sim;
+                    delete sloader->GetScene();
+                    delete sloader;
+                });
+                BenchResult result;
+                result.m_name = name;
+                result.m_resolution = resolution;
+                result.m_threads = threads;
+                result.m_repetitions = 1;
+                result.m_seconds = seconds;
+                result.m_speedup = 1.0;
+                result.m_efficiency = 1.0;
+                result.m_unit = "particles";
+                result.m_items = particles;
+                results.push_back(result);
+                result.m_unit = "cells";
+                result.m_items = (double)resolution*resolution*resolution*settings.m_frames;
+                results.push_back(result);
+                cout << "Bench: " << name << " " << resolution << "^3, " << threads
+                     << " threads: " << seconds/settings.m_frames << " s/frame" << endl;
+                if(t==0){
+                    firstHash = hash;
+                }else if(deterministic && hash!=firstHash){
+                    cout << "Warning: " << name << " " << resolution << "^3 diverged at "
+                         << threads << " threads" << endl;
+                }
+            }
+        }
+    }
+}
+
+//====================================
+// Kernel Microbenchmarks
+//====================================
+
+void RunKernelBenchmarks(const BenchSettings& settings, const int& resolution,
+                         vector<BenchResult>& results){
+    glm::vec3 dimensions = glm::vec3(resolution);
+    float density = 0.5f;
+    float maxd = resolution;
+    float w = density/maxd;
+    unsigned int cells = resolution*resolution*resolution;
+
+    //Grid<T> access, per cell through GetCell/SetCell and per row through GetRowSpan
+    fluidCore::Grid<float> grid(dimensions, 0.0f, false);
+    fluidCore::Grid<float>* g = &grid;
+    RunKernel(settings, results, "grid_cell_access", "cells", resolution, cells, []{}, [=]{
+        g->ForEachActiveBlock(dimensions, [=](const glm::vec3& lo, const glm::vec3& hi){
+            for(int i=lo.x; i<hi.x; ++i){
+                for(int j=lo.y; j<hi.y; ++j){
+                    for(int k=lo.z; k<hi.z; ++k){
+                        g->SetCell(i,j,k, g->GetCell(i,j,k)+1.0f);
+                    }
+                }
+            }
+        });
+    });
+    RunKernel(settings, results, "grid_span_access", "cells", resolution, cells, []{}, [=]{
+        g->ForEachActiveBlock(dimensions, [=](const glm::vec3& lo, const glm::vec3& hi){
+            int k0 = lo.z;
+            for(int i=lo.x; i<hi.x; ++i){
+                for(int j=lo.y; j<hi.y; ++j){
+                    float* row = g->GetRowSpan(i,j,k0);
+                    for(int k=k0; k<hi.z; ++k){
+                        row[k-k0] += 1.0f;
+                    }
+                }
+            }
+        });
+    });
+
+    //a jittered block of liquid filling an eighth of the domain, with a swirling velocity
+    fluidCore::ParticlePool pool;
+    vector<fluidCore::Particle*> shuffled;
+    int side = 0.5f*maxd/density;
+    for(int i=0; i<side; i++){
+        for(int j=0; j<side; j++){
+            for(int k=0; k<side; k++){
+                unsigned int n = (i*side+j)*side+k;
+                fluidCore::Particle* p = pool.Allocate();
+                glm::vec3 jitter = glm::vec3(HashToUnit(3*n), HashToUnit(3*n+1),
+                                             HashToUnit(3*n+2)) - glm::vec3(0.5f);
+                p->m_p = (glm::vec3(i,j,k) + glm::vec3(0.5f) + 0.5f*jitter)*w;
+                p->m_u = glm::vec3(p->m_p.z-0.25f, 0.0f, 0.25f-p->m_p.x);
+                p->m_n = glm::vec3(0.0f);
+                p->m_density = 1.0f;
+                p->m_mass = 1.0f;
+                p->m_type = FLUID;
+                p->m_invalid = false;
+                shuffled.push_back(p);
+            }
+        }
+    }
+    shuffle(shuffled.begin(), shuffled.end(), mt19937(resolution));
+    unsigned int particlecount = shuffled.size();
+
+    //ParticleGrid::Sort from a fully shuffled order, the worst case for the counting sort
+    fluidCore::ParticleGrid pgrid(dimensions);
+    fluidCore::ParticleGrid* pg = &pgrid;
+    vector<fluidCore::Particle*> particles;
+    vector<fluidCore::Particle*>* ps = &particles;
+    vector<fluidCore::Particle*>* source = &shuffled;
+    RunKernel(settings, results, "particlegrid_sort", "particles", resolution, particlecount,
+              [=]{ *ps = *source; }, [=]{ pg->Sort(*ps); });
+    particles = shuffled;
+    pgrid.Sort(particles);
+    fluidCore::ParticleSet set;
+    set.Gather(particles);
+    fluidCore::ParticleSet* s = &set;
+
+    //P2G, both the gather and the scatter formulation
+    fluidCore::MacGrid mgrid = fluidCore::CreateMacgrid(dimensions, false);
+    fluidCore::MacGrid* m = &mgrid;
+    RunKernel(settings, results, "splat_gather", "particles", resolution, particlecount, []{},
+              [=]{ fluidCore::SplatParticlesToMACGrid(pg, *s, m); });
+    //one workspace reused across repeats, the way the sim reuses it across substeps
+    fluidCore::SplatWorkspace splatWorkspace = fluidCore::CreateSplatWorkspace();
+    fluidCore::SplatWorkspace* sw = &splatWorkspace;
+    RunKernel(settings, results, "splat_scatter", "particles", resolution, particlecount, []{},
+              [=]{ fluidCore::ScatterParticlesToMACGrid(pg, *s, m, *sw); });
+    fluidCore::ClearSplatWorkspace(splatWorkspace);
+
+    //Solve with each preconditioner on the block's cells and a fixed pseudorandom divergence.
+    //Solve flips the divergence in place, so every repetition starts from a fresh copy
+    pgrid.MarkCellTypes(set, &mgrid, density, NULL, 0.0f);
+    pgrid.BuildSDF(set, mgrid, density);
+    fluidCore::Grid<float> divergence(dimensions, 0.0f, false);
+    unsigned int fluidcells = 0;
+    for(int i=0; i<resolution; i++){
+        for(int j=0; j<resolution; j++){
+            for(int k=0; k<resolution; k++){
+                if(mgrid.m_A->GetCell(i,j,k)==FLUID){
+                    divergence.SetCell(i,j,k, HashToUnit((i*resolution+j)*resolution+k)-0.5f);
+                    fluidcells++;
+                }
+            }
+        }
+    }
+    fluidCore::Grid<float>* d = &divergence;
+    //The _deterministic variants use fixed-order reductions, and MIC runs as wavefront MIC
+    fluidCore::PreconditionerType preconditioners[6] = {fluidCore::MIC, fluidCore::WAVEFRONT_MIC,
+                                                        fluidCore::MULTIGRID, fluidCore::MIC,
+                                                        fluidCore::WAVEFRONT_MIC,
+                                                        fluidCore::MULTIGRID};
+    string preconditionerNames[6] = {"solve_mic", "solve_wavefront_mic", "solve_multigrid",
+                                     "solve_mic_deterministic",
+                                     "solve_wavefront_mic_deterministic",
+                                     "solve_multigrid_deterministic"};
+    for(unsigned int p=0; p<6; p++){
+        fluidCore::FlipSettings solversettings;
+        solversettings.m_preconditioner = preconditioners[p];
+        solversettings.m_deterministic = p>=3;
+        //one workspace per variant, reused across repeats the way the sim reuses it across steps
+        fluidCore::SolverWorkspace workspace = fluidCore::CreateSolverWorkspace();
+        fluidCore::SolverWorkspace* w = &workspace;
+        RunKernel(settings, results, preconditionerNames[p], "cells", resolution, fluidcells,
+                  [=]{ m->m_D->Copy(d); m->m_P->Clear(); },
+                  [=]{ fluidCore::Solve(*m, 1, solversettings, *w, false); });
+        fluidCore::ClearSolverWorkspace(workspace);
+    }
+    fluidCore::ClearMacgrid(mgrid);
+
+    //Bvh<T> traversal against a sphere whose tesselation grows with the resolution, with rays
+    //aimed from a surrounding shell at random points inside the sphere
+    spaceCore::Bvh<objCore::Obj> sphere;
+    geomCore::SphereGen spheregen(resolution);
+    glm::vec3 center = 0.5f*dimensions;
+    float radius = 0.25f*maxd;
+    spheregen.Tesselate(&sphere.m_basegeom, center, radius);
+    sphere.BuildBvh(24);
+    spaceCore::Bvh<objCore::Obj>* bvh = &sphere;
+    unsigned int raycount = 1<<18;
+    vector<rayCore::Ray> rays(raycount);
+    for(unsigned int i=0; i<raycount; i++){
+        glm::vec3 origin = center + HashToSphere(2*i)*maxd;
+        glm::vec3 target = center + HashToSphere(2*i+1)*radius*HashToUnit(i);
+        rays[i] = rayCore::Ray(origin, glm::normalize(target-origin), 0.0f, i);
+    }
+    rayCore::Ray* raydata = &rays[0];
+    RunKernel(settings, results, "bvh_traverse", "rays", resolution, raycount, []{}, [=]{
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,raycount),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    spaceCore::TraverseAccumulator result(raydata[i].m_origin);
+                    bvh->Traverse(raydata[i], result);
+                }
+            }
+        );
+    });
+    RunKernel(settings, results, "bvh_traverse_packet", "rays", resolution, raycount, []{}, [=]{
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,raycount/BVH_PACKET_WIDTH),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    spaceCore::TraverseAccumulator packet[BVH_PACKET_WIDTH];
+                    spaceCore::TraverseAccumulator* packetresults[BVH_PACKET_WIDTH];
+                    for(unsigned int p=0; p<BVH_PACKET_WIDTH; p++){
+                        packet[p] = spaceCore::TraverseAccumulator(
+                                        raydata[i*BVH_PACKET_WIDTH+p].m_origin);
+                        packetresults[p] = &packet[p];
+                    }
+                    bvh->TraversePacket(&raydata[i*BVH_PACKET_WIDTH], packetresults,
+                                        BVH_PACKET_WIDTH);
+                }
+            }
+        );
+    });
+    RunKernel(settings, results, "bvh_traverse_anyhit", "rays", resolution, raycount, []{}, [=]{
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,raycount),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    bvh->TraverseAnyHit(raydata[i], 2.0f*maxd);
+                }
+            }
+        );
+    });
+
+    //LevelSet sampling inside the narrow band around the same sphere
+    fluidCore::LevelSet levelset(&sphere.m_basegeom);
+    fluidCore::LevelSet* ls = &levelset;
+    unsigned int samplecount = 1<<20;
+    vector<glm::vec3> positions(samplecount);
+    vector<float> values(samplecount);
+    for(unsigned int i=0; i<samplecount; i++){
+        positions[i] = center + HashToSphere(i)*(radius + 2.0f*(HashToUnit(i+samplecount)-0.5f));
+    }
+    glm::vec3* positiondata = &positions[0];
+    float* valuedata = &values[0];
+    RunKernel(settings, results, "levelset_sample", "samples", resolution, samplecount, []{},
+              [=]{ ls->Sample(positiondata, valuedata, samplecount); });
+}
+
+//====================================
+// Output
+//====================================
+
+//Speedups are against the lowest thread count each benchmark ran at. Efficiency falling off
+//past one socket's worth of threads points at remote memory traffic
+void ComputeSpeedups(vector<BenchResult>& results){
+    for(unsigned int i=0; i<results.size(); i++){
+        const BenchResult* baseline = &results[i];
+        for(unsigned int j=0; j<results.size(); j++){
+            if(results[j].m_name==results[i].m_name && results[j].m_unit==results[i].m_unit &&
+               results[j].m_resolution==results[i].m_resolution &&
+               results[j].m_threads<baseline->m_threads){
+                baseline = &results[j];
+            }
+        }
+        results[i].m_speedup = results[i].m_seconds>0.0 ?
+                               baseline->m_seconds/results[i].m_seconds : 0.0;
+        results[i].m_efficiency = results[i].m_speedup*baseline->m_threads/results[i].m_threads;
+    }
+}
+
+//A filename ending in .json writes one json object per line, anything else writes csv with a
+//header row, same as the sim's stats output
+bool WriteResults(const string& filename, const vector<BenchResult>& results){
+    FILE* file = fopen(filename.c_str(), "w");
+    if(file==NULL){
+        cout << "Error: Unable to write bench results to " << filename << endl;
+        return false;
+    }
+    size_t dot = filename.find_last_of('.');
+    bool json = dot!=string::npos && strcmp(filename.c_str()+dot, ".json")==0;
+    if(json==false){
+        fprintf(file, "benchmark,unit,resolution,threads,repetitions,seconds,items,"
+                      "throughput,speedup,efficiency\n");
+    }
+    for(unsigned int i=0; i<results.size(); i++){
+        const BenchResult& r = results[i];
+        double throughput = r.m_seconds>0.0 ? r.m_items/r.m_seconds : 0.0;
+        if(json){
+            fprintf(file, "{\"benchmark\": \"%s\", \"unit\": \"%s\", \"resolution\": %d, "
+                          "\"threads\": %d, \"repetitions\": %d, \"seconds\": %.6f, "
+                          "\"items\": %.0f, \"throughput\": %.1f, \"speedup\": %.3f, "
+                          "\"efficiency\": %.3f}\n",
+                    r.m_name.c_str(), r.m_unit.c_str(), r.m_resolution, r.m_threads,
+                    r.m_repetitions, r.m_seconds, r.m_items, throughput, r.m_speedup,
+                    r.m_efficiency);
+        }else{
+            fprintf(file, "%s,%s,%d,%d,%d,%.6f,%.0f,%.1f,%.3f,%.3f\n", r.m_name.c_str(),
+                    r.m_unit.c_str(), r.m_resolution, r.m_threads, r.m_repetitions,
+                    r.m_seconds, r.m_items, throughput, r.m_speedup, r.m_efficiency);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char** argv){
+
+    cout << "" << endl;
+    cout << "===================================================" << endl;
+    cout << "Ariel: FLIP Fluid Simulator Benchmarks" << endl;
+    cout << "Version 0.2.14.38a" << endl;
+    cout << "Copyright (C) Yining Karl Li. All rights reserved." << endl;
+    cout << "===================================================" << endl;
+    cout << "" << endl;
+
+    int maxThreads = tbb::task_scheduler_init::default_num_threads();
+    BenchSettings settings;
+    settings.m_frames = 10;
+    settings.m_minTime = 0.25;
+    settings.m_scenes = true;
+    settings.m_kernels = true;
+    settings.m_sceneDir = ".";
+    settings.m_pinThreads = false;
+    settings.m_resolutions.push_back(32);
+    settings.m_resolutions.push_back(64);
+    settings.m_resolutions.push_back(128);
+    for(int t=1; t<maxThreads; t*=2){
+        settings.m_threads.push_back(t);
+    }
+    settings.m_threads.push_back(maxThreads);
+    string outputfile = "";
+
+    for(int i=1; i<argc; i++){
+        string header; string data;
+        istringstream liness(argv[i]);
+        getline(liness, header, '='); getline(liness, data, '=');
+        if(strcmp(header.c_str(), "-output")==0){
+            outputfile = data;
+        }else if(strcmp(header.c_str(), "-resolutions")==0){
+            settings.m_resolutions = ParseList(data);
+        }else if(strcmp(header.c_str(), "-threads")==0){
+            settings.m_threads = ParseList(data);
+        }else if(strcmp(header.c_str(), "-frames")==0){
+            settings.m_frames = glm::max(1, atoi(data.c_str()));
+        }else if(strcmp(header.c_str(), "-mintime")==0){
+            settings.m_minTime = atof(data.c_str());
+        }else if(strcmp(header.c_str(), "-scenedir")==0){
+            settings.m_sceneDir = data;
+        }else if(strcmp(header.c_str(), "-scenes")==0){
+            settings.m_kernels = false;
+        }else if(strcmp(header.c_str(), "-kernels")==0){
+            settings.m_scenes = false;
+        }else if(strcmp(header.c_str(), "-pin")==0){
+            settings.m_pinThreads = true;
+        }
+    }
+
+    if(settings.m_resolutions.empty() || settings.m_threads.empty()){
+        cout << "Error: empty resolution or thread list! Use -resolutions=[a,b] -threads=[a,b]\n"
+             << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    //pinned threads fill cores in order, so each arena below runs on as few sockets as it can
+    //and the scaling report shows where a run first spills onto the next socket
+    if(settings.m_pinThreads){
+        utilityCore::ThreadPinner* pinner = new utilityCore::ThreadPinner();
+        cout << "Pinning threads across " << pinner->GetCpuCount() << " cores" << endl;
+    }
+
+    //the scheduler is sized for the largest arena up front, arenas then cap each run below it
+    tbb::task_scheduler_init init(*max_element(settings.m_threads.begin(),
+                                               settings.m_threads.end()));
+
+    vector<BenchResult> results;
+    if(settings.m_kernels){
+        for(unsigned int r=0; r<settings.m_resolutions.size(); r++){
+            RunKernelBenchmarks(settings, settings.m_resolutions[r], results);
+        }
+    }
+    if(settings.m_scenes){
+        RunSceneBenchmarks(settings, results);
+    }
+    ComputeSpeedups(results);
+
+    cout << "" << endl;
+    for(unsigned int i=0; i<results.size(); i++){
+        const BenchResult& r = results[i];
+        printf("%-34s %4d^3 %3d threads %14.1f %s/s %6.2fx %5.1f%%\n", r.m_name.c_str(), 
+               r.m_resolution, r.m_threads, r.m_items/r.m_seconds, r.m_unit.c_str(), 
+               r.m_speedup, 100.0*r.m_efficiency);
+    }
+    if(strcmp(outputfile.c_str(), "")!=0 && WriteResults(outputfile, results)==false){
+        exit(EXIT_FAILURE);
+    }
+    return EXIT_SUCCESS;
+}
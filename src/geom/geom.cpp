@@ -32,6 +32,17 @@ HOST DEVICE void Geom::Intersect(const rayCore::Ray& r, spaceCore::TraverseAccum
     m_geom->Intersect(r, result);
 }
 
+HOST DEVICE void Geom::IntersectPacket(const rayCore::Ray* rays, 
+                                       spaceCore::TraverseAccumulator** results,
+                                       const unsigned int& count){
+    m_geom->IntersectPacket(rays, results, count);
+}
+
+HOST DEVICE bool Geom::IntersectSegment(const glm::vec3& start, const glm::vec3& end, 
+                                        const float& frame){
+    return m_geom->IntersectSegment(start, end, frame);
+}
+
 HOST DEVICE GeomType Geom::GetType(){
     return m_geom->GetType();
 }
@@ -41,6 +41,11 @@ class Geom {
         HOST DEVICE void SetContents(GeomInterface* geom);
         HOST DEVICE void Intersect(const rayCore::Ray& r, 
                                    spaceCore::TraverseAccumulator& result);
+        HOST DEVICE void IntersectPacket(const rayCore::Ray* rays, 
+                                         spaceCore::TraverseAccumulator** results,
+                                         const unsigned int& count);
+        HOST DEVICE bool IntersectSegment(const glm::vec3& start, const glm::vec3& end, 
+                                          const float& frame);
         HOST DEVICE GeomType GetType();
 
         GeomInterface*          m_geom;
@@ -54,6 +59,13 @@ class GeomInterface {
 
         HOST DEVICE virtual void Intersect(const rayCore::Ray& r,
                                            spaceCore::TraverseAccumulator& result) = 0;
+        //Rays in one packet call must share the same frame
+        HOST DEVICE virtual void IntersectPacket(const rayCore::Ray* rays, 
+                                                 spaceCore::TraverseAccumulator** results,
+                                                 const unsigned int& count) = 0;
+        //Any hit test, true if the segment from start to end crosses the geom at all
+        HOST DEVICE virtual bool IntersectSegment(const glm::vec3& start, const glm::vec3& end, 
+                                                  const float& frame) = 0;
         HOST DEVICE virtual GeomType GetType() = 0;
         HOST DEVICE virtual unsigned int GetID() = 0;
 
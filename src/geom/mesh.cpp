@@ -67,7 +67,7 @@ HOST DEVICE spaceCore::Aabb MeshContainer::GetAabb(const float& frame){
     glm::mat4 transform;
     glm::mat4 inverse;
     if(GetTransforms(frame, transform, inverse)==true){
-        spaceCore::Aabb box = GetMeshFrame(frame)->m_nodes[1].m_bounds;
+        spaceCore::Aabb box = GetMeshFrame(frame)->m_bounds;
         return box.Transform(transform);        
     }else{
         return spaceCore::Aabb();
@@ -121,6 +121,50 @@ HOST DEVICE void MeshContainer::Intersect(const rayCore::Ray& r,
     result.Transform(transform);
 }
 
+HOST DEVICE void MeshContainer::IntersectPacket(const rayCore::Ray* rays, 
+                                                spaceCore::TraverseAccumulator** results,
+                                                const unsigned int& count){
+    if(count==0){
+        return;
+    }
+    glm::mat4 transform;
+    glm::mat4 inversetransform;
+    if(GetTransforms(rays[0].m_frame, transform, inversetransform)==false){
+        return;
+    }
+    spaceCore::Bvh<objCore::Obj>* mesh = GetMeshFrame(rays[0].m_frame);
+    rayCore::Ray transformedRays[BVH_PACKET_WIDTH];
+    for(unsigned int first=0; first<count; first+=BVH_PACKET_WIDTH){
+        unsigned int lanes = glm::min((unsigned int)BVH_PACKET_WIDTH, count-first);
+        for(unsigned int l=0; l<lanes; l++){
+            transformedRays[l] = rays[first+l].Transform(inversetransform);
+        }
+        mesh->TraversePacket(transformedRays, &results[first], lanes);
+        for(unsigned int l=0; l<lanes; l++){
+            results[first+l]->Transform(transform);
+        }
+    }
+}
+
+HOST DEVICE bool MeshContainer::IntersectSegment(const glm::vec3& start, const glm::vec3& end, 
+                                                 const float& frame){
+    glm::mat4 transform;
+    glm::mat4 inversetransform;
+    if(GetTransforms(frame, transform, inversetransform)==false){
+        return false;
+    }
+    //segment length is measured in object space, so scaled transforms stay correct
+    glm::vec3 localStart = glm::vec3(utilityCore::multiply(inversetransform, 
+                                                           glm::vec4(start, 1.0f)));
+    glm::vec3 localEnd = glm::vec3(utilityCore::multiply(inversetransform, glm::vec4(end, 1.0f)));
+    float length = glm::length(localEnd-localStart);
+    if(length<=0.0f){
+        return false;
+    }
+    rayCore::Ray r(localStart, (localEnd-localStart)/length, frame);
+    return GetMeshFrame(frame)->TraverseAnyHit(r, length);
+}
+
 HOST DEVICE bool MeshContainer::IsDynamic(){
     if(m_prePersist==true && m_postPersist==true && m_numberOfFrames==1){
         return false;
@@ -173,7 +217,7 @@ HOST DEVICE spaceCore::Aabb AnimatedMeshContainer::GetAabb(const float& frame){
     glm::mat4 transform;
     glm::mat4 inverse;
     if(GetTransforms(frame, transform, inverse)==true){
-        spaceCore::Aabb box = GetMeshFrame(frame)->m_nodes[1].m_bounds;
+        spaceCore::Aabb box = GetMeshFrame(frame)->m_bounds;
         return box.Transform(transform);        
     }else{
         return spaceCore::Aabb();
@@ -245,6 +289,19 @@ HOST DEVICE spaceCore::Bvh<objCore::InterpolatedObj>* AnimatedMeshContainer::Get
     return m_meshFrames[lowerFrame];
 }
 
+void AnimatedMeshContainer::RefitMeshFrame(const float& frame){
+    if(IsInFrame(frame)==false){
+        return;
+    }
+    spaceCore::Bvh<objCore::InterpolatedObj>* mesh = GetMeshFrame(frame);
+    //InterpolatedObj lerps by the ray's frame, so bounds have to use the same weight
+    float interpolation = frame - glm::floor(frame);
+    if(mesh->m_basegeom.m_boundsInterpolation!=interpolation){
+        mesh->m_basegeom.m_boundsInterpolation = interpolation;
+        mesh->Refit();
+    }
+}
+
 HOST DEVICE void AnimatedMeshContainer::Intersect(const rayCore::Ray& r, 
                                                   spaceCore::TraverseAccumulator& result){
     glm::mat4 transform;
@@ -261,6 +318,50 @@ HOST DEVICE void AnimatedMeshContainer::Intersect(const rayCore::Ray& r,
     result.Transform(transform);
 }
 
+HOST DEVICE void AnimatedMeshContainer::IntersectPacket(const rayCore::Ray* rays, 
+                                                        spaceCore::TraverseAccumulator** results,
+                                                        const unsigned int& count){
+    if(count==0){
+        return;
+    }
+    glm::mat4 transform;
+    glm::mat4 inversetransform;
+    if(GetTransforms(rays[0].m_frame, transform, inversetransform)==false){
+        return;
+    }
+    spaceCore::Bvh<objCore::InterpolatedObj>* mesh = GetMeshFrame(rays[0].m_frame);
+    rayCore::Ray transformedRays[BVH_PACKET_WIDTH];
+    for(unsigned int first=0; first<count; first+=BVH_PACKET_WIDTH){
+        unsigned int lanes = glm::min((unsigned int)BVH_PACKET_WIDTH, count-first);
+        for(unsigned int l=0; l<lanes; l++){
+            transformedRays[l] = rays[first+l].Transform(inversetransform);
+        }
+        mesh->TraversePacket(transformedRays, &results[first], lanes);
+        for(unsigned int l=0; l<lanes; l++){
+            results[first+l]->Transform(transform);
+        }
+    }
+}
+
+HOST DEVICE bool AnimatedMeshContainer::IntersectSegment(const glm::vec3& start, 
+                                                         const glm::vec3& end, 
+                                                         const float& frame){
+    glm::mat4 transform;
+    glm::mat4 inversetransform;
+    if(GetTransforms(frame, transform, inversetransform)==false){
+        return false;
+    }
+    glm::vec3 localStart = glm::vec3(utilityCore::multiply(inversetransform, 
+                                                           glm::vec4(start, 1.0f)));
+    glm::vec3 localEnd = glm::vec3(utilityCore::multiply(inversetransform, glm::vec4(end, 1.0f)));
+    float length = glm::length(localEnd-localStart);
+    if(length<=0.0f){
+        return false;
+    }
+    rayCore::Ray r(localStart, (localEnd-localStart)/length, frame);
+    return GetMeshFrame(frame)->TraverseAnyHit(r, length);
+}
+
 HOST DEVICE bool AnimatedMeshContainer::IsDynamic(){
     return true;
 }
@@ -67,6 +67,11 @@ class MeshContainer: public virtual GeomInterface {
         HOST DEVICE GeomType GetType();
         HOST DEVICE unsigned int GetID();
         HOST DEVICE void Intersect(const rayCore::Ray& r, spaceCore::TraverseAccumulator& result);
+        HOST DEVICE void IntersectPacket(const rayCore::Ray* rays, 
+                                         spaceCore::TraverseAccumulator** results,
+                                         const unsigned int& count);
+        HOST DEVICE bool IntersectSegment(const glm::vec3& start, const glm::vec3& end, 
+                                          const float& frame);
 
         HOST DEVICE bool GetTransforms(const float& frame, glm::mat4& transform,
                                        glm::mat4& inversetransform);
@@ -102,11 +107,19 @@ class AnimatedMeshContainer: public virtual GeomInterface {
         HOST DEVICE GeomType GetType();
         HOST DEVICE unsigned int GetID();
         HOST DEVICE void Intersect(const rayCore::Ray& r, spaceCore::TraverseAccumulator& result);
+        HOST DEVICE void IntersectPacket(const rayCore::Ray* rays, 
+                                         spaceCore::TraverseAccumulator** results,
+                                         const unsigned int& count);
+        HOST DEVICE bool IntersectSegment(const glm::vec3& start, const glm::vec3& end, 
+                                          const float& frame);
 
         HOST DEVICE bool GetTransforms(const float& frame, glm::mat4& transform,
                                        glm::mat4& inversetransform);
         HOST DEVICE spaceCore::Bvh<objCore::InterpolatedObj>* GetMeshFrame(const float& frame);
         HOST DEVICE float GetInterpolationWeight(const float& frame);
+        //Refits the mesh frame used at frame to tight bounds at that frame's interpolation
+        //weight. Until the next refit, traversals of that mesh frame are only valid at frame
+        void RefitMeshFrame(const float& frame);
         HOST DEVICE bool IsDynamic();
         HOST DEVICE bool IsInFrame(const float& frame);
 
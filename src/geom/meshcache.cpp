@@ -0,0 +1,231 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: meshcache.cpp
+// Implements meshcache.hpp
+
+#include <tbb/tbb.h>
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+#include "meshcache.hpp"
+
+//source files are hashed in chunks of this many bytes, one task per chunk
+#define MESHCACHE_HASH_CHUNK (1<<22)
+
+namespace geomCore {
+
+static const char meshCacheMagic[8] = {'A', 'R', 'I', 'E', 'L', 'M', 'S', 'H'};
+
+static inline unsigned long long AlignOffset(const unsigned long long& offset){
+    return (offset + MESHCACHE_ALIGNMENT - 1) & ~(unsigned long long)(MESHCACHE_ALIGNMENT - 1);
+}
+
+MeshCache::MeshCache(){
+}
+
+MeshCache::~MeshCache(){
+}
+
+void MeshCache::Load(const std::string& filename, const unsigned int& maxDepth,
+                     spaceCore::Bvh<objCore::Obj>& mesh){
+    size_t sourceSize = 0;
+    char* source = utilityCore::mapFile(filename, sourceSize, false);
+    if(source==NULL){
+        //let ReadObj report the missing file, there is nothing to key a cache on
+        mesh.m_basegeom.ReadObj(filename);
+        mesh.BuildBvh(maxDepth);
+        return;
+    }
+    unsigned long long sourceHash = HashFile(source, sourceSize);
+    utilityCore::unmapFile(source, sourceSize);
+
+    std::string cachename = filename + MESHCACHE_EXTENSION;
+    if(ReadCache(cachename, sourceSize, sourceHash, maxDepth, mesh)==true){
+        std::cout << "Read mesh cache from " << cachename << std::endl;
+        return;
+    }
+    mesh.m_basegeom.ReadObj(filename);
+    mesh.BuildBvh(maxDepth);
+    if(WriteCache(cachename, sourceSize, sourceHash, maxDepth, mesh)==true){
+        std::cout << "Wrote mesh cache to " << cachename << std::endl;
+    }
+}
+
+bool MeshCache::ReadCache(const std::string& cachename, const unsigned long long& sourceSize,
+                          const unsigned long long& sourceHash, const unsigned int& maxDepth,
+                          spaceCore::Bvh<objCore::Obj>& mesh){
+    size_t cacheSize = 0;
+    char* cache = utilityCore::mapFile(cachename, cacheSize, true);
+    if(cache==NULL){
+        return false;
+    }
+    const MeshCacheHeader* header = (const MeshCacheHeader*)cache;
+    bool valid = cacheSize>=sizeof(MeshCacheHeader) &&
+                 memcmp(header->m_magic, meshCacheMagic, 8)==0 &&
+                 header->m_version==MESHCACHE_VERSION &&
+                 header->m_nodeSize==sizeof(spaceCore::Bvh4Node) &&
+                 header->m_maxDepth==maxDepth && header->m_sourceSize==sourceSize &&
+                 header->m_sourceHash==sourceHash;
+    for(unsigned int a=0; a<MESHCACHE_ARRAYS && valid; a++){
+        valid = header->m_offsets[a]%MESHCACHE_ALIGNMENT==0 &&
+                header->m_offsets[a]+header->m_sizes[a]<=cacheSize;
+    }
+    if(valid){
+        valid = header->m_sizes[MESHCACHE_VERTICES]==
+                    header->m_numberOfVertices*sizeof(glm::vec3) &&
+                header->m_sizes[MESHCACHE_NORMALS]==header->m_numberOfNormals*sizeof(glm::vec3) &&
+                header->m_sizes[MESHCACHE_UVS]==header->m_numberOfUVs*sizeof(glm::vec2) &&
+                header->m_sizes[MESHCACHE_POLYVERTICES]==
+                    header->m_numberOfPolys*sizeof(glm::uvec4) &&
+                header->m_sizes[MESHCACHE_POLYNORMALS]==
+                    header->m_numberOfPolys*sizeof(glm::uvec4) &&
+                header->m_sizes[MESHCACHE_POLYUVS]==header->m_numberOfPolys*sizeof(glm::uvec4) &&
+                header->m_sizes[MESHCACHE_NODES]==
+                    header->m_numberOfNodes*sizeof(spaceCore::Bvh4Node) &&
+                header->m_sizes[MESHCACHE_REFERENCES]==
+                    header->m_numberOfReferenceIndices*sizeof(unsigned int);
+    }
+    if(valid==false){
+        std::cout << "Mesh cache " << cachename << " is out of date, rebuilding..." << std::endl;
+        utilityCore::unmapFile(cache, cacheSize);
+        return false;
+    }
+    //the mapping is never unmapped, since scene meshes live as long as the scene does. m_keep
+    //stops the obj and the bvh from trying to delete arrays they don't own
+    objCore::Obj& obj = mesh.m_basegeom;
+    obj.m_numberOfVertices = header->m_numberOfVertices;
+    obj.m_vertices = (glm::vec3*)(cache+header->m_offsets[MESHCACHE_VERTICES]);
+    obj.m_numberOfNormals = header->m_numberOfNormals;
+    obj.m_normals = (glm::vec3*)(cache+header->m_offsets[MESHCACHE_NORMALS]);
+    obj.m_numberOfUVs = header->m_numberOfUVs;
+    obj.m_uvs = (glm::vec2*)(cache+header->m_offsets[MESHCACHE_UVS]);
+    obj.m_numberOfPolys = header->m_numberOfPolys;
+    obj.m_polyVertexIndices = (glm::uvec4*)(cache+header->m_offsets[MESHCACHE_POLYVERTICES]);
+    obj.m_polyNormalIndices = (glm::uvec4*)(cache+header->m_offsets[MESHCACHE_POLYNORMALS]);
+    obj.m_polyUVIndices = (glm::uvec4*)(cache+header->m_offsets[MESHCACHE_POLYUVS]);
+    obj.m_keep = true;
+    mesh.m_numberOfNodes = header->m_numberOfNodes;
+    mesh.m_nodes = (spaceCore::Bvh4Node*)(cache+header->m_offsets[MESHCACHE_NODES]);
+    mesh.m_numberOfReferenceIndices = header->m_numberOfReferenceIndices;
+    mesh.m_referenceIndices = (unsigned int*)(cache+header->m_offsets[MESHCACHE_REFERENCES]);
+    mesh.m_depth = header->m_depth;
+    mesh.m_keep = true;
+    mesh.m_bounds = spaceCore::Aabb(glm::vec3(header->m_boundsMin[0], header->m_boundsMin[1],
+                                              header->m_boundsMin[2]),
+                                    glm::vec3(header->m_boundsMax[0], header->m_boundsMax[1],
+                                              header->m_boundsMax[2]), -1);
+    return true;
+}
+
+//Writes to a temporary file and renames it into place, so another sim reading the same cache
+//never maps a half written file
+bool MeshCache::WriteCache(const std::string& cachename, const unsigned long long& sourceSize,
+                           const unsigned long long& sourceHash, const unsigned int& maxDepth,
+                           spaceCore::Bvh<objCore::Obj>& mesh){
+    objCore::Obj& obj = mesh.m_basegeom;
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(MeshCacheHeader));
+    memcpy(header.m_magic, meshCacheMagic, 8);
+    header.m_version = MESHCACHE_VERSION;
+    header.m_nodeSize = sizeof(spaceCore::Bvh4Node);
+    header.m_maxDepth = maxDepth;
+    header.m_depth = mesh.m_depth;
+    header.m_sourceSize = sourceSize;
+    header.m_sourceHash = sourceHash;
+    header.m_numberOfVertices = obj.m_numberOfVertices;
+    header.m_numberOfNormals = obj.m_numberOfNormals;
+    header.m_numberOfUVs = obj.m_numberOfUVs;
+    header.m_numberOfPolys = obj.m_numberOfPolys;
+    header.m_numberOfNodes = mesh.m_numberOfNodes;
+    header.m_numberOfReferenceIndices = mesh.m_numberOfReferenceIndices;
+    for(unsigned int i=0; i<3; i++){
+        header.m_boundsMin[i] = mesh.m_bounds.m_min[i];
+        header.m_boundsMax[i] = mesh.m_bounds.m_max[i];
+    }
+    const char* arrays[MESHCACHE_ARRAYS];
+    arrays[MESHCACHE_VERTICES] = (const char*)obj.m_vertices;
+    header.m_sizes[MESHCACHE_VERTICES] = obj.m_numberOfVertices*sizeof(glm::vec3);
+    arrays[MESHCACHE_NORMALS] = (const char*)obj.m_normals;
+    header.m_sizes[MESHCACHE_NORMALS] = obj.m_numberOfNormals*sizeof(glm::vec3);
+    arrays[MESHCACHE_UVS] = (const char*)obj.m_uvs;
+    header.m_sizes[MESHCACHE_UVS] = obj.m_numberOfUVs*sizeof(glm::vec2);
+    arrays[MESHCACHE_POLYVERTICES] = (const char*)obj.m_polyVertexIndices;
+    header.m_sizes[MESHCACHE_POLYVERTICES] = obj.m_numberOfPolys*sizeof(glm::uvec4);
+    arrays[MESHCACHE_POLYNORMALS] = (const char*)obj.m_polyNormalIndices;
+    header.m_sizes[MESHCACHE_POLYNORMALS] = obj.m_numberOfPolys*sizeof(glm::uvec4);
+    arrays[MESHCACHE_POLYUVS] = (const char*)obj.m_polyUVIndices;
+    header.m_sizes[MESHCACHE_POLYUVS] = obj.m_numberOfPolys*sizeof(glm::uvec4);
+    arrays[MESHCACHE_NODES] = (const char*)mesh.m_nodes;
+    header.m_sizes[MESHCACHE_NODES] = mesh.m_numberOfNodes*sizeof(spaceCore::Bvh4Node);
+    arrays[MESHCACHE_REFERENCES] = (const char*)mesh.m_referenceIndices;
+    header.m_sizes[MESHCACHE_REFERENCES] = mesh.m_numberOfReferenceIndices*sizeof(unsigned int);
+    unsigned long long offset = AlignOffset(sizeof(MeshCacheHeader));
+    for(unsigned int a=0; a<MESHCACHE_ARRAYS; a++){
+        header.m_offsets[a] = offset;
+        offset = AlignOffset(offset+header.m_sizes[a]);
+    }
+
+    std::string tempname = cachename + ".tmp" + utilityCore::convertIntToString(getpid());
+    std::ofstream file(tempname.c_str(), std::ios::out | std::ios::binary);
+    if(file.is_open()==false){
+        std::cout << "Warning: Unable to write mesh cache to " << cachename << std::endl;
+        return false;
+    }
+    static const char padding[MESHCACHE_ALIGNMENT] = {0};
+    file.write((const char*)&header, sizeof(MeshCacheHeader));
+    unsigned long long written = sizeof(MeshCacheHeader);
+    for(unsigned int a=0; a<MESHCACHE_ARRAYS; a++){
+        file.write(padding, header.m_offsets[a]-written);
+        if(header.m_sizes[a]>0){
+            file.write(arrays[a], header.m_sizes[a]);
+        }
+        written = header.m_offsets[a]+header.m_sizes[a];
+    }
+    file.close();
+    if(file.fail() || rename(tempname.c_str(), cachename.c_str())!=0){
+        std::cout << "Warning: Unable to write mesh cache to " << cachename << std::endl;
+        remove(tempname.c_str());
+        return false;
+    }
+    return true;
+}
+
+//64 bit FNV-1a over 8 byte words. Chunks are hashed in parallel, then their hashes are hashed in
+//order, so the result only depends on the file's contents
+unsigned long long MeshCache::HashFile(const char* data, const size_t& size){
+    const unsigned long long offsetBasis = 14695981039346656037ULL;
+    const unsigned long long prime = 1099511628211ULL;
+    unsigned int numberOfChunks = (size + MESHCACHE_HASH_CHUNK - 1)/MESHCACHE_HASH_CHUNK;
+    std::vector<unsigned long long> chunkHashes(numberOfChunks);
+    unsigned long long* hashes = numberOfChunks>0 ? &chunkHashes[0] : NULL;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,numberOfChunks,1),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                size_t begin = (size_t)c*MESHCACHE_HASH_CHUNK;
+                size_t end = std::min(begin+MESHCACHE_HASH_CHUNK, size);
+                unsigned long long hash = offsetBasis;
+                size_t i = begin;
+                for(; i+8<=end; i+=8){
+                    unsigned long long word;
+                    memcpy(&word, data+i, 8);
+                    hash = (hash ^ word)*prime;
+                }
+                for(; i<end; i++){
+                    hash = (hash ^ (unsigned char)data[i])*prime;
+                }
+                hashes[c] = hash;
+            }
+        }
+    );
+    unsigned long long hash = offsetBasis;
+    for(unsigned int c=0; c<numberOfChunks; c++){
+        hash = (hash ^ chunkHashes[c])*prime;
+    }
+    return hash;
+}
+}
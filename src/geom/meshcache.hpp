@@ -0,0 +1,83 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: meshcache.hpp
+// Binary cache of a meshfile's obj arrays and bvh, loaded by memory mapping
+
+#ifndef MESHCACHE_HPP
+#define MESHCACHE_HPP
+
+#include "obj/obj.hpp"
+#include "../spatial/bvh.hpp"
+#include "../utilities/utilities.h"
+
+//bump whenever the layout of the cache or of anything stored in it changes
+#define MESHCACHE_VERSION 1
+#define MESHCACHE_ALIGNMENT 64
+#define MESHCACHE_EXTENSION ".arielcache"
+
+namespace geomCore {
+
+//====================================
+// Enums
+//====================================
+
+enum MeshCacheArray{MESHCACHE_VERTICES=0, MESHCACHE_NORMALS, MESHCACHE_UVS,
+                    MESHCACHE_POLYVERTICES, MESHCACHE_POLYNORMALS, MESHCACHE_POLYUVS,
+                    MESHCACHE_NODES, MESHCACHE_REFERENCES, MESHCACHE_ARRAYS};
+
+//====================================
+// Struct Declarations
+//====================================
+
+//Sits at the start of every cache file. Arrays follow at 64 byte aligned offsets from the start
+//of the file, so mapped bvh nodes stay cache line aligned
+struct MeshCacheHeader {
+    char                m_magic[8];
+    unsigned int        m_version;
+    unsigned int        m_nodeSize;
+    unsigned int        m_maxDepth;
+    unsigned int        m_depth;
+    unsigned long long  m_sourceSize;
+    unsigned long long  m_sourceHash;
+    unsigned int        m_numberOfVertices;
+    unsigned int        m_numberOfNormals;
+    unsigned int        m_numberOfUVs;
+    unsigned int        m_numberOfPolys;
+    unsigned int        m_numberOfNodes;
+    unsigned int        m_numberOfReferenceIndices;
+    float               m_boundsMin[3];
+    float               m_boundsMax[3];
+    unsigned long long  m_offsets[MESHCACHE_ARRAYS];
+    unsigned long long  m_sizes[MESHCACHE_ARRAYS];
+};
+
+//====================================
+// Class Declarations
+//====================================
+
+//Caches live next to their obj as <obj>.arielcache, and are only used while the obj's size and
+//content hash still match. Loaded meshes point straight into a private copy on write mapping
+//of the cache, so sims loading the same cache share its pages
+class MeshCache {
+    public:
+        MeshCache();
+        ~MeshCache();
+
+        //Fills mesh from filename's cache if it is current. Otherwise reads the obj, builds its
+        //bvh, and writes a new cache for next time
+        void Load(const std::string& filename, const unsigned int& maxDepth,
+                  spaceCore::Bvh<objCore::Obj>& mesh);
+
+    private:
+        bool ReadCache(const std::string& cachename, const unsigned long long& sourceSize,
+                       const unsigned long long& sourceHash, const unsigned int& maxDepth,
+                       spaceCore::Bvh<objCore::Obj>& mesh);
+        bool WriteCache(const std::string& cachename, const unsigned long long& sourceSize,
+                        const unsigned long long& sourceHash, const unsigned int& maxDepth,
+                        spaceCore::Bvh<objCore::Obj>& mesh);
+        unsigned long long HashFile(const char* data, const size_t& size);
+};
+}
+
+#endif
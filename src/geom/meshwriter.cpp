@@ -0,0 +1,265 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: meshwriter.cpp
+// Implements meshwriter.hpp
+
+#include <tbb/tbb.h>
+#include <cstdio>
+#include <cstring>
+#include "meshwriter.hpp"
+
+//points or faces formatted per task
+#define MESHWRITER_CHUNK 65536
+//upper bounds on one formatted obj line, "v " plus three %g floats and "f " plus four indices
+#define MESHWRITER_VERTEX_LINE 64
+#define MESHWRITER_FACE_LINE 64
+
+namespace geomCore {
+
+//====================================
+// Formatting Helpers
+//====================================
+
+//A run of points, or a run of faces inside one pool where face n is quad n for n below the
+//pool's quad count and triangle n-numberOfQuads after that
+struct MeshWriterChunk {
+    int             m_pool;         //-1 for a run of points
+    unsigned int    m_start;
+    unsigned int    m_end;
+};
+
+static inline char* WriteIndex(char* out, unsigned int value){
+    char digits[10];
+    int count = 0;
+    do{
+        digits[count++] = '0' + (value%10);
+        value = value/10;
+    }while(value>0);
+    while(count>0){
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+static inline void WritePlyFace(char* out, const unsigned int* indices, const unsigned char& count){
+    out[0] = (char)count;
+    for(unsigned char i=0; i<count; i++){
+        int index = (int)indices[i];
+        memcpy(&out[1+i*sizeof(int)], &index, sizeof(int));
+    }
+}
+
+//====================================
+// MeshWriter Class
+//====================================
+
+MeshWriter::MeshWriter(const glm::vec3* points, const unsigned int& numberOfPoints){
+    m_points = points;
+    m_numberOfPoints = numberOfPoints;
+}
+
+MeshWriter::~MeshWriter(){
+}
+
+void MeshWriter::AddPolygons(const glm::uvec4* quads, const unsigned int& numberOfQuads,
+                             const glm::uvec3* triangles, const unsigned int& numberOfTriangles){
+    if(numberOfQuads+numberOfTriangles==0){
+        return;
+    }
+    MeshWriterPool pool;
+    pool.m_quads = quads;
+    pool.m_numberOfQuads = numberOfQuads;
+    pool.m_triangles = triangles;
+    pool.m_numberOfTriangles = numberOfTriangles;
+    m_pools.push_back(pool);
+}
+
+MeshFormat MeshWriter::GetFormat(const std::string& filename){
+    size_t dot = filename.find_last_of('.');
+    if(dot!=std::string::npos && strcmp(filename.c_str()+dot, ".ply")==0){
+        return MESH_PLY;
+    }
+    return MESH_OBJ;
+}
+
+bool MeshWriter::Write(const std::string& filename){
+    MeshFormat format = GetFormat(filename);
+    size_t size = 0;
+    char* buffer = NULL;
+    if(format==MESH_PLY){
+        buffer = FormatPly(size);
+    }else{
+        buffer = FormatObj(size);
+    }
+
+    FILE* file = fopen(filename.c_str(), "wb");
+    if(file==NULL){
+        std::cout << "Error: Unable to write to " << filename << std::endl;
+        delete [] buffer;
+        return false;
+    }
+    size_t written = fwrite(buffer, 1, size, file);
+    fclose(file);
+    delete [] buffer;
+    if(written!=size){
+        std::cout << "Error: Unable to write to " << filename << std::endl;
+        return false;
+    }
+
+    if(format==MESH_PLY){
+        std::cout << "Wrote ply file to " << filename << std::endl;
+    }else{
+        std::cout << "Wrote obj file to " << filename << std::endl;
+    }
+    return true;
+}
+
+char* MeshWriter::FormatObj(size_t& size){
+    //split points and faces into chunks, format every chunk into its own buffer in parallel,
+    //then pack them in order into one buffer for the write
+    std::vector<MeshWriterChunk> chunks;
+    for(unsigned int i=0; i<m_numberOfPoints; i+=MESHWRITER_CHUNK){
+        MeshWriterChunk chunk = {-1, i, glm::min(i+MESHWRITER_CHUNK, m_numberOfPoints)};
+        chunks.push_back(chunk);
+    }
+    unsigned int poolsCount = m_pools.size();
+    for(unsigned int p=0; p<poolsCount; p++){
+        unsigned int facesCount = m_pools[p].m_numberOfQuads + m_pools[p].m_numberOfTriangles;
+        for(unsigned int i=0; i<facesCount; i+=MESHWRITER_CHUNK){
+            MeshWriterChunk chunk = {(int)p, i, glm::min(i+MESHWRITER_CHUNK, facesCount)};
+            chunks.push_back(chunk);
+        }
+    }
+
+    unsigned int chunksCount = chunks.size();
+    std::vector<char*> chunkBuffers(chunksCount, (char*)NULL);
+    std::vector<size_t> chunkSizes(chunksCount, 0);
+
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,chunksCount),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                const MeshWriterChunk& chunk = chunks[c];
+                unsigned int count = chunk.m_end - chunk.m_start;
+                if(chunk.m_pool<0){
+                    char* buffer = new char[count*MESHWRITER_VERTEX_LINE];
+                    char* out = buffer;
+                    for(unsigned int i=chunk.m_start; i<chunk.m_end; i++){
+                        const glm::vec3& v = m_points[i];
+                        //%g matches what Obj::WriteObj's stream formatting prints
+                        out += snprintf(out, MESHWRITER_VERTEX_LINE, "v %g %g %g\n",
+                                        v.x, v.y, v.z);
+                    }
+                    chunkBuffers[c] = buffer;
+                    chunkSizes[c] = out-buffer;
+                }else{
+                    const MeshWriterPool& pool = m_pools[chunk.m_pool];
+                    char* buffer = new char[count*MESHWRITER_FACE_LINE];
+                    char* out = buffer;
+                    for(unsigned int i=chunk.m_start; i<chunk.m_end; i++){
+                        *out++ = 'f';
+                        *out++ = ' ';
+                        if(i<pool.m_numberOfQuads){
+                            const glm::uvec4& f = pool.m_quads[i];
+                            for(unsigned int j=0; j<3; j++){
+                                out = WriteIndex(out, f[j]+1);
+                                *out++ = ' ';
+                            }
+                            out = WriteIndex(out, f[3]+1);
+                        }else{
+                            //triangles keep the trailing space Obj::WriteObj leaves
+                            const glm::uvec3& f = pool.m_triangles[i-pool.m_numberOfQuads];
+                            for(unsigned int j=0; j<3; j++){
+                                out = WriteIndex(out, f[j]+1);
+                                *out++ = ' ';
+                            }
+                        }
+                        *out++ = '\n';
+                    }
+                    chunkBuffers[c] = buffer;
+                    chunkSizes[c] = out-buffer;
+                }
+            }
+        }
+    );
+
+    std::vector<size_t> chunkOffsets(chunksCount, 0);
+    size = 0;
+    for(unsigned int c=0; c<chunksCount; c++){
+        chunkOffsets[c] = size;
+        size += chunkSizes[c];
+    }
+
+    char* buffer = new char[glm::max(size, (size_t)1)];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,chunksCount),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                memcpy(buffer+chunkOffsets[c], chunkBuffers[c], chunkSizes[c]);
+                delete [] chunkBuffers[c];
+            }
+        }
+    );
+    return buffer;
+}
+
+char* MeshWriter::FormatPly(size_t& size){
+    unsigned int poolsCount = m_pools.size();
+    unsigned int facesCount = 0;
+    for(unsigned int p=0; p<poolsCount; p++){
+        facesCount += m_pools[p].m_numberOfQuads + m_pools[p].m_numberOfTriangles;
+    }
+
+    char header[512];
+    int headerSize = snprintf(header, sizeof(header),
+                              "ply\n"
+                              "format binary_little_endian 1.0\n"
+                              "comment Ariel fluid surface\n"
+                              "element vertex %u\n"
+                              "property float x\n"
+                              "property float y\n"
+                              "property float z\n"
+                              "element face %u\n"
+                              "property list uchar int vertex_indices\n"
+                              "end_header\n", m_numberOfPoints, facesCount);
+
+    //every record has a fixed size, so each pool's faces start at a known offset and pools
+    //can be written in parallel straight into the final buffer
+    const size_t quadSize = 1 + 4*sizeof(int);
+    const size_t triangleSize = 1 + 3*sizeof(int);
+    size_t pointsSize = (size_t)m_numberOfPoints * 3 * sizeof(float);
+    std::vector<size_t> poolOffsets(poolsCount, 0);
+    size = headerSize + pointsSize;
+    for(unsigned int p=0; p<poolsCount; p++){
+        poolOffsets[p] = size;
+        size += m_pools[p].m_numberOfQuads*quadSize + m_pools[p].m_numberOfTriangles*triangleSize;
+    }
+
+    char* buffer = new char[size];
+    memcpy(buffer, header, headerSize);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_numberOfPoints),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                memcpy(buffer+headerSize+(size_t)i*3*sizeof(float), &m_points[i],
+                       3*sizeof(float));
+            }
+        }
+    );
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,poolsCount),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int p=r.begin(); p!=r.end(); ++p){
+                const MeshWriterPool& pool = m_pools[p];
+                char* out = buffer+poolOffsets[p];
+                for(unsigned int i=0; i<pool.m_numberOfQuads; i++){
+                    WritePlyFace(out, &pool.m_quads[i][0], 4);
+                    out += quadSize;
+                }
+                for(unsigned int i=0; i<pool.m_numberOfTriangles; i++){
+                    WritePlyFace(out, &pool.m_triangles[i][0], 3);
+                    out += triangleSize;
+                }
+            }
+        }
+    );
+    return buffer;
+}
+}
@@ -0,0 +1,64 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: meshwriter.hpp
+// Writes surface meshes straight from point and polygon arrays, formatted in parallel
+
+#ifndef MESHWRITER_HPP
+#define MESHWRITER_HPP
+
+#include <vector>
+#include <string>
+#include "../utilities/utilities.h"
+
+namespace geomCore {
+
+//====================================
+// Enums
+//====================================
+
+enum MeshFormat{MESH_OBJ=0, MESH_PLY};
+
+//====================================
+// Struct Declarations
+//====================================
+
+//One block of faces, indices are zero based into the writer's points. Pools are formatted as
+//independent tasks, so the arrays are only borrowed and have to outlive Write
+struct MeshWriterPool {
+    const glm::uvec4*   m_quads;
+    unsigned int        m_numberOfQuads;
+    const glm::uvec3*   m_triangles;
+    unsigned int        m_numberOfTriangles;
+};
+
+//====================================
+// Class Declarations
+//====================================
+
+//Mesh format is picked from the filename's extension: .ply writes binary little endian ply,
+//anything else writes obj text in the same layout Obj::WriteObj uses
+class MeshWriter {
+    public:
+        MeshWriter(const glm::vec3* points, const unsigned int& numberOfPoints);
+        ~MeshWriter();
+
+        void AddPolygons(const glm::uvec4* quads, const unsigned int& numberOfQuads,
+                         const glm::uvec3* triangles, const unsigned int& numberOfTriangles);
+
+        bool Write(const std::string& filename);
+
+        static MeshFormat GetFormat(const std::string& filename);
+
+    private:
+        //both formats build the whole file in one buffer and hand it to a single write
+        char* FormatObj(size_t& size);
+        char* FormatPly(size_t& size);
+
+        const glm::vec3*                m_points;
+        unsigned int                    m_numberOfPoints;
+        std::vector<MeshWriterPool>     m_pools;
+};
+}
+
+#endif
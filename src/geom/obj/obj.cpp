@@ -6,10 +6,189 @@
 
 #include <tbb/tbb.h>
 #include <vector>
+#include <cstring>
 #include "obj.hpp"
 
 namespace objCore {
 
+//====================================
+// Parsing Helpers
+//====================================
+
+//Chunks are parsed one per task, and start on a line so no line is split between tasks
+#define OBJ_CHUNK_SIZE (1<<20)
+
+enum ObjLineType{OBJ_VERTEX=0, OBJ_UV, OBJ_NORMAL, OBJ_FACE, OBJ_OTHER};
+
+struct ObjChunk {
+    const char*     m_begin;
+    const char*     m_end;
+    unsigned int    m_counts[OBJ_OTHER];
+    unsigned int    m_offsets[OBJ_OTHER];
+
+    ObjChunk(){
+        m_begin = NULL;
+        m_end = NULL;
+        for(unsigned int t=0; t<OBJ_OTHER; t++){
+            m_counts[t] = 0;
+            m_offsets[t] = 0;
+        }
+    }
+};
+
+static inline bool IsBlank(const char& c){
+    return c==' ' || c=='\t' || c=='\r';
+}
+
+static inline const char* SkipBlanks(const char* p, const char* end){
+    while(p<end && IsBlank(*p)){
+        p++;
+    }
+    return p;
+}
+
+static inline const char* FindLineEnd(const char* p, const char* end){
+    const char* lineEnd = (const char*)memchr(p, '\n', end-p);
+    return lineEnd==NULL ? end : lineEnd;
+}
+
+//Reads a line's keyword, and returns where its data starts. Like the tokenizer this replaced, a
+//keyword with nothing after it doesn't count as an element
+static inline ObjLineType ClassifyLine(const char* line, const char* end, const char*& data){
+    const char* p = SkipBlanks(line, end);
+    const char* keyword = p;
+    while(p<end && !IsBlank(*p)){
+        p++;
+    }
+    data = SkipBlanks(p, end);
+    if(data==end){
+        return OBJ_OTHER;
+    }
+    unsigned int length = p-keyword;
+    if(length==1 && keyword[0]=='v'){
+        return OBJ_VERTEX;
+    }else if(length==1 && keyword[0]=='f'){
+        return OBJ_FACE;
+    }else if(length==2 && keyword[0]=='v' && keyword[1]=='t'){
+        return OBJ_UV;
+    }else if(length==2 && keyword[0]=='v' && keyword[1]=='n'){
+        return OBJ_NORMAL;
+    }
+    return OBJ_OTHER;
+}
+
+//Parses one decimal float, with optional sign, fraction and exponent, without going through
+//the locale or allocating. Anything else, like inf or nan, falls back to strtod. Missing values
+//read as 0, the same as atof
+static inline const char* ParseFloat(const char* p, const char* end, float& value){
+    static const double powersOfTen[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                         1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+                                         1e20, 1e21, 1e22};
+    p = SkipBlanks(p, end);
+    const char* start = p;
+    bool negative = false;
+    if(p<end && (*p=='-' || *p=='+')){
+        negative = *p=='-';
+        p++;
+    }
+    unsigned long long mantissa = 0;
+    int exponent = 0;
+    unsigned int digits = 0;
+    while(p<end && *p>='0' && *p<='9'){
+        //past 19 digits a float can't tell the difference, so only their magnitude counts
+        if(digits<19){
+            mantissa = mantissa*10 + (*p-'0');
+        }else{
+            exponent++;
+        }
+        digits++;
+        p++;
+    }
+    if(p<end && *p=='.'){
+        p++;
+        while(p<end && *p>='0' && *p<='9'){
+            if(digits<19){
+                mantissa = mantissa*10 + (*p-'0');
+                exponent--;
+            }
+            digits++;
+            p++;
+        }
+    }
+    if(digits==0){
+        //not a plain number, let strtod sort out whatever this token is
+        const char* tokenEnd = start;
+        while(tokenEnd<end && !IsBlank(*tokenEnd)){
+            tokenEnd++;
+        }
+        char token[64];
+        unsigned int length = std::min((unsigned int)(tokenEnd-start), 63u);
+        memcpy(token, start, length);
+        token[length] = '\0';
+        value = (float)strtod(token, NULL);
+        return tokenEnd;
+    }
+    if(p<end && (*p=='e' || *p=='E')){
+        const char* e = p+1;
+        bool negativeExponent = false;
+        if(e<end && (*e=='-' || *e=='+')){
+            negativeExponent = *e=='-';
+            e++;
+        }
+        if(e<end && *e>='0' && *e<='9'){
+            int exponentValue = 0;
+            while(e<end && *e>='0' && *e<='9'){
+                exponentValue = std::min(exponentValue*10 + (*e-'0'), 1000);
+                e++;
+            }
+            exponent += negativeExponent ? -exponentValue : exponentValue;
+            p = e;
+        }
+    }
+    double result = (double)mantissa;
+    if(exponent<0 && exponent>=-22){
+        result /= powersOfTen[-exponent];
+    }else if(exponent>0 && exponent<=22){
+        result *= powersOfTen[exponent];
+    }else if(exponent!=0){
+        result *= std::pow(10.0, (double)exponent);
+    }
+    value = (float)(negative ? -result : result);
+    return p;
+}
+
+//Parses a face corner's slash separated indices, skipping empty fields. fieldCount is 0 once
+//the line has no more corners
+static inline const char* ParseFaceCorner(const char* p, const char* end, unsigned int* fields,
+                                          unsigned int& fieldCount){
+    p = SkipBlanks(p, end);
+    fieldCount = 0;
+    while(p<end && !IsBlank(*p)){
+        if(*p=='/'){
+            p++;
+            continue;
+        }
+        bool negative = false;
+        if(*p=='-' || *p=='+'){
+            negative = *p=='-';
+            p++;
+        }
+        int index = 0;
+        while(p<end && *p>='0' && *p<='9'){
+            index = index*10 + (*p-'0');
+            p++;
+        }
+        if(fieldCount<3){
+            fields[fieldCount++] = (unsigned int)(negative ? -index : index);
+        }
+        //skip anything else in this field up to the next slash
+        while(p<end && *p!='/' && !IsBlank(*p)){
+            p++;
+        }
+    }
+    return p;
+}
+
 //====================================
 // Obj Class
 //====================================
@@ -66,7 +245,56 @@ void Obj::BakeTransform(const glm::mat4& transform){
 }
 
 bool Obj::ReadObj(const std::string& filename){
-    PrereadObj(filename);
+    //map the whole file and split it into line aligned chunks
+    size_t fileSize = 0;
+    char* file = utilityCore::mapFile(filename, fileSize, false);
+    if(file==NULL){
+        std::cout << "Error: Unable to read obj from " << filename << std::endl;
+    }
+    std::vector<ObjChunk> chunks;
+    size_t chunkStart = 0;
+    while(chunkStart<fileSize){
+        size_t chunkEnd = std::min(chunkStart+OBJ_CHUNK_SIZE, fileSize);
+        const char* lineEnd = (const char*)memchr(file+chunkEnd, '\n', fileSize-chunkEnd);
+        chunkEnd = lineEnd==NULL ? fileSize : (lineEnd-file)+1;
+        ObjChunk chunk;
+        chunk.m_begin = file+chunkStart;
+        chunk.m_end = file+chunkEnd;
+        chunks.push_back(chunk);
+        chunkStart = chunkEnd;
+    }
+    unsigned int numberOfChunks = chunks.size();
+    ObjChunk* chunkList = numberOfChunks>0 ? &chunks[0] : NULL;
+
+    //first pass only classifies lines, so every chunk knows where its elements start
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,numberOfChunks,1),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                ObjChunk& chunk = chunkList[c];
+                const char* line = chunk.m_begin;
+                while(line<chunk.m_end){
+                    const char* lineEnd = FindLineEnd(line, chunk.m_end);
+                    const char* data;
+                    ObjLineType type = ClassifyLine(line, lineEnd, data);
+                    if(type!=OBJ_OTHER){
+                        chunk.m_counts[type]++;
+                    }
+                    line = lineEnd+1;
+                }
+            }
+        }
+    );
+    unsigned int totals[OBJ_OTHER] = {0, 0, 0, 0};
+    for(unsigned int c=0; c<numberOfChunks; c++){
+        for(unsigned int t=0; t<OBJ_OTHER; t++){
+            chunks[c].m_offsets[t] = totals[t];
+            totals[t] += chunks[c].m_counts[t];
+        }
+    }
+    m_numberOfVertices = totals[OBJ_VERTEX];
+    m_numberOfUVs = totals[OBJ_UV];
+    m_numberOfNormals = totals[OBJ_NORMAL];
+    m_numberOfPolys = totals[OBJ_FACE];
 
     m_vertices = new glm::vec3[m_numberOfVertices];
     m_normals = new glm::vec3[m_numberOfNormals];
@@ -75,64 +303,77 @@ bool Obj::ReadObj(const std::string& filename){
     m_polyNormalIndices = new glm::uvec4[m_numberOfPolys];
     m_polyUVIndices = new glm::uvec4[m_numberOfPolys];
 
-    unsigned int currentVertex = 0;
-    unsigned int currentNormal = 0;
-    unsigned int currentUV = 0;
-    unsigned int currentFace = 0;
-
-    //Load loop
-    std::ifstream fp_in;
-    char* fname = (char*)filename.c_str();
-    fp_in.open(fname);
-    if(fp_in.is_open()){
-        while(fp_in.good()){
-            std::string line;
-            getline(fp_in, line);
-            if(!line.empty()){
-                std::vector<std::string> tokens = utilityCore::tokenizeString(line, " ");
-                if(tokens.size()>1){
-                    if(tokens[0].compare("v")==0){
-                        m_vertices[currentVertex] = glm::vec3(atof(tokens[1].c_str()),
-                                                              atof(tokens[2].c_str()),
-                                                              atof(tokens[3].c_str()));
-                        currentVertex++;
-                    }else if(tokens[0].compare("vn")==0){
-                        m_normals[currentNormal] = glm::vec3(atof(tokens[1].c_str()),
-                                                             atof(tokens[2].c_str()),
-                                                             atof(tokens[3].c_str()));
-                        currentNormal++;
-                    }else if(tokens[0].compare("vt")==0){
-                        m_uvs[currentUV] = glm::vec2(atof(tokens[1].c_str()),
-                                                     atof(tokens[2].c_str()));
-                        currentUV++;
-                    }else if(tokens[0].compare("f")==0){
-                        glm::vec4 vertices(0);
-                        glm::vec4 normals(0);
-                        glm::vec4 uvs(0);
-                        unsigned int loops = std::min(4, (int)tokens.size()-1)+1;
-                        for(unsigned int i=1; i<loops; i++){
-                            std::vector<std::string> faceindices =
-                                                     utilityCore::tokenizeString(tokens[i], "/");
-                            vertices[i-1] = atoi(faceindices[0].c_str());
-                            if(faceindices.size()==2 && m_numberOfNormals>1){
-                                normals[i-1] = atoi(faceindices[1].c_str());
-                            }else if(faceindices.size()==2 && m_numberOfUVs>1){
-                                uvs[i-1] = atoi(faceindices[1].c_str());
-                            }else if(faceindices.size()==3){
-                                uvs[i-1] = atoi(faceindices[1].c_str());
-                                normals[i-1] = atoi(faceindices[2].c_str());
+    //second pass parses every chunk straight into its slice of the arrays
+    glm::vec3* vertices = m_vertices;
+    glm::vec3* normals = m_normals;
+    glm::vec2* uvs = m_uvs;
+    glm::uvec4* polyVertexIndices = m_polyVertexIndices;
+    glm::uvec4* polyNormalIndices = m_polyNormalIndices;
+    glm::uvec4* polyUVIndices = m_polyUVIndices;
+    bool hasNormals = m_numberOfNormals>1;
+    bool hasUVs = m_numberOfUVs>1;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,numberOfChunks,1),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                const ObjChunk& chunk = chunkList[c];
+                unsigned int currentVertex = chunk.m_offsets[OBJ_VERTEX];
+                unsigned int currentUV = chunk.m_offsets[OBJ_UV];
+                unsigned int currentNormal = chunk.m_offsets[OBJ_NORMAL];
+                unsigned int currentFace = chunk.m_offsets[OBJ_FACE];
+                const char* line = chunk.m_begin;
+                while(line<chunk.m_end){
+                    const char* lineEnd = FindLineEnd(line, chunk.m_end);
+                    const char* p;
+                    ObjLineType type = ClassifyLine(line, lineEnd, p);
+                    if(type==OBJ_VERTEX || type==OBJ_NORMAL){
+                        glm::vec3 v(0.0f);
+                        p = ParseFloat(p, lineEnd, v.x);
+                        p = ParseFloat(p, lineEnd, v.y);
+                        p = ParseFloat(p, lineEnd, v.z);
+                        if(type==OBJ_VERTEX){
+                            vertices[currentVertex++] = v;
+                        }else{
+                            normals[currentNormal++] = v;
+                        }
+                    }else if(type==OBJ_UV){
+                        glm::vec2 uv(0.0f);
+                        p = ParseFloat(p, lineEnd, uv.x);
+                        p = ParseFloat(p, lineEnd, uv.y);
+                        uvs[currentUV++] = uv;
+                    }else if(type==OBJ_FACE){
+                        glm::uvec4 faceVertices(0);
+                        glm::uvec4 faceNormals(0);
+                        glm::uvec4 faceUVs(0);
+                        for(unsigned int i=0; i<4; i++){
+                            //corners are v, v/vt, v//vn or v/vt/vn. empty fields are skipped,
+                            //so a two field corner is v/vn if the file has normals, else v/vt
+                            unsigned int fields[3] = {0, 0, 0};
+                            unsigned int fieldCount = 0;
+                            p = ParseFaceCorner(p, lineEnd, fields, fieldCount);
+                            if(fieldCount==0){
+                                break;
+                            }
+                            faceVertices[i] = fields[0];
+                            if(fieldCount==2 && hasNormals){
+                                faceNormals[i] = fields[1];
+                            }else if(fieldCount==2 && hasUVs){
+                                faceUVs[i] = fields[1];
+                            }else if(fieldCount==3){
+                                faceUVs[i] = fields[1];
+                                faceNormals[i] = fields[2];
                             }
                         }
-                        m_polyVertexIndices[currentFace] = vertices;
-                        m_polyNormalIndices[currentFace] = normals;
-                        m_polyUVIndices[currentFace] = uvs;
+                        polyVertexIndices[currentFace] = faceVertices;
+                        polyNormalIndices[currentFace] = faceNormals;
+                        polyUVIndices[currentFace] = faceUVs;
                         currentFace++;
                     }
-                }               
+                    line = lineEnd+1;
+                }
             }
         }
-    } 
-    fp_in.close();
+    );
+    utilityCore::unmapFile(file, fileSize);
 
     if(m_numberOfUVs==0){
         std::cout << "No UVs found, creating default UVs..." << std::endl;
@@ -227,39 +468,6 @@ bool Obj::WriteObj(const std::string& filename){
     }
 }
 
-void Obj::PrereadObj(const std::string& filename){
-    std::ifstream fp_in;
-    unsigned int vertexCount = 0;
-    unsigned int normalCount = 0;
-    unsigned int uvCount = 0;
-    unsigned int faceCount = 0;
-    char* fname = (char*)filename.c_str();
-    fp_in.open(fname);
-    if(fp_in.is_open()){
-        while(fp_in.good()){
-            std::string line;
-            getline(fp_in, line);
-            if(!line.empty()){
-                std::string header = utilityCore::getFirstNCharactersOfString(line, 2);
-                if(header.compare("v ")==0){
-                    vertexCount++;
-                }else if(header.compare("vt")==0){
-                    uvCount++;
-                }else if(header.compare("vn")==0){
-                    normalCount++;
-                }else if(header.compare("f ")==0){
-                    faceCount++;
-                }
-            }
-        }
-    } 
-    fp_in.close();
-    m_numberOfVertices = vertexCount;
-    m_numberOfNormals = normalCount;
-    m_numberOfUVs = uvCount;
-    m_numberOfPolys = faceCount;
-}
-
 /*Return the requested face from the mesh, unless the index is out of range, 
 in which case return a face of area zero*/
 HOST DEVICE Poly Obj::GetPoly(const unsigned int& polyIndex){
@@ -434,6 +642,7 @@ HOST DEVICE rayCore::Intersection Obj::TriangleTest(const unsigned int& polyInde
 InterpolatedObj::InterpolatedObj(){
     m_obj0 = NULL;
     m_obj1 = NULL;
+    m_boundsInterpolation = -1.0f;
 }
 
 /*Right now only prints a warning if objs have mismatched topology, must make this do something
@@ -441,6 +650,7 @@ better in the future since mismatched topology leads to Very Bad Things*/
 InterpolatedObj::InterpolatedObj(objCore::Obj* obj0, objCore::Obj* obj1){
     m_obj0 = obj0;
     m_obj1 = obj1;
+    m_boundsInterpolation = -1.0f;
     if(obj0->m_numberOfPolys!=obj1->m_numberOfPolys){
         std::cout << "Warning: Attempted to create InterpolatedObj with mismatched topology!"
                   << std::endl;
@@ -555,6 +765,22 @@ HOST DEVICE Poly InterpolatedObj::GetPoly(const unsigned int& polyIndex,
 }
 
 HOST DEVICE spaceCore::Aabb InterpolatedObj::GetElementAabb(const unsigned int& primID){
+    if(m_boundsInterpolation>=0.0f){
+        //bound the element where it actually is at this weight, same lerp as TriangleTest
+        glm::uvec4 vi0 = m_obj0->m_polyVertexIndices[primID];
+        glm::uvec4 vi1 = m_obj1->m_polyVertexIndices[primID];
+        float w = m_boundsInterpolation;
+        glm::vec3 v0 = m_obj0->m_vertices[vi0.x-1] * (1.0f-w) + m_obj1->m_vertices[vi1.x-1] * w;
+        glm::vec3 v1 = m_obj0->m_vertices[vi0.y-1] * (1.0f-w) + m_obj1->m_vertices[vi1.y-1] * w;
+        glm::vec3 v2 = m_obj0->m_vertices[vi0.z-1] * (1.0f-w) + m_obj1->m_vertices[vi1.z-1] * w;
+        glm::vec3 v3 = v0;
+        if(vi0.w>0){
+            v3 = m_obj0->m_vertices[vi0.w-1] * (1.0f-w) + m_obj1->m_vertices[vi1.w-1] * w;
+        }
+        glm::vec3 min = glm::min(glm::min(glm::min(v0, v1), v2), v3);
+        glm::vec3 max = glm::max(glm::max(glm::max(v0, v1), v2), v3);
+        return spaceCore::Aabb(min, max, (min+max)/2.0f, primID);
+    }
     spaceCore::Aabb aabb0 = m_obj0->GetElementAabb(primID);
     spaceCore::Aabb aabb1 = m_obj1->GetElementAabb(primID);
     glm::vec3 combinedMin = glm::min(aabb0.m_min, aabb1.m_min);
@@ -135,7 +135,6 @@ class Obj {
         bool            m_keep;
         
     private:
-        void PrereadObj(const std::string& filename);
         HOST DEVICE rayCore::Intersection TriangleTest(const unsigned int& polyIndex, 
                                                        const rayCore::Ray& r, 
                                                        const bool& checkQuad);
@@ -159,6 +158,9 @@ class InterpolatedObj {
 
         objCore::Obj*   m_obj0;
         objCore::Obj*   m_obj1;
+        //Interpolation weight GetElementAabb bounds elements at. Negative bounds both keyframes,
+        //which holds for every weight
+        float           m_boundsInterpolation;
 
     private:
         HOST DEVICE rayCore::Intersection TriangleTest(const unsigned int& polyIndex, 
@@ -19,6 +19,7 @@ template <typename T> class Grid{
     public:
         //Initializers
         Grid(const glm::vec3& dimensions, const T& background);
+        Grid(const glm::vec3& dimensions, const T& background, const bool& sparse);
         ~Grid();
 
         //Cell accessors and setters and whatever
@@ -29,12 +30,45 @@ template <typename T> class Grid{
         void SetCell(const int& x, const int& y, const int& z, const T& value);
 
         void Clear();
+        void Copy(Grid<T>* source);
+
+        //Sparse storage. A sparse grid only stores the 8^3 tiles it was told are active, every
+        //other cell reads back as background and writes to it are dropped
+        bool IsSparse();
+        void SetActiveTiles(const std::vector<glm::vec3>& tiles);
+        std::vector<glm::vec3>& GetActiveTiles();
+        T* GetRowSpan(const int& x, const int& y, const int& z);
+        template <typename F> void ForEachActiveBlock(const glm::vec3& extent, const F& kernel);
+
+        //Raw storage accessors. Cells live in one contiguous aligned buffer laid out with
+        //x as the slowest axis and z as the fastest, padded by one cell along every axis.
+        //In sparse mode the buffer is a pool of tiles instead, so only GetRawData, GetIndex,
+        //GetCellCount and GetRowSpan are meaningful there
+        T* GetRawData();
+        T* GetSlab(const int& x);
+        T* GetRow(const int& x, const int& y);
+        unsigned int GetIndex(const int& x, const int& y, const int& z);
+        unsigned int GetRowStride();
+        unsigned int GetSlabStride();
+        unsigned int GetCellCount();
 
     protected:
-        T***        m_rawgrid;
-        T           m_background;
+        void Init(const glm::vec3& dimensions, const T& background, const bool& sparse);
+        unsigned int GetTileIndex(const int& x, const int& y, const int& z);
+        unsigned int GetTileCellIndex(const int& x, const int& y, const int& z);
+
+        T*              m_rawgrid;
+        T               m_background;
+
+        glm::vec3       m_dimensions;
+        unsigned int    m_rowstride;
+        unsigned int    m_slabstride;
+        unsigned int    m_cellcount;
 
-        glm::vec3   m_dimensions;
+        bool                    m_sparse;
+        glm::vec3               m_tiledimensions;
+        unsigned int*           m_tileslots;
+        std::vector<glm::vec3>  m_activetiles;
 };
 }
 
@@ -9,24 +9,44 @@
 namespace fluidCore{
 
 template <typename T> Grid<T>::Grid(const glm::vec3& dimensions, const T& background){
+    Init(dimensions, background, false);
+}
+
+template <typename T> Grid<T>::Grid(const glm::vec3& dimensions, const T& background, 
+                                    const bool& sparse){
+    Init(dimensions, background, sparse);
+}
+
+template <typename T> void Grid<T>::Init(const glm::vec3& dimensions, const T& background, 
+                                         const bool& sparse){
     m_dimensions = dimensions;
     m_background = background;
-    m_rawgrid = CreateGrid<T>(m_dimensions.x+1, m_dimensions.y+1, m_dimensions.z+1);
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,(int)m_dimensions.x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){     
-                for(unsigned int j=0; j<(int)m_dimensions.y+1; ++j){
-                    for(unsigned int k=0; k<(int)m_dimensions.z+1; ++k){
-                        m_rawgrid[i][j][k] = m_background;
-                    }
-                }
-            }
-        }
-    );
+    m_sparse = sparse;
+    m_rowstride = (unsigned int)m_dimensions.z+1;
+    m_slabstride = ((unsigned int)m_dimensions.y+1)*m_rowstride;
+    m_tileslots = NULL;
+    if(m_sparse){
+        //slot 0 of the tile pool is a permanent background tile that every inactive tile
+        //points at, so reads never need to branch on whether a tile exists
+        m_tiledimensions = glm::ceil((m_dimensions+glm::vec3(1))/(float)GRID_TILE_WIDTH);
+        unsigned int tilecount = (unsigned int)(m_tiledimensions.x*m_tiledimensions.y*
+                                                m_tiledimensions.z);
+        m_tileslots = new unsigned int[tilecount];
+        std::fill(m_tileslots, m_tileslots+tilecount, 0);
+        m_cellcount = GRID_TILE_CELLS;
+    }else{
+        m_tiledimensions = glm::vec3(0);
+        m_cellcount = ((unsigned int)m_dimensions.x+1)*m_slabstride;
+    }
+    m_rawgrid = CreateGrid<T>(m_cellcount);
+    Clear();
 }
 
 template <typename T> Grid<T>::~Grid(){
-    DeleteGrid<T>(m_rawgrid, m_dimensions.x+1, m_dimensions.y+1, m_dimensions.z+1);
+    DeleteGrid<T>(m_rawgrid, m_cellcount);
+    if(m_sparse){
+        delete [] m_tileslots;
+    }
 }
 
 template <typename T> T Grid<T>::GetCell(const glm::vec3& index){
@@ -34,7 +54,10 @@ template <typename T> T Grid<T>::GetCell(const glm::vec3& index){
 }
 
 template <typename T> T Grid<T>::GetCell(const int& x, const int& y, const int& z){
-    T cell = m_rawgrid[x][y][z];
+    if(m_sparse){
+        return m_rawgrid[GetTileCellIndex(x,y,z)];
+    }
+    T cell = m_rawgrid[x*m_slabstride + y*m_rowstride + z];
     return cell;
 }
 
@@ -44,21 +67,204 @@ template <typename T> void Grid<T>::SetCell(const glm::vec3& index, const T& val
 
 template <typename T> void Grid<T>::SetCell(const int& x, const int& y, const int& z, 
                                             const T& value){
-    m_rawgrid[x][y][z] = value;
+    if(m_sparse){
+        unsigned int index = GetTileCellIndex(x,y,z);
+        if(index>=GRID_TILE_CELLS){
+            m_rawgrid[index] = value;
+        }
+        return;
+    }
+    m_rawgrid[x*m_slabstride + y*m_rowstride + z] = value;
 }
 
+//Dense grids are cleared and copied by x slab, so each slab is first touched by the thread 
+//ForEachActiveBlock later hands it to
 template <typename T> void Grid<T>::Clear(){
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,(int)m_dimensions.x+1),
+    unsigned int blocksize = m_sparse ? GRID_TILE_CELLS : m_slabstride;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_cellcount/blocksize),
         [=](const tbb::blocked_range<unsigned int>& r){
+            std::fill(m_rawgrid + r.begin()*blocksize, m_rawgrid + r.end()*blocksize, 
+                      m_background);
+        }, tbb::static_partitioner()
+    );  
+}
+
+template <typename T> void Grid<T>::Copy(Grid<T>* source){
+    //sparse grids pick up the source's tile layout first so the two pools line up, and keep
+    //their own background tile. the pool is only rebuilt if the layouts differ, so pointers
+    //into it stay valid across copies between grids sharing a tile list
+    unsigned int start = 0;
+    if(m_sparse){
+        if(m_activetiles!=source->GetActiveTiles()){
+            SetActiveTiles(source->GetActiveTiles());
+        }
+        start = GRID_TILE_CELLS;
+    }
+    T* sourcedata = source->GetRawData();
+    unsigned int blocksize = m_sparse ? GRID_TILE_CELLS : m_slabstride;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(start/blocksize,m_cellcount/blocksize),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            std::copy(sourcedata + r.begin()*blocksize, sourcedata + r.end()*blocksize, 
+                      m_rawgrid + r.begin()*blocksize);
+        }, tbb::static_partitioner()
+    );
+}
+
+template <typename T> bool Grid<T>::IsSparse(){
+    return m_sparse;
+}
+
+template <typename T> void Grid<T>::SetActiveTiles(const std::vector<glm::vec3>& tiles){
+    if(!m_sparse){
+        return;
+    }
+    unsigned int tilecount = (unsigned int)(m_tiledimensions.x*m_tiledimensions.y*
+                                            m_tiledimensions.z);
+    //the pool is laid out in Z-order, so tiles that are neighbors in space mostly sit near each
+    //other in memory too
+    std::vector<std::pair<unsigned int, unsigned int> > order(tiles.size());
+    for(unsigned int i=0; i<tiles.size(); i++){
+        glm::vec3 t = glm::max(tiles[i], glm::vec3(0.0f));
+        order[i] = std::make_pair(MortonCode(t.x, t.y, t.z), i);
+    }
+    std::sort(order.begin(), order.end());
+    //build new slot table, keeping track of where each tile lived in the old pool
+    unsigned int* slots = new unsigned int[tilecount];
+    std::fill(slots, slots+tilecount, 0);
+    std::vector<glm::vec3> activetiles;
+    std::vector<unsigned int> previousslots;
+    activetiles.reserve(tiles.size());
+    previousslots.reserve(tiles.size());
+    unsigned int tilesCount = tiles.size();
+    for(unsigned int i=0; i<tilesCount; i++){
+        glm::vec3 t = tiles[order[i].second];
+        if(t.x<0 || t.y<0 || t.z<0 || t.x>=m_tiledimensions.x || t.y>=m_tiledimensions.y ||
+           t.z>=m_tiledimensions.z){
+            continue;
+        }
+        unsigned int index = GetTileIndex(t.x*GRID_TILE_WIDTH, t.y*GRID_TILE_WIDTH, 
+                                          t.z*GRID_TILE_WIDTH);
+        if(slots[index]>0){
+            continue;
+        }
+        activetiles.push_back(t);
+        slots[index] = activetiles.size();
+        previousslots.push_back(m_tileslots[index]);
+    }
+    //move surviving tiles into the new pool and fill newly activated ones with background
+    unsigned int cellcount = (activetiles.size()+1)*GRID_TILE_CELLS;
+    T* pool = CreateGrid<T>(cellcount);
+    T* oldpool = m_rawgrid;
+    unsigned int activeCount = activetiles.size();
+    std::fill(pool, pool+GRID_TILE_CELLS, m_background);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,activeCount),
+        [&](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                for(unsigned int j=0; j<(int)m_dimensions.y+1; ++j){
-                    for(unsigned int k=0; k<(int)m_dimensions.z+1; ++k){
-                        m_rawgrid[i][j][k] = m_background;
-                    }
+                T* tile = pool + (i+1)*GRID_TILE_CELLS;
+                if(previousslots[i]>0){
+                    T* oldtile = oldpool + previousslots[i]*GRID_TILE_CELLS;
+                    std::copy(oldtile, oldtile+GRID_TILE_CELLS, tile);
+                }else{
+                    std::fill(tile, tile+GRID_TILE_CELLS, m_background);
                 }
             }
-        }
-    );  
+        }, tbb::static_partitioner()
+    );
+    DeleteGrid<T>(m_rawgrid, m_cellcount);
+    delete [] m_tileslots;
+    m_rawgrid = pool;
+    m_cellcount = cellcount;
+    m_tileslots = slots;
+    m_activetiles = activetiles;
+}
+
+template <typename T> std::vector<glm::vec3>& Grid<T>::GetActiveTiles(){
+    return m_activetiles;
+}
+
+//Returns a pointer to cell (x,y,z) whose following cells along z stay valid up to the end of
+//z's tile in sparse mode, or the end of the row in dense mode. Inactive tiles hand back the
+//shared background tile, so spans into them are read only
+template <typename T> T* Grid<T>::GetRowSpan(const int& x, const int& y, const int& z){
+    if(m_sparse){
+        return m_rawgrid + GetTileCellIndex(x,y,z);
+    }
+    return m_rawgrid + x*m_slabstride + y*m_rowstride + z;
+}
+
+//Runs kernel(lo, hi) over index blocks covering [0,extent). Dense grids are split into ranges
+//of x slabs, sparse grids into their active tiles, so blocks never straddle a tile along z.
+//Ranges are split statically to match the first touch in Clear and SetActiveTiles
+template <typename T> template <typename F> void Grid<T>::ForEachActiveBlock(
+                                                        const glm::vec3& extent, const F& kernel){
+    if(!m_sparse){
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,(unsigned int)extent.x),
+            [&](const tbb::blocked_range<unsigned int>& r){
+                kernel(glm::vec3(r.begin(),0,0), glm::vec3(r.end(),extent.y,extent.z));
+            }, tbb::static_partitioner()
+        );
+        return;
+    }
+    unsigned int activeCount = m_activetiles.size();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,activeCount),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                glm::vec3 lo = m_activetiles[i]*(float)GRID_TILE_WIDTH;
+                glm::vec3 hi = glm::min(lo+glm::vec3(GRID_TILE_WIDTH), extent);
+                if(lo.x<hi.x && lo.y<hi.y && lo.z<hi.z){
+                    kernel(lo, hi);
+                }
+            }
+        }, tbb::static_partitioner()
+    );
+}
+
+template <typename T> unsigned int Grid<T>::GetTileIndex(const int& x, const int& y, 
+                                                         const int& z){
+    unsigned int tx = x>>GRID_TILE_LOG2;
+    unsigned int ty = y>>GRID_TILE_LOG2;
+    unsigned int tz = z>>GRID_TILE_LOG2;
+    return (tx*(unsigned int)m_tiledimensions.y + ty)*(unsigned int)m_tiledimensions.z + tz;
+}
+
+//Index of a cell inside the tile pool, which is the bg tile when the cell's tile is inactive
+template <typename T> unsigned int Grid<T>::GetTileCellIndex(const int& x, const int& y, 
+                                                             const int& z){
+    unsigned int slot = m_tileslots[GetTileIndex(x,y,z)];
+    unsigned int local = (((x&(GRID_TILE_WIDTH-1))<<GRID_TILE_LOG2) + (y&(GRID_TILE_WIDTH-1)))
+                         <<GRID_TILE_LOG2;
+    return slot*GRID_TILE_CELLS + local + (z&(GRID_TILE_WIDTH-1));
+}
+
+template <typename T> T* Grid<T>::GetRawData(){
+    return m_rawgrid;
+}
+
+template <typename T> T* Grid<T>::GetSlab(const int& x){
+    return m_rawgrid + x*m_slabstride;
+}
+
+template <typename T> T* Grid<T>::GetRow(const int& x, const int& y){
+    return m_rawgrid + x*m_slabstride + y*m_rowstride;
+}
+
+template <typename T> unsigned int Grid<T>::GetIndex(const int& x, const int& y, const int& z){
+    if(m_sparse){
+        return GetTileCellIndex(x,y,z);
+    }
+    return x*m_slabstride + y*m_rowstride + z;
+}
+
+template <typename T> unsigned int Grid<T>::GetRowStride(){
+    return m_rowstride;
+}
+
+template <typename T> unsigned int Grid<T>::GetSlabStride(){
+    return m_slabstride;
+}
+
+template <typename T> unsigned int Grid<T>::GetCellCount(){
+    return m_cellcount;
 }
 }
 
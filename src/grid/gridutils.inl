@@ -7,6 +7,13 @@
 #ifndef GRIDUTILS_INL
 #define GRIDUTILS_INL
 
+#include <tbb/tbb.h>
+
+//Sparse grids are stored as 8^3 tiles, same as VDB leaf nodes
+#define GRID_TILE_LOG2 3
+#define GRID_TILE_WIDTH 8
+#define GRID_TILE_CELLS 512
+
 #define FOR_EACH_CELL(x, y, z) \
     for(int i = 0; i < x; i++) \
         for(int j = 0; j < y; j++) \
@@ -27,25 +34,31 @@
         for(int j = 0; j < y; j++) \
             for(int k = 0; k < z+1; k++) 
 
-template <class T> T *** CreateGrid(unsigned int x, unsigned int y, unsigned int z){
-    T *** field = new T **[x];
-    for(int i=0; i<x; i++){
-        field[i] = new T*[y];
-        for(int j=0; j<y; j++){
-            field[i][j] = new T[z];
-        }
-    }   
+//Grids are stored as a single cache aligned block so that rows and slabs stream linearly. 
+//Pages only land on a NUMA node when first written, so every full pass over grid or particle
+//storage, the first fill included, splits its range with tbb::static_partitioner. The same
+//range then always goes to the same threads, and pages stay on the node that works on them
+template <class T> T* CreateGrid(unsigned int count){
+    T* field = tbb::cache_aligned_allocator<T>().allocate(count);
     return field;
 }
 
-template <class T> void DeleteGrid(T ***ptr, unsigned int x, unsigned int y, unsigned int z){
-    for(int i=0; i<x; i++){
-        for(int j=0; j<y; j++){
-            delete [] ptr[i][j];
-        } 
-        delete [] ptr[i];
+template <class T> void DeleteGrid(T* ptr, unsigned int count){
+    tbb::cache_aligned_allocator<T>().deallocate(ptr, count);
+}
+
+//Interleaves the low 10 bits of x, y and z into a Z-order code, so sorting by it keeps
+//neighbors in space near each other in memory
+inline unsigned int MortonCode(unsigned int x, unsigned int y, unsigned int z){
+    unsigned int v[3] = {x, y, z};
+    for(unsigned int i=0; i<3; i++){
+        v[i] &= 0x000003ff;
+        v[i] = (v[i] | (v[i]<<16)) & 0xff0000ff;
+        v[i] = (v[i] | (v[i]<<8)) & 0x0300f00f;
+        v[i] = (v[i] | (v[i]<<4)) & 0x030c30c3;
+        v[i] = (v[i] | (v[i]<<2)) & 0x09249249;
     }
-    delete [] ptr;
+    return (v[0]<<2) | (v[1]<<1) | v[2];
 }
 
 #endif
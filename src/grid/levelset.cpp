@@ -8,11 +8,14 @@
 #include <openvdb/tools/VolumeToSpheres.h>
 #include <openvdb/tools/VolumeToMesh.h>
 #include <openvdb/util/NullInterrupter.h>
+#include <openvdb/tree/LeafManager.h>
 #include "levelset.hpp"
+#include "../geom/meshwriter.hpp"
 
 namespace fluidCore{
 
 LevelSet::LevelSet(){
+    m_generation = 1;
     openvdb::initialize();
     m_vdbgrid = openvdb::FloatGrid::create(0.0f);
 }
@@ -23,18 +26,26 @@ LevelSet::~LevelSet(){
 }
 
 LevelSet::LevelSet(objCore::Obj* mesh){
+    m_generation = 1;
     LevelSetFromMesh(mesh, glm::mat4());
 }
 
 LevelSet::LevelSet(objCore::Obj* mesh, const glm::mat4& m){
+    m_generation = 1;
     LevelSetFromMesh(mesh, m);
 }
 
 LevelSet::LevelSet(objCore::InterpolatedObj* animmesh, const float& interpolation, 
                    const glm::mat4& m){
+    m_generation = 1;
     LevelSetFromAnimMesh(animmesh, interpolation, m);
 }
 
+LevelSet::LevelSet(LevelSet& shape, const glm::mat4& m){
+    m_generation = 1;
+    LevelSetFromShape(shape, m);
+}
+
 void LevelSet::LevelSetFromAnimMesh(objCore::InterpolatedObj* animmesh, const float& interpolation, 
                                     const glm::mat4& m){
     openvdb::math::Transform::Ptr transform=openvdb::math::Transform::createLinearTransform(.25f);
@@ -98,78 +109,236 @@ void LevelSet::LevelSetFromMesh(objCore::Obj* mesh, const glm::mat4& m){
     vdbpolys.clear();
 }
 
-LevelSet::LevelSet(std::vector<Particle*>& particles, float maxdimension){
+void LevelSet::LevelSetFromShape(LevelSet& shape, const glm::mat4& m){
+    //glm is column major with column vectors, vdb is row vectors, so the layouts line up
+    openvdb::math::Mat4d xform;
+    for(unsigned int i=0; i<4; i++){
+        for(unsigned int j=0; j<4; j++){
+            xform(i,j) = m[i][j];
+        }
+    }
+    //shallow copy shares the shape's voxels, only the copy's transform is changed
+    openvdb::FloatGrid::Ptr source = shape.GetVDBGrid()->copy();
+    openvdb::math::Transform::Ptr sourcetransform = 
+                                  openvdb::math::Transform::createLinearTransform(.25f);
+    sourcetransform->postMult(xform);
+    source->setTransform(sourcetransform);
+    //resample into the same voxel size mesh level sets are built at
+    m_vdbgrid = openvdb::FloatGrid::create(source->background());
+    m_vdbgrid->setTransform(openvdb::math::Transform::createLinearTransform(.25f));
+    m_vdbgrid->setGridClass(openvdb::GRID_LEVEL_SET);
+    openvdb::tools::resampleToMatch<openvdb::tools::BoxSampler>(*source, *m_vdbgrid);
+}
+
+LevelSet::LevelSet(ParticleSet& particles, float maxdimension, const SurfaceKernel& kernel,
+                   const float& radius, const unsigned int& grainSize){
+    m_generation = 1;
+    if(kernel==SURFACE_SPHERES){
+        LevelSetFromSpheres(particles, maxdimension, radius, grainSize);
+        return;
+    }
+    if(kernel==SURFACE_ZHUBRIDSON){
+        LevelSetFromZhuBridson(particles, maxdimension, radius, grainSize);
+        return;
+    }
     m_vdbgrid = openvdb::createLevelSet<openvdb::FloatGrid>();
     openvdb::tools::ParticlesToLevelSet<openvdb::FloatGrid> raster(*m_vdbgrid);
-    raster.setGrainSize(1);
+    raster.setGrainSize(grainSize);
     raster.setRmin(.01f);
 
-    ParticleList plist(particles, maxdimension);
-    // raster.rasterizeSpheres(plist);
+    ParticleList plist(&particles, maxdimension, radius);
     raster.rasterizeTrails(plist);
     raster.finalize();
 }
 
-void LevelSet::WriteObjToFile(std::string filename){
+//Exported particles are gathered in the sim's sorted cell order, so a run of them covers a
+//compact slab of cells. Each task rasterizes its runs into its own grid, and the reduction
+//only has to reconcile the leaves where two slabs meet
+void LevelSet::LevelSetFromSpheres(ParticleSet& particles, const float& maxdimension,
+                                   const float& radius, const unsigned int& grainSize){
+    float background = openvdb::createLevelSet<openvdb::FloatGrid>()->background();
+    float reach = radius + background;
+    ParticleSet* set = &particles;
+    openvdb::FloatGrid::Ptr grid = tbb::parallel_reduce(
+        tbb::blocked_range<unsigned int>(0, particles.Size(), glm::max(1u, grainSize)),
+        openvdb::FloatGrid::Ptr(),
+        [=](const tbb::blocked_range<unsigned int>& r, openvdb::FloatGrid::Ptr partial){
+            if(!partial){
+                partial = openvdb::createLevelSet<openvdb::FloatGrid>();
+            }
+            openvdb::FloatGrid::Accessor accessor = partial->getAccessor();
+            for(unsigned int n=r.begin(); n!=r.end(); ++n){
+                if(set->m_invalid[n]){
+                    continue;
+                }
+                glm::vec3 p = set->m_p[n]*maxdimension;
+                glm::ivec3 lo = glm::ivec3(glm::floor(p-glm::vec3(reach)));
+                glm::ivec3 hi = glm::ivec3(glm::ceil(p+glm::vec3(reach)));
+                for(int i=lo.x; i<=hi.x; i++){
+                    for(int j=lo.y; j<=hi.y; j++){
+                        for(int k=lo.z; k<=hi.z; k++){
+                            float d = glm::length(glm::vec3(i,j,k)-p) - radius;
+                            if(d>=background){
+                                continue;
+                            }
+                            openvdb::Coord coord(i,j,k);
+                            d = glm::max(d, -background);
+                            if(d<accessor.getValue(coord)){
+                                accessor.setValue(coord, d);
+                            }
+                        }
+                    }
+                }
+            }
+            return partial;
+        },
+        [](openvdb::FloatGrid::Ptr a, openvdb::FloatGrid::Ptr b){
+            if(!a){
+                return b;
+            }
+            if(b){
+                openvdb::tools::compMin(*a, *b);
+            }
+            return a;
+        }
+    );
+    if(!grid){
+        grid = openvdb::createLevelSet<openvdb::FloatGrid>();
+    }
+    grid->tree().signedFloodFill();
+    m_vdbgrid = grid;
+}
+
+//One task's kernel weights and weighted positions for LevelSetFromZhuBridson
+struct ZhuBridsonSums{
+    openvdb::FloatGrid::Ptr     m_weights;
+    openvdb::Vec3SGrid::Ptr     m_positions;
+};
+
+//Zhu and Bridson's surface: every voxel within four radii of particles is placed radius away
+//from the kernel weighted average of those particles' positions. Sums are splatted per task
+//like spheres and added up, then each leaf of the result is solved on its own
+void LevelSet::LevelSetFromZhuBridson(ParticleSet& particles, const float& maxdimension,
+                                      const float& radius, const unsigned int& grainSize){
+    m_vdbgrid = openvdb::createLevelSet<openvdb::FloatGrid>();
+    float background = m_vdbgrid->background();
+    float support = 4.0f*radius;
+    float invsupport2 = 1.0f/(support*support);
+    ParticleSet* set = &particles;
+    ZhuBridsonSums sums = tbb::parallel_reduce(
+        tbb::blocked_range<unsigned int>(0, particles.Size(), glm::max(1u, grainSize)),
+        ZhuBridsonSums(),
+        [=](const tbb::blocked_range<unsigned int>& r, ZhuBridsonSums partial){
+            if(!partial.m_weights){
+                partial.m_weights = openvdb::FloatGrid::create(0.0f);
+                partial.m_positions = openvdb::Vec3SGrid::create(openvdb::Vec3s(0.0f));
+            }
+            openvdb::FloatGrid::Accessor weights = partial.m_weights->getAccessor();
+            openvdb::Vec3SGrid::Accessor positions = partial.m_positions->getAccessor();
+            for(unsigned int n=r.begin(); n!=r.end(); ++n){
+                if(set->m_invalid[n]){
+                    continue;
+                }
+                glm::vec3 p = set->m_p[n]*maxdimension;
+                glm::ivec3 lo = glm::ivec3(glm::floor(p-glm::vec3(support)));
+                glm::ivec3 hi = glm::ivec3(glm::ceil(p+glm::vec3(support)));
+                for(int i=lo.x; i<=hi.x; i++){
+                    for(int j=lo.y; j<=hi.y; j++){
+                        for(int k=lo.z; k<=hi.z; k++){
+                            glm::vec3 offset = glm::vec3(i,j,k)-p;
+                            float s = 1.0f - glm::dot(offset, offset)*invsupport2;
+                            if(s<=0.0f){
+                                continue;
+                            }
+                            float w = s*s*s;
+                            openvdb::Coord coord(i,j,k);
+                            weights.setValue(coord, weights.getValue(coord) + w);
+                            positions.setValue(coord, positions.getValue(coord) + 
+                                                      openvdb::Vec3s(p.x, p.y, p.z)*w);
+                        }
+                    }
+                }
+            }
+            return partial;
+        },
+        [](ZhuBridsonSums a, ZhuBridsonSums b){
+            if(!a.m_weights){
+                return b;
+            }
+            if(b.m_weights){
+                openvdb::tools::compSum(*a.m_weights, *b.m_weights);
+                openvdb::tools::compSum(*a.m_positions, *b.m_positions);
+            }
+            return a;
+        }
+    );
+    if(!sums.m_weights){
+        return;
+    }
+
+    m_vdbgrid->tree().topologyUnion(sums.m_weights->tree());
+    openvdb::tree::LeafManager<openvdb::FloatTree> leaves(m_vdbgrid->tree());
+    openvdb::FloatGrid::Ptr weightGrid = sums.m_weights;
+    openvdb::Vec3SGrid::Ptr positionGrid = sums.m_positions;
+    tbb::parallel_for(leaves.leafRange(),
+        [=](const openvdb::tree::LeafManager<openvdb::FloatTree>::LeafRange& r){
+            openvdb::FloatGrid::ConstAccessor weights = weightGrid->getConstAccessor();
+            openvdb::Vec3SGrid::ConstAccessor positions = positionGrid->getConstAccessor();
+            for(openvdb::tree::LeafManager<openvdb::FloatTree>::LeafRange::Iterator leaf = 
+                r.begin(); leaf; ++leaf){
+                for(openvdb::FloatTree::LeafNodeType::ValueOnIter v = leaf->beginValueOn(); v;
+                    ++v){
+                    openvdb::Coord coord = v.getCoord();
+                    float w = weights.getValue(coord);
+                    if(w<=0.0f){
+                        v.setValue(background);
+                        v.setValueOff();
+                        continue;
+                    }
+                    openvdb::Vec3s average = positions.getValue(coord)/w;
+                    glm::vec3 offset = glm::vec3(coord.x(), coord.y(), coord.z()) - 
+                                       glm::vec3(average.x(), average.y(), average.z());
+                    float d = glm::length(offset) - radius;
+                    v.setValue(glm::clamp(d, -background, background));
+                }
+            }
+        }
+    );
+    m_vdbgrid->tree().signedFloodFill();
+}
+
+void LevelSet::WriteMeshToFile(std::string filename){
     openvdb::tools::VolumeToMesh vdbmesher(0,.05f);
     vdbmesher(*GetVDBGrid());
 
-    //get all mesh points and dump to glm::vec3 std::vector
+    //the writer reads vdb's point and polygon arrays in place, Vec3s and Vec3I/Vec4I are laid
+    //out exactly like glm's vec3 and uvec3/uvec4
     unsigned int vdbPointsCount = vdbmesher.pointListSize();
     openvdb::tools::PointList& vdbPoints = vdbmesher.pointList();
-    
-    std::vector<glm::vec3> points;
-    points.reserve(vdbPointsCount);
-    for(unsigned int i=0; i<vdbPointsCount; i++){
-        glm::vec3 v(vdbPoints[i][0], vdbPoints[i][1], vdbPoints[i][2]);
-        points.push_back(v);
+    const glm::vec3* points = NULL;
+    if(vdbPointsCount>0){
+        points = reinterpret_cast<const glm::vec3*>(&vdbPoints[0]);
     }
+    geomCore::MeshWriter writer(points, vdbPointsCount);
 
-    //get all mesh faces and dump to glm::vec4 std::vector
     unsigned int vdbFacesCount = vdbmesher.polygonPoolListSize();
     openvdb::tools::PolygonPoolList& vdbFaces = vdbmesher.polygonPoolList();
-
-    unsigned int facesCount = 0;
-    for(unsigned int i=0; i<vdbFacesCount; i++){
-        facesCount = facesCount + vdbFaces[i].numQuads() + vdbFaces[i].numTriangles();
-    }
-
-    std::vector<glm::uvec4> faces;
-    faces.reserve(facesCount);
-
     for(unsigned int i=0; i<vdbFacesCount; i++){
-        unsigned int count = vdbFaces[i].numQuads();
-        for(unsigned int j=0; j<count; j++){
-            openvdb::Vec4I vdbface = vdbFaces[i].quad(j);
-            glm::uvec4 f(vdbface[0]+1, vdbface[1]+1, vdbface[2]+1, vdbface[3]+1);
-            faces.push_back(f);
+        openvdb::tools::PolygonPool& pool = vdbFaces[i];
+        unsigned int quadsCount = pool.numQuads();
+        unsigned int trianglesCount = pool.numTriangles();
+        const glm::uvec4* quads = NULL;
+        const glm::uvec3* triangles = NULL;
+        if(quadsCount>0){
+            quads = reinterpret_cast<const glm::uvec4*>(&pool.quad(0));
         }
-        count = vdbFaces[i].numTriangles();
-        for(unsigned int j=0; j<count; j++){
-            openvdb::Vec3I vdbface = vdbFaces[i].triangle(j);
-            glm::uvec4 f(vdbface[0]+1, vdbface[1]+1, vdbface[2]+1, 0);
-            faces.push_back(f);
+        if(trianglesCount>0){
+            triangles = reinterpret_cast<const glm::uvec3*>(&pool.triangle(0));
         }
+        writer.AddPolygons(quads, quadsCount, triangles, trianglesCount);
     }
 
-    //pack points and faces into objcontainer and write
-    objCore::Obj* mesh = new objCore::Obj();
-    mesh->m_numberOfVertices = points.size();
-    mesh->m_vertices = &points[0];
-    mesh->m_numberOfNormals = 0;
-    mesh->m_normals = NULL;
-    mesh->m_numberOfUVs = 0;
-    mesh->m_uvs = NULL;
-    mesh->m_numberOfPolys = faces.size();
-    mesh->m_polyVertexIndices = &faces[0];
-    mesh->m_polyNormalIndices = NULL;
-    mesh->m_polyUVIndices = NULL;
-    
-    mesh->m_keep = true;
-
-    mesh->WriteObj(filename);
-
-    delete mesh;
+    writer.Write(filename);
 }
 
 void LevelSet::ProjectPointsToSurface(std::vector<Particle*>& particles, const float& pscale){
@@ -205,17 +374,38 @@ float LevelSet::GetInterpolatedCell(const glm::vec3& index){
 }
 
 float LevelSet::GetInterpolatedCell(const float& x, const float& y, const float& z){
-    float value;
-    m_getInterpolatedCellLock.lock();
-    {
-        openvdb::Vec3f p(x,y,z);
-        openvdb::tools::GridSampler<openvdb::FloatTree, openvdb::tools::BoxSampler> interpolator(
-                                                                        m_vdbgrid->constTree(), 
-                                                                        m_vdbgrid->transform());
-        value = interpolator.wsSample(p);
+    openvdb::Vec3f p(x,y,z);
+    return GetAccessor().m_sampler->wsSample(p);
+}
+
+void LevelSet::Sample(const glm::vec3* positions, float* values, const unsigned int& count){
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,count),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            LevelSetAccessor::Sampler* sampler = GetAccessor().m_sampler;
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                openvdb::Vec3f p(positions[i].x, positions[i].y, positions[i].z);
+                values[i] = sampler->wsSample(p);
+            }
+        }
+    );
+}
+
+glm::vec3 LevelSet::GetInterpolatedGradient(const glm::vec3& p){
+    LevelSetAccessor::Sampler* sampler = GetAccessor().m_sampler;
+    float h = m_vdbgrid->voxelSize()[0];
+    glm::vec3 gradient;
+    for(unsigned int i=0; i<3; i++){
+        openvdb::Vec3f forward(p.x, p.y, p.z);
+        openvdb::Vec3f back(p.x, p.y, p.z);
+        forward[i] += h;
+        back[i] -= h;
+        gradient[i] = (sampler->wsSample(forward) - sampler->wsSample(back))/(2.0f*h);
     }
-    m_getInterpolatedCellLock.unlock();
-    return value;
+    return gradient;
+}
+
+float LevelSet::GetBandWidth(){
+    return m_vdbgrid->background();
 }
 
 float LevelSet::GetCell(const glm::vec3& index){
@@ -224,9 +414,7 @@ float LevelSet::GetCell(const glm::vec3& index){
 
 float LevelSet::GetCell(const int& x, const int& y, const int& z){
     openvdb::Coord coord = openvdb::Coord(x,y,z);
-    openvdb::FloatGrid::Accessor accessor = m_vdbgrid->getAccessor();
-    float cell = accessor.getValue(coord);
-    return cell;
+    return GetAccessor().m_accessor->getValue(coord);
 }
 
 void LevelSet::SetCell(const glm::vec3& index, const float& value){
@@ -241,9 +429,31 @@ void LevelSet::SetCell(const int& x, const int& y, const int& z, const float& va
         accessor.setValue(coord, value);
     }
     m_setCellLock.unlock();
+    //writes can add or drop tree nodes out from under cached read accessors
+    InvalidateAccessors();
+}
+
+LevelSetAccessor& LevelSet::GetAccessor(){
+    LevelSetAccessor& accessor = m_accessors.local();
+    unsigned int generation = m_generation;
+    if(accessor.m_generation!=generation){
+        delete accessor.m_sampler;
+        delete accessor.m_accessor;
+        accessor.m_accessor = new openvdb::FloatGrid::ConstAccessor(m_vdbgrid->getConstAccessor());
+        accessor.m_sampler = new LevelSetAccessor::Sampler(*accessor.m_accessor, 
+                                                           m_vdbgrid->transform());
+        accessor.m_generation = generation;
+    }
+    return accessor;
+}
+
+void LevelSet::InvalidateAccessors(){
+    m_generation++;
 }
 
 openvdb::FloatGrid::Ptr& LevelSet::GetVDBGrid(){
+    //the caller may edit or swap the grid through the returned pointer
+    InvalidateAccessors();
     return m_vdbgrid;
 }
 
@@ -251,9 +461,11 @@ void LevelSet::Merge(LevelSet& ls){
     openvdb::FloatGrid::Ptr objectSDF = ls.GetVDBGrid()->deepCopy();
     openvdb::tools::csgUnion(*m_vdbgrid, *objectSDF);
     objectSDF->clear();
+    InvalidateAccessors();
 }
     
 void LevelSet::Copy(LevelSet& ls){
     m_vdbgrid = ls.GetVDBGrid()->deepCopy();
+    InvalidateAccessors();
 }
 }
@@ -12,64 +12,95 @@
 #include <openvdb/tools/MeshToVolume.h>
 #include <openvdb/tools/LevelSetSphere.h>
 #include <openvdb/tools/Composite.h>
+#include <openvdb/tools/GridTransformer.h>
 #include "macgrid.inl"
+#include "particleset.hpp"
 #include "../geom/geomlist.hpp"
 
 namespace fluidCore {
+//====================================
+// Enums
+//====================================
+
+//How particles become a level set for export. Trails smear each particle along its velocity
+//with vdb's rasterizer. Spheres and zhu_bridson are our own parallel rasterizers, the latter
+//blending neighbors into a smoother surface
+enum SurfaceKernel{SURFACE_TRAILS=0, SURFACE_SPHERES, SURFACE_ZHUBRIDSON};
+
 //====================================
 // Class Declarations
 //====================================
 
 class ParticleList{ //used for VDB particle to level set construction
     public:
-        ParticleList(){ }
+        ParticleList(){ 
+            m_particles = NULL;
+        }
 
-        ParticleList(std::vector<Particle*> plist, float maxdimension){
+        ParticleList(ParticleSet* plist, float maxdimension, float radius){
             m_particles = plist;
             m_maxdimension = maxdimension;
+            m_radius = radius;
         }
 
         ~ParticleList(){ }
 
         int size() const { 
-            return m_particles.size(); 
+            return m_particles->Size(); 
         }
 
         void getPos(size_t n, openvdb::Vec3R& pos) const {
-            pos = openvdb::Vec3f(m_particles[n]->m_p.x*m_maxdimension, 
-                                 m_particles[n]->m_p.y*m_maxdimension, 
-                                 m_particles[n]->m_p.z*m_maxdimension);
+            pos = openvdb::Vec3f(m_particles->m_p[n].x*m_maxdimension, 
+                                 m_particles->m_p[n].y*m_maxdimension, 
+                                 m_particles->m_p[n].z*m_maxdimension);
         }
 
         void getPosRad(size_t n, openvdb::Vec3R& pos, openvdb::Real& rad) const {
-            pos = openvdb::Vec3f(m_particles[n]->m_p.x*m_maxdimension, 
-                                 m_particles[n]->m_p.y*m_maxdimension, 
-                                 m_particles[n]->m_p.z*m_maxdimension);
-            rad = m_particles[n]->m_density;
-            rad = .5f;
-            if(m_particles[n]->m_invalid){
+            pos = openvdb::Vec3f(m_particles->m_p[n].x*m_maxdimension, 
+                                 m_particles->m_p[n].y*m_maxdimension, 
+                                 m_particles->m_p[n].z*m_maxdimension);
+            rad = m_radius;
+            if(m_particles->m_invalid[n]){
                 rad = 0.0f;
             }
         }
 
         void getPosRadVel(size_t n, openvdb::Vec3R& pos, openvdb::Real& rad, 
                           openvdb::Vec3R& vel) const {
-            pos = openvdb::Vec3f(m_particles[n]->m_p.x*m_maxdimension, 
-                                 m_particles[n]->m_p.y*m_maxdimension, 
-                                 m_particles[n]->m_p.z*m_maxdimension);
-            rad = m_particles[n]->m_density;
-            rad = .5f;
-            vel = openvdb::Vec3f(m_particles[n]->m_u.x, m_particles[n]->m_u.y, 
-                                 m_particles[n]->m_u.z);
-            if(m_particles[n]->m_invalid){
+            pos = openvdb::Vec3f(m_particles->m_p[n].x*m_maxdimension, 
+                                 m_particles->m_p[n].y*m_maxdimension, 
+                                 m_particles->m_p[n].z*m_maxdimension);
+            rad = m_radius;
+            vel = openvdb::Vec3f(m_particles->m_u[n].x, m_particles->m_u[n].y, 
+                                 m_particles->m_u[n].z);
+            if(m_particles->m_invalid[n]){
                 rad = 0.0f;
             }
         }
 
         void getAtt(size_t n, openvdb::Index32& att) const { att = n; }
     private:
-        std::vector<Particle*>      m_particles;
+        ParticleSet*                m_particles;
         float                       m_maxdimension;
+        float                       m_radius;
+};
+
+//Read accessor and sampler owned by one thread, rebuilt when the grid it was bound to changes
+//so vdb's node cache survives across queries
+struct LevelSetAccessor{
+    typedef openvdb::tools::GridSampler<openvdb::FloatGrid::ConstAccessor, 
+                                        openvdb::tools::BoxSampler> Sampler;
+
+    unsigned int                                m_generation;
+    openvdb::FloatGrid::ConstAccessor*          m_accessor;
+    Sampler*                                    m_sampler;
+
+    //Initializer
+    LevelSetAccessor(): m_generation(0), m_accessor(NULL), m_sampler(NULL){};
+    ~LevelSetAccessor(){ 
+        delete m_sampler;
+        delete m_accessor;
+    };
 };
 
 class LevelSet{
@@ -81,7 +112,11 @@ class LevelSet{
         LevelSet(objCore::Obj* mesh, const glm::mat4& m);
         LevelSet(objCore::InterpolatedObj* animmesh, const float& interpolation, 
                  const glm::mat4& m);
-        LevelSet(std::vector<Particle*>& particles, float maxdimension);
+        //radius is in grid cells. grainSize is the fewest particles one task rasterizes
+        LevelSet(ParticleSet& particles, float maxdimension, const SurfaceKernel& kernel,
+                 const float& radius, const unsigned int& grainSize);
+        //Resamples an already voxelized shape under a transform instead of revoxelizing
+        LevelSet(LevelSet& shape, const glm::mat4& m);
         ~LevelSet();
 
         //Cell accessors and setters and whatever
@@ -91,9 +126,20 @@ class LevelSet{
         void SetCell(const glm::vec3& index, const float& value);
         void SetCell(const int& x, const int& y, const int& z, const float& value);
 
+        //Reads are lock free and safe to call from any number of threads, as long as nothing
+        //is writing to the level set at the same time
         float GetInterpolatedCell(const glm::vec3& index);
         float GetInterpolatedCell(const float& x, const float& y, const float& z);
 
+        //Samples count world space positions in parallel
+        void Sample(const glm::vec3* positions, float* values, const unsigned int& count);
+        //Central difference gradient of the interpolated distance, one voxel either side.
+        //Zero where the whole stencil is outside the narrow band
+        glm::vec3 GetInterpolatedGradient(const glm::vec3& p);
+        //Distance the narrow band extends to either side of the surface. Values further out
+        //are clamped to it
+        float GetBandWidth();
+
         openvdb::FloatGrid::Ptr& GetVDBGrid();
 
         void Merge(LevelSet& ls);
@@ -101,18 +147,28 @@ class LevelSet{
 
         void ProjectPointsToSurface(std::vector<Particle*>& particles, const float& pscale);
 
-        void WriteObjToFile(std::string filename);
+        //Meshes the zero isosurface and writes it as obj, or as binary ply if filename ends
+        //in .ply
+        void WriteMeshToFile(std::string filename);
         void WriteVDBGridToFile(std::string filename);
 
     protected:
         void LevelSetFromAnimMesh(objCore::InterpolatedObj* animmesh, const float& interpolation, 
                                   const glm::mat4& m);
         void LevelSetFromMesh(objCore::Obj* mesh, const glm::mat4& m);
+        void LevelSetFromShape(LevelSet& shape, const glm::mat4& m);
+        void LevelSetFromSpheres(ParticleSet& particles, const float& maxdimension,
+                                 const float& radius, const unsigned int& grainSize);
+        void LevelSetFromZhuBridson(ParticleSet& particles, const float& maxdimension,
+                                    const float& radius, const unsigned int& grainSize);
+        LevelSetAccessor& GetAccessor();
+        void InvalidateAccessors();
 
         openvdb::FloatGrid::Ptr     m_vdbgrid;
 
-        tbb::mutex                  m_getInterpolatedCellLock;
-        tbb::mutex                  m_setCellLock;
+        tbb::atomic<unsigned int>                               m_generation;
+        tbb::enumerable_thread_specific<LevelSetAccessor>       m_accessors;
+        tbb::mutex                                              m_setCellLock;
 };
 }
 
@@ -12,14 +12,33 @@
 
 enum geomtype {SOLID=2, FLUID=1, AIR=0};
 
+//Cell type grids hold one geomtype per byte. Neighboring cells are written from different
+//threads, so types aren't packed any tighter than a byte
+typedef unsigned char celltype;
+
+//Channels that only feed solver weights, like the lightweight SDF, can be stored at half 
+//precision by building with ARIEL_HALF_CHANNELS. Reads widen back to float
+#ifdef ARIEL_HALF_CHANNELS
+#include <OpenEXR/half.h>
+typedef half auxfloat;
+#else
+typedef float auxfloat;
+#endif
+
+//Both splats reach faces up to two cells from a particle's cell, so a band this wide holds every
+//face a splat can write
+#define NARROW_BAND_WIDTH 2
+
 namespace fluidCore {
 //====================================
 // Struct and Function Declarations
 //====================================
 
-//A macgrid in this simulator is built up entirely out of VDB volumes
+//A macgrid in this simulator is built up entirely out of VDB volumes. In sparse mode every
+//channel only stores the 8^3 tiles handed to ActivateMacgridTiles
 struct MacGrid{
     glm::vec3       m_dimensions;
+    bool            m_sparse;
 
     //face velocities
     Grid<float>*    m_u_x;
@@ -29,8 +48,16 @@ struct MacGrid{
 
     Grid<float>*    m_D; //divergence 
     Grid<float>*    m_P; //pressure
-    Grid<int>*      m_A; //cell type
-    Grid<float>*    m_L; //internal lightweight SDF for project step
+    Grid<celltype>* m_A; //cell type
+    Grid<auxfloat>* m_L; //internal lightweight SDF for project step
+
+    //Rebuilt by ParticleGrid::MarkCellTypes, both in x slab order. Band cells are every cell
+    //within m_bandWidth of a FLUID or particle holding cell and run up to m_dimensions on each
+    //axis, so the band also names the upper boundary faces. Faces outside the band stay zero 
+    //after a splat, so per step face passes only need to visit these
+    std::vector<glm::vec3> m_fluidCells;
+    std::vector<glm::vec3> m_bandCells;
+    int             m_bandWidth; //at least NARROW_BAND_WIDTH
 };
 
 struct Particle{
@@ -52,7 +79,8 @@ struct Particle{
 //Forward declarations for externed inlineable methods
 extern inline Particle CreateParticle(const glm::vec3& position, const glm::vec3& velocity, 
                                       const glm::vec3& normal, const float& density);
-extern inline MacGrid CreateMacgrid(const glm::vec3& dimensions);
+extern inline MacGrid CreateMacgrid(const glm::vec3& dimensions, const bool& sparse);
+extern inline void ActivateMacgridTiles(MacGrid& m, const std::vector<glm::vec3>& tiles);
 extern inline void ClearMacgrid(MacGrid& m);
 
 //====================================
@@ -69,20 +97,37 @@ Particle CreateParticle(const glm::vec3& position, const glm::vec3& velocity,
     return p;
 }
 
-MacGrid CreateMacgrid(const glm::vec3& dimensions){
+MacGrid CreateMacgrid(const glm::vec3& dimensions, const bool& sparse){
     int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
     MacGrid m;
     m.m_dimensions = dimensions;
-    m.m_u_x = new Grid<float>(glm::vec3(x+1,y,z), 0.0f);
-    m.m_u_y = new Grid<float>(glm::vec3(x,y+1,z), 0.0f);
-    m.m_u_z = new Grid<float>(glm::vec3(x,y,z+1), 0.0f);
-    m.m_D = new Grid<float>(glm::vec3(x,y,z), 0.0f);
-    m.m_P = new Grid<float>(glm::vec3(x,y,z), 0.0f);
-    m.m_A = new Grid<int>(glm::vec3(x,y,z), 0);
-    m.m_L = new Grid<float>(glm::vec3(x,y,z), 1.6f);
+    m.m_sparse = sparse;
+    m.m_u_x = new Grid<float>(glm::vec3(x+1,y,z), 0.0f, sparse);
+    m.m_u_y = new Grid<float>(glm::vec3(x,y+1,z), 0.0f, sparse);
+    m.m_u_z = new Grid<float>(glm::vec3(x,y,z+1), 0.0f, sparse);
+    m.m_D = new Grid<float>(glm::vec3(x,y,z), 0.0f, sparse);
+    m.m_P = new Grid<float>(glm::vec3(x,y,z), 0.0f, sparse);
+    m.m_A = new Grid<celltype>(glm::vec3(x,y,z), AIR, sparse);
+    m.m_L = new Grid<auxfloat>(glm::vec3(x,y,z), 1.6f, sparse);
+    m.m_bandWidth = NARROW_BAND_WIDTH;
     return m;
 }
 
+//All channels share one tile list so kernels can walk any channel's blocks and index the
+//others with the same coordinates. Does nothing for dense macgrids
+void ActivateMacgridTiles(MacGrid& m, const std::vector<glm::vec3>& tiles){
+    if(!m.m_sparse){
+        return;
+    }
+    m.m_u_x->SetActiveTiles(tiles);
+    m.m_u_y->SetActiveTiles(tiles);
+    m.m_u_z->SetActiveTiles(tiles);
+    m.m_D->SetActiveTiles(tiles);
+    m.m_P->SetActiveTiles(tiles);
+    m.m_A->SetActiveTiles(tiles);
+    m.m_L->SetActiveTiles(tiles);
+}
+
 void ClearMacgrid(MacGrid& m){
     delete m.m_u_x;
     delete m.m_u_y;
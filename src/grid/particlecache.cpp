@@ -0,0 +1,323 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: particlecache.cpp
+// Implements particlecache.hpp
+
+#include <zlib.h>
+#include <cstdio>
+#include <cstring>
+#include "particlecache.hpp"
+
+namespace fluidCore {
+
+static const char particleCacheMagic[8] = {'A', 'R', 'I', 'E', 'L', 'P', 'R', 'T'};
+
+//====================================
+// Byte Plane Helpers
+//====================================
+
+//A channel of count values is stored as one plane per byte of the value, so the slowly
+//varying high bytes of neighbouring particles end up next to each other
+
+static inline void WritePlanes16(unsigned char* planes, const unsigned int& count,
+                                 const unsigned int& i, const unsigned short& value){
+    planes[i] = value & 0xff;
+    planes[count+i] = value>>8;
+}
+
+static inline unsigned short ReadPlanes16(const unsigned char* planes, const unsigned int& count,
+                                          const unsigned int& i){
+    return (unsigned short)(planes[i] | (planes[count+i]<<8));
+}
+
+static inline void WritePlanes32(unsigned char* planes, const unsigned int& count,
+                                 const unsigned int& i, const float& value){
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(float));
+    for(unsigned int b=0; b<4; b++){
+        planes[b*count+i] = (bits>>(8*b)) & 0xff;
+    }
+}
+
+static inline float ReadPlanes32(const unsigned char* planes, const unsigned int& count,
+                                 const unsigned int& i){
+    unsigned int bits = 0;
+    for(unsigned int b=0; b<4; b++){
+        bits = bits | ((unsigned int)planes[b*count+i]<<(8*b));
+    }
+    float value;
+    memcpy(&value, &bits, sizeof(float));
+    return value;
+}
+
+//====================================
+// ParticleCache Class
+//====================================
+
+ParticleCache::ParticleCache(){
+}
+
+ParticleCache::~ParticleCache(){
+}
+
+unsigned int ParticleCache::GetRawBlockSize(const unsigned int& count,
+                                            const unsigned int& channels){
+    unsigned int size = 0;
+    if(channels & PARTICLECACHE_POSITION){
+        size += count*3*sizeof(unsigned short);
+    }
+    if(channels & PARTICLECACHE_VELOCITY){
+        size += count*3*sizeof(unsigned short);
+    }
+    if(channels & PARTICLECACHE_DENSITY){
+        size += count*sizeof(unsigned short);
+    }
+    if(channels & PARTICLECACHE_MASS){
+        size += count*sizeof(float);
+    }
+    return size;
+}
+
+bool ParticleCache::Write(const std::string& filename, ParticleSet& particles, const float& maxd,
+                          const int& frame, const unsigned int& channels){
+    unsigned int particlesCount = particles.Size();
+    unsigned int blocksCount = (particlesCount+PARTICLECACHE_BLOCK_SIZE-1)/PARTICLECACHE_BLOCK_SIZE;
+
+    ParticleCacheHeader header;
+    memset(&header, 0, sizeof(ParticleCacheHeader));
+    memcpy(header.m_magic, particleCacheMagic, sizeof(header.m_magic));
+    header.m_version = PARTICLECACHE_VERSION;
+    header.m_channels = channels & PARTICLECACHE_ALL;
+    header.m_numberOfParticles = particlesCount;
+    header.m_blockSize = PARTICLECACHE_BLOCK_SIZE;
+    header.m_numberOfBlocks = blocksCount;
+    header.m_frame = frame;
+    header.m_maxd = maxd;
+
+    std::vector<ParticleCacheBlock> blocks(blocksCount);
+    std::vector<unsigned char*> compressed(blocksCount, (unsigned char*)NULL);
+    tbb::atomic<bool> failed;
+    failed = false;
+
+    //quantize and compress every block independently
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,blocksCount),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                unsigned int start = b*PARTICLECACHE_BLOCK_SIZE;
+                unsigned int count = glm::min((unsigned int)PARTICLECACHE_BLOCK_SIZE,
+                                              particlesCount-start);
+                ParticleCacheBlock& block = blocks[b];
+                memset(&block, 0, sizeof(ParticleCacheBlock));
+                block.m_rawSize = GetRawBlockSize(count, header.m_channels);
+
+                unsigned char* raw = new unsigned char[block.m_rawSize];
+                unsigned char* out = raw;
+                if(header.m_channels & PARTICLECACHE_POSITION){
+                    glm::vec3 boundsMin = particles.m_p[start];
+                    glm::vec3 boundsMax = particles.m_p[start];
+                    for(unsigned int i=1; i<count; i++){
+                        boundsMin = glm::min(boundsMin, particles.m_p[start+i]);
+                        boundsMax = glm::max(boundsMax, particles.m_p[start+i]);
+                    }
+                    for(unsigned int a=0; a<3; a++){
+                        block.m_boundsMin[a] = boundsMin[a];
+                        block.m_boundsMax[a] = boundsMax[a];
+                        float extent = boundsMax[a]-boundsMin[a];
+                        float scale = extent>0.0f ? 65535.0f/extent : 0.0f;
+                        for(unsigned int i=0; i<count; i++){
+                            float q = (particles.m_p[start+i][a]-boundsMin[a])*scale;
+                            q = utilityCore::clamp(q+0.5f, 0.0f, 65535.0f);
+                            WritePlanes16(out, count, i, (unsigned short)q);
+                        }
+                        out += count*sizeof(unsigned short);
+                    }
+                }
+                if(header.m_channels & PARTICLECACHE_VELOCITY){
+                    for(unsigned int a=0; a<3; a++){
+                        for(unsigned int i=0; i<count; i++){
+                            WritePlanes16(out, count, i,
+                                          utilityCore::floatToHalf(particles.m_u[start+i][a]));
+                        }
+                        out += count*sizeof(unsigned short);
+                    }
+                }
+                if(header.m_channels & PARTICLECACHE_DENSITY){
+                    for(unsigned int i=0; i<count; i++){
+                        WritePlanes16(out, count, i,
+                                      utilityCore::floatToHalf(particles.m_density[start+i]));
+                    }
+                    out += count*sizeof(unsigned short);
+                }
+                if(header.m_channels & PARTICLECACHE_MASS){
+                    for(unsigned int i=0; i<count; i++){
+                        WritePlanes32(out, count, i, particles.m_mass[start+i]);
+                    }
+                    out += count*sizeof(float);
+                }
+
+                uLongf compressedSize = compressBound(block.m_rawSize);
+                compressed[b] = new unsigned char[compressedSize];
+                if(compress2(compressed[b], &compressedSize, raw, block.m_rawSize,
+                             Z_BEST_SPEED)!=Z_OK){
+                    failed = true;
+                }
+                block.m_compressedSize = compressedSize;
+                delete [] raw;
+            }
+        }
+    );
+
+    unsigned long long offset = sizeof(ParticleCacheHeader) +
+                                blocksCount*sizeof(ParticleCacheBlock);
+    for(unsigned int b=0; b<blocksCount; b++){
+        blocks[b].m_offset = offset;
+        offset += blocks[b].m_compressedSize;
+    }
+
+    FILE* file = NULL;
+    if(failed==false){
+        file = fopen(filename.c_str(), "wb");
+    }
+    bool written = file!=NULL;
+    if(file!=NULL){
+        written = fwrite(&header, sizeof(ParticleCacheHeader), 1, file)==1;
+        if(written && blocksCount>0){
+            written = fwrite(&blocks[0], sizeof(ParticleCacheBlock), blocksCount,
+                             file)==blocksCount;
+        }
+        for(unsigned int b=0; b<blocksCount && written; b++){
+            written = fwrite(compressed[b], 1, blocks[b].m_compressedSize,
+                             file)==blocks[b].m_compressedSize;
+        }
+        fclose(file);
+    }
+    for(unsigned int b=0; b<blocksCount; b++){
+        delete [] compressed[b];
+    }
+
+    if(written==false){
+        std::cout << "Error: Unable to write to " << filename << std::endl;
+        return false;
+    }
+    std::cout << "Wrote particle cache to " << filename << std::endl;
+    return true;
+}
+
+bool ParticleCache::Read(const std::string& filename, ParticleSet& particles, float& maxd,
+                         int& frame, unsigned int& channels){
+    size_t size = 0;
+    char* data = utilityCore::mapFile(filename, size, false);
+    if(data==NULL){
+        std::cout << "Error: Unable to read particle cache " << filename << std::endl;
+        return false;
+    }
+
+    ParticleCacheHeader header;
+    bool valid = size>=sizeof(ParticleCacheHeader);
+    if(valid){
+        memcpy(&header, data, sizeof(ParticleCacheHeader));
+        valid = memcmp(header.m_magic, particleCacheMagic, sizeof(header.m_magic))==0 &&
+                header.m_version==PARTICLECACHE_VERSION && header.m_blockSize>0 &&
+                header.m_numberOfBlocks==(header.m_numberOfParticles+header.m_blockSize-1)/
+                                         header.m_blockSize &&
+                sizeof(ParticleCacheHeader)+(unsigned long long)header.m_numberOfBlocks*
+                                            sizeof(ParticleCacheBlock)<=size;
+    }
+    if(valid==false){
+        std::cout << "Error: " << filename << " is not a version " << PARTICLECACHE_VERSION
+                  << " particle cache" << std::endl;
+        utilityCore::unmapFile(data, size);
+        return false;
+    }
+
+    unsigned int blocksCount = header.m_numberOfBlocks;
+    std::vector<ParticleCacheBlock> blocks(blocksCount);
+    if(blocksCount>0){
+        memcpy(&blocks[0], data+sizeof(ParticleCacheHeader),
+               blocksCount*sizeof(ParticleCacheBlock));
+    }
+
+    particles.Resize(header.m_numberOfParticles);
+    tbb::atomic<bool> failed;
+    failed = false;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,blocksCount),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                unsigned int start = b*header.m_blockSize;
+                unsigned int count = glm::min(header.m_blockSize,
+                                              header.m_numberOfParticles-start);
+                const ParticleCacheBlock& block = blocks[b];
+
+                uLongf rawSize = GetRawBlockSize(count, header.m_channels);
+                if(block.m_rawSize!=rawSize || block.m_offset+block.m_compressedSize>size){
+                    failed = true;
+                    continue;
+                }
+                unsigned char* raw = new unsigned char[glm::max((unsigned int)rawSize, 1u)];
+                if(uncompress(raw, &rawSize, (const Bytef*)(data+block.m_offset),
+                              block.m_compressedSize)!=Z_OK || rawSize!=block.m_rawSize){
+                    failed = true;
+                    delete [] raw;
+                    continue;
+                }
+
+                const unsigned char* in = raw;
+                for(unsigned int i=0; i<count; i++){
+                    particles.m_p[start+i] = glm::vec3(0.0f);
+                    particles.m_u[start+i] = glm::vec3(0.0f);
+                    particles.m_density[start+i] = 0.0f;
+                    particles.m_mass[start+i] = 0.0f;
+                    particles.m_type[start+i] = FLUID;
+                    particles.m_invalid[start+i] = false;
+                }
+                if(header.m_channels & PARTICLECACHE_POSITION){
+                    for(unsigned int a=0; a<3; a++){
+                        float extent = block.m_boundsMax[a]-block.m_boundsMin[a];
+                        for(unsigned int i=0; i<count; i++){
+                            float q = (float)ReadPlanes16(in, count, i);
+                            particles.m_p[start+i][a] = block.m_boundsMin[a] +
+                                                        q*(extent/65535.0f);
+                        }
+                        in += count*sizeof(unsigned short);
+                    }
+                }
+                if(header.m_channels & PARTICLECACHE_VELOCITY){
+                    for(unsigned int a=0; a<3; a++){
+                        for(unsigned int i=0; i<count; i++){
+                            particles.m_u[start+i][a] =
+                                utilityCore::halfToFloat(ReadPlanes16(in, count, i));
+                        }
+                        in += count*sizeof(unsigned short);
+                    }
+                }
+                if(header.m_channels & PARTICLECACHE_DENSITY){
+                    for(unsigned int i=0; i<count; i++){
+                        particles.m_density[start+i] =
+                            utilityCore::halfToFloat(ReadPlanes16(in, count, i));
+                    }
+                    in += count*sizeof(unsigned short);
+                }
+                if(header.m_channels & PARTICLECACHE_MASS){
+                    for(unsigned int i=0; i<count; i++){
+                        particles.m_mass[start+i] = ReadPlanes32(in, count, i);
+                    }
+                    in += count*sizeof(float);
+                }
+                delete [] raw;
+            }
+        }
+    );
+    utilityCore::unmapFile(data, size);
+
+    if(failed==true){
+        std::cout << "Error: particle cache " << filename << " is corrupt" << std::endl;
+        particles.Resize(0);
+        return false;
+    }
+    maxd = header.m_maxd;
+    frame = header.m_frame;
+    channels = header.m_channels;
+    return true;
+}
+}
@@ -0,0 +1,78 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: particlecache.hpp
+// Native compressed particle cache, quantized per block and written in parallel
+
+#ifndef PARTICLECACHE_HPP
+#define PARTICLECACHE_HPP
+
+#include "particleset.hpp"
+
+//bump whenever the layout of the cache changes
+#define PARTICLECACHE_VERSION 1
+#define PARTICLECACHE_EXTENSION ".arielparticles"
+//particles per independently compressed block
+#define PARTICLECACHE_BLOCK_SIZE 65536
+
+namespace fluidCore {
+
+//====================================
+// Enums
+//====================================
+
+//Channel bits, stored in this order inside every block
+enum ParticleCacheChannel{PARTICLECACHE_POSITION=1, PARTICLECACHE_VELOCITY=2,
+                          PARTICLECACHE_DENSITY=4, PARTICLECACHE_MASS=8,
+                          PARTICLECACHE_ALL=15};
+
+//====================================
+// Struct Declarations
+//====================================
+
+struct ParticleCacheHeader {
+    char                m_magic[8];
+    unsigned int        m_version;
+    unsigned int        m_channels;
+    unsigned int        m_numberOfParticles;
+    unsigned int        m_blockSize;
+    unsigned int        m_numberOfBlocks;
+    int                 m_frame;
+    float               m_maxd;
+};
+
+//Follows the header once per block. Positions in a block are quantized to 16 bits per axis
+//inside the block's bounds, which are in sim space, so multiply by the header's maxd for world
+struct ParticleCacheBlock {
+    float               m_boundsMin[3];
+    float               m_boundsMax[3];
+    unsigned long long  m_offset;
+    unsigned int        m_compressedSize;
+    unsigned int        m_rawSize;
+};
+
+//====================================
+// Class Declarations
+//====================================
+
+//Velocity and density are stored as half floats and mass as full floats. Every channel is
+//split into byte planes before zlib sees it, which is where most of the compression comes from
+class ParticleCache {
+    public:
+        ParticleCache();
+        ~ParticleCache();
+
+        bool Write(const std::string& filename, ParticleSet& particles, const float& maxd,
+                   const int& frame, const unsigned int& channels);
+
+        //Refills particles as valid FLUID particles in sim space. Channels missing from the
+        //cache read back as zero
+        bool Read(const std::string& filename, ParticleSet& particles, float& maxd,
+                  int& frame, unsigned int& channels);
+
+    private:
+        unsigned int GetRawBlockSize(const unsigned int& count, const unsigned int& channels);
+};
+}
+
+#endif
@@ -4,6 +4,7 @@
 // File: particlegrid.cpp
 // Implements particlegrid.hpp
 
+#include <cstring>
 #include "particlegrid.hpp"
 
 namespace fluidCore{
@@ -17,87 +18,96 @@ ParticleGrid::ParticleGrid(const int& x, const int& y, const int& z){
 }
 
 ParticleGrid::~ParticleGrid(){
-    delete m_grid;
+    delete [] m_cellcursors;
 }
 
 void ParticleGrid::Init(const int& x, const int& y, const int& z){
     m_dimensions = glm::vec3(x,y,z);
-    m_grid = new Grid<int>(glm::vec3(x,y,z), -1);
+    m_cellcount = x*y*z;
+    m_cellstarts.assign(m_cellcount+1, 0);
+    m_cellcursors = new tbb::atomic<unsigned int>[m_cellcount];
+    m_bandseed.assign((x+1)*(y+1)*(z+1), 0);
+    m_bandmask.assign((x+1)*(y+1)*(z+1), 0);
 }
 
+void ParticleGrid::GetCellRange(const int& i, const int& j, const int& k, unsigned int& begin,
+                                unsigned int& end){
+    unsigned int cell = (i*(int)m_dimensions.y + j)*(int)m_dimensions.z + k;
+    begin = m_cellstarts[cell];
+    end = m_cellstarts[cell+1];
+}
+
+void ParticleGrid::GetColumnRange(const int& i, const int& j, const int& k0, const int& k1,
+                                  unsigned int& begin, unsigned int& end){
+    int z = m_dimensions.z;
+    int klo = glm::max(0, k0);
+    int khi = glm::min(z-1, k1);
+    unsigned int column = (i*(int)m_dimensions.y + j)*z;
+    begin = m_cellstarts[column+klo];
+    end = klo>khi ? begin : m_cellstarts[column+khi+1];
+}
+
+std::vector<Particle*>& ParticleGrid::GetSortedParticles(){
+    return m_particles;
+}
+
+unsigned int ParticleGrid::GetCellIndex(const glm::vec3& position, const float& maxd){
+    int i = glm::max(0.0f, glm::min(m_dimensions.x-1.0f, int(maxd)*position.x));
+    int j = glm::max(0.0f, glm::min(m_dimensions.y-1.0f, int(maxd)*position.y));
+    int k = glm::max(0.0f, glm::min(m_dimensions.z-1.0f, int(maxd)*position.z));
+    return (i*(int)m_dimensions.y + j)*(int)m_dimensions.z + k;
+}
+
+//Pushes a visited particle into a neighbor list
+struct NeighborCollector{
+    std::vector<Particle*>* m_neighbors;
+    void operator()(Particle* p) const{ m_neighbors->push_back(p); }
+};
+
 std::vector<Particle*> ParticleGrid::GetCellNeighbors(const glm::vec3& index,
                                                       const glm::vec3& numberOfNeighbors){
-    //loop through neighbors, for each neighbor, check if cell has particles and push back contents
     std::vector<Particle*> neighbors;
-    for( int sx=index.x-numberOfNeighbors.x; sx<=index.x+numberOfNeighbors.x; sx++ ){
-        for( int sy=index.y-numberOfNeighbors.y; sy<=index.y+numberOfNeighbors.y; sy++ ) {
-            for( int sz=index.z-numberOfNeighbors.z; sz<=index.z+numberOfNeighbors.z; sz++ ) {
-                if( sx < 0 || sx > m_dimensions.x-1 || sy < 0 || sy > m_dimensions.y-1 || 
-                    sz < 0 || sz > m_dimensions.z-1 ){
-                    continue;
-                }
-                int cellindex = m_grid->GetCell(glm::vec3(sx, sy, sz));
-                if(cellindex>=0){
-                    int cellparticlecount = m_cells[cellindex].size();
-                    for(int a=0; a<cellparticlecount; a++){
-                        neighbors.push_back(m_cells[cellindex][a]);
-                    }
-                }   
-            }
-        }
-    }
+    NeighborCollector collector;
+    collector.m_neighbors = &neighbors;
+    ForEachCellNeighbor(index, numberOfNeighbors, collector);
     return neighbors;
 }
 
 std::vector<Particle*> ParticleGrid::GetWallNeighbors(const glm::vec3& index, 
                                                       const glm::vec3& numberOfNeighbors){
     std::vector<Particle*> neighbors;
-    for( int sx=index.x-numberOfNeighbors.x; sx<=index.x+numberOfNeighbors.x-1; sx++ ){
-        for( int sy=index.y-numberOfNeighbors.y; sy<=index.y+numberOfNeighbors.y-1; sy++ ) {
-            for( int sz=index.z-numberOfNeighbors.z; sz<=index.z+numberOfNeighbors.z-1; sz++ ) {
-                if( sx < 0 || sx > m_dimensions.x-1 || sy < 0 || sy > m_dimensions.y-1 || 
-                    sz < 0 || sz > m_dimensions.z-1 ){
-                    continue;
-                }
-                int cellindex = m_grid->GetCell(glm::vec3(sx, sy, sz));
-                if(cellindex>=0){
-                    int cellparticlecount = m_cells[cellindex].size();
-                    for(int a=0; a<cellparticlecount; a++){
-                        neighbors.push_back(m_cells[cellindex][a]);
-                    }
-                }   
-            }
-        }
-    }
+    NeighborCollector collector;
+    collector.m_neighbors = &neighbors;
+    ForEachWallNeighbor(index, numberOfNeighbors, collector);
     return neighbors;
 }
 
-float ParticleGrid::CellSDF(const int& i, const int& j, const int& k, const float& density, 
-                            const geomtype& type){
+float ParticleGrid::CellSDF(ParticleSet& particles, const int& i, const int& j, const int& k, 
+                            const float& density, const geomtype& type){
     float accm = 0.0f;
-    int cellindex = m_grid->GetCell(i,j,k);
-    if(cellindex>=0){
-        for( int a=0; a<m_cells[cellindex].size(); a++ ) { 
-            if( m_cells[cellindex][a]->m_type == type) {
-                accm += m_cells[cellindex][a]->m_density;
-            } else {
-                return 1.0f;
-            }
+    unsigned int begin, end;
+    GetCellRange(i, j, k, begin, end);
+    for(unsigned int a=begin; a<end; a++){ 
+        if( particles.m_type[a] == type) {
+            accm += particles.m_density[a];
+        } else {
+            return 1.0f;
         }
     }
     float n0 = 1.0f/(density*density*density);
     return 0.2f*n0-accm;
 }
 
-void ParticleGrid::BuildSDF(MacGrid& mgrid, const float& density){
+void ParticleGrid::BuildSDF(ParticleSet& particles, MacGrid& mgrid, const float& density){
     int x = m_dimensions.x; int y = m_dimensions.y; int z = m_dimensions.z;
+    ParticleSet* set = &particles;
     mgrid.m_L->Clear();
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(int j = 0; j < y; ++j){
-                    for(int k = 0; k < z; ++k){
-                        mgrid.m_L->SetCell(i, j, k, CellSDF(i, j, k, density, FLUID));
+    mgrid.m_L->ForEachActiveBlock(m_dimensions,
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            for(unsigned int i=lo.x; i<hi.x; ++i){ 
+                for(int j=lo.y; j<hi.y; ++j){
+                    for(int k=lo.z; k<hi.z; ++k){
+                        mgrid.m_L->SetCell(i, j, k, CellSDF(*set, i, j, k, density, FLUID));
                     }
                 }
             }   
@@ -105,69 +115,215 @@ void ParticleGrid::BuildSDF(MacGrid& mgrid, const float& density){
     );
 }
 
-void ParticleGrid::MarkCellTypes(std::vector<Particle*>& particles, Grid<int>* A, 
-                                 const float& density){
-    int x = m_dimensions.x; int y = m_dimensions.y; int z = m_dimensions.z;
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
+void ParticleGrid::MarkCellTypes(ParticleSet& particles, MacGrid* mgrid, const float& density,
+                                 Grid<float>* interior, const float& interiorLevel){
+    ParticleSet* set = &particles;
+    Grid<celltype>* A = mgrid->m_A;
+    int y = m_dimensions.y; int z = m_dimensions.z;
+    //seeds are only written inside active blocks, so clear out last step's first
+    unsigned char* seed = &m_bandseed[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_dimensions.x+1),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){     
-                for(int j = 0; j < y; ++j){
-                    for(int k = 0; k < z; ++k){
+            memset(seed+r.begin()*(y+1)*(z+1), 0, (r.end()-r.begin())*(y+1)*(z+1));
+        }
+    );
+    A->ForEachActiveBlock(m_dimensions,
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            for(unsigned int i=lo.x; i<hi.x; ++i){     
+                for(int j=lo.y; j<hi.y; ++j){
+                    for(int k=lo.z; k<hi.z; ++k){
                         A->SetCell(i,j,k, AIR);
-                        int cellindex = m_grid->GetCell(i,j,k);
-                        if(cellindex>=0 && cellindex<m_cells.size()){
-                            for( int a=0; a<m_cells[cellindex].size(); a++ ) { 
-                                if( m_cells[cellindex][a]->m_type == SOLID ) {
-                                    A->SetCell(i,j,k, SOLID);
-                                }
+                        unsigned int begin, end;
+                        GetCellRange(i, j, k, begin, end);
+                        for(unsigned int a=begin; a<end; a++){ 
+                            if( set->m_type[a] == SOLID ) {
+                                A->SetCell(i,j,k, SOLID);
                             }
                         }
                         if( A->GetCell(i,j,k) != SOLID ){
-                            bool isfluid = CellSDF(i, j, k, density, FLUID) < 0.0 ;
+                            bool isfluid = CellSDF(*set, i, j, k, density, FLUID) < 0.0 ||
+                                           (interior!=NULL && 
+                                            interior->GetCell(i,j,k)<interiorLevel);
                             if(isfluid){
                                 A->SetCell(i,j,k, FLUID);
                             }else{
                                 A->SetCell(i,j,k, AIR);
                             }
                         }
+                        seed[(i*(y+1)+j)*(z+1)+k] = begin<end || A->GetCell(i,j,k)==FLUID;
                     }
                 }
             }
         }
     );
+    BuildCellLists(mgrid);
 }
 
-void ParticleGrid::Sort(std::vector<Particle*>& particles){
-    // clear existing cells
-    int cellcount = m_cells.size();
-    for(int i=0; i<cellcount; i++){
-        m_cells[i].clear();
+//Dilates the band seed by the macgrid's band width along z, then y, then x, gathering the fluid and band
+//lists per x slab during the last pass so they come out in the same order on any thread count
+void ParticleGrid::BuildCellLists(MacGrid* mgrid){
+    int x = m_dimensions.x; int y = m_dimensions.y; int z = m_dimensions.z;
+    int w = mgrid->m_bandWidth;
+    int sx = (y+1)*(z+1); int sy = z+1;
+    unsigned char* seed = &m_bandseed[0];
+    unsigned char* mask = &m_bandmask[0];
+    Grid<celltype>* A = mgrid->m_A;
+    //seed -> mask along z, then mask -> seed along y
+    for(unsigned int pass=0; pass<2; pass++){
+        unsigned char* src = pass==0 ? seed : mask;
+        unsigned char* dst = pass==0 ? mask : seed;
+        int stride = pass==0 ? 1 : sy;
+        int extent = pass==0 ? z : y;
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    for(int j=0; j<=y; ++j){
+                        for(int k=0; k<=z; ++k){
+                            int c = i*sx+j*sy+k;
+                            int a = pass==0 ? k : j;
+                            unsigned char band = 0;
+                            for(int d=glm::max(0,a-w); d<=glm::min(extent,a+w) && !band; d++){
+                                band = src[c+(d-a)*stride];
+                            }
+                            dst[c] = band;
+                        }
+                    }
+                }
+            }
+        );
+    }
+    //seed -> lists along x
+    std::vector< std::vector<glm::vec3> > fluidslabs(x+1);
+    std::vector< std::vector<glm::vec3> > bandslabs(x+1);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                int ilo = glm::max(0,(int)i-w); int ihi = glm::min(x,(int)i+w);
+                for(int j=0; j<=y; ++j){
+                    for(int k=0; k<=z; ++k){
+                        unsigned char band = 0;
+                        for(int d=ilo; d<=ihi && !band; d++){
+                            band = seed[d*sx+j*sy+k];
+                        }
+                        if(!band){
+                            continue;
+                        }
+                        bandslabs[i].push_back(glm::vec3(i,j,k));
+                        if((int)i<x && j<y && k<z && A->GetCell(i,j,k)==FLUID){
+                            fluidslabs[i].push_back(glm::vec3(i,j,k));
+                        }
+                    }
+                }
+            }
+        }
+    );
+    mgrid->m_fluidCells.clear();
+    mgrid->m_bandCells.clear();
+    for(int i=0; i<=x; i++){
+        mgrid->m_fluidCells.insert(mgrid->m_fluidCells.end(), fluidslabs[i].begin(), 
+                                   fluidslabs[i].end());
+        mgrid->m_bandCells.insert(mgrid->m_bandCells.end(), bandslabs[i].begin(), 
+                                  bandslabs[i].end());
     }
+}
 
+//Parallel counting sort: histogram particles into cells, prefix sum the counts into cell 
+//offsets, scatter, then sort each cell by original index so the result is stable and does not 
+//depend on thread scheduling. The caller's particle array is reordered to match, so particles 
+//sharing a cell sit next to each other
+void ParticleGrid::Sort(std::vector<Particle*>& particles){
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.y), m_dimensions.z);
+    unsigned int particlecount = particles.size();
+    unsigned int cellcount = m_cellcount;
+    tbb::atomic<unsigned int>* cursors = m_cellcursors;
+    unsigned int* starts = &m_cellstarts[0];
 
-    int particlecount = particles.size();
-    int cellscount = m_cells.size();
-    // cout << particlecount << endl;
-    for(int i=0; i<particlecount; i++){
-        Particle* p = particles[i];
-
-        glm::vec3 pos = p->m_p;
-        pos.x = (int)glm::max(0.0f, glm::min((int)maxd-1.0f, int(maxd)*pos.x));
-        pos.y = (int)glm::max(0.0f, glm::min((int)maxd-1.0f, int(maxd)*pos.y));
-        pos.z = (int)glm::max(0.0f, glm::min((int)maxd-1.0f, int(maxd)*pos.z));
-        
-        int cellindex = m_grid->GetCell(pos);
-        
-        if(cellindex>=0){ //if grid has value here, a cell already exists for it
-            m_cells[cellindex].push_back(p);
-        }else{ //if grid has no value, create new cell and push index to grid
-            std::vector<Particle*> cell;
-            cell.push_back(p);
-            m_cells.push_back(cell);
-            m_grid->SetCell(pos, cellscount);
-            cellscount++;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cellcount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                cursors[c] = 0;
+            }
         }
+    );
+
+    //histogram
+    m_particlecells.resize(particlecount);
+    unsigned int* particlecells = particlecount>0 ? &m_particlecells[0] : NULL;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+        [=,&particles](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int p=r.begin(); p!=r.end(); ++p){
+                unsigned int cell = GetCellIndex(particles[p]->m_p, maxd);
+                particlecells[p] = cell;
+                cursors[cell].fetch_and_increment();
+            }
+        }
+    );
+
+    //prefix sum, in fixed size chunks so chunk boundaries don't depend on the thread count
+    unsigned int chunksize = 4096;
+    unsigned int chunkcount = (cellcount+chunksize-1)/chunksize;
+    std::vector<unsigned int> chunksums(chunkcount+1, 0);
+    unsigned int* sums = &chunksums[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,chunkcount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int chunk=r.begin(); chunk!=r.end(); ++chunk){
+                unsigned int end = glm::min(cellcount, (chunk+1)*chunksize);
+                unsigned int sum = 0;
+                for(unsigned int c=chunk*chunksize; c<end; c++){
+                    sum += cursors[c];
+                }
+                sums[chunk+1] = sum;
+            }
+        }
+    );
+    for(unsigned int chunk=0; chunk<chunkcount; chunk++){
+        sums[chunk+1] += sums[chunk];
     }
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,chunkcount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int chunk=r.begin(); chunk!=r.end(); ++chunk){
+                unsigned int end = glm::min(cellcount, (chunk+1)*chunksize);
+                unsigned int offset = sums[chunk];
+                for(unsigned int c=chunk*chunksize; c<end; c++){
+                    unsigned int count = cursors[c];
+                    starts[c] = offset;
+                    cursors[c] = offset;
+                    offset += count;
+                }
+            }
+        }
+    );
+    starts[cellcount] = particlecount;
+
+    //scatter original indices into their cells, then restore original order within each cell
+    m_order.resize(particlecount);
+    unsigned int* order = particlecount>0 ? &m_order[0] : NULL;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int p=r.begin(); p!=r.end(); ++p){
+                order[cursors[particlecells[p]].fetch_and_increment()] = p;
+            }
+        }
+    );
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cellcount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                if(starts[c+1]-starts[c]>1){
+                    std::sort(order+starts[c], order+starts[c+1]);
+                }
+            }
+        }
+    );
+
+    //reorder particle storage into cell order
+    m_particles.resize(particlecount);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+        [=,&particles](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int p=r.begin(); p!=r.end(); ++p){
+                m_particles[p] = particles[order[p]];
+            }
+        }
+    );
+    std::copy(m_particles.begin(), m_particles.end(), particles.begin());
 }
 }
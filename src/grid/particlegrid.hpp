@@ -11,6 +11,7 @@
 #include "../utilities/utilities.h"
 #include "macgrid.inl"
 #include "gridutils.inl"
+#include "particleset.hpp"
 
 namespace fluidCore {
 //====================================
@@ -26,26 +27,128 @@ class ParticleGrid{
 
         //Sorting tools
         void Sort(std::vector<Particle*>& particles);
+        void GetCellRange(const int& i, const int& j, const int& k, unsigned int& begin, 
+                          unsigned int& end);
+        //Sorted span covering cells k0 to k1 inclusive of column (i,j), clipped to the grid
+        void GetColumnRange(const int& i, const int& j, const int& k0, const int& k1,
+                            unsigned int& begin, unsigned int& end);
+        std::vector<Particle*>& GetSortedParticles();
         std::vector<Particle*> GetCellNeighbors(const glm::vec3& index, 
                                                 const glm::vec3& numberOfNeighbors);
         std::vector<Particle*> GetWallNeighbors(const glm::vec3& index, 
                                                 const glm::vec3& numberOfNeighbors);
+        //Allocation free versions of the above, calls visitor(Particle*) for each neighbor
+        template <typename F> void ForEachCellNeighbor(const glm::vec3& index, 
+                                                       const glm::vec3& numberOfNeighbors,
+                                                       const F& visitor);
+        template <typename F> void ForEachWallNeighbor(const glm::vec3& index, 
+                                                       const glm::vec3& numberOfNeighbors,
+                                                       const F& visitor);
+        //Same again but calls visitor(unsigned int) with the particle's sorted index, which
+        //is also its index in the array passed to Sort and in a ParticleSet gathered from it
+        template <typename F> void ForEachCellNeighborIndex(const glm::vec3& index, 
+                                                            const glm::vec3& numberOfNeighbors,
+                                                            const F& visitor);
+        template <typename F> void ForEachWallNeighborIndex(const glm::vec3& index, 
+                                                            const glm::vec3& numberOfNeighbors,
+                                                            const F& visitor);
 
-        void MarkCellTypes(std::vector<Particle*>& particles, Grid<int>* A, 
-                           const float& density);
-        float CellSDF(const int& i, const int& j, const int& k, const float& density, 
-                      const geomtype& type);
+        //These read types and densities out of a ParticleSet gathered after the last Sort
+        //Also rebuilds mgrid's fluid cell and narrow band lists. Cells where interior is below
+        //interiorLevel are FLUID even without particles, interior can be NULL
+        void MarkCellTypes(ParticleSet& particles, MacGrid* mgrid, const float& density,
+                           Grid<float>* interior, const float& interiorLevel);
+        float CellSDF(ParticleSet& particles, const int& i, const int& j, const int& k, 
+                      const float& density, const geomtype& type);
 
-        void BuildSDF(MacGrid& mgrid, const float& density);
+        void BuildSDF(ParticleSet& particles, MacGrid& mgrid, const float& density);
 
     private:
         void Init(const int& x, const int& y, const int& z);
+        unsigned int GetCellIndex(const glm::vec3& position, const float& maxd);
+        void BuildCellLists(MacGrid* mgrid);
+        template <typename F> void ForEachParticleInRange(const glm::vec3& lo, const glm::vec3& hi,
+                                                          const F& visitor);
+        template <typename F> void ForEachIndexInRange(const glm::vec3& lo, const glm::vec3& hi,
+                                                       const F& visitor);
 
         glm::vec3                                   m_dimensions;
-        Grid<int>*                                  m_grid;
-        std::vector< std::vector<Particle*> >       m_cells;
-        
+        unsigned int                                m_cellcount;
+        //particles in cell c are m_particles[m_cellstarts[c]] to m_particles[m_cellstarts[c+1]]
+        std::vector<unsigned int>                   m_cellstarts;
+        std::vector<Particle*>                      m_particles;
+        std::vector<unsigned int>                   m_particlecells;
+        std::vector<unsigned int>                   m_order;
+        tbb::atomic<unsigned int>*                  m_cellcursors;
+        //one byte per cell over the face extents, used to dilate the band seed one axis at a time
+        std::vector<unsigned char>                  m_bandseed;
+        std::vector<unsigned char>                  m_bandmask;
+
 };
+
+//====================================
+// Template Implementations
+//====================================
+
+template <typename F> void ParticleGrid::ForEachCellNeighbor(const glm::vec3& index, 
+                                                             const glm::vec3& numberOfNeighbors,
+                                                             const F& visitor){
+    ForEachParticleInRange(index-numberOfNeighbors, index+numberOfNeighbors, visitor);
+}
+
+template <typename F> void ParticleGrid::ForEachWallNeighbor(const glm::vec3& index, 
+                                                             const glm::vec3& numberOfNeighbors,
+                                                             const F& visitor){
+    ForEachParticleInRange(index-numberOfNeighbors, index+numberOfNeighbors-glm::vec3(1), 
+                           visitor);
+}
+
+template <typename F> void ParticleGrid::ForEachCellNeighborIndex(const glm::vec3& index, 
+                                                                  const glm::vec3& numberOfNeighbors,
+                                                                  const F& visitor){
+    ForEachIndexInRange(index-numberOfNeighbors, index+numberOfNeighbors, visitor);
+}
+
+template <typename F> void ParticleGrid::ForEachWallNeighborIndex(const glm::vec3& index, 
+                                                                  const glm::vec3& numberOfNeighbors,
+                                                                  const F& visitor){
+    ForEachIndexInRange(index-numberOfNeighbors, index+numberOfNeighbors-glm::vec3(1), visitor);
+}
+
+template <typename F> void ParticleGrid::ForEachParticleInRange(const glm::vec3& lo, 
+                                                                const glm::vec3& hi,
+                                                                const F& visitor){
+    std::vector<Particle*>& particles = m_particles;
+    ForEachIndexInRange(lo, hi, [&](const unsigned int& a){ visitor(particles[a]); });
+}
+
+//Visits the sorted index of every particle in cells lo to hi inclusive, clipped to the grid. 
+//Cells along z are adjacent in the sorted array, so each (x,y) column is a single contiguous span
+template <typename F> void ParticleGrid::ForEachIndexInRange(const glm::vec3& lo, 
+                                                             const glm::vec3& hi,
+                                                             const F& visitor){
+    int y = m_dimensions.y; int z = m_dimensions.z;
+    int klo = glm::max(0, (int)lo.z);
+    int khi = glm::min(z-1, (int)glm::floor(hi.z));
+    if(klo>khi){
+        return;
+    }
+    for(int sx=lo.x; sx<=hi.x; sx++){
+        if(sx<0 || sx>m_dimensions.x-1){
+            continue;
+        }
+        for(int sy=lo.y; sy<=hi.y; sy++){
+            if(sy<0 || sy>m_dimensions.y-1){
+                continue;
+            }
+            unsigned int column = (sx*y + sy)*z;
+            unsigned int end = m_cellstarts[column+khi+1];
+            for(unsigned int a=m_cellstarts[column+klo]; a<end; a++){
+                visitor(a);
+            }
+        }
+    }
+}
 }
 
 #endif
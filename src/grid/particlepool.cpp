@@ -0,0 +1,165 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: particlepool.cpp
+// Implements particlepool.hpp
+
+#include <algorithm>
+#include <climits>
+#include "particlepool.hpp"
+
+namespace fluidCore{
+
+ParticlePool::ParticlePool(){
+    Init(16384);
+}
+
+ParticlePool::ParticlePool(const unsigned int& blocksize){
+    Init(blocksize);
+}
+
+ParticlePool::~ParticlePool(){
+    unsigned int blockcount = m_blockcount;
+    for(unsigned int b=0; b<blockcount; b++){
+        DeleteGrid(m_blocks[b], m_blocksize);
+    }
+}
+
+void ParticlePool::Init(const unsigned int& blocksize){
+    m_blocksize = std::max(1u, blocksize);
+    m_blockcount = 0;
+    m_cursor = 0;
+}
+
+Particle* ParticlePool::Allocate(){
+    Particle* p;
+    if(m_freelist.try_pop(p)){
+        return p;
+    }
+    //bump allocate, only the thread that runs off the end of the last block takes the lock
+    unsigned int slot = m_cursor.fetch_and_increment();
+    unsigned int block = slot/m_blocksize;
+    if(block>=m_blockcount){
+        tbb::spin_mutex::scoped_lock lock(m_blocklock);
+        while(m_blockcount<=block){
+            m_blocks.push_back(CreateGrid<Particle>(m_blocksize));
+            m_blockcount = m_blocks.size();
+        }
+    }
+    return &m_blocks[block][slot%m_blocksize];
+}
+
+void ParticlePool::Free(Particle* p){
+    m_freelist.push(p);
+}
+
+void ParticlePool::Reset(){
+    m_freelist.clear();
+    //blocks are kept, so cursor positions still map into allocated memory
+    m_cursor = 0;
+}
+
+unsigned int ParticlePool::GetLiveCount(){
+    return m_cursor - m_freelist.unsafe_size();
+}
+
+bool ParticlePool::FindSlot(const Particle* p, unsigned int& slot){
+    //last block starting at or before p
+    std::vector< std::pair<Particle*, unsigned int> >::iterator block = 
+        std::upper_bound(m_blockorder.begin(), m_blockorder.end(), 
+                         std::make_pair((Particle*)p, UINT_MAX));
+    if(block==m_blockorder.begin()){
+        return false;
+    }
+    --block;
+    if(p>=block->first+m_blocksize){
+        return false;
+    }
+    slot = block->second*m_blocksize + (unsigned int)(p-block->first);
+    return true;
+}
+
+//Particles are staged in their new order and copied back over the front of the pool, so a
+//reorder briefly needs a second copy of every particle moved
+bool ParticlePool::Reorder(std::vector<Particle*>& particles){
+    unsigned int blockcount = m_blockcount;
+    m_blockorder.resize(blockcount);
+    for(unsigned int b=0; b<blockcount; b++){
+        m_blockorder[b] = std::make_pair(m_blocks[b], b);
+    }
+    std::sort(m_blockorder.begin(), m_blockorder.end());
+
+    unsigned int particlecount = particles.size();
+    std::vector<unsigned int> slots(particlecount);
+    unsigned int* slotdata = particlecount>0 ? &slots[0] : NULL;
+    Particle** source = particlecount>0 ? &particles[0] : NULL;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                if(FindSlot(source[i], slotdata[i])==false){
+                    slotdata[i] = UINT_MAX;
+                }
+            }
+        }
+    );
+
+    //new slots go out in particle order. A slot seen twice or a live slot never seen means 
+    //particles doesn't match the pool, and nothing has moved yet. Freed slots are never seen,
+    //and end up past the new cursor
+    unsigned int slotcount = m_cursor;
+    std::vector<unsigned int> remap(slotcount, UINT_MAX);
+    unsigned int moved = 0;
+    for(unsigned int i=0; i<particlecount; i++){
+        if(slots[i]==UINT_MAX){
+            continue;
+        }
+        if(slots[i]>=slotcount || remap[slots[i]]!=UINT_MAX){
+            return false;
+        }
+        remap[slots[i]] = moved;
+        slots[i] = moved;
+        moved++;
+    }
+    if(moved!=GetLiveCount()){
+        return false;
+    }
+
+    Particle* staging = CreateGrid<Particle>(moved);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                if(slotdata[i]!=UINT_MAX){
+                    staging[slotdata[i]] = *source[i];
+                }
+            }
+        }
+    );
+    unsigned int blocksize = m_blocksize;
+    Particle* const* blocks = &m_blocks[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                if(slotdata[i]!=UINT_MAX){
+                    Particle* target = &blocks[slotdata[i]/blocksize][slotdata[i]%blocksize];
+                    *target = staging[slotdata[i]];
+                    source[i] = target;
+                }
+            }
+        }, tbb::static_partitioner()
+    );
+    DeleteGrid(staging, moved);
+    m_remap.swap(remap);
+    m_freelist.clear();
+    m_cursor = moved;
+    return true;
+}
+
+Particle* ParticlePool::Remap(Particle* p){
+    unsigned int slot;
+    if(FindSlot(p, slot)==false || slot>=m_remap.size() || m_remap[slot]==UINT_MAX){
+        return p;
+    }
+    unsigned int target = m_remap[slot];
+    return &m_blocks[target/m_blocksize][target%m_blocksize];
+}
+}
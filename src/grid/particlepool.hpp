@@ -0,0 +1,71 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: particlepool.hpp
+// Block arena for Particle structs, replaces per particle new/delete
+
+#ifndef PARTICLEPOOL_HPP
+#define PARTICLEPOOL_HPP
+
+#include <tbb/tbb.h>
+#include <tbb/concurrent_queue.h>
+#include <tbb/concurrent_vector.h>
+#include "../utilities/utilities.h"
+#include "macgrid.inl"
+#include "gridutils.inl"
+
+namespace fluidCore {
+//====================================
+// Class Declarations
+//====================================
+
+//Hands out Particle slots from large cache aligned blocks. Allocate and Free are thread safe, 
+//Reset is not. Blocks are only returned to the system when the pool is destroyed, so a pool 
+//that is Reset every frame stops allocating once it has seen its largest frame
+class ParticlePool{
+    public:
+        //Initializers
+        ParticlePool();
+        ParticlePool(const unsigned int& blocksize);
+        ~ParticlePool();
+
+        //Returns an uninitialized particle, reusing a freed slot when one is available
+        Particle* Allocate();
+        //Hands a single slot back for reuse
+        void Free(Particle* p);
+        //Bulk free, every particle handed out so far becomes invalid
+        void Reset();
+
+        unsigned int GetLiveCount();
+
+        //Moves this pool's particles to the front of the pool in the order they appear in 
+        //particles, and points particles at the new slots, which also compacts away freed 
+        //slots. Entries from other pools are left alone. Returns false and moves nothing unless
+        //particles holds every live particle of this pool exactly once. Not thread safe
+        bool Reorder(std::vector<Particle*>& particles);
+        //Where p moved to in the last Reorder, or p itself if it isn't from this pool
+        Particle* Remap(Particle* p);
+
+    private:
+        //blocks hold raw arrays, so pools are never copied
+        ParticlePool(const ParticlePool& source);
+        ParticlePool& operator=(const ParticlePool& source);
+
+        void Init(const unsigned int& blocksize);
+        bool FindSlot(const Particle* p, unsigned int& slot);
+
+        unsigned int                            m_blocksize;
+        tbb::concurrent_vector<Particle*>       m_blocks;
+        tbb::atomic<unsigned int>               m_blockcount;
+        tbb::atomic<unsigned int>               m_cursor;
+        tbb::concurrent_queue<Particle*>        m_freelist;
+        tbb::spin_mutex                         m_blocklock;
+
+        //Reorder scratch. Blocks sorted by address so a particle's slot can be found, and each
+        //old slot's new slot
+        std::vector< std::pair<Particle*, unsigned int> >   m_blockorder;
+        std::vector<unsigned int>                           m_remap;
+};
+}
+
+#endif
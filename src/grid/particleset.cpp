@@ -0,0 +1,142 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: particleset.cpp
+// Implements particleset.hpp
+
+#include "particleset.hpp"
+
+namespace fluidCore{
+
+ParticleSet::ParticleSet(){
+    m_size = 0;
+    m_capacity = 0;
+    m_p = NULL;
+    m_u = NULL;
+    m_density = NULL;
+    m_mass = NULL;
+    m_type = NULL;
+    m_invalid = NULL;
+    for(unsigned int c=0; c<SCRATCH_CHANNELS; c++){
+        m_scratch[c] = NULL;
+    }
+}
+
+ParticleSet::~ParticleSet(){
+    Reserve(0);
+}
+
+unsigned int ParticleSet::Size(){
+    return m_size;
+}
+
+void ParticleSet::Resize(const unsigned int& size){
+    if(size>m_capacity){
+        //grow geometrically so emitters adding a few particles a step don't realloc every step
+        Reserve(std::max(size, m_capacity+m_capacity/2));
+    }
+    m_size = size;
+}
+
+//Channels are scratch between steps, so growing drops the old contents instead of copying
+void ParticleSet::Reserve(const unsigned int& capacity){
+    if(m_capacity>0){
+        DeleteGrid(m_p, m_capacity);
+        DeleteGrid(m_u, m_capacity);
+        DeleteGrid(m_density, m_capacity);
+        DeleteGrid(m_mass, m_capacity);
+        DeleteGrid(m_type, m_capacity);
+        DeleteGrid(m_invalid, m_capacity);
+        for(unsigned int c=0; c<SCRATCH_CHANNELS; c++){
+            if(m_scratch[c]!=NULL){
+                DeleteGrid(m_scratch[c], m_capacity);
+                m_scratch[c] = NULL;
+            }
+        }
+    }
+    m_capacity = capacity;
+    m_size = std::min(m_size, capacity);
+    if(m_capacity>0){
+        m_p = CreateGrid<glm::vec3>(m_capacity);
+        m_u = CreateGrid<glm::vec3>(m_capacity);
+        m_density = CreateGrid<float>(m_capacity);
+        m_mass = CreateGrid<float>(m_capacity);
+        m_type = CreateGrid<int>(m_capacity);
+        m_invalid = CreateGrid<bool>(m_capacity);
+    }else{
+        m_p = NULL;
+        m_u = NULL;
+        m_density = NULL;
+        m_mass = NULL;
+        m_type = NULL;
+        m_invalid = NULL;
+    }
+}
+
+glm::vec3* ParticleSet::GetScratch(const ScratchChannel& channel){
+    if(m_scratch[channel]==NULL && m_capacity>0){
+        m_scratch[channel] = CreateGrid<glm::vec3>(m_capacity);
+    }
+    return m_scratch[channel];
+}
+
+//Sorted particles run in x slab order, so static ranges keep each channel's pages near the 
+//threads working on the matching slabs
+void ParticleSet::Gather(const std::vector<Particle*>& particles){
+    unsigned int particlecount = particles.size();
+    Resize(particlecount);
+    glm::vec3* p = m_p; glm::vec3* u = m_u; float* density = m_density; float* mass = m_mass;
+    int* type = m_type; bool* invalid = m_invalid;
+    const Particle* const* source = particlecount>0 ? &particles[0] : NULL;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                p[i] = source[i]->m_p;
+                u[i] = source[i]->m_u;
+                density[i] = source[i]->m_density;
+                mass[i] = source[i]->m_mass;
+                type[i] = source[i]->m_type;
+                invalid[i] = source[i]->m_invalid;
+            }
+        }, tbb::static_partitioner()
+    );
+}
+
+void ParticleSet::Scatter(std::vector<Particle*>& particles){
+    unsigned int particlecount = std::min((unsigned int)particles.size(), m_size);
+    glm::vec3* p = m_p; glm::vec3* u = m_u; float* density = m_density;
+    Particle** target = particlecount>0 ? &particles[0] : NULL;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                target[i]->m_p = p[i];
+                target[i]->m_u = u[i];
+                target[i]->m_density = density[i];
+            }
+        }, tbb::static_partitioner()
+    );
+}
+
+void ParticleSet::CopyValid(ParticleSet& source, const geomtype& type){
+    unsigned int sourcecount = source.Size();
+    unsigned int count = 0;
+    for(unsigned int i=0; i<sourcecount; i++){
+        if(source.m_type[i]==type && !source.m_invalid[i]){
+            count++;
+        }
+    }
+    Resize(count);
+    unsigned int n = 0;
+    for(unsigned int i=0; i<sourcecount; i++){
+        if(source.m_type[i]==type && !source.m_invalid[i]){
+            m_p[n] = source.m_p[i];
+            m_u[n] = source.m_u[i];
+            m_density[n] = source.m_density[i];
+            m_mass[n] = source.m_mass[i];
+            m_type[n] = source.m_type[i];
+            m_invalid[n] = false;
+            n++;
+        }
+    }
+}
+}
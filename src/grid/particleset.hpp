@@ -0,0 +1,70 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: particleset.hpp
+// Structure of arrays particle storage for the per step sim passes
+
+#ifndef PARTICLESET_HPP
+#define PARTICLESET_HPP
+
+#include <tbb/tbb.h>
+#include "../utilities/utilities.h"
+#include "macgrid.inl"
+#include "gridutils.inl"
+
+namespace fluidCore {
+//====================================
+// Enums
+//====================================
+
+//Scratch channels are only allocated once a pass asks for them
+enum ScratchChannel{SCRATCH_T=0, SCRATCH_CHANNELS};
+
+//====================================
+// Class Declarations
+//====================================
+
+//Every channel is its own cache aligned array, so a pass that only reads positions and
+//velocities streams through just those. Storage only ever grows, so refilling the set every
+//step does not allocate once the particle count settles
+class ParticleSet{
+    public:
+        //Initializers
+        ParticleSet();
+        ~ParticleSet();
+
+        unsigned int Size();
+        void Resize(const unsigned int& size);
+
+        //Copies particles into the set in array order, and back out again. Gathering right
+        //after ParticleGrid::Sort means set index n is sorted index n. Scatter only writes
+        //back the channels the sim passes change: position, velocity and density
+        void Gather(const std::vector<Particle*>& particles);
+        void Scatter(std::vector<Particle*>& particles);
+
+        //Copies every particle of the given type that is not marked invalid from source
+        void CopyValid(ParticleSet& source, const geomtype& type);
+
+        glm::vec3* GetScratch(const ScratchChannel& channel);
+
+        glm::vec3*          m_p; //position
+        glm::vec3*          m_u; //velocity
+        float*              m_density;
+        float*              m_mass;
+        int*                m_type;
+        bool*               m_invalid;
+
+    private:
+        //channels are owned raw arrays, so sets are never copied
+        ParticleSet(const ParticleSet& source);
+        ParticleSet& operator=(const ParticleSet& source);
+
+        void Reserve(const unsigned int& capacity);
+
+        unsigned int        m_size;
+        unsigned int        m_capacity;
+        glm::vec3*          m_scratch[SCRATCH_CHANNELS];
+};
+}
+
+#endif
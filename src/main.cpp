@@ -5,14 +5,70 @@
 // Entry point for Ariel
 
 #include <iostream>
+#include <thread>
 #include "grid/particlegrid.hpp"
 #include "sim/flip.hpp"
 #include "viewer/viewer.hpp"
 #include "scene/sceneloader.hpp"
+#include "utilities/threadpinner.hpp"
 
 using namespace std;
 using namespace glm;
 
+//Steps the sim with no window or GL context until it reaches frames, then waits for queued 
+//exports to hit disk
+void RunHeadless(fluidCore::FlipSim* sim, const int& frames, const bool& dumpVDB, 
+                 const bool& dumpOBJ, const bool& dumpPARTIO){
+    tbb::tick_count start = tbb::tick_count::now();
+    if(sim->m_frame==0){
+        sim->Init();
+    }
+    int firstFrame = sim->m_frame;
+    while(sim->m_frame<frames){
+        sim->Step(dumpVDB, dumpOBJ, dumpPARTIO);
+    }
+    sim->GetScene()->FlushExports();
+    cout << "Simulated frames " << firstFrame+1 << " to " << frames << " in " 
+         << (tbb::tick_count::now()-start).seconds() << " seconds" << endl;
+}
+
+//Runs every variant of a wedge headless at once, each in its own arena so one variant's phases
+//can't steal another's cores
+void RunWedge(const std::vector<sceneCore::WedgeVariant>& variants, const int& frames, 
+              const bool& dumpVDB, const bool& dumpOBJ, const bool& dumpPARTIO, 
+              const bool& verbose){
+    tbb::tick_count start = tbb::tick_count::now();
+    unsigned int variantCount = variants.size();
+    int evenShare = glm::max(1, tbb::task_scheduler_init::default_num_threads()/
+                                glm::max(1, (int)variantCount));
+    std::vector<fluidCore::FlipSim*> sims(variantCount);
+    for(unsigned int i=0; i<variantCount; i++){
+        sims[i] = new fluidCore::FlipSim(variants[i].m_dimensions, variants[i].m_density, 
+                                         variants[i].m_stepsize, variants[i].m_scene, 
+                                         variants[i].m_flipSettings, verbose);
+    }
+    std::vector<std::thread*> threads(variantCount);
+    for(unsigned int i=0; i<variantCount; i++){
+        int cores = variants[i].m_cores>0 ? variants[i].m_cores : evenShare;
+        cout << "Running variant " << variants[i].m_name << " on " << cores << " cores..." 
+             << endl;
+        fluidCore::FlipSim* sim = sims[i];
+        threads[i] = new std::thread([=](){
+            tbb::task_arena arena(cores);
+            arena.execute([&](){
+                RunHeadless(sim, frames, dumpVDB, dumpOBJ, dumpPARTIO);
+            });
+        });
+    }
+    for(unsigned int i=0; i<variantCount; i++){
+        threads[i]->join();
+        delete threads[i];
+        delete sims[i];
+    }
+    cout << "Simulated " << variantCount << " variants in " 
+         << (tbb::tick_count::now()-start).seconds() << " seconds" << endl;
+}
+
 int main(int argc, char** argv){ 
 
     cout << "" << endl;
@@ -26,6 +82,19 @@ int main(int argc, char** argv){
     bool retina = false;
     bool verbose = false;
     string scenefile = "";
+    string resumefile = "";
+    bool headless = false;
+    int frames = 0;
+    bool dumpVDB = false;
+    bool dumpOBJ = false;
+    bool dumpPARTIO = false;
+    viewerCore::PreviewLod previewLod = viewerCore::PREVIEW_FULL;
+    int previewFactor = 0;
+    int streamPort = 0;
+    int streamStride = 8;
+    string attachAddress = "";
+    bool pinThreads = false;
+    string wedgefile = "";
 
     for(int i=1; i<argc; i++){
         string header; string data;
@@ -39,6 +108,36 @@ int main(int argc, char** argv){
             cout << "Verbose mode activated..." << endl;
         }else if(strcmp(header.c_str(), "-scene")==0){
             scenefile = data;
+        }else if(strcmp(header.c_str(), "-resume")==0){
+            resumefile = data;
+        }else if(strcmp(header.c_str(), "-headless")==0){
+            headless = true;
+        }else if(strcmp(header.c_str(), "-frames")==0){
+            frames = atoi(data.c_str());
+        }else if(strcmp(header.c_str(), "-vdb")==0){
+            dumpVDB = true;
+        }else if(strcmp(header.c_str(), "-obj")==0){
+            dumpOBJ = true;
+        }else if(strcmp(header.c_str(), "-partio")==0){
+            dumpPARTIO = true;
+        }else if(strcmp(header.c_str(), "-preview")==0){
+            if(strcmp(data.c_str(), "stride")==0){
+                previewLod = viewerCore::PREVIEW_STRIDE;
+            }else if(strcmp(data.c_str(), "voxel")==0){
+                previewLod = viewerCore::PREVIEW_VOXEL;
+            }
+        }else if(strcmp(header.c_str(), "-previewfactor")==0){
+            previewFactor = atoi(data.c_str());
+        }else if(strcmp(header.c_str(), "-stream")==0){
+            streamPort = atoi(data.c_str());
+        }else if(strcmp(header.c_str(), "-streamstride")==0){
+            streamStride = atoi(data.c_str());
+        }else if(strcmp(header.c_str(), "-attach")==0){
+            attachAddress = data;
+        }else if(strcmp(header.c_str(), "-pinthreads")==0){
+            pinThreads = true;
+        }else if(strcmp(header.c_str(), "-wedge")==0){
+            wedgefile = data;
         }
     }
 
@@ -46,16 +145,66 @@ int main(int argc, char** argv){
         cout << "Error: no scene specified! Use -scene=[file]\n" << endl;
         exit(EXIT_FAILURE);
     } 
+    if(headless && frames<=0){
+        cout << "Error: headless mode needs a frame count! Use -frames=[n]\n" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if(headless && strcmp(attachAddress.c_str(), "")!=0){
+        cout << "Error: -attach needs the viewer, it can't be used with -headless\n" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if(strcmp(wedgefile.c_str(), "")!=0 && (headless==false || 
+       strcmp(resumefile.c_str(), "")!=0 || streamPort>0)){
+        cout << "Error: -wedge only runs -headless, without -resume or -stream\n" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    //has to start observing before the scene loader first brings up the scheduler's threads
+    if(pinThreads){
+        utilityCore::ThreadPinner* pinner = new utilityCore::ThreadPinner();
+        cout << "Pinning threads across " << pinner->GetCpuCount() << " cores..." << endl;
+    }
 
     sceneCore::SceneLoader* sloader = new sceneCore::SceneLoader(scenefile);
 
+    //variants borrow the loaded scene's geometry, so it stays loaded but is never simulated
+    if(strcmp(wedgefile.c_str(), "")!=0){
+        std::vector<sceneCore::WedgeVariant> variants = sloader->LoadWedge(wedgefile);
+        if(variants.empty()){
+            cout << "Error: wedge " << wedgefile << " has no variants\n" << endl;
+            exit(EXIT_FAILURE);
+        }
+        RunWedge(variants, frames, dumpVDB, dumpOBJ, dumpPARTIO, verbose);
+        return EXIT_SUCCESS;
+    }
+
     fluidCore::FlipSim* f = new fluidCore::FlipSim(sloader->GetDimensions(), sloader->GetDensity(), 
                                                    sloader->GetStepsize(), sloader->GetScene(), 
-                                                   verbose);
+                                                   sloader->GetFlipSettings(), verbose);
+
+    //a resumed sim starts past frame 0, so the viewer skips Init
+    if(strcmp(resumefile.c_str(), "")!=0 && f->Resume(resumefile)==false){
+        exit(EXIT_FAILURE);
+    }
+
+    if(streamPort>0 && f->OpenStream(streamPort, glm::max(streamStride, 1))==false){
+        exit(EXIT_FAILURE);
+    }
+
+    if(headless){
+        RunHeadless(f, frames, dumpVDB, dumpOBJ, dumpPARTIO);
+        return EXIT_SUCCESS;
+    }
 
     viewerCore::Viewer* glview = new viewerCore::Viewer();
     glview->Load(f, retina, sloader->m_cameraResolution, sloader->m_cameraRotate, 
                  sloader->m_cameraTranslate, sloader->m_cameraFov, sloader->m_cameraLookat);
+    glview->SetPreview(previewLod, glm::max(previewFactor, 0));
+    //attached viewers only use the local sim for the scene's dimensions and meshes
+    if(strcmp(attachAddress.c_str(), "")!=0 && glview->Attach(attachAddress)==false){
+        exit(EXIT_FAILURE);
+    }
     glview->Launch();
 
 }
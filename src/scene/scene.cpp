@@ -4,24 +4,49 @@
 // File: scene.cpp
 // Implements scene.hpp
 
+#include <algorithm>
 #include <openvdb/openvdb.h>
 #include <openvdb/tools/MeshToVolume.h>
 #include <partio/Partio.h>
 #include "scene.hpp"
 
+//points closer than this to a solid surface, in world units, get the exact ray parity test
+//instead of trusting the sign of the voxelized sdf
+
 namespace sceneCore{
 
 Scene::Scene(){
     m_solidLevelSet = new fluidCore::LevelSet();
     m_liquidLevelSet = new fluidCore::LevelSet();
     m_permaSolidLevelSet = new fluidCore::LevelSet();
+    m_previousSolidLevelSet = NULL;
+    m_solidLevelSetFrame = -1;
+    m_solidsMoved = true;
+    m_solidBoundsFrame = -1.0f;
+    m_sdfInsideTests = true;
     m_liquidParticleCount = 0;
+    m_solidParticlePool = 0;
+    m_exportQueueDepth = 2;
+    m_particleCacheChannels = fluidCore::PARTICLECACHE_POSITION | 
+                              fluidCore::PARTICLECACHE_VELOCITY;
+    m_exportThread = NULL;
+    m_skipFullEmission = true;
+    m_surfaceKernel = fluidCore::SURFACE_TRAILS;
+    m_surfaceRadius = .5f;
+    m_surfaceGrainSize = 1024;
+    m_geometrySource = NULL;
+    m_geometryShared = false;
 }
 
 Scene::~Scene(){
+    FlushExports();
     delete m_solidLevelSet;
     delete m_liquidLevelSet;
-    delete m_permaSolidLevelSet;
+    if(m_geometrySource==NULL){
+        delete m_permaSolidLevelSet;
+    }
+    delete m_previousSolidLevelSet;
+    ClearSolidSDFCache();
 }
 
 void Scene::SetPaths(const std::string& imagePath, const std::string& meshPath, 
@@ -32,22 +57,115 @@ void Scene::SetPaths(const std::string& imagePath, const std::string& meshPath,
     m_partioPath = partioPath;
 }
 
-void Scene::ExportParticles(std::vector<fluidCore::Particle*> particles, 
+void Scene::ExportParticles(fluidCore::ParticleSet& particles, fluidCore::ParticleSet* fill,
                             const float& maxd, const int& frame, const bool& VDB, const bool& OBJ, 
                             const bool& PARTIO){
-    unsigned int particlesCount = particles.size();
+    //the snapshot is the only export work left on the sim thread
+    ExportJob* job = new ExportJob;
+    job->m_particles = new fluidCore::ParticleSet();
+    job->m_particles->CopyValid(particles, FLUID);
+    job->m_fill = fill;
+    job->m_maxd = maxd;
+    job->m_frame = frame;
+    job->m_VDB = VDB;
+    job->m_OBJ = OBJ;
+    job->m_PARTIO = PARTIO;
+    job->m_buffer = NULL;
+    job->m_bufferSize = 0;
+    QueueExport(job);
+}
+
+void Scene::ExportBuffer(const std::string& filename, char* buffer, const size_t& size){
+    ExportJob* job = new ExportJob;
+    job->m_particles = NULL;
+    job->m_fill = NULL;
+    job->m_frame = 0;
+    job->m_VDB = false;
+    job->m_OBJ = false;
+    job->m_PARTIO = false;
+    job->m_buffer = buffer;
+    job->m_bufferSize = size;
+    job->m_filename = filename;
+    QueueExport(job);
+}
+
+void Scene::QueueExport(ExportJob* job){
+    if(m_exportQueueDepth==0){
+        WriteExport(job);
+        return;
+    }
+
+    //at most m_exportQueueDepth snapshots wait in the queue plus one being written, past that
+    //the sim waits here for the writer to catch up
+    if(m_exportThread==NULL){
+        m_exportQueue.set_capacity(m_exportQueueDepth);
+        m_exportThread = new std::thread([=](){
+            ExportLoop();
+        });
+    }
+    m_exportQueue.push(job);
+}
+
+void Scene::FlushExports(){
+    if(m_exportThread==NULL){
+        return;
+    }
+    m_exportQueue.push(NULL);
+    m_exportThread->join();
+    delete m_exportThread;
+    m_exportThread = NULL;
+}
+
+void Scene::ExportLoop(){
+    while(1){
+        ExportJob* job;
+        m_exportQueue.pop(job);
+        if(job==NULL){
+            return;
+        }
+        WriteExport(job);
+    }
+}
 
-    std::vector<fluidCore::Particle*> sdfparticles;
-    for(unsigned int i = 0; i<particlesCount; i++){
-        if(particles[i]->m_type==FLUID && !particles[i]->m_invalid){
-            sdfparticles.push_back(particles[i]);
+//Only ever runs on one thread at a time, either the writer or the sim thread when exports are
+//synchronous, so partio and the mesher never see two frames at once
+void Scene::WriteExport(ExportJob* job){
+    if(job->m_buffer!=NULL){
+        std::string tmpfilename = job->m_filename + ".tmp";
+        FILE* file = fopen(tmpfilename.c_str(), "wb");
+        bool written = file!=NULL;
+        if(file!=NULL){
+            written = fwrite(job->m_buffer, 1, job->m_bufferSize, file)==job->m_bufferSize;
+            written = fclose(file)==0 && written;
+        }
+        if(written && rename(tmpfilename.c_str(), job->m_filename.c_str())==0){
+            std::cout << "Wrote " << job->m_filename << std::endl;
+        }else{
+            std::cout << "Error: Unable to write to " << job->m_filename << std::endl;
+            remove(tmpfilename.c_str());
         }
+        delete [] job->m_buffer;
+        delete job;
+        return;
     }
-    int sdfparticlesCount = sdfparticles.size();
-    
-    std::string frameString = utilityCore::padString(4, utilityCore::convertIntToString(frame));
 
-    if(PARTIO){
+    fluidCore::ParticleSet& sdfparticles = *job->m_particles;
+    int sdfparticlesCount = sdfparticles.Size();
+    float maxd = job->m_maxd;
+
+    std::string frameString = utilityCore::padString(4, 
+                                                     utilityCore::convertIntToString(job->m_frame));
+
+    if(job->m_PARTIO && m_partioPath.size()>=strlen(PARTICLECACHE_EXTENSION) && 
+       m_partioPath.compare(m_partioPath.size()-strlen(PARTICLECACHE_EXTENSION), 
+                            std::string::npos, PARTICLECACHE_EXTENSION)==0){
+        //partio_output ending in the native extension writes our own compressed cache instead
+        std::string cachefilename = m_partioPath;
+        cachefilename.insert(cachefilename.size()-strlen(PARTICLECACHE_EXTENSION), 
+                             "."+frameString);
+        fluidCore::ParticleCache cache;
+        cache.Write(cachefilename, sdfparticles, maxd, job->m_frame, m_particleCacheChannels);
+    }else if(job->m_PARTIO){
         std::string partiofilename = m_partioPath;
         std::vector<std::string> tokens = utilityCore::tokenizeString(partiofilename, ".");
         std::string ext = "." + tokens[tokens.size()-1];
@@ -66,13 +184,13 @@ void Scene::ExportParticles(std::vector<fluidCore::Particle*> particles,
 
         for(unsigned int i = 0; i<sdfparticlesCount; i++){
             float* pos = partioData->dataWrite<float>(positionAttr, i);
-            pos[0] = sdfparticles[i]->m_p.x * maxd;
-            pos[1] = sdfparticles[i]->m_p.y * maxd;
-            pos[2] = sdfparticles[i]->m_p.z * maxd;
+            pos[0] = sdfparticles.m_p[i].x * maxd;
+            pos[1] = sdfparticles.m_p[i].y * maxd;
+            pos[2] = sdfparticles.m_p[i].z * maxd;
             float* vel = partioData->dataWrite<float>(velocityAttr, i);
-            vel[0] = sdfparticles[i]->m_u.x;
-            vel[1] = sdfparticles[i]->m_u.y;
-            vel[2] = sdfparticles[i]->m_u.z;
+            vel[0] = sdfparticles.m_u[i].x;
+            vel[1] = sdfparticles.m_u[i].y;
+            vel[2] = sdfparticles.m_u[i].z;
             int* id = partioData->dataWrite<int>(idAttr, i);
             id[0] = i;          
         }
@@ -81,24 +199,204 @@ void Scene::ExportParticles(std::vector<fluidCore::Particle*> particles,
         partioData->release();
     }
 
-    if(VDB || OBJ){
+    if(job->m_VDB || job->m_OBJ){
         std::string vdbfilename = m_vdbPath;
         utilityCore::replaceString(vdbfilename, ".vdb", "."+frameString+".vdb");
 
-        std::string objfilename = m_meshPath;
-        utilityCore::replaceString(objfilename, ".obj", "."+frameString+".obj");
+        //mesh_output's extension picks the mesh format, so the frame goes in front of it
+        std::string meshfilename = m_meshPath;
+        size_t extension = meshfilename.find_last_of('.');
+        size_t directory = meshfilename.find_last_of('/');
+        if(extension!=std::string::npos && (directory==std::string::npos || extension>directory)){
+            meshfilename.insert(extension, "."+frameString);
+        }else{
+            meshfilename += "."+frameString+".obj";
+        }
 
-        fluidCore::LevelSet* fluidSDF = new fluidCore::LevelSet(sdfparticles, maxd);
+        fluidCore::LevelSet* fluidSDF = new fluidCore::LevelSet(sdfparticles, maxd, 
+                                                                m_surfaceKernel, m_surfaceRadius,
+                                                                m_surfaceGrainSize);
+        //the fill only has to close up the interior, so it always takes the cheapest kernel
+        if(job->m_fill!=NULL && job->m_fill->Size()>0){
+            fluidCore::LevelSet* fillSDF = new fluidCore::LevelSet(*job->m_fill, maxd, 
+                                                                   fluidCore::SURFACE_SPHERES,
+                                                                   .5f, m_surfaceGrainSize);
+            fluidSDF->Merge(*fillSDF);
+            delete fillSDF;
+        }
 
-        if(VDB){
+        if(job->m_VDB){
             fluidSDF->WriteVDBGridToFile(vdbfilename);
         }
 
-        if(OBJ){
-            fluidSDF->WriteObjToFile(objfilename);
+        if(job->m_OBJ){
+            fluidSDF->WriteMeshToFile(meshfilename);
         }
         delete fluidSDF;
     }
+
+    delete job->m_particles;
+    delete job->m_fill;
+    delete job;
+}
+
+tbb::concurrent_vector<fluidCore::Particle*>& Scene::GetLiquidParticles(){
+    return m_liquidParticles;
+}
+
+tbb::concurrent_vector<fluidCore::Particle*>& Scene::GetPermaSolidParticles(){
+    return m_permaSolidParticles;
+}
+
+void Scene::RestoreParticles(const fluidCore::Particle* liquids, const unsigned int& liquidCount,
+                             const fluidCore::Particle* permaSolids, 
+                             const unsigned int& permaSolidCount,
+                             std::vector<fluidCore::Particle*>& particles){
+    m_particleLock.lock();
+
+    m_particlePool.Reset();
+    m_solidParticlePools[0].Reset();
+    m_solidParticlePools[1].Reset();
+    tbb::concurrent_vector<fluidCore::Particle*>().swap(m_solidParticles);
+    tbb::concurrent_vector<fluidCore::Particle*>().swap(m_liquidParticles);
+    tbb::concurrent_vector<fluidCore::Particle*>().swap(m_permaSolidParticles);
+    m_liquidParticles.grow_by(liquidCount);
+    m_permaSolidParticles.grow_by(permaSolidCount);
+
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,liquidCount),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                fluidCore::Particle* p = m_particlePool.Allocate();
+                *p = liquids[i];
+                m_liquidParticles[i] = p;
+            }
+        }
+    );
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,permaSolidCount),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                fluidCore::Particle* p = m_particlePool.Allocate();
+                *p = permaSolids[i];
+                m_permaSolidParticles[i] = p;
+            }
+        }
+    );
+
+    std::vector<fluidCore::Particle*>().swap(particles);
+    particles.reserve(m_liquidParticles.size()+m_permaSolidParticles.size());
+    particles.insert(particles.end(), m_liquidParticles.begin(), m_liquidParticles.end()); 
+    particles.insert(particles.end(), m_permaSolidParticles.begin(), m_permaSolidParticles.end());
+    m_liquidParticleCount = m_liquidParticles.size();
+
+    m_particleLock.unlock();
+}
+
+void Scene::ReorderParticleStore(std::vector<fluidCore::Particle*>& particles){
+    m_particleLock.lock();
+    if(m_particlePool.Reorder(particles)==true){
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_liquidParticles.size()),
+            [&](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    m_liquidParticles[i] = m_particlePool.Remap(m_liquidParticles[i]);
+                }
+            }
+        );
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_permaSolidParticles.size()),
+            [&](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    m_permaSolidParticles[i] = m_particlePool.Remap(m_permaSolidParticles[i]);
+                }
+            }
+        );
+    }
+    m_particleLock.unlock();
+}
+
+void Scene::ExchangeLiquidParticles(std::vector<fluidCore::Particle*>& particles,
+                                    const std::vector<unsigned int>& removed,
+                                    const std::vector<fluidCore::Particle>& added){
+    m_particleLock.lock();
+
+    std::vector<fluidCore::Particle*> gone(removed.size());
+    for(unsigned int r=0; r<removed.size(); r++){
+        gone[r] = particles[removed[r]];
+    }
+    std::sort(gone.begin(), gone.end());
+    tbb::concurrent_vector<fluidCore::Particle*> liquids;
+    liquids.reserve(m_liquidParticles.size()-gone.size()+added.size());
+    for(unsigned int i=0; i<m_liquidParticles.size(); i++){
+        if(std::binary_search(gone.begin(), gone.end(), m_liquidParticles[i])==false){
+            liquids.push_back(m_liquidParticles[i]);
+        }
+    }
+    //compact particles in place, removed is ascending
+    unsigned int next = 0;
+    unsigned int kept = 0;
+    for(unsigned int i=0; i<particles.size(); i++){
+        if(next<removed.size() && removed[next]==i){
+            next++;
+            continue;
+        }
+        particles[kept++] = particles[i];
+    }
+    particles.resize(kept);
+    //freed only once nothing points at them, since the pool hands them straight back out
+    for(unsigned int r=0; r<gone.size(); r++){
+        m_particlePool.Free(gone[r]);
+    }
+    particles.reserve(kept+added.size());
+    for(unsigned int a=0; a<added.size(); a++){
+        fluidCore::Particle* p = m_particlePool.Allocate();
+        *p = added[a];
+        liquids.push_back(p);
+        particles.push_back(p);
+    }
+    m_liquidParticles.swap(liquids);
+    m_liquidParticleCount = m_liquidParticles.size();
+
+    m_particleLock.unlock();
+}
+
+Scene* Scene::CreateVariant(){
+    if(m_geometryShared==false){
+        //bounds over both keyframes hold at any time, so variants never have to refit
+        for(unsigned int i=0; i<m_animMeshes.size(); i++){
+            if(m_animMeshes[i].m_basegeom.m_boundsInterpolation>=0.0f){
+                m_animMeshes[i].m_basegeom.m_boundsInterpolation = -1.0f;
+                m_animMeshes[i].Refit();
+            }
+        }
+        BuildPermaSolidGeomLevelSet();
+        m_geometryShared = true;
+    }
+
+    Scene* variant = new Scene();
+    delete variant->m_permaSolidLevelSet;
+    variant->m_permaSolidLevelSet = m_permaSolidLevelSet;
+    variant->m_geometrySource = this;
+    variant->m_geometryShared = true;
+    //geoms only point at their containers, so copies share this scene's meshes and bvhs
+    variant->m_geoms = m_geoms;
+    for(unsigned int i=0; i<m_solids.size(); i++){
+        variant->m_solids.push_back(&variant->m_geoms[m_solids[i]->m_id]);
+    }
+    for(unsigned int i=0; i<m_liquids.size(); i++){
+        variant->m_liquids.push_back(&variant->m_geoms[m_liquids[i]->m_id]);
+    }
+    variant->m_liquidStartingVelocities = m_liquidStartingVelocities;
+    variant->m_externalForces = m_externalForces;
+
+    variant->SetPaths(m_imagePath, m_meshPath, m_vdbPath, m_partioPath);
+    variant->m_checkpointPath = m_checkpointPath;
+    variant->m_statsPath = m_statsPath;
+    variant->m_sdfInsideTests = m_sdfInsideTests;
+    variant->m_exportQueueDepth = m_exportQueueDepth;
+    variant->m_particleCacheChannels = m_particleCacheChannels;
+    variant->m_skipFullEmission = m_skipFullEmission;
+    variant->m_surfaceKernel = m_surfaceKernel;
+    variant->m_surfaceRadius = m_surfaceRadius;
+    variant->m_surfaceGrainSize = m_surfaceGrainSize;
+    return variant;
 }
 
 void Scene::AddExternalForce(glm::vec3 force){
@@ -118,6 +416,12 @@ std::vector<geomCore::Geom*>& Scene::GetLiquidGeoms(){
 }
 
 void Scene::BuildPermaSolidGeomLevelSet(){
+    //the cached solid union has the old permanent solids baked in
+    m_solidLevelSetFrame = -1;
+    //shared geometry was built once before the first variant, and variants read it in place
+    if(m_geometryShared==true){
+        return;
+    }
     delete m_permaSolidLevelSet;
     m_permaSolidLevelSet = new fluidCore::LevelSet();
 
@@ -147,49 +451,44 @@ void Scene::BuildPermaSolidGeomLevelSet(){
 }
 
 void Scene::BuildSolidGeomLevelSet(const int& frame){
-    delete m_solidLevelSet;
-    m_solidLevelSet = new fluidCore::LevelSet();
-    //build levelsets for all varying geoms, then merge in cached permanent solid level set
     unsigned int solidObjectsCount = m_solids.size();
+    if(m_solidSDFCache.size()!=solidObjectsCount){
+        ClearSolidSDFCache();
+        m_solidSDFCache.resize(solidObjectsCount);
+    }
+    //refresh per solid sdfs, only revoxelizing solids whose shape actually changed
+    bool solidsChanged = m_solidLevelSetFrame<0;
+    for(unsigned int i=0; i<solidObjectsCount; i++){
+        if(UpdateSolidSDFCache(i, frame)==true){
+            solidsChanged = true;
+        }
+    }
+
+    delete m_previousSolidLevelSet;
+    m_previousSolidLevelSet = NULL;
+    m_solidsMoved = solidsChanged;
+    if(solidsChanged==false){
+        //nothing moved, so the cached union is already this frame's solids
+        m_solidLevelSetFrame = frame;
+        return;
+    }
+    //keep the last frame's solids around so substeps can blend between the two
+    if(m_solidLevelSetFrame==frame-1){
+        m_previousSolidLevelSet = m_solidLevelSet;
+    }else{
+        delete m_solidLevelSet;
+    }
+    m_solidLevelSetFrame = frame;
+    m_solidLevelSet = new fluidCore::LevelSet();
+    //merge all cached varying geoms, then merge in cached permanent solid level set
     bool solidSDFCreated = false;
     for(unsigned int i=0; i<solidObjectsCount; i++){
-        if(m_solids[i]->m_geom->IsDynamic()==true){     
-            glm::mat4 transform;
-            glm::mat4 inversetransform;
-            if(m_solids[i]->m_geom->GetTransforms((float)frame, transform, inversetransform)==true){
-                GeomType type = m_solids[i]->m_geom->GetType();
-                if(type==MESH){
-                    geomCore::MeshContainer* m = dynamic_cast<geomCore::MeshContainer*>
-                                                             (m_solids[i]->m_geom);
-                    objCore::Obj* o = &m->GetMeshFrame((float)frame)->m_basegeom;
-                    if(solidSDFCreated==false){
-                        delete m_solidLevelSet;
-                        m_solidLevelSet = new fluidCore::LevelSet(o, transform);
-                        solidSDFCreated = true;
-                    }else{
-                        fluidCore::LevelSet* objectSDF = new fluidCore::LevelSet(o, transform);
-                        m_solidLevelSet->Merge(*objectSDF);
-                        delete objectSDF;
-                    }
-                }else if(type==ANIMMESH){
-                    geomCore::AnimatedMeshContainer* m = dynamic_cast
-                                                         <geomCore::AnimatedMeshContainer*>
-                                                         (m_solids[i]->m_geom);
-                    objCore::InterpolatedObj* o = &m->GetMeshFrame((float)frame)->m_basegeom;
-                    float interpolationWeight = m->GetInterpolationWeight((float)frame);
-                    if(solidSDFCreated==false){
-                        delete m_solidLevelSet;
-                        m_solidLevelSet = new fluidCore::LevelSet(o, interpolationWeight,
-                                                                   transform);
-                        solidSDFCreated = true;
-                    }else{
-                        fluidCore::LevelSet* objectSDF = 
-                                                new fluidCore::LevelSet(o, interpolationWeight,
-                                                                        transform);
-                        m_solidLevelSet->Merge(*objectSDF);
-                        delete objectSDF;
-                    }
-                }
+        if(m_solidSDFCache[i].m_active==true){
+            if(solidSDFCreated==false){
+                m_solidLevelSet->Copy(*m_solidSDFCache[i].m_sdf);
+                solidSDFCreated = true;
+            }else{
+                m_solidLevelSet->Merge(*m_solidSDFCache[i].m_sdf);
             }
         }
     }
@@ -200,48 +499,148 @@ void Scene::BuildSolidGeomLevelSet(const int& frame){
     }
 }
 
+//Brings one solid's cached SDF up to date for the given frame, returns true if it changed.
+//Rigid meshes are voxelized once per mesh frame in object space and resampled when only
+//their transform moves; animated meshes are revoxelized whenever their pose changes
+bool Scene::UpdateSolidSDFCache(const unsigned int& solidGeomID, const int& frame){
+    SolidSDFCache& cache = m_solidSDFCache[solidGeomID];
+    geomCore::GeomInterface* geom = m_solids[solidGeomID]->m_geom;
+    bool active = false;
+    bool changed = false;
+    glm::mat4 transform;
+    glm::mat4 inversetransform;
+    if(geom->IsDynamic()==true && geom->GetTransforms((float)frame, transform, 
+                                                      inversetransform)==true){
+        GeomType type = geom->GetType();
+        if(type==MESH){
+            active = true;
+            geomCore::MeshContainer* m = dynamic_cast<geomCore::MeshContainer*>(geom);
+            spaceCore::Bvh<objCore::Obj>* mesh = m->GetMeshFrame((float)frame);
+            //resampling only holds up for rigid motion, scaled meshes are voxelized in place
+            glm::vec3 scale(glm::length(glm::vec3(transform[0])), 
+                            glm::length(glm::vec3(transform[1])),
+                            glm::length(glm::vec3(transform[2])));
+            glm::vec3 scaleerror = glm::abs(scale-glm::vec3(1.0f));
+            bool rigid = glm::max(glm::max(scaleerror.x, scaleerror.y), scaleerror.z)<1e-4f;
+            if(cache.m_mesh!=mesh){
+                delete cache.m_shape;
+                cache.m_shape = NULL;
+                delete cache.m_sdf;
+                cache.m_sdf = NULL;
+                cache.m_mesh = mesh;
+            }
+            if(cache.m_sdf==NULL || cache.m_transform!=transform){
+                delete cache.m_sdf;
+                if(rigid==true){
+                    if(cache.m_shape==NULL){
+                        cache.m_shape = new fluidCore::LevelSet(&mesh->m_basegeom);
+                    }
+                    cache.m_sdf = new fluidCore::LevelSet(*cache.m_shape, transform);
+                }else{
+                    cache.m_sdf = new fluidCore::LevelSet(&mesh->m_basegeom, transform);
+                }
+                cache.m_transform = transform;
+                changed = true;
+            }
+        }else if(type==ANIMMESH){
+            active = true;
+            geomCore::AnimatedMeshContainer* m = dynamic_cast<geomCore::AnimatedMeshContainer*>
+                                                 (geom);
+            spaceCore::Bvh<objCore::InterpolatedObj>* animmesh = m->GetMeshFrame((float)frame);
+            float interpolationWeight = m->GetInterpolationWeight((float)frame);
+            if(cache.m_sdf==NULL || cache.m_animmesh!=animmesh || 
+               cache.m_interpolation!=interpolationWeight || cache.m_transform!=transform){
+                delete cache.m_sdf;
+                cache.m_sdf = new fluidCore::LevelSet(&animmesh->m_basegeom, interpolationWeight,
+                                                      transform);
+                cache.m_animmesh = animmesh;
+                cache.m_interpolation = interpolationWeight;
+                cache.m_transform = transform;
+                changed = true;
+            }
+        }
+    }
+    if(active!=cache.m_active){
+        cache.m_active = active;
+        changed = true;
+    }
+    return changed;
+}
+
+void Scene::ClearSolidSDFCache(){
+    unsigned int cacheCount = m_solidSDFCache.size();
+    for(unsigned int i=0; i<cacheCount; i++){
+        delete m_solidSDFCache[i].m_shape;
+        delete m_solidSDFCache[i].m_sdf;
+    }
+    m_solidSDFCache.clear();
+}
+
 void Scene::BuildLiquidGeomLevelSet(const int& frame){
     delete m_liquidLevelSet;
     m_liquidLevelSet = new fluidCore::LevelSet();
 
     unsigned int liquidObjectsCount = m_liquids.size();
+    m_liquidSDFStates.resize(liquidObjectsCount);
     bool liquidSDFCreated = false;
     for(unsigned int i=0; i<liquidObjectsCount; i++){
-        glm::mat4 transform;
-        glm::mat4 inversetransform;
-        if(m_liquids[i]->m_geom->GetTransforms((float)frame, transform, inversetransform)==true){
-            GeomType type = m_liquids[i]->m_geom->GetType();
-            if(type==MESH){
-                geomCore::MeshContainer* m = dynamic_cast<geomCore::MeshContainer*>
-                                                         (m_liquids[i]->m_geom);
-                objCore::Obj* o = &m->GetMeshFrame((float)frame)->m_basegeom;
-                if(liquidSDFCreated==false){
-                    delete m_liquidLevelSet;
-                    m_liquidLevelSet = new fluidCore::LevelSet(o, transform);
-                    liquidSDFCreated = true;
-                }else{
-                    fluidCore::LevelSet* objectSDF = new fluidCore::LevelSet(o, transform);
-                    m_liquidLevelSet->Merge(*objectSDF);
-                    delete objectSDF;
-                }
-            }else if(type==ANIMMESH){
-                geomCore::AnimatedMeshContainer* m=dynamic_cast<geomCore::AnimatedMeshContainer*>
-                                                                  (m_liquids[i]->m_geom);
-                objCore::InterpolatedObj* o = &m->GetMeshFrame((float)frame)->m_basegeom;
-                float interpolationWeight = m->GetInterpolationWeight((float)frame);
-                if(liquidSDFCreated==false){
-                    delete m_liquidLevelSet;
-                    m_liquidLevelSet = new fluidCore::LevelSet(o, interpolationWeight,
-                                                               transform);
-                    liquidSDFCreated = true;
-                }else{
-                    fluidCore::LevelSet* objectSDF = new fluidCore::LevelSet(o,interpolationWeight,
-                                                                             transform);
-                    m_liquidLevelSet->Merge(*objectSDF);
-                    delete objectSDF;
-                }
-            }
+        LiquidSDFState state = GetLiquidSDFState(i, frame);
+        m_liquidSDFStates[i] = state;
+        if(state.m_active==false){
+            continue;
+        }
+        fluidCore::LevelSet* objectSDF;
+        if(state.m_mesh!=NULL){
+            objectSDF = new fluidCore::LevelSet(&state.m_mesh->m_basegeom, state.m_transform);
+        }else{
+            objectSDF = new fluidCore::LevelSet(&state.m_animmesh->m_basegeom, 
+                                                state.m_interpolation, state.m_transform);
         }
+        if(liquidSDFCreated==false){
+            delete m_liquidLevelSet;
+            m_liquidLevelSet = objectSDF;
+            liquidSDFCreated = true;
+        }else{
+            m_liquidLevelSet->Merge(*objectSDF);
+            delete objectSDF;
+        }
+    }
+}
+
+LiquidSDFState Scene::GetLiquidSDFState(const unsigned int& liquidIndex, const int& frame){
+    LiquidSDFState state;
+    geomCore::GeomInterface* geom = m_liquids[liquidIndex]->m_geom;
+    glm::mat4 inversetransform;
+    if(geom->GetTransforms((float)frame, state.m_transform, inversetransform)==true){
+        GeomType type = geom->GetType();
+        if(type==MESH){
+            geomCore::MeshContainer* m = dynamic_cast<geomCore::MeshContainer*>(geom);
+            state.m_mesh = m->GetMeshFrame((float)frame);
+            state.m_active = true;
+        }else if(type==ANIMMESH){
+            geomCore::AnimatedMeshContainer* m = dynamic_cast<geomCore::AnimatedMeshContainer*>
+                                                 (geom);
+            state.m_animmesh = m->GetMeshFrame((float)frame);
+            state.m_interpolation = m->GetInterpolationWeight((float)frame);
+            state.m_active = true;
+        }
+    }
+    return state;
+}
+
+void Scene::UpdateLiquidGeomLevelSet(const int& frame){
+    unsigned int liquidCount = m_liquids.size();
+    bool changed = m_liquidSDFStates.size()!=liquidCount;
+    for(unsigned int l=0; l<liquidCount && changed==false; l++){
+        LiquidSDFState state = GetLiquidSDFState(l, frame);
+        const LiquidSDFState& built = m_liquidSDFStates[l];
+        changed = state.m_active!=built.m_active || state.m_mesh!=built.m_mesh || 
+                  state.m_animmesh!=built.m_animmesh || 
+                  state.m_interpolation!=built.m_interpolation || 
+                  state.m_transform!=built.m_transform;
+    }
+    if(changed==true){
+        BuildLiquidGeomLevelSet(frame);
     }
 }
 
@@ -254,8 +653,50 @@ unsigned int Scene::GetLiquidParticleCount(){
     return m_liquidParticleCount;
 }
 
+//Number of emission lattice points i, at (i+0.5)*density in cell units, that land in cell c
+static inline unsigned int LatticePointsInCell(const int& c, const float& density){
+    return (int)glm::ceil((c+1)/density-0.5f) - (int)glm::ceil(c/density-0.5f);
+}
+
+//True if a liquid particle sorted into cell lies in emission voxel (i,j,k), of width w. Cells
+//holding a full lattice's worth of liquid particles count as occupied wherever they sit. Solid
+//particles never fill a voxel
+static inline bool IsVoxelOccupied(fluidCore::ParticleGrid* pgrid, fluidCore::Particle** sorted,
+                                   const int& i, const int& j, const int& k, const float& w,
+                                   const float& density, const glm::vec3& cell){
+    int ci = cell.x; int cj = cell.y; int ck = cell.z;
+    unsigned int begin, end;
+    pgrid->GetCellRange(ci, cj, ck, begin, end);
+    unsigned int liquid = 0;
+    for(unsigned int p=begin; p<end; p++){
+        if(sorted[p]->m_type!=FLUID){
+            continue;
+        }
+        liquid++;
+        glm::vec3 voxel = glm::floor(sorted[p]->m_p/w);
+        if((int)voxel.x==i && (int)voxel.y==j && (int)voxel.z==k){
+            return true;
+        }
+    }
+    return liquid>=LatticePointsInCell(ci, density)*LatticePointsInCell(cj, density)*
+                  LatticePointsInCell(ck, density);
+}
+
+//Appends each slab's particles in slab order, so the merged order is the voxel order no matter
+//how the slabs were scheduled
+static void AppendSlabs(const std::vector< std::vector<fluidCore::Particle*> >& slabs,
+                        tbb::concurrent_vector<fluidCore::Particle*>& target){
+    unsigned int slabCount = slabs.size();
+    for(unsigned int s=0; s<slabCount; s++){
+        unsigned int count = slabs[s].size();
+        for(unsigned int p=0; p<count; p++){
+            target.push_back(slabs[s][p]);
+        }
+    }
+}
+
 void Scene::GenerateParticles(std::vector<fluidCore::Particle*>& particles,
-                              const glm::vec3& dimensions, const float& density, 
+                              const glm::vec3& dimensions, const float& density,
                               fluidCore::ParticleGrid* pgrid, const int& frame){
 
     float maxdimension = glm::max(glm::max(dimensions.x, dimensions.y), dimensions.z);
@@ -263,87 +704,138 @@ void Scene::GenerateParticles(std::vector<fluidCore::Particle*>& particles,
     float thickness = 1.0f/maxdimension;
     float w = density*thickness;
 
-    //store list of pointers to particles we need to delete for later deletion in the locked block
-    std::vector<fluidCore::Particle*> particlesToDelete;
-    particlesToDelete.reserve(m_solidParticles.size());
-    particlesToDelete.insert(particlesToDelete.end(), m_solidParticles.begin(), 
-                             m_solidParticles.end());
+    //new dynamic solid particles go into the other pool, the current one is still referenced by
+    //the particle list and gets bulk freed in the locked block
+    unsigned int nextSolidPool = 1-m_solidParticlePool;
+    fluidCore::ParticlePool* solidPool = &m_solidParticlePools[nextSolidPool];
 
     tbb::concurrent_vector<fluidCore::Particle*>().swap(m_solidParticles);
-    
+
+    //particles have moved since the sim's last sort, so sort again to get cell ranges that match
+    //their current positions. On frame 0 nothing has been emitted yet
+    bool skipFull = m_skipFullEmission==true && frame>0 && pgrid!=NULL && particles.size()>0;
+    if(skipFull==true){
+        pgrid->Sort(particles);
+    }
+    fluidCore::Particle** sorted = skipFull==true ? &pgrid->GetSortedParticles()[0] : NULL;
+    glm::vec3 maxcell = dimensions-glm::vec3(1.0f);
+
+    unsigned int liquidCount = m_liquids.size();
+    bool emitting = false;
+    for(unsigned int l=0; l<liquidCount; ++l){
+        emitting = emitting || m_liquids[l]->m_geom->IsInFrame(frame);
+    }
+    if(m_sdfInsideTests==true && emitting==true){
+        UpdateLiquidGeomLevelSet(frame);
+    }
+
     //place fluid particles
     //for each fluid geom in the frame, loop through voxels in the geom's AABB to place particles
-    unsigned int liquidCount = m_liquids.size();
     for(unsigned int l=0; l<liquidCount; ++l){
 
-        spaceCore::Aabb liquidaabb = m_liquids[l]->m_geom->GetAabb(frame);   
-        glm::vec3 liquidvelocity = m_liquidStartingVelocities[l]; 
+        spaceCore::Aabb liquidaabb = m_liquids[l]->m_geom->GetAabb(frame);
+        glm::vec3 liquidvelocity = m_liquidStartingVelocities[l];
 
         if(m_liquids[l]->m_geom->IsInFrame(frame)){
+            //the liquid sdf is the union of every liquid, so it only proves a point is inside
+            //this one where no other liquid in it overlaps
+            bool exclusive = true;
+            for(unsigned int o=0; o<m_liquidSDFStates.size() && exclusive==true; ++o){
+                if(o!=l && m_liquidSDFStates[o].m_active==true){
+                    spaceCore::Aabb otheraabb = m_liquids[o]->m_geom->GetAabb(frame);
+                    exclusive = otheraabb.m_max.x<liquidaabb.m_min.x || 
+                                otheraabb.m_max.y<liquidaabb.m_min.y ||
+                                otheraabb.m_max.z<liquidaabb.m_min.z ||
+                                otheraabb.m_min.x>liquidaabb.m_max.x || 
+                                otheraabb.m_min.y>liquidaabb.m_max.y ||
+                                otheraabb.m_min.z>liquidaabb.m_max.z;
+                }
+            }
             //clip AABB to sim boundaries, account for density
             glm::vec3 lmin = glm::floor(liquidaabb.m_min);
             glm::vec3 lmax = glm::ceil(liquidaabb.m_max);
-            lmin = glm::max(lmin, glm::vec3(0.0f))/density;             
+            lmin = glm::max(lmin, glm::vec3(0.0f))/density;
             lmax = glm::min(lmax, dimensions+glm::vec3(1.0f))/density;
+            unsigned int imin = lmin.x;
+            unsigned int imax = glm::max(lmin.x, lmax.x);
+            //each x slab fills its own list, so threads never contend on a shared vector
+            std::vector< std::vector<fluidCore::Particle*> > slabs(imax-imin);
             //place particles in AABB
-            tbb::parallel_for(tbb::blocked_range<unsigned int>(lmin.x,lmax.x),
-                [=](const tbb::blocked_range<unsigned int>& r){
-                    for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
+            tbb::parallel_for(tbb::blocked_range<unsigned int>(imin,imax),
+                [=,&slabs](const tbb::blocked_range<unsigned int>& r){
+                    for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                        std::vector<fluidCore::Particle*>& slab = slabs[i-imin];
                         for(unsigned int j = lmin.y; j<lmax.y; ++j){
                             for(unsigned int k = lmin.z; k<lmax.z; ++k){
                                 float x = (i*w)+(w/2.0f);
                                 float y = (j*w)+(w/2.0f);
                                 float z = (k*w)+(w/2.0f);
-                                AddLiquidParticle(glm::vec3(x,y,z), liquidvelocity, 
-                                                  3.0f/maxdimension, maxdimension, 
-                                                  frame, m_liquids[l]->m_id);
+                                if(skipFull==true){
+                                    glm::vec3 cell = glm::floor(glm::vec3(x,y,z)*maxdimension);
+                                    cell = glm::clamp(cell, glm::vec3(0.0f), maxcell);
+                                    if(IsVoxelOccupied(pgrid, sorted, i, j, k, w, density, 
+                                                       cell)==true){
+                                        continue;
+                                    }
+                                }
+                                fluidCore::Particle* p = AddLiquidParticle(glm::vec3(x,y,z),
+                                                            liquidvelocity, 3.0f/maxdimension,
+                                                            maxdimension, frame, l, exclusive);
+                                if(p!=NULL){
+                                    slab.push_back(p);
+                                }
                             }
                         }
                     }
                 }
             );
-        }   
+            AppendSlabs(slabs, m_liquidParticles);
+        }
     }
     unsigned int solidCount = m_solids.size();
     for(unsigned int l=0; l<solidCount; ++l){
-        spaceCore::Aabb solidaabb = m_solids[l]->m_geom->GetAabb(frame);        
-        if((frame==0 && m_solids[l]->m_geom->IsDynamic()==false) || 
-           (m_solids[l]->m_geom->IsDynamic()==true && m_solids[l]->m_geom->IsInFrame(frame))){
+        spaceCore::Aabb solidaabb = m_solids[l]->m_geom->GetAabb(frame);
+        bool dynamic = m_solids[l]->m_geom->IsDynamic();
+        if((frame==0 && dynamic==false) || 
+           (dynamic==true && m_solids[l]->m_geom->IsInFrame(frame))){
             //clip AABB to sim boundaries, account for density
             glm::vec3 lmin = glm::floor(solidaabb.m_min);
             glm::vec3 lmax = glm::ceil(solidaabb.m_max);
-            lmin = glm::max(lmin, glm::vec3(0.0f))/density;             
+            lmin = glm::max(lmin, glm::vec3(0.0f))/density;
             lmax = glm::min(lmax, dimensions+glm::vec3(1.0f))/density;
+            unsigned int imin = lmin.x;
+            unsigned int imax = glm::max(lmin.x, lmax.x);
+            std::vector< std::vector<fluidCore::Particle*> > slabs(imax-imin);
             //place particles in AABB
-            tbb::parallel_for(tbb::blocked_range<unsigned int>(lmin.x,lmax.x),
-                [=](const tbb::blocked_range<unsigned int>& r){
-                    for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
+            tbb::parallel_for(tbb::blocked_range<unsigned int>(imin,imax),
+                [=,&slabs](const tbb::blocked_range<unsigned int>& r){
+                    for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                        std::vector<fluidCore::Particle*>& slab = slabs[i-imin];
                         for(unsigned int j = lmin.y; j<lmax.y; ++j){
                             for(unsigned int k = lmin.z; k<lmax.z; ++k){
                                 float x = (i*w)+(w/2.0f);
                                 float y = (j*w)+(w/2.0f);
                                 float z = (k*w)+(w/2.0f);
-                                AddSolidParticle(glm::vec3(x,y,z), 3.0f/maxdimension, 
-                                                 maxdimension, frame, m_solids[l]->m_id);
+                                fluidCore::Particle* p = AddSolidParticle(glm::vec3(x,y,z),
+                                                            3.0f/maxdimension, maxdimension,
+                                                            frame, l, solidPool);
+                                if(p!=NULL){
+                                    slab.push_back(p);
+                                }
                             }
                         }
                     }
                 }
             );
-        }   
+            AppendSlabs(slabs, dynamic==true ? m_solidParticles : m_permaSolidParticles);
+        }
     }
 
     m_particleLock.lock();
    
-    //delete old particles 
-    unsigned int delParticleCount = particlesToDelete.size();
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,delParticleCount),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                delete particlesToDelete[i];
-            }
-        }
-    );
+    //free last frame's dynamic solid particles in one go
+    m_solidParticlePools[m_solidParticlePool].Reset();
+    m_solidParticlePool = nextSolidPool;
 
     //add new particles to main particles list
     std::vector<fluidCore::Particle*>().swap(particles);
@@ -381,11 +873,41 @@ bool Scene::CheckPointInsideGeomByID(const glm::vec3& p, const float& frame,
 
 bool Scene::CheckPointInsideSolidGeom(const glm::vec3& p, const float& frame, 
                                       unsigned int& solidGeomID){
+    //the sdf settles points well clear of every solid, which is nearly all of them. points
+    //inside or near a surface still take the ray test, which also finds which solid it is
+    if(m_sdfInsideTests==true && IsSolidLevelSetCurrent(frame)==true){
+        bool inside;
+        if(CheckPointInsideSDF(m_solidLevelSet, p, inside)==true && inside==false){
+            return false;
+        }
+    }
     rayCore::Ray r;
     r.m_origin = p;
     r.m_frame = frame;
     r.m_direction = glm::normalize(glm::vec3(0,0,1));
     unsigned int solidGeomCount = m_solids.size();
+    if(IsSolidBoundsCurrent(frame)==true){
+        //solids the ray misses have no hits to count. The lowest index solid containing the
+        //point is reported, same as the full loop below
+        unsigned int best = solidGeomCount;
+        std::vector<spaceCore::Aabb>& bounds = m_solidBounds.m_basegeom.m_bounds;
+        auto visit = [&](const unsigned int& i)->bool{
+            if(i<best && bounds[i].FastIntersectionTest(r)>=0.0f){
+                spaceCore::HitCountTraverseAccumulator traverser(p);
+                m_solids[i]->Intersect(r, traverser);
+                if(traverser.m_intersection.m_hit==true && (traverser.m_numberOfHits)%2==1){
+                    best = i;
+                }
+            }
+            return best==0;
+        };
+        m_solidBounds.VisitElements(r, REALLY_BIG_NUMBER, visit);
+        if(best<solidGeomCount){
+            solidGeomID = best;
+            return true;
+        }
+        return false;
+    }
     for(unsigned int i=0; i<solidGeomCount; i++){
         unsigned int hits = 0;
         spaceCore::HitCountTraverseAccumulator traverser(p);
@@ -401,6 +923,28 @@ bool Scene::CheckPointInsideSolidGeom(const glm::vec3& p, const float& frame,
     return false;
 }
 
+//Returns true if the sdf alone can classify the point, false if it is within the band around
+//the surface where voxelization error could flip the sign
+bool Scene::CheckPointInsideSDF(fluidCore::LevelSet* sdf, const glm::vec3& p, 
+                                     bool& inside){
+    float distance = sdf->GetInterpolatedCell(p);
+    inside = distance<0.0f;
+    return glm::abs(distance)>SOLID_SDF_BAND;
+}
+
+//The solid level set matches the given time if it was built for that frame, or if it was
+//built for the end of the frame being substepped and no solid moved over that frame
+bool Scene::IsSolidLevelSetCurrent(const float& frame){
+    if(m_solidLevelSetFrame<0){
+        return false;
+    }
+    float built = (float)m_solidLevelSetFrame;
+    if(frame==built){
+        return true;
+    }
+    return m_solidsMoved==false && frame>built-1.0f && frame<built;
+}
+
 bool Scene::CheckPointInsideLiquidGeom(const glm::vec3& p, const float& frame, 
                                        unsigned int& liquidGeomID){
     rayCore::Ray r;
@@ -425,6 +969,24 @@ bool Scene::CheckPointInsideLiquidGeom(const glm::vec3& p, const float& frame,
 rayCore::Intersection Scene::IntersectSolidGeoms(const rayCore::Ray& r){
     rayCore::Intersection bestHit;
     unsigned int solidGeomCount = m_solids.size();
+    if(IsSolidBoundsCurrent(r.m_frame)==true){
+        std::vector<spaceCore::Aabb>& bounds = m_solidBounds.m_basegeom.m_bounds;
+        float directionLength = glm::length(r.m_direction);
+        auto visit = [&](const unsigned int& i)->bool{
+            float entry = bounds[i].FastIntersectionTest(r);
+            //a solid entered past the closest hit so far can't hold a closer one
+            if(entry<0.0f || (bestHit.m_hit==true && 
+               entry*directionLength>glm::length(bestHit.m_point-r.m_origin))){
+                return false;
+            }
+            spaceCore::TraverseAccumulator traverser;
+            m_solids[i]->Intersect(r, traverser);
+            bestHit = bestHit.CompareClosestAgainst(traverser.m_intersection, r.m_origin);
+            return false;
+        };
+        m_solidBounds.VisitElements(r, REALLY_BIG_NUMBER, visit);
+        return bestHit;
+    }
     for(unsigned int i=0; i<solidGeomCount; i++){
         spaceCore::TraverseAccumulator traverser;
         m_solids[i]->Intersect(r, traverser);
@@ -433,47 +995,214 @@ rayCore::Intersection Scene::IntersectSolidGeoms(const rayCore::Ray& r){
     return bestHit;
 }
 
-void Scene::AddLiquidParticle(const glm::vec3& pos, const glm::vec3& vel, const float& thickness, 
-                              const float& scale, const int& frame, 
-                              const unsigned int& liquidGeomID){
-    glm::vec3 worldpos = pos*scale;
-    if(CheckPointInsideGeomByID(worldpos, frame, liquidGeomID)==true){
-        //if particles are in a solid, don't generate them
-        unsigned int solidGeomID;
-        if(CheckPointInsideSolidGeom(worldpos, frame, solidGeomID)==false){
-            fluidCore::Particle* p = new fluidCore::Particle;
-            p->m_p = pos;
-            p->m_u = vel;
-            p->m_n = glm::vec3(0.0f);
-            p->m_density = 10.0f;
-            p->m_type = FLUID;
-            p->m_mass = 1.0f;
-            p->m_invalid = false;
-            m_liquidParticles.push_back(p);
+void Scene::IntersectSolidGeoms(const rayCore::Ray* rays, rayCore::Intersection* hits,
+                                const unsigned int& count){
+    unsigned int solidGeomCount = m_solids.size();
+    //with current solid bounds, a packet only traces the solids one of its rays reaches
+    bool culled = count>0 && IsSolidBoundsCurrent(rays[0].m_frame)==true;
+    std::vector<unsigned char> reached(culled==true ? solidGeomCount : 0);
+    std::vector<spaceCore::Aabb>& bounds = m_solidBounds.m_basegeom.m_bounds;
+    for(unsigned int first=0; first<count; first+=BVH_PACKET_WIDTH){
+        unsigned int lanes = glm::min((unsigned int)BVH_PACKET_WIDTH, count-first);
+        for(unsigned int l=0; l<lanes; l++){
+            hits[first+l] = rayCore::Intersection();
+        }
+        if(culled==true){
+            std::fill(reached.begin(), reached.end(), 0);
+            for(unsigned int l=0; l<lanes; l++){
+                const rayCore::Ray& r = rays[first+l];
+                auto visit = [&](const unsigned int& i)->bool{
+                    if(reached[i]==0 && bounds[i].FastIntersectionTest(r)>=0.0f){
+                        reached[i] = 1;
+                    }
+                    return false;
+                };
+                m_solidBounds.VisitElements(r, REALLY_BIG_NUMBER, visit);
+            }
+        }
+        for(unsigned int i=0; i<solidGeomCount; i++){
+            if(culled==true && reached[i]==0){
+                continue;
+            }
+            spaceCore::TraverseAccumulator traversers[BVH_PACKET_WIDTH];
+            spaceCore::TraverseAccumulator* results[BVH_PACKET_WIDTH];
+            for(unsigned int l=0; l<lanes; l++){
+                results[l] = &traversers[l];
+            }
+            m_solids[i]->IntersectPacket(&rays[first], results, lanes);
+            for(unsigned int l=0; l<lanes; l++){
+                hits[first+l] = hits[first+l].CompareClosestAgainst(traversers[l].m_intersection, 
+                                                                    rays[first+l].m_origin);
+            }
         }
     }
 }
 
-void Scene::AddSolidParticle(const glm::vec3& pos, const float& thickness, const float& scale, 
-                             const int& frame, const unsigned int& solidGeomID){
-    glm::vec3 worldpos = pos*scale;
-    if(CheckPointInsideGeomByID(worldpos, frame, solidGeomID)==true){
-        fluidCore::Particle* p = new fluidCore::Particle;
-        p->m_p = pos;
-        p->m_u = glm::vec3(0.0f);
-        p->m_n = glm::vec3(0.0f);
-        p->m_density = 10.0f;
-        p->m_type = SOLID;
-        p->m_mass = 10.0f;
-        p->m_invalid = false;
-        if(frame==0 && m_geoms[solidGeomID].m_geom->IsDynamic()==false){
-            m_permaSolidParticles.push_back(p);
-        }else if(m_geoms[solidGeomID].m_geom->IsDynamic()==true){
-            m_solidParticles.push_back(p);
-        }else{
-            delete p;
+void Scene::RefitAnimatedMeshes(const float& frame){
+    unsigned int animmeshCount = m_animmeshContainers.size();
+    for(unsigned int i=0; i<animmeshCount && m_geometryShared==false; i++){
+        m_animmeshContainers[i].RefitMeshFrame(frame);
+    }
+    UpdateSolidGeomBounds(frame);
+}
+
+void Scene::UpdateSolidGeomBounds(const float& frame){
+    unsigned int solidGeomCount = m_solids.size();
+    if(solidGeomCount==0){
+        return;
+    }
+    std::vector<spaceCore::Aabb>& bounds = m_solidBounds.m_basegeom.m_bounds;
+    bool build = bounds.size()!=solidGeomCount || m_solidBounds.m_numberOfNodes==0;
+    bounds.resize(solidGeomCount);
+    for(unsigned int i=0; i<solidGeomCount; i++){
+        //solids outside their frame range come back empty, and stay out of every node
+        spaceCore::Aabb box = m_solids[i]->m_geom->GetAabb(frame);
+        bounds[i] = spaceCore::Aabb(box.m_min, box.m_max, i);
+    }
+    //the tree is kept from the first build and only refit, solids keep their neighbors
+    if(build==true){
+        m_solidBounds.BuildBvh(24);
+    }else{
+        m_solidBounds.Refit();
+    }
+    m_solidBoundsFrame = frame;
+}
+
+bool Scene::CheckSegmentHitsSolidGeom(const glm::vec3& start, const glm::vec3& end, 
+                                      const float& frame){
+    unsigned int solidGeomCount = m_solids.size();
+    float length = glm::length(end-start);
+    if(length>0.0f && IsSolidBoundsCurrent(frame)==true){
+        rayCore::Ray r;
+        r.m_origin = start;
+        r.m_frame = frame;
+        r.m_direction = (end-start)/length;
+        bool hit = false;
+        auto visit = [&](const unsigned int& i)->bool{
+            hit = m_solids[i]->IntersectSegment(start, end, frame);
+            return hit;
+        };
+        m_solidBounds.VisitElements(r, length, visit);
+        return hit;
+    }
+    for(unsigned int i=0; i<solidGeomCount; i++){
+        if(m_solids[i]->IntersectSegment(start, end, frame)==true){
+            return true;
         }
     }
+    return false;
+}
+
+fluidCore::Particle* Scene::AddLiquidParticle(const glm::vec3& pos, const glm::vec3& vel,
+                                             const float& thickness, const float& scale,
+                                             const int& frame, const unsigned int& liquidIndex,
+                                             const bool& exclusive){
+    glm::vec3 worldpos = pos*scale;
+    //the liquid sdf settles points well clear of every liquid surface. Points near one, or
+    //inside where liquids overlap, take the ray parity test against this liquid
+    bool inside = false;
+    bool resolved = false;
+    if(m_sdfInsideTests==true && liquidIndex<m_liquidSDFStates.size() &&
+       m_liquidSDFStates[liquidIndex].m_active==true){
+        resolved = CheckPointInsideSDF(m_liquidLevelSet, worldpos, inside);
+        resolved = resolved==true && (inside==false || exclusive==true);
+    }
+    if(resolved==false){
+        inside = CheckPointInsideGeomByID(worldpos, frame, m_liquids[liquidIndex]->m_id);
+    }
+    if(inside==false){
+        return NULL;
+    }
+    //if particles are in a solid, don't generate them
+    unsigned int solidGeomID;
+    if(CheckPointInsideSolidGeom(worldpos, frame, solidGeomID)==true){
+        return NULL;
+    }
+    fluidCore::Particle* p = m_particlePool.Allocate();
+    p->m_p = pos;
+    p->m_u = vel;
+    p->m_n = glm::vec3(0.0f);
+    p->m_density = 10.0f;
+    p->m_type = FLUID;
+    p->m_mass = 1.0f;
+    p->m_invalid = false;
+    return p;
+}
+
+fluidCore::Particle* Scene::AddSolidParticle(const glm::vec3& pos, const float& thickness, 
+                                            const float& scale, const int& frame, 
+                                            const unsigned int& solidIndex,
+                                            fluidCore::ParticlePool* solidPool){
+    glm::vec3 worldpos = pos*scale;
+    unsigned int solidGeomID = m_solids[solidIndex]->m_id;
+    bool dynamic = m_geoms[solidGeomID].m_geom->IsDynamic();
+    if(frame!=0 && dynamic==false){
+        return NULL;
+    }
+    //dynamic solids have their own cached sdf once this frame's solids are built
+    bool inside = false;
+    bool resolved = false;
+    if(m_sdfInsideTests==true && dynamic==true && m_solidLevelSetFrame==frame && 
+       solidIndex<m_solidSDFCache.size() && m_solidSDFCache[solidIndex].m_active==true){
+        resolved = CheckPointInsideSDF(m_solidSDFCache[solidIndex].m_sdf, worldpos, inside);
+    }
+    if(resolved==false){
+        inside = CheckPointInsideGeomByID(worldpos, frame, solidGeomID);
+    }
+    if(inside==false){
+        return NULL;
+    }
+    fluidCore::Particle* p;
+    if(dynamic){
+        p = solidPool->Allocate();
+    }else{
+        p = m_particlePool.Allocate();
+    }
+    p->m_p = pos;
+    p->m_u = glm::vec3(0.0f);
+    p->m_n = glm::vec3(0.0f);
+    p->m_density = 10.0f;
+    p->m_type = SOLID;
+    p->m_mass = 10.0f;
+    p->m_invalid = false;
+    return p;
+}
+
+bool Scene::SampleSolidSDF(const glm::vec3& p, const float& frame, float& distance){
+    if(IsSolidLevelSetCurrent(frame)==false){
+        return false;
+    }
+    distance = m_solidLevelSet->GetInterpolatedCell(p);
+    return distance>SOLID_SDF_BAND-m_solidLevelSet->GetBandWidth();
+}
+
+glm::vec3 Scene::GetSolidSDFGradient(const glm::vec3& p){
+    return m_solidLevelSet->GetInterpolatedGradient(p);
+}
+
+void Scene::ProjectPointsToSolidSurface(std::vector<fluidCore::Particle*>& particles, 
+                                        const float& pscale, const float& interpolation){
+    if(m_previousSolidLevelSet==NULL || interpolation>=1.0f){
+        m_solidLevelSet->ProjectPointsToSurface(particles, pscale);
+        return;
+    }
+    //project against both frames and blend the results instead of building a blended SDF
+    unsigned int particleCount = particles.size();
+    std::vector<glm::vec3> start(particleCount);
+    std::vector<glm::vec3> previous(particleCount);
+    for(unsigned int i=0; i<particleCount; i++){
+        start[i] = particles[i]->m_p;
+    }
+    m_previousSolidLevelSet->ProjectPointsToSurface(particles, pscale);
+    for(unsigned int i=0; i<particleCount; i++){
+        previous[i] = particles[i]->m_p;
+        particles[i]->m_p = start[i];
+    }
+    m_solidLevelSet->ProjectPointsToSurface(particles, pscale);
+    float alpha = glm::max(0.0f, interpolation);
+    for(unsigned int i=0; i<particleCount; i++){
+        particles[i]->m_p = glm::mix(previous[i], particles[i]->m_p, alpha);
+    }
 }
 
 fluidCore::LevelSet* Scene::GetSolidLevelSet(){
@@ -8,16 +8,87 @@
 #define SCENE_HPP
 
 #include <vector>
+#include <thread>
 #include <tbb/tbb.h>
 #include <tbb/concurrent_vector.h>
 #include "../utilities/utilities.h"
 #include "../grid/macgrid.inl"
 #include "../geom/mesh.hpp"
 #include "../grid/particlegrid.hpp"
+#include "../grid/particlepool.hpp"
 #include "../grid/levelset.hpp"
+#include "../grid/particlecache.hpp"
 #include "../spatial/bvh.hpp"
 
+//Solid SDF values closer to zero than this can't be trusted to get inside/outside right
+#define SOLID_SDF_BAND .5f
+
 namespace sceneCore {
+//====================================
+// Struct Declarations
+//====================================
+
+//Per dynamic solid SDF from the last build, plus what it was built from so unchanged solids
+//can be reused. Rigid meshes also keep their untransformed voxelization around
+struct SolidSDFCache{
+    fluidCore::LevelSet*                            m_shape;        //object space, MESH only
+    fluidCore::LevelSet*                            m_sdf;          //world space
+    spaceCore::Bvh<objCore::Obj>*                   m_mesh;
+    spaceCore::Bvh<objCore::InterpolatedObj>*       m_animmesh;
+    float                                           m_interpolation;
+    glm::mat4                                       m_transform;
+    bool                                            m_active;
+
+    //Initializer
+    SolidSDFCache(): m_shape(NULL), m_sdf(NULL), m_mesh(NULL), m_animmesh(NULL),
+                     m_interpolation(0.0f), m_active(false){};
+};
+
+//What a liquid's mesh and placement were when the liquid SDF was last built, so the SDF is only
+//rebuilt once a liquid in it moves, changes mesh frames, or enters or leaves the frame
+struct LiquidSDFState{
+    spaceCore::Bvh<objCore::Obj>*                   m_mesh;
+    spaceCore::Bvh<objCore::InterpolatedObj>*       m_animmesh;
+    float                                           m_interpolation;
+    glm::mat4                                       m_transform;
+    bool                                            m_active;       //in frame and voxelizable
+
+    //Initializer
+    LiquidSDFState(): m_mesh(NULL), m_animmesh(NULL), m_interpolation(0.0f), m_active(false){};
+};
+
+//One frame waiting on the export writer. Owns a fluid only snapshot of the sim's particles, so
+//the sim can keep stepping while the frame is rasterized, meshed and written. Jobs with a
+//buffer instead just write that buffer out to m_filename
+//Bvh element list over the solid geoms' world space bounds at one time, the top level of solid
+//queries. Elements are bounds only; each geom's own bvh does the exact test
+struct SolidGeomBounds{
+    std::vector<spaceCore::Aabb>                    m_bounds;
+
+    unsigned int GetNumberOfElements(){
+        return m_bounds.size();
+    }
+    spaceCore::Aabb GetElementAabb(const unsigned int& primID){
+        return m_bounds[primID];
+    }
+    rayCore::Intersection IntersectElement(const unsigned int& primID, const rayCore::Ray& r){
+        return rayCore::Intersection();
+    }
+};
+
+struct ExportJob{
+    fluidCore::ParticleSet*                         m_particles;
+    fluidCore::ParticleSet*                         m_fill;     //meshed but never written out
+    float                                           m_maxd;
+    int                                             m_frame;
+    bool                                            m_VDB;
+    bool                                            m_OBJ;
+    bool                                            m_PARTIO;
+    char*                                           m_buffer;
+    size_t                                          m_bufferSize;
+    std::string                                     m_filename;
+};
+
 //====================================
 // Class Declarations
 //====================================
@@ -43,17 +114,79 @@ class Scene {
         void BuildSolidGeomLevelSet(const int& frame);
         void BuildPermaSolidGeomLevelSet();
 
+        //Projects particles out along the solid SDF blended between the last two built frames,
+        //interpolation 0 is the previous frame's solids and 1 is the current frame's
+        //Distance from p to the nearest solid at frame, straight from the solid level set. 
+        //Returns false if the level set isn't for frame, or p is too deep inside a solid for 
+        //the band to say where the surface is. Far from solids the distance is clamped to the
+        //band, so it's only a lower bound there
+        bool SampleSolidSDF(const glm::vec3& p, const float& frame, float& distance);
+        //Outward gradient of the solid level set at p, only meaningful where SampleSolidSDF
+        //succeeded
+        glm::vec3 GetSolidSDFGradient(const glm::vec3& p);
+        void ProjectPointsToSolidSurface(std::vector<fluidCore::Particle*>& particles, 
+                                         const float& pscale, const float& interpolation);
+
         void SetPaths(const std::string& imagePath, const std::string& meshPath, 
                       const std::string& vdbPath, const std::string& partioPath);
 
-        void ExportParticles(std::vector<fluidCore::Particle*> particles, 
+        //Snapshots the fluid particles and hands them to the export writer thread. Blocks only
+        //once m_exportQueueDepth frames are already waiting, which caps snapshot memory. A
+        //depth of 0 exports synchronously on the calling thread. fill, if not NULL, is taken
+        //over and only added to the level set and mesh, for liquid with no particles in it
+        void ExportParticles(fluidCore::ParticleSet& particles, fluidCore::ParticleSet* fill,
                              const float& maxd, const int& frame, const bool& VDB, 
                              const bool& OBJ, const bool& PARTIO);
+        //Queues buffer to be written to filename by the export writer, which then deletes it.
+        //Files are written next to their destination and renamed into place, so a killed
+        //writer never leaves a truncated file behind
+        void ExportBuffer(const std::string& filename, char* buffer, const size_t& size);
+        //Waits for every queued export to be written and stops the writer thread
+        void FlushExports();
+
+        //Liquid and permanent solid particles carry the sim's state between frames, dynamic
+        //solid particles are regenerated every frame
+        tbb::concurrent_vector<fluidCore::Particle*>& GetLiquidParticles();
+        tbb::concurrent_vector<fluidCore::Particle*>& GetPermaSolidParticles();
+        //Replaces the liquid and permanent solid particles with copies of the given ones and
+        //rebuilds particles from them, the way GenerateParticles would have left it
+        void RestoreParticles(const fluidCore::Particle* liquids, const unsigned int& liquidCount,
+                              const fluidCore::Particle* permaSolids, 
+                              const unsigned int& permaSolidCount,
+                              std::vector<fluidCore::Particle*>& particles);
+        //Moves liquid and permanent solid particles in memory into the order they have in
+        //particles, normally the sim's cell sorted order, and repoints particles and the
+        //scene's own lists at them
+        void ReorderParticleStore(std::vector<fluidCore::Particle*>& particles);
+        //Makes a scene for one variant of a wedge. It shares this scene's meshes, bvhs and
+        //permanent solid SDF read only, and has its own particles, level sets and outputs. 
+        //This scene has to outlive every variant. From the first call on, animated mesh bvhs
+        //bound both keyframes instead of being refit, since variants are at different times
+        Scene* CreateVariant();
+        //Frees the liquid particles at the given indices of particles, which have to be in
+        //ascending order, and adds copies of added as new liquid particles. particles and the
+        //scene's liquid list both lose the removed ones and gain the new ones at the end
+        void ExchangeLiquidParticles(std::vector<fluidCore::Particle*>& particles,
+                                     const std::vector<unsigned int>& removed,
+                                     const std::vector<fluidCore::Particle>& added);
 
         std::vector<geomCore::Geom*>& GetSolidGeoms();
         std::vector<geomCore::Geom*>& GetLiquidGeoms();
 
+        //Tightens animated mesh bvhs to their bounds at frame, then updates the solid bounds
+        //bvh for frame. Ray queries after this have to be at frame until the next refit
+        void RefitAnimatedMeshes(const float& frame);
+        //Refits the bvh over every solid's bounds to frame, building it on the first call.
+        //Solid queries at frame then only test the solids their ray or segment reaches; 
+        //queries at any other time test every solid
+        void UpdateSolidGeomBounds(const float& frame);
+
         rayCore::Intersection IntersectSolidGeoms(const rayCore::Ray& r);
+        //Closest hits for a batch of rays sharing one frame, traced as packets
+        void IntersectSolidGeoms(const rayCore::Ray* rays, rayCore::Intersection* hits,
+                                 const unsigned int& count);
+        bool CheckSegmentHitsSolidGeom(const glm::vec3& start, const glm::vec3& end, 
+                                       const float& frame);
         bool CheckPointInsideSolidGeom(const glm::vec3& p, const float& frame, 
                                        unsigned int& solidGeomID);
         bool CheckPointInsideLiquidGeom(const glm::vec3& p, const float& frame, 
@@ -67,19 +200,57 @@ class Scene {
         std::string                                                 m_meshPath;
         std::string                                                 m_vdbPath;
         std::string                                                 m_partioPath;
+        std::string                                                 m_checkpointPath;
+        std::string                                                 m_statsPath;
 
         tbb::mutex                                                  m_particleLock;
 
+        unsigned int                                                m_exportQueueDepth;
+        //ParticleCacheChannel bits written when partio_output is a native particle cache
+        unsigned int                                                m_particleCacheChannels;
+        //emitters leave out voxels whose grid cell already held a full lattice of particles
+        //at the sim's last sort
+        bool                                                        m_skipFullEmission;
+        //how exported particles are surfaced for vdb and mesh output, radius in grid cells
+        fluidCore::SurfaceKernel                                    m_surfaceKernel;
+        float                                                       m_surfaceRadius;
+        unsigned int                                                m_surfaceGrainSize;
+
     private:
-        void AddLiquidParticle(const glm::vec3& pos, const glm::vec3& vel, const float& thickness, 
-                               const float& scale, const int& frame, 
-                               const unsigned int& liquidGeomID);
-        void AddSolidParticle(const glm::vec3& pos, const float& thickness, const float& scale, 
-                              const int& frame, const unsigned int& solidGeomID);
+        //Both return the new particle, or NULL if pos is not inside the geom
+        fluidCore::Particle* AddLiquidParticle(const glm::vec3& pos, const glm::vec3& vel, 
+                                               const float& thickness, const float& scale, 
+                                               const int& frame, const unsigned int& liquidIndex,
+                                               const bool& exclusive);
+        fluidCore::Particle* AddSolidParticle(const glm::vec3& pos, const float& thickness, 
+                                              const float& scale, const int& frame, 
+                                              const unsigned int& solidIndex, 
+                                              fluidCore::ParticlePool* solidPool);
+        bool CheckPointInsideSDF(fluidCore::LevelSet* sdf, const glm::vec3& p, bool& inside);
+        LiquidSDFState GetLiquidSDFState(const unsigned int& liquidIndex, const int& frame);
+        //Rebuilds the liquid SDF if any liquid's state at frame differs from the last build
+        void UpdateLiquidGeomLevelSet(const int& frame);
+        bool IsSolidLevelSetCurrent(const float& frame);
+        inline bool IsSolidBoundsCurrent(const float& frame){
+            return m_solidBoundsFrame==frame && m_solidBounds.m_numberOfNodes>0;
+        }
+        bool UpdateSolidSDFCache(const unsigned int& solidGeomID, const int& frame);
+        void ClearSolidSDFCache();
+        void QueueExport(ExportJob* job);
+        void ExportLoop();
+        void WriteExport(ExportJob* job);
 
         fluidCore::LevelSet*                                        m_solidLevelSet;
         fluidCore::LevelSet*                                        m_permaSolidLevelSet;
+        fluidCore::LevelSet*                                        m_previousSolidLevelSet;
+        int                                                         m_solidLevelSetFrame;
+        bool                                                        m_solidsMoved;
+        spaceCore::Bvh<SolidGeomBounds>                             m_solidBounds;
+        float                                                       m_solidBoundsFrame;
+        bool                                                        m_sdfInsideTests;
+        std::vector<SolidSDFCache>                                  m_solidSDFCache;
         fluidCore::LevelSet*                                        m_liquidLevelSet;
+        std::vector<LiquidSDFState>                                 m_liquidSDFStates;
         std::vector<glm::vec3>                                      m_externalForces;
 
         std::vector<geomCore::GeomTransform>                        m_geomTransforms;
@@ -95,9 +266,24 @@ class Scene {
         tbb::concurrent_vector<fluidCore::Particle*>                m_liquidParticles;
         tbb::concurrent_vector<fluidCore::Particle*>                m_permaSolidParticles;
         tbb::concurrent_vector<fluidCore::Particle*>                m_solidParticles;
+
+        //liquid and perma solid particles live for the whole sim, dynamic solid particles are
+        //rebuilt every frame, alternating between two pools so last frame's stay valid until 
+        //the particle list stops pointing at them
+        fluidCore::ParticlePool                                     m_particlePool;
+        fluidCore::ParticlePool                                     m_solidParticlePools[2];
+        unsigned int                                                m_solidParticlePool;
+
+        //frames waiting on the writer, a NULL job tells the writer to stop
+        tbb::concurrent_bounded_queue<ExportJob*>                   m_exportQueue;
+        std::thread*                                                m_exportThread;
     
         unsigned int                                                m_liquidParticleCount;
 
+        //the scene whose loaded geometry a variant points into, NULL if it's this one's own
+        Scene*                                                      m_geometrySource;
+        //set on both sides once a variant exists, after which geometry is never written
+        bool                                                        m_geometryShared;
 };
 }
 
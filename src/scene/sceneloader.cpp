@@ -43,7 +43,8 @@ SceneLoader::SceneLoader(const std::string& filename){
     }else{
         if(root.isMember("settings")){
             std::cout << "Loading settings..." << std::endl;
-            LoadSettings(root["settings"][0]);
+            m_jsonSettings = root["settings"][0];
+            LoadSettings(m_jsonSettings);
         }
         if(root.isMember("camera")){
             std::cout << "Loading camera..." << std::endl;
@@ -68,6 +69,7 @@ SceneLoader::SceneLoader(const std::string& filename){
             for(unsigned int j=0; j<nodesInGroup; j++){
                 LoadMeshFiles(root["meshfiles"][j]);
             }
+            LoadPendingMeshFiles();
         }
         if(root.isMember("animatedmeshes")){
             std::cout << "Loading animatedmeshes..." << std::endl;
@@ -78,7 +80,7 @@ SceneLoader::SceneLoader(const std::string& filename){
             m_animMeshSequences.reserve(nodesInGroup);
             unsigned int interpObjCount = 0;
             for(unsigned int j=0; j<nodesInGroup; j++){
-                interpObjCount = interpObjCount + root["animatedmeshes"][j].size() + 1;
+                interpObjCount = interpObjCount + root["animatedmeshes"][j]["frames"].size();
             }
             m_s->m_animMeshes.reserve(interpObjCount);
             for(unsigned int j=0; j<nodesInGroup; j++){
@@ -150,6 +152,117 @@ float SceneLoader::GetStepsize(){
     return m_stepsize;
 }
 
+fluidCore::FlipSettings SceneLoader::GetFlipSettings(){
+    return m_flipSettings;
+}
+
+std::vector<WedgeVariant> SceneLoader::LoadWedge(const std::string& filename){
+    std::cout << "Loading wedge from " << filename << "...\n" << std::endl;
+    std::vector<WedgeVariant> variants;
+
+    std::string jsonInput = utilityCore::readFileAsString(filename);
+    Json::Value root;
+    Json::Reader reader;
+    bool parsedSuccess = reader.parse(jsonInput, root, false);
+    if(!parsedSuccess){
+        std::cout << "Error: Failed to parse JSON" << std::endl 
+                  << reader.getFormatedErrorMessages() << std::endl;
+        return variants;
+    }
+
+    unsigned int cores = 0;
+    if(root.isMember("cores")){
+        cores = glm::max(0, root["cores"].asInt());
+    }
+    unsigned int variantCount = root["variants"].size();
+    for(unsigned int i=0; i<variantCount; i++){
+        Json::Value jsonvariant = root["variants"][i];
+        std::string name = "variant" + utilityCore::convertIntToString(i);
+        if(jsonvariant.isMember("name")){
+            name = jsonvariant["name"].asString();
+        }
+        std::cout << "Loading variant " << name << "..." << std::endl;
+        WedgeVariant variant = LoadVariant(name, jsonvariant["settings"]);
+        variant.m_cores = cores;
+        if(jsonvariant.isMember("cores")){
+            variant.m_cores = glm::max(0, jsonvariant["cores"].asInt());
+        }
+        variants.push_back(variant);
+    }
+
+    std::cout << std::endl;
+    std::cout << "Loaded " << variants.size() << " variants from " << filename << ".\n" 
+              << std::endl;
+    return variants;
+}
+
+WedgeVariant SceneLoader::LoadVariant(const std::string& name, 
+                                      const Json::Value& jsonoverrides){
+    //LoadSettings writes into the loader's own state, so the base scene's is put back after
+    Scene* base = m_s;
+    glm::vec3 dimensions = m_dimensions;
+    float density = m_density;
+    float stepsize = m_stepsize;
+    fluidCore::FlipSettings flipSettings = m_flipSettings;
+    std::string imagePath = m_imagePath;
+    std::string meshPath = m_meshPath;
+    std::string vdbPath = m_vdbPath;
+    std::string partioPath = m_partioPath;
+
+    Json::Value jsonsettings = m_jsonSettings;
+    std::vector<std::string> keys = jsonoverrides.getMemberNames();
+    for(unsigned int i=0; i<keys.size(); i++){
+        jsonsettings[keys[i]] = jsonoverrides[keys[i]];
+    }
+
+    m_s = base->CreateVariant();
+    m_flipSettings = fluidCore::FlipSettings();
+    LoadSettings(jsonsettings);
+    m_s->SetPaths(AddVariantName(m_imagePath, name), AddVariantName(m_meshPath, name), 
+                  AddVariantName(m_vdbPath, name), AddVariantName(m_partioPath, name));
+    m_s->m_checkpointPath = AddVariantName(m_s->m_checkpointPath, name);
+    m_s->m_statsPath = AddVariantName(m_s->m_statsPath, name);
+
+    WedgeVariant variant;
+    variant.m_name = name;
+    variant.m_scene = m_s;
+    variant.m_dimensions = m_dimensions;
+    variant.m_density = m_density;
+    variant.m_stepsize = m_stepsize;
+    variant.m_flipSettings = m_flipSettings;
+    variant.m_cores = 0;
+
+    m_s = base;
+    m_dimensions = dimensions;
+    m_density = density;
+    m_stepsize = stepsize;
+    m_flipSettings = flipSettings;
+    m_imagePath = imagePath;
+    m_meshPath = meshPath;
+    m_vdbPath = vdbPath;
+    m_partioPath = partioPath;
+    return variant;
+}
+
+//"out/fluid.bgeo.gz" becomes "out/fluid.name.bgeo.gz", so the frame number still lands where
+//the exporters expect it
+std::string SceneLoader::AddVariantName(const std::string& path, const std::string& name){
+    if(path.size()==0){
+        return path;
+    }
+    size_t directory = path.find_last_of('/');
+    if(directory==path.size()-1){
+        return path + name;
+    }
+    size_t extension = path.find('.', directory==std::string::npos ? 0 : directory+1);
+    if(extension==std::string::npos){
+        return path + "." + name;
+    }
+    std::string named = path;
+    named.insert(extension, "."+name);
+    return named;
+}
+
 void SceneLoader::LoadSim(const Json::Value& jsonsim){
     std::string id = jsonsim["geom"].asString();
     unsigned int geomID = m_linkNames["geom_"+id];
@@ -252,6 +365,31 @@ void SceneLoader::LoadGeom(const Json::Value& jsongeom){
     }
 }
 
+//Reads and builds every meshfile node queued by LoadMeshFiles concurrently. Obj files go through
+//their binary cache unless the node sets "cache" to false. Nodes without a file were already
+//filled in by a mesh generator and only need their bvh
+void SceneLoader::LoadPendingMeshFiles(){
+    unsigned int loadCount = m_meshFileLoads.size();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,loadCount,1),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                const MeshFileLoad& load = m_meshFileLoads[i];
+                spaceCore::Bvh<objCore::Obj>& meshfile = m_s->m_meshFiles[load.m_nodeNumber];
+                if(load.m_filename.empty()==false && load.m_cache==true){
+                    geomCore::MeshCache cache;
+                    cache.Load(load.m_filename, 24, meshfile);
+                }else{
+                    if(load.m_filename.empty()==false){
+                        meshfile.m_basegeom.ReadObj(load.m_filename);
+                    }
+                    meshfile.BuildBvh(24);
+                }
+            }
+        }
+    );
+    m_meshFileLoads.clear();
+}
+
 void SceneLoader::LoadAnimMeshSequences(const Json::Value& jsonanimmesh){
     if(jsonanimmesh.isMember("id")==false){
         std::cout << "Warning: Couldn't load animmesh node, missing ID. Skipping...\n" 
@@ -271,6 +409,13 @@ void SceneLoader::LoadAnimMeshSequences(const Json::Value& jsonanimmesh){
             unsigned int frameCount = jsonanimmesh["frames"].size();
             m_animMeshSequences[nodeNumber].reserve(frameCount);
             std::cout << "Creating animmesh with " << frameCount << " frames" << std::endl;
+            //frames of a sequence share topology, so by default only the first frame gets a full
+            //build and the rest refit its tree
+            bool refit = true;
+            if(jsonanimmesh.isMember("bvh_refit")){
+                refit = jsonanimmesh["bvh_refit"].asBool();
+            }
+            spaceCore::Bvh<objCore::InterpolatedObj>* topology = NULL;
             for(unsigned int i=0; i<frameCount-1; i++){
                 //grab current and next frame IDs to pass to an InterpolatedObj
                 std::string thisframelink = jsonanimmesh["frames"][i].asString();
@@ -282,7 +427,7 @@ void SceneLoader::LoadAnimMeshSequences(const Json::Value& jsonanimmesh){
                 objCore::InterpolatedObj interpObj(&m_s->m_meshFiles[thisframeID].m_basegeom,
                                                    &m_s->m_meshFiles[nextframeID].m_basegeom);
                 m_s->m_animMeshes[animMeshNodeNumber] = interpObj;
-                m_s->m_animMeshes[animMeshNodeNumber].BuildBvh(24);
+                BuildAnimMeshBvh(m_s->m_animMeshes[animMeshNodeNumber], refit, topology);
                 m_s->m_animMeshes[animMeshNodeNumber].m_id = animMeshNodeNumber;
                 m_animMeshSequences[nodeNumber].push_back(&m_s->m_animMeshes[animMeshNodeNumber]);
             }
@@ -294,7 +439,7 @@ void SceneLoader::LoadAnimMeshSequences(const Json::Value& jsonanimmesh){
             objCore::InterpolatedObj interpObj(&m_s->m_meshFiles[thisframeID].m_basegeom,
                                                &m_s->m_meshFiles[thisframeID].m_basegeom);
             m_s->m_animMeshes[animMeshNodeNumber] = interpObj;
-            m_s->m_animMeshes[animMeshNodeNumber].BuildBvh(24);
+            BuildAnimMeshBvh(m_s->m_animMeshes[animMeshNodeNumber], refit, topology);
             m_s->m_animMeshes[animMeshNodeNumber].m_id = animMeshNodeNumber;
             m_animMeshSequences[nodeNumber].push_back(&m_s->m_animMeshes[animMeshNodeNumber]);
             m_linkNames["animmesh_"+id] = nodeNumber;
@@ -302,6 +447,22 @@ void SceneLoader::LoadAnimMeshSequences(const Json::Value& jsonanimmesh){
     }
 }
 
+//Refits topology's tree when there is one over the same number of polys, otherwise builds a
+//full bvh, which becomes the topology for later frames when refitting
+void SceneLoader::BuildAnimMeshBvh(spaceCore::Bvh<objCore::InterpolatedObj>& animmesh, 
+                                   const bool& refit, 
+                                   spaceCore::Bvh<objCore::InterpolatedObj>*& topology){
+    if(topology!=NULL && topology->m_basegeom.GetNumberOfElements()==
+                         animmesh.m_basegeom.GetNumberOfElements()){
+        animmesh.BuildFromTopology(*topology);
+    }else{
+        animmesh.BuildBvh(24);
+        if(refit==true){
+            topology = &animmesh;
+        }
+    }
+}
+
 void SceneLoader::LoadGeomTransforms(const Json::Value& jsontransforms){
     if(jsontransforms.isMember("id")==false){
         std::cout << "Warning: Couldn't load transform node, missing ID. Skipping...\n" 
@@ -360,7 +521,12 @@ void SceneLoader::LoadMeshFiles(const Json::Value& jsonmeshfile){
             //meshfile can either point to obj file or request a mesh generator
             if(jsonmeshfile.isMember("file")==true){    
                 std::string filename = jsonmeshfile["file"].asString();
-                m_s->m_meshFiles[nodeNumber].m_basegeom.ReadObj(m_relativePath+filename);
+                bool cache = true;
+                if(jsonmeshfile.isMember("cache")==true){
+                    cache = jsonmeshfile["cache"].asBool();
+                }
+                m_meshFileLoads.push_back(MeshFileLoad(nodeNumber, m_relativePath+filename, 
+                                                       cache));
             }else if(jsonmeshfile.isMember("mesh_gen")==true){
                 std::string gentype = jsonmeshfile["mesh_gen"].asString();
                 if(strcmp(gentype.c_str(), "box")==0){
@@ -389,7 +555,10 @@ void SceneLoader::LoadMeshFiles(const Json::Value& jsonmeshfile){
                                             center, radius);
                 }
             }
-            m_s->m_meshFiles[nodeNumber].BuildBvh(24);
+            //obj files are only read once every meshfile node is known, see LoadPendingMeshFiles
+            if(jsonmeshfile.isMember("file")==false){
+                m_meshFileLoads.push_back(MeshFileLoad(nodeNumber, std::string(), false));
+            }
             m_linkNames["meshfile_"+id] = nodeNumber;
             m_s->m_meshFiles[nodeNumber].m_basegeom.m_id = nodeNumber;
             m_s->m_meshFiles[nodeNumber].m_id = nodeNumber;
@@ -427,6 +596,166 @@ void SceneLoader::LoadSettings(const Json::Value& jsonsettings){
         m_dimensions.y = jsonsettings["dim"]["y"].asInt();
         m_dimensions.z = jsonsettings["dim"]["z"].asInt();
     }
+    if(jsonsettings.isMember("sparse_grid")){
+        m_flipSettings.m_sparse = jsonsettings["sparse_grid"].asBool();
+    }
+
+    if(jsonsettings.isMember("fused_pcg")){
+        m_flipSettings.m_fusedSolver = jsonsettings["fused_pcg"].asBool();
+    }
+
+    if(jsonsettings.isMember("warm_start_pressure")){
+        m_flipSettings.m_warmStart = jsonsettings["warm_start_pressure"].asBool();
+    }
+
+    if(jsonsettings.isMember("scatter_p2g")){
+        m_flipSettings.m_scatterSplat = jsonsettings["scatter_p2g"].asBool();
+    }
+
+    if(jsonsettings.isMember("advection")){
+        std::string advection = jsonsettings["advection"].asString();
+        if(strcmp(advection.c_str(), "rk3")==0){
+            m_flipSettings.m_advection = fluidCore::RK3;
+        }else if(strcmp(advection.c_str(), "rk2")==0){
+            m_flipSettings.m_advection = fluidCore::RK2;
+        }else if(strcmp(advection.c_str(), "euler")==0){
+            m_flipSettings.m_advection = fluidCore::FORWARD_EULER;
+        }else{
+            std::cout << "Warning: unknown advection scheme \"" << advection 
+                      << "\", using euler" << std::endl;
+        }
+    }
+
+    if(jsonsettings.isMember("cfl")){
+        m_flipSettings.m_cfl = jsonsettings["cfl"].asFloat();
+    }
+
+    if(jsonsettings.isMember("max_substeps")){
+        m_flipSettings.m_maxSubsteps = glm::max(1, jsonsettings["max_substeps"].asInt());
+    }
+
+    if(jsonsettings.isMember("frame_length")){
+        m_flipSettings.m_frameLength = glm::max(0.0f, jsonsettings["frame_length"].asFloat());
+    }
+
+    if(jsonsettings.isMember("frame_cfl")){
+        m_flipSettings.m_frameCfl = jsonsettings["frame_cfl"].asFloat();
+        if(m_flipSettings.m_frameCfl<=0.0f){
+            std::cout << "Warning: frame_cfl must be positive, using 3" << std::endl;
+            m_flipSettings.m_frameCfl = 3.0f;
+        }
+    }
+
+    if(jsonsettings.isMember("max_frame_substeps")){
+        m_flipSettings.m_maxFrameSubsteps = glm::max(1, 
+                                                     jsonsettings["max_frame_substeps"].asInt());
+    }
+
+    if(jsonsettings.isMember("extrapolation_layers")){
+        m_flipSettings.m_extrapolationLayers = glm::clamp(
+                                               jsonsettings["extrapolation_layers"].asInt(), 0, 254);
+    }
+
+    if(jsonsettings.isMember("particle_reorder_interval")){
+        m_flipSettings.m_reorderInterval = glm::max(0, 
+                                           jsonsettings["particle_reorder_interval"].asInt());
+    }
+
+    if(jsonsettings.isMember("sdf_depenetration")){
+        m_flipSettings.m_sdfDepenetration = jsonsettings["sdf_depenetration"].asBool();
+    }
+
+    if(jsonsettings.isMember("resample_interval")){
+        m_flipSettings.m_resampleInterval = glm::max(0, jsonsettings["resample_interval"].asInt());
+    }
+
+    if(jsonsettings.isMember("resample_density_tolerance")){
+        m_flipSettings.m_resampleTolerance = glm::max(0.0f, 
+                                             jsonsettings["resample_density_tolerance"].asFloat());
+    }
+
+    //narrow band FLIP needs room for a full splat stencil of particles under the surface
+    if(jsonsettings.isMember("particle_band_width")){
+        int width = jsonsettings["particle_band_width"].asInt();
+        m_flipSettings.m_particleBandWidth = width>0 ? glm::clamp(width, 3, 250) : 0;
+    }
+
+    if(jsonsettings.isMember("picflip_ratio")){
+        m_flipSettings.m_picflipRatio = glm::clamp(jsonsettings["picflip_ratio"].asFloat(), 
+                                                   0.0f, 1.0f);
+    }
+
+    if(jsonsettings.isMember("sdf_inside_test")){
+        m_s->m_sdfInsideTests = jsonsettings["sdf_inside_test"].asBool();
+    }
+
+    if(jsonsettings.isMember("skip_full_emission")){
+        m_s->m_skipFullEmission = jsonsettings["skip_full_emission"].asBool();
+    }
+
+    if(jsonsettings.isMember("deterministic")){
+        m_flipSettings.m_deterministic = jsonsettings["deterministic"].asBool();
+    }
+
+    if(jsonsettings.isMember("export_queue_depth")){
+        m_s->m_exportQueueDepth = glm::max(0, jsonsettings["export_queue_depth"].asInt());
+    }
+
+    if(jsonsettings.isMember("surface_kernel")){
+        std::string kernel = jsonsettings["surface_kernel"].asString();
+        if(strcmp(kernel.c_str(), "spheres")==0){
+            m_s->m_surfaceKernel = fluidCore::SURFACE_SPHERES;
+        }else if(strcmp(kernel.c_str(), "zhu_bridson")==0){
+            m_s->m_surfaceKernel = fluidCore::SURFACE_ZHUBRIDSON;
+        }else if(strcmp(kernel.c_str(), "trails")==0){
+            m_s->m_surfaceKernel = fluidCore::SURFACE_TRAILS;
+        }else{
+            std::cout << "Warning: unknown surface kernel \"" << kernel 
+                      << "\", using trails" << std::endl;
+        }
+    }
+
+    if(jsonsettings.isMember("surface_radius")){
+        m_s->m_surfaceRadius = glm::max(.01f, jsonsettings["surface_radius"].asFloat());
+    }
+
+    if(jsonsettings.isMember("surface_grain_size")){
+        m_s->m_surfaceGrainSize = glm::max(1, jsonsettings["surface_grain_size"].asInt());
+    }
+
+    if(jsonsettings.isMember("particle_cache_channels")){
+        m_s->m_particleCacheChannels = 0;
+        unsigned int channelCount = jsonsettings["particle_cache_channels"].size();
+        for(unsigned int i=0; i<channelCount; i++){
+            std::string channel = jsonsettings["particle_cache_channels"][i].asString();
+            if(strcmp(channel.c_str(), "position")==0){
+                m_s->m_particleCacheChannels |= fluidCore::PARTICLECACHE_POSITION;
+            }else if(strcmp(channel.c_str(), "velocity")==0){
+                m_s->m_particleCacheChannels |= fluidCore::PARTICLECACHE_VELOCITY;
+            }else if(strcmp(channel.c_str(), "density")==0){
+                m_s->m_particleCacheChannels |= fluidCore::PARTICLECACHE_DENSITY;
+            }else if(strcmp(channel.c_str(), "mass")==0){
+                m_s->m_particleCacheChannels |= fluidCore::PARTICLECACHE_MASS;
+            }else{
+                std::cout << "Warning: unknown particle cache channel \"" << channel 
+                          << "\"" << std::endl;
+            }
+        }
+    }
+
+    if(jsonsettings.isMember("preconditioner")){
+        std::string preconditioner = jsonsettings["preconditioner"].asString();
+        if(strcmp(preconditioner.c_str(), "multigrid")==0){
+            m_flipSettings.m_preconditioner = fluidCore::MULTIGRID;
+        }else if(strcmp(preconditioner.c_str(), "wavefront_mic")==0){
+            m_flipSettings.m_preconditioner = fluidCore::WAVEFRONT_MIC;
+        }else if(strcmp(preconditioner.c_str(), "mic")==0){
+            m_flipSettings.m_preconditioner = fluidCore::MIC;
+        }else{
+            std::cout << "Warning: unknown preconditioner \"" << preconditioner 
+                      << "\", using mic" << std::endl;
+        }
+    }
     
     if(jsonsettings.isMember("image_output")){
         m_imagePath = jsonsettings["image_output"].asString();
@@ -440,6 +769,18 @@ void SceneLoader::LoadSettings(const Json::Value& jsonsettings){
     if(jsonsettings.isMember("partio_output")){
         m_partioPath = jsonsettings["partio_output"].asString();
     }
+
+    m_s->m_checkpointPath = m_relativePath + "checkpoint" + CHECKPOINT_EXTENSION;
+    if(jsonsettings.isMember("checkpoint_output")){
+        m_s->m_checkpointPath = jsonsettings["checkpoint_output"].asString();
+    }
+    if(jsonsettings.isMember("stats_output")){
+        m_s->m_statsPath = jsonsettings["stats_output"].asString();
+    }
+    if(jsonsettings.isMember("checkpoint_interval")){
+        m_flipSettings.m_checkpointInterval = glm::max(0, 
+                                                       jsonsettings["checkpoint_interval"].asInt());
+    }
 }
 
 void SceneLoader::LoadCamera(const Json::Value& jsoncamera){
@@ -10,9 +10,41 @@
 #include <json/json.h>
 #include "../utilities/utilities.h"
 #include "../geom/geomlist.hpp"
+#include "../geom/meshcache.hpp"
 #include "scene.hpp"
+#include "../sim/flipsettings.hpp"
+#include "../sim/checkpoint.hpp"
 
 namespace sceneCore {
+//====================================
+// Struct Declarations
+//====================================
+
+//A meshfile node waiting to be read. Generated meshes have no filename and only need a bvh
+struct MeshFileLoad {
+    unsigned int    m_nodeNumber;
+    std::string     m_filename;
+    bool            m_cache;
+
+    MeshFileLoad(const unsigned int& nodeNumber, const std::string& filename, const bool& cache){
+        m_nodeNumber = nodeNumber;
+        m_filename = filename;
+        m_cache = cache;
+    }
+};
+
+//One run of a wedge: the base scene's settings with the variant's overrides on top, in a scene
+//sharing the base scene's geometry. m_cores of 0 splits the machine evenly between variants
+struct WedgeVariant {
+    std::string                 m_name;
+    Scene*                      m_scene;
+    glm::vec3                   m_dimensions;
+    float                       m_density;
+    float                       m_stepsize;
+    fluidCore::FlipSettings     m_flipSettings;
+    unsigned int                m_cores;
+};
+
 //====================================
 // Class Declarations
 //====================================
@@ -26,6 +58,11 @@ class SceneLoader {
         float GetDensity();
         glm::vec3 GetDimensions();
         float GetStepsize();
+        fluidCore::FlipSettings GetFlipSettings();
+        //Reads a wedge file, {"cores": n, "variants": [{"name", "cores", "settings"}]}, into
+        //one variant of the loaded scene per entry. Each variant's outputs get its name added
+        //before their extensions
+        std::vector<WedgeVariant> LoadWedge(const std::string& filename);
 
         glm::vec3       m_cameraRotate;
         glm::vec3       m_cameraTranslate;
@@ -40,22 +77,31 @@ class SceneLoader {
 
         void LoadGeomTransforms(const Json::Value& jsontransforms);
         void LoadMeshFiles(const Json::Value& jsonmeshfiles);
+        void LoadPendingMeshFiles();
         void LoadAnimMeshSequences(const Json::Value& jsonanimmesh);
+        void BuildAnimMeshBvh(spaceCore::Bvh<objCore::InterpolatedObj>& animmesh, 
+                              const bool& refit,
+                              spaceCore::Bvh<objCore::InterpolatedObj>*& topology);
         void LoadGeom(const Json::Value& jsongeom);
         void LoadSim(const Json::Value& jsonsim);
+        WedgeVariant LoadVariant(const std::string& name, const Json::Value& jsonoverrides);
+        std::string AddVariantName(const std::string& path, const std::string& name);
 
         Scene*                                  m_s;
         glm::vec3                               m_dimensions;
         float                                   m_density;
         float                                   m_stepsize;
+        fluidCore::FlipSettings                 m_flipSettings;
         std::string                             m_relativePath;
         std::string                             m_imagePath;
         std::string                             m_meshPath;
         std::string                             m_vdbPath;
         std::string                             m_partioPath;
         std::vector<glm::vec3>                  m_externalForces;
+        Json::Value                             m_jsonSettings;
         
         std::map<std::string, unsigned int>                         m_linkNames;
+        std::vector<MeshFileLoad>                                   m_meshFileLoads;
         std::vector< std::vector< 
                      spaceCore::Bvh<objCore::InterpolatedObj>* > >  m_animMeshSequences;
 };
@@ -0,0 +1,56 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: checkpoint.hpp
+// Binary layout of full sim state checkpoints, written by FlipSim and read back on resume
+
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+//bump whenever the layout of the checkpoint or of anything stored in it changes
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_ALIGNMENT 64
+#define CHECKPOINT_EXTENSION ".arielcheckpoint"
+
+namespace fluidCore {
+
+//====================================
+// Enums
+//====================================
+
+//Particles are stored as raw Particle structs. Grids are the previous step's pressure and
+//cell types used for warm starting, each with its sparse tile list (empty for dense grids)
+//followed by its raw cell pool. The particle band's dense depth and face velocity grids are
+//empty when the band is off
+enum CheckpointArray{CHECKPOINT_LIQUIDPARTICLES=0, CHECKPOINT_PERMASOLIDPARTICLES,
+                     CHECKPOINT_PRESSURETILES, CHECKPOINT_PRESSURE,
+                     CHECKPOINT_CELLTYPETILES, CHECKPOINT_CELLTYPES, CHECKPOINT_BANDPHI,
+                     CHECKPOINT_BANDU_X, CHECKPOINT_BANDU_Y, CHECKPOINT_BANDU_Z,
+                     CHECKPOINT_ARRAYS};
+
+//====================================
+// Struct Declarations
+//====================================
+
+//Sits at the start of every checkpoint. Arrays follow at 64 byte aligned offsets from the
+//start of the file, so a mapped checkpoint can be read in place
+struct CheckpointHeader {
+    char                m_magic[8];
+    unsigned int        m_version;
+    unsigned int        m_particleSize;
+    float               m_dimensions[3];
+    unsigned int        m_sparse;
+    int                 m_frame;
+    float               m_maxDensity;
+    float               m_dt;
+    float               m_time;
+    float               m_solidInterpolation;
+    unsigned int        m_numberOfLiquidParticles;
+    unsigned int        m_numberOfPermaSolidParticles;
+    int                 m_particleBandWidth;
+    unsigned long long  m_offsets[CHECKPOINT_ARRAYS];
+    unsigned long long  m_sizes[CHECKPOINT_ARRAYS];
+};
+}
+
+#endif
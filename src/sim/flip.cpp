@@ -4,76 +4,195 @@
 // File: flip.cpp
 // Implements the FLIP sim
 
+#include <algorithm>
+#include <cstring>
 #include "flip.hpp"
 #include "../math/kernels.inl"
 #include "particlegridoperations.inl"
 #include "particleresampler.inl"
 #include "solver.inl"
+#include "phasegraph.hpp"
 
 namespace fluidCore{
 
 FlipSim::FlipSim(const glm::vec3& maxres, const float& density, const float& stepsize, 
-                 sceneCore::Scene* s, const bool& verbose){
+                 sceneCore::Scene* s, const FlipSettings& settings, const bool& verbose){
     m_dimensions = maxres;  
+    m_settings = settings;
     m_pgrid = new ParticleGrid(maxres);
-    m_mgrid = CreateMacgrid(maxres);
-    m_mgrid_previous = CreateMacgrid(maxres);
+    m_mgrid = CreateMacgrid(maxres, m_settings.m_sparse);
+    m_mgrid_previous = CreateMacgrid(maxres, m_settings.m_sparse);
+    //n extrapolation layers reach n+1 cells past the fluid
+    m_mgrid.m_bandWidth = glm::max(NARROW_BAND_WIDTH, m_settings.m_extrapolationLayers+1);
+    for(unsigned int n=0; n<3; n++){
+        m_faceLayers[n].assign((maxres.x+1)*(maxres.y+1)*(maxres.z+1), 0);
+    }
+    m_solverWorkspace = CreateSolverWorkspace();
+    m_splatWorkspace = CreateSplatWorkspace();
+    if(m_settings.m_particleBandWidth>0){
+        m_particleBand = CreateParticleBand(maxres, m_settings.m_particleBandWidth);
+    }else{
+        m_particleBand.m_width = 0;
+        m_particleBand.m_phi = NULL;
+        m_particleBand.m_depth = NULL;
+        m_particleBand.m_u_x = NULL;
+        m_particleBand.m_u_y = NULL;
+        m_particleBand.m_u_z = NULL;
+    }
     m_max_density = 0.0f;
     m_density = density;
     m_scene = s;
     m_frame = 0;
+    m_reorderDue = false;
+    m_substepsSinceResample = 0;
     m_stepsize = stepsize;
+    m_dt = stepsize;
+    m_time = 0.0f;
+    m_solidInterpolation = 1.0f;
     m_subcell = 1;
-    m_picflipratio = .95f;
+    m_picflipratio = m_settings.m_picflipRatio;
     m_densitythreshold = 0.04f;
     m_verbose = verbose;
+    m_stream = NULL;
+    if(strcmp(s->m_statsPath.c_str(), "")!=0){
+        m_profiler.Open(s->m_statsPath);
+    }
+    if(m_verbose){
+        std::cout << "Velocity interpolation: " << GetInterpolationISAName(GetInterpolationISA())
+                  << std::endl;
+    }
 }
 
 FlipSim::~FlipSim(){
+    delete m_stream;
     delete m_pgrid;
-    unsigned int particlecount = m_particles.size();
-    for(unsigned int i=0; i<particlecount; i++){
-        delete m_particles[i];
-    }
+    //particles belong to the scene's pools
     m_particles.clear();
     ClearMacgrid(m_mgrid);
+    ClearSolverWorkspace(m_solverWorkspace);
+    ClearSplatWorkspace(m_splatWorkspace);
+    if(m_particleBand.m_width>0){
+        ClearParticleBand(m_particleBand);
+    }
 }
 
-void FlipSim::Init(){
-    m_scene->BuildPermaSolidGeomLevelSet();
-    //We need to figure out maximum particle pressure, 
-    //so we generate a bunch of temporary particles
-    //inside of a known area, sort them back onto the underlying grid, and calculate the density
-    float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
-    float h = m_density/maxd;
-    //generate temp particles
-    for(unsigned int i = 0; i < 10; i++){               //FOR_EACH_CELL
-        for(unsigned int j = 0; j < 10; j++){ 
-            for(unsigned int k = 0; k < 10; k++){ 
-                Particle* p = new Particle;
-                p->m_p = (glm::vec3(i,j,k) + glm::vec3(0.5f))*h;
-                p->m_type = FLUID;
-                p->m_mass = 1.0f;
-                m_particles.push_back(p);
+//Density sum ComputeDensity gives a unit mass particle inside fully filled liquid, taken over
+//the emission lattice (i+0.5)*density in cell units. The lattice can fall differently in each
+//cell, so the peak is taken over a cell's worth of lattice points well away from the boundary
+static float ComputeLatticeDensity(const float& density, const float& maxd){
+    float spacing = density/maxd;
+    float h = 4.0f*density/maxd;
+    float invh2 = 1.0f/(h*h);
+    int reach = (int)glm::ceil(2.0f/density)+1;
+    int first = (int)glm::ceil(4.0f/density);
+    int count = glm::max(1, (int)glm::ceil(1.0f/density));
+    //per axis, the lattice offsets whose cell is within one of the sample point's cell
+    std::vector< std::vector<float> > offsets(count);
+    for(int a=0; a<count; a++){
+        float x = (first+a+0.5f)*spacing;
+        int cell = (int)(maxd*x);
+        for(int n=first+a-reach; n<=first+a+reach; n++){
+            float y = (n+0.5f)*spacing;
+            if(glm::abs((int)(maxd*y)-cell)<=1){
+                offsets[a].push_back(y-x);
             }
         }
     }
-    m_pgrid->Sort(m_particles);
-    m_max_density = 1.0f;
-    ComputeDensity(); 
-    m_max_density = 0.0f;
-    //sum densities across particles
-    for(unsigned int n=0; n<m_particles.size(); n++) {
-        Particle *p = m_particles[n];
-        m_max_density = glm::max(m_max_density,p->m_density);
-        delete p;
+    float peak = 0.0f;
+    for(int a=0; a<count; a++){
+        for(int b=0; b<count; b++){
+            for(int c=0; c<count; c++){
+                float sum = 0.0f;
+                for(unsigned int i=0; i<offsets[a].size(); i++){
+                    for(unsigned int j=0; j<offsets[b].size(); j++){
+                        for(unsigned int k=0; k<offsets[c].size(); k++){
+                            float sqd = offsets[a][i]*offsets[a][i] +
+                                        offsets[b][j]*offsets[b][j] +
+                                        offsets[c][k]*offsets[c][k];
+                            sum = sum + glm::max(1.0f-sqd*invh2, 0.0f);
+                        }
+                    }
+                }
+                peak = glm::max(peak, sum);
+            }
+        }
     }
-    m_particles.clear();
+    return peak;
+}
+
+void FlipSim::Init(){
+    m_scene->BuildPermaSolidGeomLevelSet();
+    m_scene->UpdateSolidGeomBounds(0.0f);
+    //density is normalized so a particle inside evenly filled liquid comes out at 1
+    float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
+    m_max_density = ComputeLatticeDensity(m_density, maxd);
 
     //Generate particles and sort
     m_scene->GenerateParticles(m_particles, m_dimensions, m_density, m_pgrid, 0);
     m_pgrid->Sort(m_particles);
-    m_pgrid->MarkCellTypes(m_particles, m_mgrid.m_A, m_density);
+    m_particleset.Gather(m_particles);
+    UpdateActiveTiles();
+    m_pgrid->MarkCellTypes(m_particleset, &m_mgrid, m_density, m_particleBand.m_phi,
+                           GetParticleBandInteriorLevel(m_particleBand));
+    if(m_particleBand.m_width>0){
+        InitParticleBand();
+    }
+}
+
+//In sparse mode, activates every grid tile that holds a particle plus a one tile border, which
+//covers everything splatting, projection and extrapolation touch in a step
+void FlipSim::UpdateActiveTiles(){
+    if(!m_settings.m_sparse){
+        return;
+    }
+    float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
+    //face grids are one cell bigger than the domain, so size the tile space off of those
+    glm::vec3 tiledims = glm::ceil((m_dimensions+glm::vec3(2))/(float)GRID_TILE_WIDTH);
+    int tx = tiledims.x; int ty = tiledims.y; int tz = tiledims.z;
+    std::vector<bool> occupied(tx*ty*tz, false);
+    unsigned int particlecount = m_particleset.Size();
+    for(unsigned int p=0; p<particlecount; p++){
+        glm::vec3 cell = glm::floor(m_particleset.m_p[p]*maxd);
+        cell = glm::max(glm::vec3(0), glm::min(m_dimensions-glm::vec3(1), cell));
+        int i = (int)cell.x>>GRID_TILE_LOG2; 
+        int j = (int)cell.y>>GRID_TILE_LOG2; 
+        int k = (int)cell.z>>GRID_TILE_LOG2;
+        occupied[(i*ty+j)*tz+k] = true;
+    }
+    //the band's interior is liquid too, with or without particles in it. Only the band's own
+    //cells can be below zero
+    unsigned int bandCount = m_particleBand.m_cells.size();
+    for(unsigned int c=0; c<bandCount; c++){
+        glm::vec3 cell = m_particleBand.m_cells[c];
+        if(m_particleBand.m_phi->GetCell(cell)<0.0f){
+            int i = (int)cell.x>>GRID_TILE_LOG2; 
+            int j = (int)cell.y>>GRID_TILE_LOG2; 
+            int k = (int)cell.z>>GRID_TILE_LOG2;
+            occupied[(i*ty+j)*tz+k] = true;
+        }
+    }
+    std::vector<glm::vec3> tiles;
+    for(int i=0; i<tx; i++){
+        for(int j=0; j<ty; j++){
+            for(int k=0; k<tz; k++){
+                bool active = false;
+                for(int si=glm::max(0,i-1); si<=glm::min(tx-1,i+1) && !active; si++){
+                    for(int sj=glm::max(0,j-1); sj<=glm::min(ty-1,j+1) && !active; sj++){
+                        for(int sk=glm::max(0,k-1); sk<=glm::min(tz-1,k+1) && !active; sk++){
+                            active = occupied[(si*ty+sj)*tz+sk];
+                        }
+                    }
+                }
+                if(active){
+                    tiles.push_back(glm::vec3(i,j,k));
+                }
+            }
+        }
+    }
+    ActivateMacgridTiles(m_mgrid, tiles);
+    if(m_verbose){
+        std::cout << "Active grid tiles: " << tiles.size() << "/" << tx*ty*tz << std::endl;
+    }
 }
 
 void FlipSim::StoreTempParticleVelocities(){
@@ -92,113 +211,806 @@ void FlipSim::StoreTempParticleVelocities(){
 void FlipSim::Step(bool saveVDB, bool saveOBJ, bool savePARTIO){
     m_frame++;  
     std::cout << "Simulating Step: " << m_frame << "..." << std::endl;
+    m_profiler.BeginFrame(m_frame);
+    m_reorderDue = m_settings.m_reorderInterval>0 && m_frame%m_settings.m_reorderInterval==0;
     
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
 
-    m_scene->GenerateParticles(m_particles, m_dimensions, m_density, m_pgrid, m_frame);
-    m_scene->BuildSolidGeomLevelSet(m_frame);
+    //solids first, so particle generation can test against this frame's sdfs and bvhs. The
+    //sdfs are voxelized from mesh vertices and never touch the bvhs, so the two overlap
+    {
+        PhaseGraph graph(m_profiler);
+        unsigned int solids = graph.AddPhase(PROFILE_BUILDSOLIDS, {}, [&](){
+            m_scene->BuildSolidGeomLevelSet(m_frame);
+        });
+        unsigned int refit = graph.AddPhase(PROFILE_REFIT, {}, [&](){
+            m_scene->RefitAnimatedMeshes(m_frame);
+        });
+        graph.AddPhase(PROFILE_GENERATE, {solids, refit}, [&](){
+            m_scene->GenerateParticles(m_particles, m_dimensions, m_density, m_pgrid, m_frame);
+        });
+        graph.Run();
+    }
 
-    AdjustParticlesStuckInSolids();
+    if(m_settings.m_frameLength>0.0f){
+        //frame is a fixed length in seconds, covered by as many CFL limited substeps as it
+        //takes. solids are only rebuilt above and blended in between
+        float frameLength = m_settings.m_frameLength;
+        float elapsed = 0.0f;
+        int substeps = 0;
+        while(elapsed<frameLength){
+            float remaining = frameLength-elapsed;
+            m_dt = ComputeSubstepSize(remaining, m_settings.m_maxFrameSubsteps-substeps);
+            if(m_dt>=remaining){
+                m_dt = remaining;
+                elapsed = frameLength;
+            }else{
+                elapsed += m_dt;
+            }
+            substeps++;
+            m_solidInterpolation = elapsed/frameLength;
+            m_time = (float)(m_frame-1) + m_solidInterpolation;
+            Substep();
+        }
+        if(m_verbose){
+            std::cout << "Frame: " << substeps << " substeps" << std::endl;
+        }
+    }else{
+        m_dt = m_stepsize;
+        m_time = (float)m_frame;
+        m_solidInterpolation = 1.0f;
+        Substep();
+    }
+
+    //exports and checkpoints share the scene's writer queue, so the checkpoint waits on the 
+    //export instead of overlapping it
+    PhaseGraph outputs(m_profiler);
+    std::vector<unsigned int> exported;
+    if(saveVDB || saveOBJ || savePARTIO){
+        //with queued exports this only times the snapshot, and any wait for the writer
+        exported.push_back(outputs.AddPhase(PROFILE_EXPORT, {}, [&](){
+            m_particleset.Gather(m_particles);
+            //only the meshers use the fill, particle caches write the particles alone
+            ParticleSet* fill = saveVDB || saveOBJ ? GatherParticleBandFill() : NULL;
+            m_scene->ExportParticles(m_particleset, fill, maxd, m_frame, saveVDB, saveOBJ, 
+                                     savePARTIO);
+        }));
+    }
+    if(m_settings.m_checkpointInterval>0 && m_frame%m_settings.m_checkpointInterval==0){
+        outputs.AddPhase(PROFILE_CHECKPOINT, exported, [&](){
+            std::string filename = m_scene->m_checkpointPath;
+            std::string frameString = utilityCore::padString(4, 
+                                          utilityCore::convertIntToString(m_frame));
+            size_t extensionLength = strlen(CHECKPOINT_EXTENSION);
+            if(filename.size()>=extensionLength && 
+               filename.compare(filename.size()-extensionLength, extensionLength, 
+                                CHECKPOINT_EXTENSION)==0){
+                filename.insert(filename.size()-extensionLength, "."+frameString);
+            }else{
+                filename += "."+frameString+CHECKPOINT_EXTENSION;
+            }
+            WriteCheckpoint(filename);
+        });
+    }
+    outputs.Run();
+
+    m_profiler.SetCount(PROFILE_PARTICLES, m_particles.size());
+    m_profiler.SetCount(PROFILE_LIQUIDPARTICLES, m_scene->GetLiquidParticleCount());
+    m_profiler.EndFrame();
+
+    if(m_stream!=NULL){
+        m_stream->Publish(m_frame, m_particles, m_scene->GetLiquidParticleCount(), maxd,
+                          m_profiler.GetFrameRecord());
+    }
+}
+
+bool FlipSim::OpenStream(const int& port, const unsigned int& stride){
+    SimStreamServer* stream = new SimStreamServer();
+    if(stream->Open(port, stride)==false){
+        delete stream;
+        return false;
+    }
+    delete m_stream;
+    m_stream = stream;
+    m_profiler.Enable();
+    return true;
+}
 
-    StoreTempParticleVelocities();
+//====================================
+// Particle Band
+//====================================
+
+//At init the grid velocity comes straight from the particles, and with no time passed the
+//advected depth is just the measured one
+void FlipSim::InitParticleBand(){
+    MeasureParticleBandDepth(m_particleBand, m_mgrid.m_A, m_dimensions);
+    ScatterParticlesToMACGrid(m_pgrid, m_particleset, &m_mgrid, m_splatWorkspace);
+    AdvectParticleBand(m_particleBand, &m_mgrid, 0.0f);
+    ExchangeParticleBand();
+    m_particleset.Gather(m_particles);
+}
+
+//Particles are kept one cell deeper than the interior starts, so no cell is ever left without
+//either particles or the interior. Seeds only go into cells that sit above the interior and
+//have no liquid particles, which is where liquid has risen out of the interior
+void FlipSim::ExchangeParticleBand(){
+    float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
+    int x = (int)m_dimensions.x; int y = (int)m_dimensions.y; int z = (int)m_dimensions.z;
+    float level = GetParticleBandInteriorLevel(m_particleBand);
+    float cull = -(float)m_particleBand.m_width;
+    int perAxis = glm::max(1, (int)glm::round(1.0f/m_density));
     m_pgrid->Sort(m_particles);
-    ComputeDensity();
-    ApplyExternalForces(); 
-    SplatParticlesToMACGrid(m_pgrid, m_particles, &m_mgrid);
-    m_pgrid->MarkCellTypes(m_particles, m_mgrid.m_A, m_density);
-    StorePreviousGrid();
-    EnforceBoundaryVelocity(&m_mgrid);
-    Project();
-    EnforceBoundaryVelocity(&m_mgrid);
-    ExtrapolateVelocity();
-    SubtractPreviousGrid();
-    SolvePicFlip();
-    AdvectParticles();
-    
-    CheckParticleSolidConstraints();
-    StoreTempParticleVelocities();
-    float h = m_density/maxd;
-    ResampleParticles(m_pgrid, m_particles, m_scene, m_frame, m_stepsize, h, m_dimensions);
 
-    CheckParticleSolidConstraints();
+    //each x slab fills its own lists, so threads never contend on a shared vector
+    std::vector< std::vector<unsigned int> > removedSlabs(x);
+    std::vector< std::vector<Particle> > addedSlabs(x);
+    tbb::parallel_for(tbb::blocked_range<int>(0,x),
+        [&](const tbb::blocked_range<int>& r){
+            for(int i=r.begin(); i!=r.end(); ++i){
+                for(int j=0; j<y; j++){
+                    for(int k=0; k<z; k++){
+                        float phi = m_particleBand.m_phi->GetCell(i,j,k);
+                        if(phi>-1.5f){
+                            continue;
+                        }
+                        unsigned int begin;
+                        unsigned int end;
+                        m_pgrid->GetCellRange(i,j,k, begin, end);
+                        bool liquid = false;
+                        for(unsigned int p=begin; p<end; p++){
+                            if(m_particles[p]->m_type==FLUID){
+                                liquid = true;
+                                if(phi<cull){
+                                    removedSlabs[i].push_back(p);
+                                }
+                            }
+                        }
+                        if(liquid==true || phi<level){
+                            continue;
+                        }
+                        for(int a=0; a<perAxis*perAxis*perAxis; a++){
+                            glm::vec3 offset(a/(perAxis*perAxis), (a/perAxis)%perAxis, 
+                                             a%perAxis);
+                            glm::vec3 position = (glm::vec3(i,j,k) + 
+                                                  (offset+glm::vec3(0.5f))/(float)perAxis)/maxd;
+                            Particle seed = CreateParticle(position, 
+                                                           InterpolateVelocity(position, &m_mgrid),
+                                                           glm::vec3(0.0f), 10.0f);
+                            seed.m_type = FLUID;
+                            seed.m_mass = 1.0f;
+                            seed.m_invalid = false;
+                            seed.m_pt = seed.m_p;
+                            seed.m_ut = seed.m_u;
+                            addedSlabs[i].push_back(seed);
+                        }
+                    }
+                }
+            }
+        }
+    );
+    std::vector<unsigned int> removed;
+    std::vector<Particle> added;
+    for(int i=0; i<x; i++){
+        removed.insert(removed.end(), removedSlabs[i].begin(), removedSlabs[i].end());
+        added.insert(added.end(), addedSlabs[i].begin(), addedSlabs[i].end());
+    }
+    if(removed.empty() && added.empty()){
+        return;
+    }
+    std::sort(removed.begin(), removed.end());
+    m_scene->ExchangeLiquidParticles(m_particles, removed, added);
+    m_pgrid->Sort(m_particles);
+    m_profiler.AddCount(PROFILE_BANDREMOVED, removed.size());
+    m_profiler.AddCount(PROFILE_BANDSEEDED, added.size());
+    if(m_verbose){
+        std::cout << "Particle band: " << removed.size() << " removed, " << added.size() 
+                  << " seeded" << std::endl;
+    }
+}
 
-    if(saveVDB || saveOBJ || savePARTIO){
-        m_scene->ExportParticles(m_particles, maxd, m_frame, saveVDB, saveOBJ, savePARTIO);
+//Eight points per interior cell, at half cell spacing, which the mesher's half cell radius
+//spheres close up into solid liquid. Interior cells are all in the band's cell list, which is 
+//counted and then filled in fixed size chunks, so the fill comes out in list order on any 
+//thread count
+ParticleSet* FlipSim::GatherParticleBandFill(){
+    if(m_particleBand.m_width==0){
+        return NULL;
     }
+    float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
+    float level = GetParticleBandInteriorLevel(m_particleBand);
+    Grid<float>* phi = m_particleBand.m_phi;
+    unsigned int cellCount = m_particleBand.m_cells.size();
+    const glm::vec3* cells = cellCount>0 ? &m_particleBand.m_cells[0] : NULL;
+    unsigned int chunksize = 4096;
+    unsigned int chunkcount = (cellCount+chunksize-1)/chunksize;
+    std::vector<unsigned int> chunkstarts(chunkcount+1, 0);
+    unsigned int* starts = &chunkstarts[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,chunkcount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int chunk=r.begin(); chunk!=r.end(); ++chunk){
+                unsigned int end = glm::min(cellCount, (chunk+1)*chunksize);
+                unsigned int interior = 0;
+                for(unsigned int c=chunk*chunksize; c<end; c++){
+                    interior += phi->GetCell(cells[c])<level ? 1 : 0;
+                }
+                starts[chunk+1] = interior;
+            }
+        }
+    );
+    for(unsigned int chunk=0; chunk<chunkcount; chunk++){
+        starts[chunk+1] += starts[chunk];
+    }
+
+    ParticleSet* fill = new ParticleSet();
+    fill->Resize(starts[chunkcount]*8);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,chunkcount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int chunk=r.begin(); chunk!=r.end(); ++chunk){
+                unsigned int end = glm::min(cellCount, (chunk+1)*chunksize);
+                unsigned int n = starts[chunk]*8;
+                for(unsigned int c=chunk*chunksize; c<end; c++){
+                    if(phi->GetCell(cells[c])>=level){
+                        continue;
+                    }
+                    for(unsigned int a=0; a<8; a++, n++){
+                        glm::vec3 offset((a>>2)&1, (a>>1)&1, a&1);
+                        fill->m_p[n] = (cells[c] + glm::vec3(0.25f) + offset*0.5f)/maxd;
+                        fill->m_u[n] = glm::vec3(0.0f);
+                        fill->m_density[n] = 10.0f;
+                        fill->m_mass[n] = 1.0f;
+                        fill->m_type[n] = FLUID;
+                        fill->m_invalid[n] = false;
+                    }
+                }
+            }
+        }
+    );
+    return fill;
+}
+
+//====================================
+// Checkpoints
+//====================================
+
+static inline unsigned long long AlignCheckpointOffset(const unsigned long long& offset){
+    return (offset + CHECKPOINT_ALIGNMENT - 1) & ~(unsigned long long)(CHECKPOINT_ALIGNMENT - 1);
+}
+
+//Grids are restored by reactivating the saved tiles and copying the raw pool back over, which
+//only lines up if the pool comes out the size it was saved at
+template <typename T> static bool RestoreCheckpointGrid(Grid<T>* grid, const char* data, 
+                                                        const CheckpointHeader& header,
+                                                        const CheckpointArray& tilesArray,
+                                                        const CheckpointArray& cellsArray){
+    if(grid->IsSparse()){
+        const glm::vec3* tiles = (const glm::vec3*)(data+header.m_offsets[tilesArray]);
+        unsigned int tilesCount = header.m_sizes[tilesArray]/sizeof(glm::vec3);
+        grid->SetActiveTiles(std::vector<glm::vec3>(tiles, tiles+tilesCount));
+    }
+    if((unsigned long long)grid->GetCellCount()*sizeof(T)!=header.m_sizes[cellsArray]){
+        return false;
+    }
+    memcpy(grid->GetRawData(), data+header.m_offsets[cellsArray], header.m_sizes[cellsArray]);
+    return true;
+}
+
+//Snapshots everything the next step depends on into one buffer on the sim thread, then lets 
+//the scene's export writer put it on disk. Dynamic solid particles and solid sdfs are left 
+//out, since they are rebuilt from the scene every frame anyway
+void FlipSim::WriteCheckpoint(const std::string& filename){
+    tbb::concurrent_vector<Particle*>& liquids = m_scene->GetLiquidParticles();
+    tbb::concurrent_vector<Particle*>& permaSolids = m_scene->GetPermaSolidParticles();
+    Grid<float>* pressure = m_mgrid_previous.m_P;
+    Grid<celltype>* celltypes = m_mgrid_previous.m_A;
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(CheckpointHeader));
+    memcpy(header.m_magic, "ARIELCKP", sizeof(header.m_magic));
+    header.m_version = CHECKPOINT_VERSION;
+    header.m_particleSize = sizeof(Particle);
+    header.m_dimensions[0] = m_dimensions.x;
+    header.m_dimensions[1] = m_dimensions.y;
+    header.m_dimensions[2] = m_dimensions.z;
+    header.m_sparse = m_settings.m_sparse ? 1 : 0;
+    header.m_frame = m_frame;
+    header.m_maxDensity = m_max_density;
+    header.m_dt = m_dt;
+    header.m_time = m_time;
+    header.m_solidInterpolation = m_solidInterpolation;
+    header.m_numberOfLiquidParticles = liquids.size();
+    header.m_numberOfPermaSolidParticles = permaSolids.size();
+    header.m_particleBandWidth = m_particleBand.m_width;
+
+    header.m_sizes[CHECKPOINT_LIQUIDPARTICLES] = liquids.size()*sizeof(Particle);
+    header.m_sizes[CHECKPOINT_PERMASOLIDPARTICLES] = permaSolids.size()*sizeof(Particle);
+    unsigned long long pressureTiles = 0;
+    unsigned long long celltypeTiles = 0;
+    if(m_settings.m_sparse){
+        pressureTiles = pressure->GetActiveTiles().size();
+        celltypeTiles = celltypes->GetActiveTiles().size();
+    }
+    header.m_sizes[CHECKPOINT_PRESSURETILES] = pressureTiles*sizeof(glm::vec3);
+    header.m_sizes[CHECKPOINT_PRESSURE] = pressure->GetCellCount()*sizeof(float);
+    header.m_sizes[CHECKPOINT_CELLTYPETILES] = celltypeTiles*sizeof(glm::vec3);
+    header.m_sizes[CHECKPOINT_CELLTYPES] = celltypes->GetCellCount()*sizeof(celltype);
+    Grid<float>* bandGrids[4] = {m_particleBand.m_phi, m_particleBand.m_u_x, 
+                                 m_particleBand.m_u_y, m_particleBand.m_u_z};
+    for(unsigned int b=0; b<4; b++){
+        header.m_sizes[CHECKPOINT_BANDPHI+b] = bandGrids[b]!=NULL ? 
+                                               bandGrids[b]->GetCellCount()*sizeof(float) : 0;
+    }
+    unsigned long long size = sizeof(CheckpointHeader);
+    for(unsigned int a=0; a<CHECKPOINT_ARRAYS; a++){
+        header.m_offsets[a] = AlignCheckpointOffset(size);
+        size = header.m_offsets[a] + header.m_sizes[a];
+    }
+
+    char* buffer = new char[size];
+    memset(buffer, 0, header.m_offsets[0]);
+    memcpy(buffer, &header, sizeof(CheckpointHeader));
+    Particle* liquidData = (Particle*)(buffer+header.m_offsets[CHECKPOINT_LIQUIDPARTICLES]);
+    Particle* permaSolidData = (Particle*)(buffer+header.m_offsets[CHECKPOINT_PERMASOLIDPARTICLES]);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,liquids.size()),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                liquidData[i] = *liquids[i];
+            }
+        }
+    );
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,permaSolids.size()),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                permaSolidData[i] = *permaSolids[i];
+            }
+        }
+    );
+    if(header.m_sizes[CHECKPOINT_PRESSURETILES]>0){
+        memcpy(buffer+header.m_offsets[CHECKPOINT_PRESSURETILES], &pressure->GetActiveTiles()[0],
+               header.m_sizes[CHECKPOINT_PRESSURETILES]);
+    }
+    memcpy(buffer+header.m_offsets[CHECKPOINT_PRESSURE], pressure->GetRawData(),
+           header.m_sizes[CHECKPOINT_PRESSURE]);
+    if(header.m_sizes[CHECKPOINT_CELLTYPETILES]>0){
+        memcpy(buffer+header.m_offsets[CHECKPOINT_CELLTYPETILES], 
+               &celltypes->GetActiveTiles()[0], header.m_sizes[CHECKPOINT_CELLTYPETILES]);
+    }
+    memcpy(buffer+header.m_offsets[CHECKPOINT_CELLTYPES], celltypes->GetRawData(),
+           header.m_sizes[CHECKPOINT_CELLTYPES]);
+    for(unsigned int b=0; b<4; b++){
+        if(bandGrids[b]!=NULL){
+            memcpy(buffer+header.m_offsets[CHECKPOINT_BANDPHI+b], bandGrids[b]->GetRawData(),
+                   header.m_sizes[CHECKPOINT_BANDPHI+b]);
+        }
+    }
+
+    m_scene->ExportBuffer(filename, buffer, size);
+}
+
+bool FlipSim::Resume(const std::string& filename){
+    size_t size = 0;
+    char* data = utilityCore::mapFile(filename, size, false);
+    if(data==NULL){
+        std::cout << "Error: Unable to read checkpoint " << filename << std::endl;
+        return false;
+    }
+
+    CheckpointHeader header;
+    bool valid = size>=sizeof(CheckpointHeader);
+    if(valid){
+        memcpy(&header, data, sizeof(CheckpointHeader));
+        valid = memcmp(header.m_magic, "ARIELCKP", sizeof(header.m_magic))==0 &&
+                header.m_version==CHECKPOINT_VERSION && header.m_particleSize==sizeof(Particle);
+        for(unsigned int a=0; a<CHECKPOINT_ARRAYS && valid; a++){
+            valid = header.m_offsets[a]+header.m_sizes[a]<=size;
+        }
+        valid = valid && 
+                header.m_sizes[CHECKPOINT_LIQUIDPARTICLES]==
+                (unsigned long long)header.m_numberOfLiquidParticles*sizeof(Particle) &&
+                header.m_sizes[CHECKPOINT_PERMASOLIDPARTICLES]==
+                (unsigned long long)header.m_numberOfPermaSolidParticles*sizeof(Particle);
+    }
+    if(valid==false){
+        std::cout << "Error: " << filename << " is not a version " << CHECKPOINT_VERSION 
+                  << " checkpoint" << std::endl;
+        utilityCore::unmapFile(data, size);
+        return false;
+    }
+    if(glm::vec3(header.m_dimensions[0], header.m_dimensions[1], 
+                 header.m_dimensions[2])!=m_dimensions || 
+       (header.m_sparse==1)!=m_settings.m_sparse){
+        std::cout << "Error: checkpoint " << filename << " was written for a different grid" 
+                  << std::endl;
+        utilityCore::unmapFile(data, size);
+        return false;
+    }
+    //without the band, the liquid it kept on the grid would just be gone
+    if(header.m_particleBandWidth>0 && m_particleBand.m_width==0){
+        std::cout << "Error: checkpoint " << filename << " needs particle_band_width " 
+                  << header.m_particleBandWidth << std::endl;
+        utilityCore::unmapFile(data, size);
+        return false;
+    }
+    //a band of a different width is measured again from the restored particles instead
+    bool restoreBand = m_particleBand.m_width>0 && 
+                       header.m_particleBandWidth==m_particleBand.m_width;
+    Grid<float>* bandGrids[4] = {m_particleBand.m_phi, m_particleBand.m_u_x, 
+                                 m_particleBand.m_u_y, m_particleBand.m_u_z};
+    for(unsigned int b=0; b<4 && restoreBand; b++){
+        if((unsigned long long)bandGrids[b]->GetCellCount()*sizeof(float)!=
+           header.m_sizes[CHECKPOINT_BANDPHI+b]){
+            std::cout << "Error: checkpoint " << filename << " has mismatched band data" 
+                      << std::endl;
+            utilityCore::unmapFile(data, size);
+            return false;
+        }
+    }
+    if(RestoreCheckpointGrid(m_mgrid_previous.m_P, data, header, CHECKPOINT_PRESSURETILES, 
+                             CHECKPOINT_PRESSURE)==false ||
+       RestoreCheckpointGrid(m_mgrid_previous.m_A, data, header, CHECKPOINT_CELLTYPETILES, 
+                             CHECKPOINT_CELLTYPES)==false){
+        std::cout << "Error: checkpoint " << filename << " has mismatched grid data" << std::endl;
+        m_mgrid_previous.m_P->Clear();
+        m_mgrid_previous.m_A->Clear();
+        utilityCore::unmapFile(data, size);
+        return false;
+    }
+
+    m_frame = header.m_frame;
+    m_max_density = header.m_maxDensity;
+    m_dt = header.m_dt;
+    m_time = header.m_time;
+    m_solidInterpolation = header.m_solidInterpolation;
+    for(unsigned int b=0; b<4 && restoreBand; b++){
+        memcpy(bandGrids[b]->GetRawData(), data+header.m_offsets[CHECKPOINT_BANDPHI+b],
+               header.m_sizes[CHECKPOINT_BANDPHI+b]);
+    }
+    if(restoreBand){
+        CollectParticleBandCells(m_particleBand, m_dimensions);
+    }
+
+    m_scene->BuildPermaSolidGeomLevelSet();
+    m_scene->RestoreParticles((const Particle*)(data+header.m_offsets[CHECKPOINT_LIQUIDPARTICLES]),
+                              header.m_numberOfLiquidParticles,
+                              (const Particle*)(data+
+                                                header.m_offsets[CHECKPOINT_PERMASOLIDPARTICLES]),
+                              header.m_numberOfPermaSolidParticles, m_particles);
+    utilityCore::unmapFile(data, size);
+
+    //rebuild this frame's solids so the next step blends from them like it would have
+    m_scene->BuildSolidGeomLevelSet(m_frame);
+    m_pgrid->Sort(m_particles);
+    m_particleset.Gather(m_particles);
+    UpdateActiveTiles();
+    m_pgrid->MarkCellTypes(m_particleset, &m_mgrid, m_density, m_particleBand.m_phi,
+                           GetParticleBandInteriorLevel(m_particleBand));
+    if(m_particleBand.m_width>0 && restoreBand==false){
+        InitParticleBand();
+    }
+
+    std::cout << "Resumed from " << filename << " at frame " << m_frame << std::endl;
+    return true;
+}
+
+//Picks the next substep so the fastest particle, plus what gravity adds over the step, moves
+//at most m_frameCfl cells. Steps close to the end of the frame are evened out so the frame
+//never ends on a sliver of a step
+float FlipSim::ComputeSubstepSize(const float& remaining, const int& substepsLeft){
+    if(substepsLeft<=1){
+        return remaining;
+    }
+    float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
+    float h = 1.0f/maxd;
+    unsigned int particlecount = m_particles.size();
+    tbb::combinable<float> maxspeed(0.0f);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            float& localmax = maxspeed.local();
+            for(unsigned int p=r.begin(); p!=r.end(); ++p){
+                if(m_particles[p]->m_type==FLUID){
+                    localmax = glm::max(localmax, glm::length(m_particles[p]->m_u));
+                }
+            }
+        }
+    );
+    float umax = maxspeed.combine([](float a, float b){ return glm::max(a,b); });
+    std::vector<glm::vec3> externalForces = m_scene->GetExternalForces();
+    glm::vec3 g(0.0f);
+    for(unsigned int i=0; i<externalForces.size(); i++){
+        g += externalForces[i];
+    }
+    umax += glm::sqrt(5.0f*h*glm::length(g));
+    float dt = remaining;
+    if(umax>0.0f){
+        dt = glm::max(m_settings.m_frameCfl*h/umax, remaining/substepsLeft);
+    }
+    if(dt<remaining && 2.0f*dt>remaining){
+        dt = 0.5f*remaining;
+    }
+    return dt;
+}
+
+void FlipSim::Substep(){
+    float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
+    m_profiler.AddCount(PROFILE_SUBSTEPS, 1);
+
+    //density, forces and the sparse tile update all only read the sorted particles, and the
+    //splat and cell marking write different grids, so each pair runs side by side. Everything
+    //from the projection on needs everything before it
+    PhaseGraph graph(m_profiler);
+    unsigned int refit = graph.AddPhase(PROFILE_REFIT, {}, [&](){
+        m_scene->RefitAnimatedMeshes(m_time);
+    });
+    unsigned int adjust = graph.AddPhase(PROFILE_ADJUST, {refit}, [&](){
+        AdjustParticlesStuckInSolids();
+    });
+    unsigned int sort = graph.AddPhase(PROFILE_SORT, {adjust}, [&](){
+        StoreTempParticleVelocities();
+        m_pgrid->Sort(m_particles);
+        if(m_reorderDue==true){
+            //moving the particles themselves into sorted order lets every later pass over
+            //m_particles stream through memory. The grid's sorted copy holds the old pointers
+            m_scene->ReorderParticleStore(m_particles);
+            m_pgrid->GetSortedParticles() = m_particles;
+            m_reorderDue = false;
+        }
+        //the grid passes below run on the sorted SoA copy until advection scatters it back
+        m_particleset.Gather(m_particles);
+    });
+    unsigned int tiles = graph.AddPhase(PROFILE_TILES, {sort}, [&](){
+        UpdateActiveTiles();
+    });
+    unsigned int density = graph.AddPhase(PROFILE_DENSITY, {sort}, [&](){
+        ComputeDensity();
+    });
+    unsigned int forces = graph.AddPhase(PROFILE_FORCES, {sort}, [&](){
+        ApplyExternalForces(); 
+    });
+    unsigned int splat = graph.AddPhase(PROFILE_SPLAT, {tiles, forces}, [&](){
+        tbb::tick_count splatstart = tbb::tick_count::now();
+        if(m_settings.m_scatterSplat){
+            ScatterParticlesToMACGrid(m_pgrid, m_particleset, &m_mgrid, m_splatWorkspace);
+        }else{
+            SplatParticlesToMACGrid(m_pgrid, m_particleset, &m_mgrid);
+        }
+        if(m_particleBand.m_width>0){
+            ApplyParticleBandVelocity(m_particleBand, &m_mgrid);
+        }
+        if(m_verbose){
+            std::cout << "P2G splat: " << (tbb::tick_count::now()-splatstart).seconds()*1000.0f 
+                      << " ms" << (m_settings.m_scatterSplat ? " (scatter)" : " (gather)") 
+                      << std::endl;
+        }
+    });
+    unsigned int markcells = graph.AddPhase(PROFILE_MARKCELLS, {tiles, density}, [&](){
+        m_pgrid->MarkCellTypes(m_particleset, &m_mgrid, m_density, m_particleBand.m_phi,
+                           GetParticleBandInteriorLevel(m_particleBand));
+        if(m_particleBand.m_width>0){
+            MeasureParticleBandDepth(m_particleBand, m_mgrid.m_A, m_dimensions);
+        }
+        if(m_profiler.IsEnabled()){
+            m_profiler.SetCount(PROFILE_FLUIDCELLS, CountFluidCells());
+        }
+    });
+    unsigned int project = graph.AddPhase(PROFILE_PROJECT, {splat, markcells}, [&](){
+        StorePreviousGrid();
+        EnforceBoundaryVelocity(&m_mgrid);
+        Project();
+        EnforceBoundaryVelocity(&m_mgrid);
+        m_profiler.AddCount(PROFILE_CGITERATIONS, m_solverStats.m_iterations);
+    });
+    unsigned int extrapolate = graph.AddPhase(PROFILE_EXTRAPOLATE, {project}, [&](){
+        ExtrapolateVelocity();
+    });
+    unsigned int picflip = graph.AddPhase(PROFILE_PICFLIP, {extrapolate}, [&](){
+        SubtractPreviousGrid();
+        SolvePicFlip();
+    });
+    unsigned int advect = graph.AddPhase(PROFILE_ADVECT, {picflip}, [&](){
+        AdvectParticles();
+    });
+    unsigned int constraints = graph.AddPhase(PROFILE_CONSTRAINTS, {advect}, [&](){
+        CheckParticleSolidConstraints();
+        StoreTempParticleVelocities();
+    });
+    bool resampled = false;
+    unsigned int resample = graph.AddPhase(PROFILE_RESAMPLE, {constraints}, [&](){
+        m_substepsSinceResample++;
+        if(m_settings.m_resampleInterval>0 && 
+           m_substepsSinceResample>=m_settings.m_resampleInterval){
+            float h = m_density/maxd;
+            ResampleParticles(m_pgrid, m_particles, m_scene, m_time, m_dt, h, m_dimensions,
+                              m_settings.m_resampleTolerance, m_resampleCells, 
+                              m_resampleParticles);
+            m_substepsSinceResample = 0;
+            resampled = true;
+        }
+    });
+    //only resampling moves particles after the first constraints pass, so the second one is 
+    //timed as part of resampling
+    unsigned int settle = graph.AddPhase(PROFILE_RESAMPLE, {resample}, [&](){
+        if(resampled==true){
+            CheckParticleSolidConstraints();
+        }
+    });
+    graph.AddPhase(PROFILE_PARTICLEBAND, {settle}, [&](){
+        if(m_particleBand.m_width>0){
+            AdvectParticleBand(m_particleBand, &m_mgrid, m_dt);
+            ExchangeParticleBand();
+        }
+    });
+    graph.Run();
+}
+
+//Only used for stats
+unsigned int FlipSim::CountFluidCells(){
+    return m_mgrid.m_fluidCells.size();
 }
 
 void FlipSim::AdjustParticlesStuckInSolids(){
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
     unsigned int particleCount = m_particles.size();
+    bool sdf = m_settings.m_sdfDepenetration;
+    tbb::atomic<unsigned int> sdfTests;
+    tbb::atomic<unsigned int> rayTests;
+    sdfTests = 0;
+    rayTests = 0;
+    tbb::atomic<unsigned int>* sdfTestCount = &sdfTests;
+    tbb::atomic<unsigned int>* rayTestCount = &rayTests;
     //pushi_back to vectors doesn't play nice with lambdas for some reason, so we have to
     //do something a little bit convoluted here...
-    bool* particleInSolidChecks = new bool[particleCount];
+    if(m_particleInSolid.size()<particleCount){
+        m_particleInSolid.resize(particleCount);
+    }
+    char* particleInSolidChecks = m_particleInSolid.empty() ? NULL : &m_particleInSolid[0];
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
         [=](const tbb::blocked_range<unsigned int>& r){
+            unsigned int sdfCount = 0;
+            unsigned int rayCount = 0;
             for(unsigned int p=r.begin(); p!=r.end(); ++p){ 
                 particleInSolidChecks[p] = false;
                 if(m_particles[p]->m_type==FLUID){
                                     m_particles[p]->m_temp = false;
                     m_particles[p]->m_temp2 = false;
                     glm::vec3 point = m_particles[p]->m_p * maxd;
+                    //clear of solids, or inside one but within the band, the sdf alone says
+                    //where the particle belongs. Near the surface its sign isn't reliable
+                    float distance;
+                    if(sdf==true && m_scene->SampleSolidSDF(point, m_time, distance)==true){
+                        if(distance>=SOLID_SDF_BAND){
+                            sdfCount++;
+                            continue;
+                        }
+                        glm::vec3 gradient = m_scene->GetSolidSDFGradient(point);
+                        if(distance<-SOLID_SDF_BAND && glm::length(gradient)>.5f){
+                            glm::vec3 normal = glm::normalize(gradient);
+                            m_particles[p]->m_pt = m_particles[p]->m_p;
+                            m_particles[p]->m_p = (point - normal * 1.05f * distance)/maxd;
+                            m_particles[p]->m_u = -normal * distance/maxd;
+                            sdfCount++;
+                            continue;
+                        }
+                    }
+                    rayCount++;
                     unsigned int id;
-                    if(m_scene->CheckPointInsideSolidGeom(point, m_frame, id)==true){
+                    if(m_scene->CheckPointInsideSolidGeom(point, m_time, id)==true){
                         particleInSolidChecks[p] = true;
                     }
                 }
             }
+            *sdfTestCount += sdfCount;
+            *rayTestCount += rayCount;
         }
     );
+    m_profiler.AddCount(PROFILE_SDFSOLIDTESTS, sdfTests);
+    m_profiler.AddCount(PROFILE_RAYSOLIDTESTS, rayTests);
     //build vector of particles we need to adjust
-    std::vector<Particle*> stuckParticles;
-    stuckParticles.reserve(particleCount);  
+    std::vector<Particle*>& stuckParticles = m_stuckParticles;
+    stuckParticles.clear();
     for(unsigned int p=0; p<particleCount; p++){
         if(particleInSolidChecks[p]==true){
             stuckParticles.push_back(m_particles[p]);
             m_particles[p]->m_pt = m_particles[p]->m_p;
         }
     }
-    delete particleInSolidChecks;
     //figure out direction to nearest surface from levelset, then raycast for a precise result
-    m_scene->GetSolidLevelSet()->ProjectPointsToSurface(stuckParticles, maxd);
+    m_scene->ProjectPointsToSolidSurface(stuckParticles, maxd, m_solidInterpolation);
     unsigned int stuckCount = stuckParticles.size();
+    std::vector<Particle*> rayParticles;
+    std::vector<rayCore::Ray> rays;
+    rayParticles.reserve(stuckCount);
+    rays.reserve(stuckCount);
     for(unsigned int p=0; p<stuckCount; p++){
         rayCore::Ray r;
         r.m_origin = stuckParticles[p]->m_pt * maxd;
-        r.m_frame = m_frame;
+        r.m_frame = m_time;
         r.m_direction = glm::normalize(stuckParticles[p]->m_p - 
                                        stuckParticles[p]->m_pt);
-        float d = glm::length(stuckParticles[p]->m_p - stuckParticles[p]->m_pt);
         float raynulltest = glm::length(r.m_direction);
         if(raynulltest==raynulltest){
-            rayCore::Intersection hit = m_scene->IntersectSolidGeoms(r);
-            float nearestDistance = glm::length(r.m_origin - hit.m_point);
-            stuckParticles[p]->m_p = (r.m_origin + r.m_direction * 1.05f * nearestDistance)/maxd;
-            stuckParticles[p]->m_u = glm::normalize(r.m_direction) * d;
+            rayParticles.push_back(stuckParticles[p]);
+            rays.push_back(r);
         }
     }
+    //all rays share a frame, so they go through the solids as packets
+    unsigned int rayCount = rays.size();
+    std::vector<rayCore::Intersection> hits(rayCount);
+    if(rayCount>0){
+        m_scene->IntersectSolidGeoms(&rays[0], &hits[0], rayCount);
+    }
+    for(unsigned int p=0; p<rayCount; p++){
+        const rayCore::Ray& r = rays[p];
+        float d = glm::length(rayParticles[p]->m_p - rayParticles[p]->m_pt);
+        float nearestDistance = glm::length(r.m_origin - hits[p].m_point);
+        rayParticles[p]->m_p = (r.m_origin + r.m_direction * 1.05f * nearestDistance)/maxd;
+        rayParticles[p]->m_u = glm::normalize(r.m_direction) * d;
+    }
     stuckParticles.clear();
 }
 
 void FlipSim::CheckParticleSolidConstraints(){
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
     unsigned int particlecount = m_particles.size();   
+    bool sdf = m_settings.m_sdfDepenetration;
+    tbb::atomic<unsigned int> sdfTests;
+    tbb::atomic<unsigned int> rayTests;
+    sdfTests = 0;
+    rayTests = 0;
+    tbb::atomic<unsigned int>* sdfTestCount = &sdfTests;
+    tbb::atomic<unsigned int>* rayTestCount = &rayTests;
     // for(unsigned int p=0; p<particlecount; p++){ 
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
         [=](const tbb::blocked_range<unsigned int>& r){
+            unsigned int sdfCount = 0;
+            unsigned int rayCount = 0;
             for(unsigned int p=r.begin(); p!=r.end(); ++p){ 
                 if(m_particles[p]->m_type==FLUID){
                     rayCore::Ray r;
                     r.m_origin = m_particles[p]->m_pt * maxd;
-                    r.m_frame = m_frame;
+                    r.m_frame = m_time;
                     r.m_direction = glm::normalize(m_particles[p]->m_p - 
                                                    m_particles[p]->m_pt);
                     float d = glm::length(m_particles[p]->m_p - m_particles[p]->m_pt);
                     float raynulltest = glm::length(r.m_direction);
 
                     if(raynulltest==raynulltest){
-                        rayCore::Intersection hit = m_scene->IntersectSolidGeoms(r);
                         float u_dir = glm::length(m_particles[p]->m_ut);
+                        //the sdf is 1-lipschitz, so no point on the step can be nearer a solid
+                        //than half of (start distance + end distance - step length). Steps
+                        //that clear that bound, and ends inside a solid but within the band,
+                        //are settled without rays
+                        glm::vec3 end = m_particles[p]->m_p * maxd;
+                        float startDistance;
+                        float endDistance;
+                        if(sdf==true && 
+                           m_scene->SampleSolidSDF(r.m_origin, m_time, startDistance)==true &&
+                           m_scene->SampleSolidSDF(end, m_time, endDistance)==true){
+                            if(startDistance+endDistance-d*maxd>2.0f*SOLID_SDF_BAND){
+                                sdfCount++;
+                                continue;
+                            }
+                            if(endDistance<-SOLID_SDF_BAND){
+                                glm::vec3 gradient = m_scene->GetSolidSDFGradient(end);
+                                if(glm::length(gradient)>.5f){
+                                    glm::vec3 normal = glm::normalize(gradient);
+                                    m_particles[p]->m_p = (end - normal * 1.05f * endDistance)/
+                                                          maxd;
+                                    m_particles[p]->m_u = 2.0f*glm::dot(r.m_direction, normal)*
+                                                          normal-r.m_direction;
+                                    m_particles[p]->m_u = glm::normalize(m_particles[p]->m_u) * 
+                                                          u_dir;
+                                    sdfCount++;
+                                    continue;
+                                }
+                            }
+                        }
+                        rayCount++;
+                        //most particles cross nothing in a step, the any hit test rules them
+                        //out before paying for a closest hit
+                        rayCore::Intersection hit;
+                        if(m_scene->CheckSegmentHitsSolidGeom(r.m_origin, m_particles[p]->m_p*maxd,
+                                                              m_time)==true){
+                            hit = m_scene->IntersectSolidGeoms(r);
+                        }
                         if(hit.m_hit==true){
                             float solidDistance = glm::length(r.m_origin - 
                                                               hit.m_point);
@@ -214,36 +1026,44 @@ void FlipSim::CheckParticleSolidConstraints(){
                         }    
                         r.m_origin = m_particles[p]->m_p * maxd;
                         unsigned int id;
-                        if(m_scene->CheckPointInsideSolidGeom(r.m_origin, m_frame, id)==true){
+                        if(m_scene->CheckPointInsideSolidGeom(r.m_origin, m_time, id)==true){
                             m_particles[p]->m_u = -glm::normalize(r.m_direction) * u_dir;
                             m_particles[p]->m_p = m_particles[p]->m_pt + 
-                                                  m_particles[p]->m_u * m_stepsize;
+                                                  m_particles[p]->m_u * m_dt;
                         }
                     }
                 }
             }
+            *sdfTestCount += sdfCount;
+            *rayTestCount += rayCount;
         }
     );
+    m_profiler.AddCount(PROFILE_SDFSOLIDTESTS, sdfTests);
+    m_profiler.AddCount(PROFILE_RAYSOLIDTESTS, rayTests);
 }
 
 void FlipSim::AdvectParticles(){
     unsigned int x = (unsigned int)m_dimensions.x; unsigned int y = (unsigned int)m_dimensions.y; 
     unsigned int z = (unsigned int)m_dimensions.z;
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
-    unsigned int particleCount = m_particles.size();
+    unsigned int particleCount = m_particleset.Size();
 
-    //update positions
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                if(m_particles[i]->m_type == FLUID){
-                    glm::vec3 velocity = InterpolateVelocity(m_particles[i]->m_p, &m_mgrid);
-                    m_particles[i]->m_p += m_stepsize*velocity;
-                    //m_particles[i]->m_u = velocity;
-                }
-            }
-        }
-    );
+    //update positions, split into substeps so no particle crosses more than m_cfl cells in one
+    float cells = m_dt*MaxGridSpeed(&m_mgrid)*maxd;
+    int substeps = 1;
+    if(m_settings.m_cfl>0.0f){
+        substeps = glm::clamp((int)glm::ceil(cells/m_settings.m_cfl), 1, m_settings.m_maxSubsteps);
+    }
+    float dt = m_dt/substeps;
+    for(int s=0; s<substeps; s++){
+        AdvectParticlePositions(m_particleset, &m_mgrid, dt, m_settings.m_advection);
+    }
+    if(m_verbose){
+        std::cout << "Advection: " << substeps << " substeps, max " << cells 
+                  << " cells per step" << std::endl;
+    }
+    //hand positions, velocities and densities back to the particle list for the solid passes
+    m_particleset.Scatter(m_particles);
     m_pgrid->Sort(m_particles); //sort
 
     //apply constraints for outer walls of sim
@@ -261,101 +1081,84 @@ void FlipSim::AdvectParticles(){
                     unsigned int i = glm::min(x-1.0f,p->m_p.x*maxd);
                     unsigned int j = glm::min(y-1.0f,p->m_p.y*maxd);
                     unsigned int k = glm::min(z-1.0f,p->m_p.z*maxd);            
-                    std::vector<Particle*> neighbors = m_pgrid->GetCellNeighbors(glm::vec3(i,j,k), 
-                                                                                 glm::vec3(1));
-                    for(int p1=0; p1<neighbors.size(); p1++){
-                        Particle* np = neighbors[p1];
-                        float re = 1.5f*m_density/maxd;
-                        if(np->m_type == SOLID){
-                            float dist = glm::length(p->m_p-np->m_p); //check this later
-                            if(dist<re){
-                                glm::vec3 normal = np->m_n;
-                                if(glm::length(normal)<0.0000001f && dist){
-                                    normal = glm::normalize(p->m_p - np->m_p);
+                    float re = 1.5f*m_density/maxd;
+                    m_pgrid->ForEachCellNeighbor(glm::vec3(i,j,k), glm::vec3(1),
+                        [&](Particle* np){
+                            if(np->m_type == SOLID){
+                                float dist = glm::length(p->m_p-np->m_p); //check this later
+                                if(dist<re){
+                                    glm::vec3 normal = np->m_n;
+                                    if(glm::length(normal)<0.0000001f && dist){
+                                        normal = glm::normalize(p->m_p - np->m_p);
+                                    }
+                                    p->m_p += (re-dist)*normal;
+                                    p->m_u -= glm::dot(p->m_u, normal) * normal;
                                 }
-                                p->m_p += (re-dist)*normal;
-                                p->m_u -= glm::dot(p->m_u, normal) * normal;
                             }
                         }
-                    }
+                    );
                 }
             }
         }
     );
 }
 
+//Fused G2P. m_mgrid_previous holds the velocity change from SubtractPreviousGrid, so the FLIP 
+//velocity is the particle's old velocity plus the sampled change and the PIC velocity is the new 
+//grid sampled directly. Both grids are sampled a batch at a time and blended in the same sweep
 void FlipSim::SolvePicFlip(){
-    int particleCount = m_particles.size();
-
-    //store copy of current velocities for later
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                m_particles[i]->m_t = m_particles[i]->m_u;
-            }
-        }
-    );
-
-    SplatMACGridToParticles(m_particles, &m_mgrid_previous);
-
-    //set FLIP velocity
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                m_particles[i]->m_t = m_particles[i]->m_u + m_particles[i]->m_t;
-            }
-        }
-    );
-
-    //set PIC velocity
-    SplatMACGridToParticles(m_particles, &m_mgrid);
+    unsigned int particleCount = m_particleset.Size();
+    glm::vec3* pp = m_particleset.m_p;
+    glm::vec3* pu = m_particleset.m_u;
 
-    //combine PIC and FLIP
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
+    unsigned int batchCount = (particleCount+INTERPOLATION_BATCH-1)/INTERPOLATION_BATCH;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,batchCount),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                m_particles[i]->m_u = (1.0f-m_picflipratio)*m_particles[i]->m_u + 
-                                      m_picflipratio*m_particles[i]->m_t;
+            glm::vec3 delta[INTERPOLATION_BATCH];
+            glm::vec3 pic[INTERPOLATION_BATCH];
+            for(unsigned int t=r.begin(); t!=r.end(); ++t){
+                unsigned int b = t*INTERPOLATION_BATCH;
+                unsigned int batch = std::min((unsigned int)INTERPOLATION_BATCH, 
+                                              particleCount-b);
+                InterpolateVelocities(&pp[b], delta, batch, &m_mgrid_previous);
+                InterpolateVelocities(&pp[b], pic, batch, &m_mgrid);
+                for(unsigned int i=0; i<batch; ++i){ 
+                    glm::vec3 flip = delta[i] + pu[b+i];
+                    pu[b+i] = (1.0f-m_picflipratio)*pic[i] + m_picflipratio*flip;
+                }
             }
         }
     );
 }
 
+//Only band faces change between here and SubtractPreviousGrid, and particles only sample faces
+//inside the band, so the faces outside it are left alone
 void FlipSim::StorePreviousGrid(){
     unsigned int x = (unsigned int)m_dimensions.x; unsigned int y = (unsigned int)m_dimensions.y; 
     unsigned int z = (unsigned int)m_dimensions.z;
-    //for every x face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        m_mgrid_previous.m_u_x->SetCell(i,j,k,m_mgrid.m_u_x->GetCell(i,j,k));
-                    }
-                }
-            }
+    //sparse faces can only be written once the previous grids share this step's tiles
+    Grid<float>* current[3] = {m_mgrid.m_u_x, m_mgrid.m_u_y, m_mgrid.m_u_z};
+    Grid<float>* previous[3] = {m_mgrid_previous.m_u_x, m_mgrid_previous.m_u_y, 
+                                m_mgrid_previous.m_u_z};
+    for(unsigned int a=0; a<3; a++){
+        if(previous[a]->GetActiveTiles()!=current[a]->GetActiveTiles()){
+            previous[a]->SetActiveTiles(current[a]->GetActiveTiles());
         }
-    );
-    //for every y face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
+    }
+    const glm::vec3* cells = m_mgrid.m_bandCells.empty() ? NULL : &m_mgrid.m_bandCells[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_mgrid.m_bandCells.size()),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y+1; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        m_mgrid_previous.m_u_y->SetCell(i,j,k,m_mgrid.m_u_y->GetCell(i,j,k));
-                    }
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                unsigned int i = cells[c].x; unsigned int j = cells[c].y; 
+                unsigned int k = cells[c].z;
+                if(j<y && k<z){
+                    m_mgrid_previous.m_u_x->SetCell(i,j,k, m_mgrid.m_u_x->GetCell(i,j,k));
                 }
-            }
-        }
-    );
-    //for every z face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        m_mgrid_previous.m_u_z->SetCell(i,j,k,m_mgrid.m_u_z->GetCell(i,j,k));
-                    }
+                if(i<x && k<z){
+                    m_mgrid_previous.m_u_y->SetCell(i,j,k, m_mgrid.m_u_y->GetCell(i,j,k));
+                }
+                if(i<x && j<y){
+                    m_mgrid_previous.m_u_z->SetCell(i,j,k, m_mgrid.m_u_z->GetCell(i,j,k));
                 }
             }
         }
@@ -365,43 +1168,69 @@ void FlipSim::StorePreviousGrid(){
 void FlipSim::SubtractPreviousGrid(){
     unsigned int x = (unsigned int)m_dimensions.x; unsigned int y = (unsigned int)m_dimensions.y; 
     unsigned int z = (unsigned int)m_dimensions.z;
-    //for every x face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
+    const glm::vec3* cells = m_mgrid.m_bandCells.empty() ? NULL : &m_mgrid.m_bandCells[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_mgrid.m_bandCells.size()),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        float subx = m_mgrid.m_u_x->GetCell(i,j,k) - 
-                                     m_mgrid_previous.m_u_x->GetCell(i,j,k);
-                        m_mgrid_previous.m_u_x->SetCell(i,j,k,subx);
-                    }
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                unsigned int i = cells[c].x; unsigned int j = cells[c].y; 
+                unsigned int k = cells[c].z;
+                if(j<y && k<z){
+                    m_mgrid_previous.m_u_x->SetCell(i,j,k, m_mgrid.m_u_x->GetCell(i,j,k) - 
+                                                           m_mgrid_previous.m_u_x->GetCell(i,j,k));
                 }
-            }
-        }
-    );
-    //for every y face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y+1; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        float suby = m_mgrid.m_u_y->GetCell(i,j,k) - 
-                                     m_mgrid_previous.m_u_y->GetCell(i,j,k);
-                        m_mgrid_previous.m_u_y->SetCell(i,j,k,suby);
-                    }
+                if(i<x && k<z){
+                    m_mgrid_previous.m_u_y->SetCell(i,j,k, m_mgrid.m_u_y->GetCell(i,j,k) - 
+                                                           m_mgrid_previous.m_u_y->GetCell(i,j,k));
+                }
+                if(i<x && j<y){
+                    m_mgrid_previous.m_u_z->SetCell(i,j,k, m_mgrid.m_u_z->GetCell(i,j,k) - 
+                                                           m_mgrid_previous.m_u_z->GetCell(i,j,k));
                 }
             }
         }
     );
-    //for every z face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){     
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        float subz = m_mgrid.m_u_z->GetCell(i,j,k) - 
-                                     m_mgrid_previous.m_u_z->GetCell(i,j,k);
-                        m_mgrid_previous.m_u_z->SetCell(i,j,k,subz);
+}
+
+//Seeds the pressure solve. With warm starting, cells that were fluid last step keep last step's
+//pressure and newly fluid cells take the average of their previously fluid neighbors, everything
+//else starts from zero
+void FlipSim::InitializePressure(){
+    if(!m_settings.m_warmStart){
+        m_mgrid.m_P->Clear();
+        return;
+    }
+    int x = (int)m_dimensions.x; int y = (int)m_dimensions.y; int z = (int)m_dimensions.z;
+    Grid<celltype>* A = m_mgrid.m_A;
+    Grid<celltype>* previousA = m_mgrid_previous.m_A;
+    Grid<float>* P = m_mgrid.m_P;
+    Grid<float>* previousP = m_mgrid_previous.m_P;
+    A->ForEachActiveBlock(m_dimensions,
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            for(int i=lo.x; i<hi.x; ++i){ 
+                for(int j=lo.y; j<hi.y; ++j){ 
+                    for(int k=lo.z; k<hi.z; ++k){
+                        float pressure = 0.0f;
+                        if(A->GetCell(i,j,k)==FLUID){
+                            if(previousA->GetCell(i,j,k)==FLUID){
+                                pressure = previousP->GetCell(i,j,k);
+                            }else{
+                                int q[][3] = { {i-1,j,k}, {i+1,j,k}, {i,j-1,k}, {i,j+1,k}, 
+                                               {i,j,k-1}, {i,j,k+1} };
+                                float count = 0.0f;
+                                for(int m=0; m<6; m++){
+                                    int qi = q[m][0]; int qj = q[m][1]; int qk = q[m][2];
+                                    if(qi>=0 && qi<x && qj>=0 && qj<y && qk>=0 && qk<z && 
+                                       previousA->GetCell(qi,qj,qk)==FLUID){
+                                        pressure += previousP->GetCell(qi,qj,qk);
+                                        count += 1.0f;
+                                    }
+                                }
+                                if(count>0.0f){
+                                    pressure = pressure/count;
+                                }
+                            }
+                        }
+                        P->SetCell(i,j,k,pressure);
                     }
                 }
             }
@@ -409,6 +1238,15 @@ void FlipSim::SubtractPreviousGrid(){
     );
 }
 
+//Keeps this step's pressure and fluid mask around for warm starting the next solve
+void FlipSim::StorePreviousPressure(){
+    if(!m_settings.m_warmStart){
+        return;
+    }
+    m_mgrid_previous.m_P->Copy(m_mgrid.m_P);
+    m_mgrid_previous.m_A->Copy(m_mgrid.m_A);
+}
+
 void FlipSim::Project(){
     unsigned int x = (unsigned int)m_dimensions.x; unsigned int y = (unsigned int)m_dimensions.y; 
     unsigned int z = (unsigned int)m_dimensions.z;
@@ -416,32 +1254,43 @@ void FlipSim::Project(){
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
     float h = 1.0f/maxd; //cell width
 
-    //compute divergence per cell
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
+    //compute divergence per FLUID cell, the solver never reads it anywhere else
+    const glm::vec3* cells = m_mgrid.m_fluidCells.empty() ? NULL : &m_mgrid.m_fluidCells[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_mgrid.m_fluidCells.size()),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){     
-                for(unsigned int j = 0; j < y; ++j){
-                    for(unsigned int k = 0; k < z; ++k){
-                        float divergence = (m_mgrid.m_u_x->GetCell(i+1, j, k) - 
-                                            m_mgrid.m_u_x->GetCell(i, j, k) + 
-                                            m_mgrid.m_u_y->GetCell(i, j+1, k) - 
-                                            m_mgrid.m_u_y->GetCell(i, j, k) +
-                                            m_mgrid.m_u_z->GetCell(i, j, k+1) - 
-                                            m_mgrid.m_u_z->GetCell(i, j, k)
-                                            ) / h;
-                        m_mgrid.m_D->SetCell(i,j,k,divergence);
-                    }
-                }
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                int i = cells[c].x; int j = cells[c].y; int k = cells[c].z;
+                float divergence = (m_mgrid.m_u_x->GetCell(i+1,j,k) - 
+                                    m_mgrid.m_u_x->GetCell(i,j,k) +
+                                    m_mgrid.m_u_y->GetCell(i,j+1,k) - 
+                                    m_mgrid.m_u_y->GetCell(i,j,k) +
+                                    m_mgrid.m_u_z->GetCell(i,j,k+1) - 
+                                    m_mgrid.m_u_z->GetCell(i,j,k)) / h;
+                m_mgrid.m_D->SetCell(i,j,k, divergence);
             }
         }
     );
 
     //compute internal level set for liquid surface
-    m_pgrid->BuildSDF(m_mgrid, m_density);
+    m_pgrid->BuildSDF(m_particleset, m_mgrid, m_density);
     
-    Solve(m_mgrid, m_subcell, m_verbose);
+    InitializePressure();
+    m_solverStats = Solve(m_mgrid, m_subcell, m_settings, m_solverWorkspace, m_verbose);
+    StorePreviousPressure();
 
     if(m_verbose){
+        std::cout << "Pressure solve: " << m_solverStats.m_iterations << " iterations" 
+                  << (m_settings.m_warmStart ? " (warm start)" : "") << std::endl;
+        float iterationtime = 0.0f;
+        for(unsigned int i=0; i<m_solverStats.m_iterationTimes.size(); i++){
+            iterationtime += m_solverStats.m_iterationTimes[i];
+        }
+        if(m_solverStats.m_iterations>0){
+            iterationtime = iterationtime/m_solverStats.m_iterations;
+        }
+        std::cout << "Pressure solve: " << m_solverStats.m_totalTime << " ms total, " 
+                  << m_solverStats.m_setupTime << " ms setup, " << iterationtime 
+                  << " ms/iteration" << std::endl;
         std::cout << " " << std::endl;//TODO: no more stupid formatting hacks like this to std::out
     }
 
@@ -449,122 +1298,111 @@ void FlipSim::Project(){
     SubtractPressureGradient();
 }
 
-void FlipSim::ExtrapolateVelocity(){
-    unsigned int x = (unsigned int)m_dimensions.x; unsigned int y = (unsigned int)m_dimensions.y; 
-    unsigned int z = (unsigned int)m_dimensions.z;
+//Band cells reach m_dimensions on every axis, but an axis n face only exists past the last cell 
+//along n itself
+static inline bool IsFace(const unsigned int& n, const int* p, const int* dimensions){
+    return (n==0 || p[0]<dimensions[0]) && (n==1 || p[1]<dimensions[1]) && 
+           (n==2 || p[2]<dimensions[2]);
+}
 
-    Grid<int>** mark = new Grid<int>*[3];
-    Grid<int>** wallmark = new Grid<int>*[3];
-    for(unsigned int i=0; i<3; i++){
-        mark[i] = new Grid<int>(m_dimensions, 0);
-        wallmark[i] = new Grid<int>(m_dimensions, 0);
+//Extends velocities from faces next to fluid into the solid faces around them, one face layer
+//per pass for m_extrapolationLayers passes. A pass only reads faces valid before it began, so the
+//result does not depend on visiting order. MarkCellTypes widens the band to fit every layer, so
+//all passes only walk the band
+void FlipSim::ExtrapolateVelocity(){
+    int dimensions[3] = {(int)m_dimensions.x, (int)m_dimensions.y, (int)m_dimensions.z};
+    int x = dimensions[0]; int y = dimensions[1]; int z = dimensions[2];
+    unsigned int slabstride = (y+1)*(z+1);
+    unsigned int rowstride = z+1;
+    int layerCount = m_settings.m_extrapolationLayers;
+    if(layerCount<=0){
+        return;
     }
 
-    //initalize temp grids with values
-    //for every x face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        mark[0]->SetCell(i,j,k, (i>0 && m_mgrid.m_A->GetCell(i-1,j,k)==FLUID) || 
-                                                (i<x && m_mgrid.m_A->GetCell(i,j,k)==FLUID));
-                        wallmark[0]->SetCell(i,j,k,(i<=0 || m_mgrid.m_A->GetCell(i-1,j,k)==SOLID) && 
-                                                   (i>=x || m_mgrid.m_A->GetCell(i,j,k)==SOLID));
-                    }
-                }
-            }
-        }
-    );
-    //for every y face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){     
-                for(unsigned int j = 0; j < y+1; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        mark[1]->SetCell(i,j,k, (j>0 && m_mgrid.m_A->GetCell(i,j-1,k)==FLUID) || 
-                                                (j<y && m_mgrid.m_A->GetCell(i,j,k)==FLUID));
-                        wallmark[1]->SetCell(i,j,k,(j<=0 || m_mgrid.m_A->GetCell(i,j-1,k)==SOLID) && 
-                                                   (j>=y || m_mgrid.m_A->GetCell(i,j,k)==SOLID));
-                    }
-                }
-            }
-        }
-    );
-    //for every z face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
+    Grid<celltype>* A = m_mgrid.m_A;
+    Grid<float>* faces[3] = {m_mgrid.m_u_x, m_mgrid.m_u_y, m_mgrid.m_u_z};
+    unsigned char* layers[3] = {&m_faceLayers[0][0], &m_faceLayers[1][0], &m_faceLayers[2][0]};
+    const glm::vec3* cells = m_mgrid.m_bandCells.empty() ? NULL : &m_mgrid.m_bandCells[0];
+    unsigned int cellCount = m_mgrid.m_bandCells.size();
+
+    //faces touching a FLUID cell hold valid velocities from the start, layer 1
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cellCount),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){     
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        mark[2]->SetCell(i,j,k, (k>0 && m_mgrid.m_A->GetCell(i,j,k-1)==FLUID) || 
-                                                (k<z && m_mgrid.m_A->GetCell(i,j,k)==FLUID));
-                        wallmark[2]->SetCell(i,j,k,(k<=0 || m_mgrid.m_A->GetCell(i,j,k-1)==SOLID) && 
-                                                   (k>=z || m_mgrid.m_A->GetCell(i,j,k)==SOLID));
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                int p[3] = {(int)cells[c].x, (int)cells[c].y, (int)cells[c].z};
+                unsigned int f = p[0]*slabstride + p[1]*rowstride + p[2];
+                for(unsigned int n=0; n<3; ++n){
+                    if(!IsFace(n, p, dimensions)){
+                        continue;
                     }
+                    int b[3] = {p[0], p[1], p[2]};
+                    b[n]--;
+                    bool fluid = (p[n]>0 && A->GetCell(b[0],b[1],b[2])==FLUID) || 
+                                 (p[n]<dimensions[n] && A->GetCell(p[0],p[1],p[2])==FLUID);
+                    layers[n][f] = fluid ? 1 : 0;
                 }
             }
         }
     );
 
-    //extrapolate
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y+1; ++j){ 
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        for(unsigned int n=0; n<3; ++n){
-                            if(n!=0 && i>x-1){ continue; };
-                            if(n!=1 && j>y-1){ continue; };
-                            if(n!=2 && k>z-1){ continue; };
-                            if(!mark[n]->GetCell(i,j,k) && wallmark[n]->GetCell(i,j,k)){
-                                unsigned int wsum = 0;
-                                float sum = 0.0f;
-                                glm::vec3 q[6] = { glm::vec3(i-1,j,k), glm::vec3(i+1,j,k), 
-                                                   glm::vec3(i,j-1,k), glm::vec3(i,j+1,k), 
-                                                   glm::vec3(i,j,k-1), glm::vec3(i,j,k+1) };
-                                for(unsigned int qk=0; qk<6; ++qk){
-                                    if(q[qk][0]>=0 && q[qk][0]<x+(n==0) && q[qk][1]>=0 && 
-                                       q[qk][1]<y+(n==1) && q[qk][2]>=0 && q[qk][2]<z+(n==2) ) {
-                                        if(mark[n]->GetCell(q[qk][0],q[qk][1],q[qk][2])){
-                                            wsum ++;
-                                            if(n==0){
-                                                sum += m_mgrid.m_u_x->GetCell(q[qk][0],q[qk][1],
-                                                                          q[qk][2]);
-                                            }else if(n==1){
-                                                sum += m_mgrid.m_u_y->GetCell(q[qk][0],q[qk][1],
-                                                                          q[qk][2]);
-                                            }else if(n==2){
-                                                sum += m_mgrid.m_u_z->GetCell(q[qk][0],q[qk][1],
-                                                                          q[qk][2]);
-                                            }
-                                        }
-                                    }
-                                }
-                                if(wsum){
-                                    if(n==0){
-                                        m_mgrid.m_u_x->SetCell(i,j,k,sum/wsum);
-                                    }else if(n==1){
-                                        m_mgrid.m_u_y->SetCell(i,j,k,sum/wsum);
-                                    }else if(n==2){
-                                        m_mgrid.m_u_z->SetCell(i,j,k,sum/wsum);
-                                    }
+    for(int layer=1; layer<=layerCount; layer++){
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cellCount),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                    int p[3] = {(int)cells[c].x, (int)cells[c].y, (int)cells[c].z};
+                    unsigned int f = p[0]*slabstride + p[1]*rowstride + p[2];
+                    for(unsigned int n=0; n<3; ++n){
+                        if(!IsFace(n, p, dimensions) || layers[n][f]!=0){
+                            continue;
+                        }
+                        //only faces with solid or the domain edge on both sides are filled
+                        int b[3] = {p[0], p[1], p[2]};
+                        b[n]--;
+                        if(!((p[n]<=0 || A->GetCell(b[0],b[1],b[2])==SOLID) && 
+                             (p[n]>=dimensions[n] || A->GetCell(p[0],p[1],p[2])==SOLID))){
+                            continue;
+                        }
+                        //faces written in this pass are tagged layer+1, so reads of the layer 
+                        //tags never see this pass's results
+                        unsigned int wsum = 0;
+                        float sum = 0.0f;
+                        for(unsigned int qk=0; qk<6; ++qk){
+                            int q[3] = {p[0], p[1], p[2]};
+                            q[qk/2] += (qk%2==0) ? -1 : 1;
+                            if(q[0]>=0 && q[0]<x+(n==0) && q[1]>=0 && q[1]<y+(n==1) && 
+                               q[2]>=0 && q[2]<z+(n==2)){
+                                unsigned char l = layers[n][q[0]*slabstride+q[1]*rowstride+q[2]];
+                                if(l!=0 && l<=layer){
+                                    wsum++;
+                                    sum += faces[n]->GetCell(q[0],q[1],q[2]);
                                 }
                             }
                         }
+                        if(wsum){
+                            faces[n]->SetCell(p[0],p[1],p[2],sum/wsum);
+                            layers[n][f] = layer+1;
+                        }
                     }
                 }
             }
+        );
+    }
+
+    //leave the layer tags all zero for the next step
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cellCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                unsigned int f = (unsigned int)cells[c].x*slabstride + 
+                                 (unsigned int)cells[c].y*rowstride + (unsigned int)cells[c].z;
+                layers[0][f] = 0;
+                layers[1][f] = 0;
+                layers[2][f] = 0;
+            }
         }
     );
-    for(unsigned int i=0; i<3; i++){
-        delete mark[i];
-        delete wallmark[i];
-    }
-    delete mark;
-    delete wallmark;
 }
 
+//Pressure is zero outside FLUID cells, so only band faces can see a gradient
 void FlipSim::SubtractPressureGradient(){
     unsigned int x = (unsigned int)m_dimensions.x; unsigned int y = (unsigned int)m_dimensions.y; 
     unsigned int z = (unsigned int)m_dimensions.z;
@@ -572,162 +1410,185 @@ void FlipSim::SubtractPressureGradient(){
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
     float h = 1.0f/maxd; //cell width
 
-    //for every x face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
+    const glm::vec3* cells = m_mgrid.m_bandCells.empty() ? NULL : &m_mgrid.m_bandCells[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_mgrid.m_bandCells.size()),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        if(i>0 && i<x){
-                            float pf = m_mgrid.m_P->GetCell(i,j,k);
-                            float pb = m_mgrid.m_P->GetCell(i-1,j,k);
-                            if(m_subcell && m_mgrid.m_L->GetCell(i,j,k) * 
-                               m_mgrid.m_L->GetCell(i-1,j,k) < 0.0f){
-                                if(m_mgrid.m_L->GetCell(i,j,k)<0.0f){
-                                    pf = m_mgrid.m_P->GetCell(i,j,k);
-                                }else{
-                                    pf = m_mgrid.m_L->GetCell(i,j,k)/
-                                         glm::min(1.0e-3f,m_mgrid.m_L->GetCell(i-1,j,k))*
-                                                  m_mgrid.m_P->GetCell(i-1,j,k);
-                                }
-                                if(m_mgrid.m_L->GetCell(i-1,j,k)<0.0f){
-                                    pb = m_mgrid.m_P->GetCell(i-1,j,k);
-                                }else{
-                                    pb = m_mgrid.m_L->GetCell(i-1,j,k)/
-                                         glm::min(1.0e-6f,m_mgrid.m_L->GetCell(i,j,k))*
-                                                  m_mgrid.m_P->GetCell(i,j,k);
-                                }               
-                            }
-                            float xval = m_mgrid.m_u_x->GetCell(i,j,k);
-                            xval -= (pf-pb)/h;
-                            m_mgrid.m_u_x->SetCell(i,j,k,xval);
-                        }
-                    }
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                unsigned int i = cells[c].x; unsigned int j = cells[c].y; 
+                unsigned int k = cells[c].z;
+                //x face
+                if(i>0 && i<x && j<y && k<z){
+                    float xval = m_mgrid.m_u_x->GetCell(i,j,k);
+                    xval -= PressureDifference(i,j,k, i-1,j,k)/h;
+                    m_mgrid.m_u_x->SetCell(i,j,k,xval);
                 }
-            } 
-        }
-    );
-    //for every y face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y+1; ++j){
-                    for(unsigned int k = 0; k < z; ++k){
-                        if(j>0 && j<y){
-                            float pf = m_mgrid.m_P->GetCell(i,j,k);
-                            float pb = m_mgrid.m_P->GetCell(i,j-1,k);   
-                            if(m_subcell && m_mgrid.m_L->GetCell(i,j,k) * 
-                               m_mgrid.m_L->GetCell(i,j-1,k) < 0.0f){
-                                if(m_mgrid.m_L->GetCell(i,j,k)<0.0f){
-                                    pf = m_mgrid.m_P->GetCell(i,j,k);
-                                }else{
-                                    pf = m_mgrid.m_L->GetCell(i,j,k)/
-                                         glm::min(1.0e-3f,m_mgrid.m_L->GetCell(i,j-1,k))*
-                                                  m_mgrid.m_P->GetCell(i,j-1,k);
-                                }
-                                if(m_mgrid.m_L->GetCell(i,j-1,k)<0.0f){
-                                    pb = m_mgrid.m_P->GetCell(i,j-1,k);
-                                }else{
-                                    pb = m_mgrid.m_L->GetCell(i,j-1,k)/
-                                         glm::min(1.0e-6f,m_mgrid.m_L->GetCell(i,j,k))*
-                                                  m_mgrid.m_P->GetCell(i,j,k);
-                                }   
-                            }
-                            float yval = m_mgrid.m_u_y->GetCell(i,j,k);
-                            yval -= (pf-pb)/h;
-                            m_mgrid.m_u_y->SetCell(i,j,k,yval);
-                        }       
-                    } 
+                //y face
+                if(j>0 && j<y && i<x && k<z){
+                    float yval = m_mgrid.m_u_y->GetCell(i,j,k);
+                    yval -= PressureDifference(i,j,k, i,j-1,k)/h;
+                    m_mgrid.m_u_y->SetCell(i,j,k,yval);
                 }
-            }
-        }
-    );
-    //for every z face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        if(k>0 && k<z){
-                            float pf = m_mgrid.m_P->GetCell(i,j,k);
-                            float pb = m_mgrid.m_P->GetCell(i,j,k-1);
-                            if(m_subcell && m_mgrid.m_L->GetCell(i,j,k) * 
-                               m_mgrid.m_L->GetCell(i,j,k-1) < 0.0f){
-                                if(m_mgrid.m_L->GetCell(i,j,k)<0.0f){
-                                    pf = m_mgrid.m_P->GetCell(i,j,k);
-                                }else{
-                                    pf = m_mgrid.m_L->GetCell(i,j,k)/
-                                         glm::min(1.0e-3f,m_mgrid.m_L->GetCell(i,j,k-1))*
-                                                  m_mgrid.m_P->GetCell(i,j,k-1);
-                                }
-                                if(m_mgrid.m_L->GetCell(i,j,k-1)<0.0f){
-                                    pb = m_mgrid.m_P->GetCell(i,j,k-1);
-                                }else{
-                                    pb = m_mgrid.m_L->GetCell(i,j,k-1)/
-                                         glm::min(1.0e-6f,m_mgrid.m_L->GetCell(i,j,k))*
-                                                  m_mgrid.m_P->GetCell(i,j,k);
-                                }   
-                            }
-                            float zval = m_mgrid.m_u_z->GetCell(i,j,k);
-                            zval -= (pf-pb)/h;
-                            m_mgrid.m_u_z->SetCell(i,j,k,zval);
-                        }       
-                    } 
+                //z face
+                if(k>0 && k<z && i<x && j<y){
+                    float zval = m_mgrid.m_u_z->GetCell(i,j,k);
+                    zval -= PressureDifference(i,j,k, i,j,k-1)/h;
+                    m_mgrid.m_u_z->SetCell(i,j,k,zval);
                 }
             }
         }
     );
 }
 
+//Pressure across the face between cell f and the cell b behind it. With subcell accuracy, a face
+//the liquid surface crosses takes a ghost pressure on its air side from the level set ratio
+float FlipSim::PressureDifference(const int& fi, const int& fj, const int& fk, const int& bi,
+                                  const int& bj, const int& bk){
+    float pf = m_mgrid.m_P->GetCell(fi,fj,fk);
+    float pb = m_mgrid.m_P->GetCell(bi,bj,bk);
+    if(!m_subcell){
+        return pf-pb;
+    }
+    float lf = m_mgrid.m_L->GetCell(fi,fj,fk);
+    float lb = m_mgrid.m_L->GetCell(bi,bj,bk);
+    if(lf*lb < 0.0f){
+        float ghostf = lf/glm::min(1.0e-3f,lb)*pb;
+        float ghostb = lb/glm::min(1.0e-6f,lf)*pf;
+        if(lf>=0.0f){
+            pf = ghostf;
+        }
+        if(lb>=0.0f){
+            pb = ghostb;
+        }
+    }
+    return pf-pb;
+}
+
 void FlipSim::ApplyExternalForces(){
     std::vector<glm::vec3> externalForces = m_scene->GetExternalForces();
     unsigned int numberOfExternalForces = externalForces.size();
-    unsigned int particlecount = m_particles.size();
+    unsigned int particlecount = m_particleset.Size();
+    glm::vec3* u = m_particleset.m_u;
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
                 for(unsigned int j=0; j<numberOfExternalForces; j++){
-                    m_particles[i]->m_u += externalForces[j]*m_stepsize;
+                    u[i] += externalForces[j]*m_dt;
                 }
             }
         }
     );
 }
 
+//Visits each pair of particle i with sorted particles begin to end once: the neighbors' masses
+//weighted by the density kernel are returned as i's sum, and i's mass weighted the same way goes
+//into each neighbor's density. Spans are fixed by the sort, so the four lane sums come out the
+//same no matter how the pass was scheduled
+static inline float AccumulateDensitySpan(const glm::vec3& p, const float& mass,
+                                          const glm::vec3* pp, const float* pmass,
+                                          float* pdensity, const unsigned int& begin,
+                                          const unsigned int& end, const float& invh2){
+    unsigned int n = begin;
+    float sum = 0.0f;
+#ifdef ARIEL_SIMD_DISPATCH
+    __m128 px = _mm_set1_ps(p.x); __m128 py = _mm_set1_ps(p.y); __m128 pz = _mm_set1_ps(p.z);
+    __m128 mi = _mm_set1_ps(mass);
+    __m128 one = _mm_set1_ps(1.0f); __m128 zero = _mm_setzero_ps();
+    __m128 scale = _mm_set1_ps(invh2);
+    __m128 lanes = zero;
+    for(; n+4<=end; n+=4){
+        __m128 dx = _mm_sub_ps(_mm_set_ps(pp[n+3].x, pp[n+2].x, pp[n+1].x, pp[n].x), px);
+        __m128 dy = _mm_sub_ps(_mm_set_ps(pp[n+3].y, pp[n+2].y, pp[n+1].y, pp[n].y), py);
+        __m128 dz = _mm_sub_ps(_mm_set_ps(pp[n+3].z, pp[n+2].z, pp[n+1].z, pp[n].z), pz);
+        __m128 sqd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx,dx), _mm_mul_ps(dy,dy)),
+                                _mm_mul_ps(dz,dz));
+        __m128 weight = _mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(sqd, scale)), zero);
+        lanes = _mm_add_ps(lanes, _mm_mul_ps(weight, _mm_loadu_ps(pmass+n)));
+        _mm_storeu_ps(pdensity+n, _mm_add_ps(_mm_loadu_ps(pdensity+n), _mm_mul_ps(weight, mi)));
+    }
+    float lane[4];
+    _mm_storeu_ps(lane, lanes);
+    sum = (lane[0]+lane[1]) + (lane[2]+lane[3]);
+#endif
+    for(; n<end; n++){
+        float weight = glm::max(1.0f-mathCore::Sqrlength(pp[n], p)*invh2, 0.0f);
+        sum = sum + weight*pmass[n];
+        pdensity[n] = pdensity[n] + weight*mass;
+    }
+    return sum;
+}
+
+//Density is each particle's kernel weighted sum of the masses in the 3x3x3 cells around it.
+//Every cell pairs its particles with itself and the 13 cells ahead of it, so each pair is visited
+//once and both ends take its weight. A cell writes into its own x slab and the next one, so even
+//slabs run in parallel first and odd slabs second
 void FlipSim::ComputeDensity(){
 
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
+    float h = 4.0f*m_density/maxd;
+    float invh2 = 1.0f/(h*h);
 
-    unsigned int particlecount = m_particles.size();
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                //Find neighbours
-                if(m_particles[i]->m_type==SOLID){
-                    m_particles[i]->m_density = 1.0f;
-                }else{
-                    glm::vec3 position = m_particles[i]->m_p;
-
-                    position.x = (int)glm::max(0.0f,glm::min((int)maxd-1.0f,(int)maxd*position.x));
-                    position.y = (int)glm::max(0.0f,glm::min((int)maxd-1.0f,(int)maxd*position.y));
-                    position.z = (int)glm::max(0.0f,glm::min((int)maxd-1.0f,(int)maxd*position.z));
-                    std::vector<Particle *> neighbors;
-                    neighbors = m_pgrid->GetCellNeighbors(position, glm::vec3(1));
-                    float weightsum = 0.0f;
-                    unsigned int neighborscount = neighbors.size();
-                    for(unsigned int m=0; m<neighborscount; m++){
-                        // if(neighbors[m]->m_type!=SOLID){
-                            float sqd = mathCore::Sqrlength(neighbors[m]->m_p, 
-                                                            m_particles[i]->m_p);
-                            //TODO: figure out a better density smooth approx than density/maxd
-                            float weight = neighbors[m]->m_mass * 
-                                           mathCore::Smooth(sqd, 4.0f*m_density/maxd);
-                            weightsum = weightsum + weight;
-                        // }
+    unsigned int particlecount = m_particleset.Size();
+    glm::vec3* pp = m_particleset.m_p; float* pmass = m_particleset.m_mass;
+    float* pdensity = m_particleset.m_density; int* ptype = m_particleset.m_type;
+    memset(pdensity, 0, particlecount*sizeof(float));
+
+    int dx = m_dimensions.x; int dy = m_dimensions.y; int dz = m_dimensions.z;
+    ParticleGrid* pgrid = m_pgrid;
+    for(int phase=0; phase<2; phase++){
+        unsigned int slabcount = (dx-phase+1)/2;
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,slabcount),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int s=r.begin(); s!=r.end(); ++s){
+                    int i = 2*s+phase;
+                    for(int j=0; j<dy; j++){
+                        for(int k=0; k<dz; k++){
+                            unsigned int begin, end;
+                            pgrid->GetCellRange(i, j, k, begin, end);
+                            if(begin==end){
+                                continue;
+                            }
+                            //forward spans: rest of this cell through k+1, then (i,j+1) and the
+                            //three columns of slab i+1, each over k-1 to k+1
+                            unsigned int spanstarts[5]; unsigned int spanends[5];
+                            unsigned int spancount = 0;
+                            unsigned int cellend;
+                            pgrid->GetColumnRange(i, j, k, k+1, begin, cellend);
+                            if(j+1<dy){
+                                pgrid->GetColumnRange(i, j+1, k-1, k+1, spanstarts[spancount],
+                                                      spanends[spancount]);
+                                spancount++;
+                            }
+                            for(int b=glm::max(j-1,0); i+1<dx && b<=glm::min(j+1,dy-1); b++){
+                                pgrid->GetColumnRange(i+1, b, k-1, k+1, spanstarts[spancount],
+                                                      spanends[spancount]);
+                                spancount++;
+                            }
+                            for(unsigned int n=begin; n<end; n++){
+                                glm::vec3 p = pp[n];
+                                float mass = pmass[n];
+                                float sum = mass;
+                                sum = sum + AccumulateDensitySpan(p, mass, pp, pmass, pdensity,
+                                                                  n+1, cellend, invh2);
+                                for(unsigned int c=0; c<spancount; c++){
+                                    sum = sum + AccumulateDensitySpan(p, mass, pp, pmass,
+                                                                      pdensity, spanstarts[c],
+                                                                      spanends[c], invh2);
+                                }
+                                pdensity[n] = pdensity[n] + sum;
+                            }
+                        }
                     }
-                    m_particles[i]->m_density = weightsum/m_max_density;
                 }
             }
+        );
+    }
+
+    float maxdensity = m_max_density;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int n=r.begin(); n!=r.end(); ++n){
+                pdensity[n] = ptype[n]==SOLID ? 1.0f : pdensity[n]/maxdensity;
+            }
         }
     );
 }
@@ -748,19 +1609,11 @@ glm::vec3 FlipSim::GetDimensions(){
     return m_dimensions;
 }
 
-sceneCore::Scene* FlipSim::GetScene(){
-    return m_scene; 
-}
-
-FlipTask::FlipTask(FlipSim* sim, bool dumpVDB, bool dumpOBJ, bool dumpPARTIO){
-    m_sim = sim;
-    m_dumpPARTIO = dumpPARTIO;
-    m_dumpOBJ = dumpOBJ;
-    m_dumpVDB = dumpVDB;
+SolverStats FlipSim::GetSolverStats(){
+    return m_solverStats;
 }
 
-tbb::task* FlipTask::execute(){
-    m_sim->Step(m_dumpVDB, m_dumpOBJ, m_dumpPARTIO);
-    return NULL;
+sceneCore::Scene* FlipSim::GetScene(){
+    return m_scene; 
 }
 }
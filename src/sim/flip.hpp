@@ -10,7 +10,15 @@
 #include <tbb/tbb.h>
 #include "../grid/macgrid.inl"
 #include "../grid/particlegrid.hpp"
+#include "../grid/particlepool.hpp"
 #include "../scene/scene.hpp"
+#include "flipsettings.hpp"
+#include "solverstats.hpp"
+#include "solver.inl"
+#include "checkpoint.hpp"
+#include "profiler.hpp"
+#include "simstream.hpp"
+#include "particleband.inl"
 
 namespace fluidCore {
 //====================================
@@ -20,19 +28,31 @@ namespace fluidCore {
 class FlipSim{
     public:
         FlipSim(const glm::vec3& maxres, const float& density, const float& stepsize, 
-                sceneCore::Scene* scene, const bool& verbose);
+                sceneCore::Scene* scene, const FlipSettings& settings, const bool& verbose);
         ~FlipSim();
 
         void Init();
+        //Runs the frame's phases as PhaseGraphs, so phases that don't depend on each other
+        //overlap
         void Step(bool saveVDB, bool saveOBJ, bool savePARTIO);
+        //Restores a checkpoint in place of Init, returns false and leaves the sim untouched if
+        //the checkpoint is unreadable or was written for a different grid
+        bool Resume(const std::string& filename);
+        //Publishes every stride'th liquid particle and the frame's stats to viewers attached on
+        //port after each step. Turns the profiler on if the scene didn't already
+        bool OpenStream(const int& port, const unsigned int& stride);
 
         std::vector<Particle*>* GetParticles();
         glm::vec3 GetDimensions();
         sceneCore::Scene* GetScene();
+        SolverStats GetSolverStats();
 
         int                                     m_frame;
 
     private:
+        void Substep();
+        void WriteCheckpoint(const std::string& filename);
+        float ComputeSubstepSize(const float& remaining, const int& substepsLeft);
         void StoreTempParticleVelocities();
         void CheckParticleSolidConstraints();
         void AdjustParticlesStuckInSolids();
@@ -41,17 +61,45 @@ class FlipSim{
         void SubtractPreviousGrid();
         void StorePreviousGrid();
         void SubtractPressureGradient();
+        float PressureDifference(const int& fi, const int& fj, const int& fk, const int& bi,
+                                 const int& bj, const int& bk);
         void ExtrapolateVelocity();
         void Project();
+        void InitializePressure();
+        void StorePreviousPressure();
         void SolvePicFlip();
         void AdvectParticles();
+        void UpdateActiveTiles();
+        //Measures the band from the current cell types and starts its interior off with the
+        //particles' own velocities
+        void InitParticleBand();
+        //Drops liquid particles that have sunk below the band and seeds empty cells that have
+        //come up into it
+        void ExchangeParticleBand();
+        //Fills every interior cell with points for exports to mesh, NULL when the band is off
+        ParticleSet* GatherParticleBandFill();
         bool IsCellFluid(const int& x, const int& y, const int& z);
+        unsigned int CountFluidCells();
 
         glm::vec3                               m_dimensions;
         std::vector<Particle*>                  m_particles;
+        ParticleSet                             m_particleset;
         MacGrid                                 m_mgrid;
         MacGrid                                 m_mgrid_previous;
         ParticleGrid*                           m_pgrid;
+        //per face direction, the extrapolation layer each face became valid in. Kept across 
+        //steps and left all zero between them
+        std::vector<unsigned char>              m_faceLayers[3];
+        SolverWorkspace                         m_solverWorkspace;
+        SplatWorkspace                          m_splatWorkspace;
+        //AdjustParticlesStuckInSolids scratch, grown to the particle count and reused
+        std::vector<char>                       m_particleInSolid;
+        std::vector<Particle*>                  m_stuckParticles;
+        //ResampleParticles scratch, the cell flags sized to the domain and left all clear
+        std::vector<char>                       m_resampleCells;
+        std::vector<char>                       m_resampleParticles;
+        //narrow band FLIP state, m_width is 0 and the grids NULL when the band is off
+        ParticleBand                            m_particleBand;
 
         int                                     m_subcell;
         float                                   m_density;
@@ -60,21 +108,18 @@ class FlipSim{
         float                                   m_picflipratio;
 
         sceneCore::Scene*                       m_scene;
+        FlipSettings                            m_settings;
+        SolverStats                             m_solverStats;
+        Profiler                                m_profiler;
+        SimStreamServer*                        m_stream;
 
         bool                                    m_verbose;
+        bool                                    m_reorderDue;   //reorder particle memory next sort
+        int                                     m_substepsSinceResample;
         float                                   m_stepsize;
-};
-
-class FlipTask: public tbb::task {
-    public:
-        FlipTask(FlipSim* sim, bool dumpVDB, bool dumpOBJ, bool dumpPARTIO);
-
-        tbb::task* execute();
-    private:
-        FlipSim*                                m_sim;
-        bool                                    m_dumpPARTIO;
-        bool                                    m_dumpOBJ;
-        bool                                    m_dumpVDB;
+        float                                   m_dt;           //current substep length
+        float                                   m_time;         //geometry time in frames
+        float                                   m_solidInterpolation;
 };
 }
 
@@ -0,0 +1,52 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: flipsettings.hpp
+// Optional sim settings read from the scene file
+
+#ifndef FLIPSETTINGS_HPP
+#define FLIPSETTINGS_HPP
+
+namespace fluidCore {
+//====================================
+// Struct Declarations
+//====================================
+
+enum PreconditionerType{MIC, WAVEFRONT_MIC, MULTIGRID};
+enum AdvectionScheme{FORWARD_EULER, RK2, RK3};
+
+struct FlipSettings{
+    bool                    m_sparse;           //only store grid tiles near particles
+    bool                    m_fusedSolver;      //fused PCG over a compact fluid cell list
+    PreconditionerType      m_preconditioner;   //MIC(0), wavefront MIC(0) or multigrid
+    bool                    m_warmStart;        //seed pressure from the previous step
+    bool                    m_scatterSplat;     //P2G by scattering particles instead of gathering
+    AdvectionScheme         m_advection;        //particle integrator through the grid velocity
+    float                   m_cfl;              //max cells moved per advection substep, 0 is off
+    int                     m_maxSubsteps;      //cap on advection substeps per step
+    float                   m_frameLength;      //seconds per output frame, 0 is one step a frame
+    float                   m_frameCfl;         //max cells moved per solver substep in a frame
+    int                     m_maxFrameSubsteps; //cap on solver substeps per frame
+    int                     m_checkpointInterval; //frames between checkpoints, 0 is off
+    bool                    m_deterministic;    //bitwise reproducible runs for any thread count
+    int                     m_extrapolationLayers; //face layers velocity is extended into solids
+    int                     m_reorderInterval;  //frames between particle memory reorders, 0 is off
+    bool                    m_sdfDepenetration; //resolve solid collisions from the SDF where it can
+    int                     m_resampleInterval; //substeps between particle resamples, 0 is off
+    float                   m_resampleTolerance; //density error that triggers resampling, 0 is all
+    int                     m_particleBandWidth; //cells of particles under the surface, 0 is all
+    float                   m_picflipRatio;     //share of FLIP in the velocity update, 0 is PIC
+
+    //Initializer
+    FlipSettings(): m_sparse(false), m_fusedSolver(true), m_preconditioner(MIC), 
+                    m_warmStart(true), m_scatterSplat(true), m_advection(FORWARD_EULER), 
+                    m_cfl(1.0f), m_maxSubsteps(8), m_frameLength(0.0f), m_frameCfl(3.0f),
+                    m_maxFrameSubsteps(16), m_checkpointInterval(0), 
+                    m_deterministic(false), m_extrapolationLayers(1), m_reorderInterval(8), 
+                    m_sdfDepenetration(false), m_resampleInterval(1), 
+                    m_resampleTolerance(0.0f), m_particleBandWidth(0),
+                    m_picflipRatio(.95f){};
+};
+}
+
+#endif
@@ -0,0 +1,326 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: multigrid.inl
+// Geometric multigrid V-cycle, used as a preconditioner for the PCG pressure solve
+
+#ifndef MULTIGRID_INL
+#define MULTIGRID_INL
+
+#include <tbb/tbb.h>
+#include <vector>
+#include "../grid/macgrid.inl"
+
+#define MULTIGRID_SMOOTH_ITERATIONS 2
+#define MULTIGRID_COARSE_ITERATIONS 32
+#define MULTIGRID_MIN_DIMENSION 8
+#define MULTIGRID_JACOBI_WEIGHT 0.666667f
+
+namespace fluidCore {
+//====================================
+// Struct and Function Declarations
+//====================================
+
+//One level of the multigrid hierarchy. Level 0 borrows the sim's cell types and reads x/b from
+//the solver's vectors, coarser levels own everything
+struct MultigridLevel{
+    glm::vec3       m_dimensions;
+    float           m_scale; //operator scale, 1/h^2 on the finest level
+    Grid<celltype>*      m_A;
+    Grid<float>*    m_diag;
+    Grid<float>*    m_x;
+    Grid<float>*    m_b;
+    Grid<float>*    m_r;
+};
+
+//Forward declarations for externed inlineable methods
+extern inline void BuildMultigrid(MacGrid& mgrid, const int& subcell,
+                                  std::vector<MultigridLevel>& levels);
+extern inline void AllocateMultigrid(MacGrid& mgrid, std::vector<MultigridLevel>& levels);
+extern inline void DeleteMultigrid(std::vector<MultigridLevel>& levels);
+extern inline void ApplyMultigridPreconditioner(std::vector<MultigridLevel>& levels,
+                                                Grid<float>* Z, Grid<float>* R);
+//defined in solver.inl
+inline float ADiag(Grid<celltype>* A, Grid<auxfloat>* L, int i, int j, int k, glm::vec3 dimensions,
+                   int subcell);
+inline void MultigridBuildDiagonal(MultigridLevel& level, Grid<auxfloat>* L, const int& subcell);
+inline void MultigridResidual(MultigridLevel& level);
+inline void MultigridSmooth(MultigridLevel& level, const int& iterations);
+inline void MultigridRestrict(MultigridLevel& fine, MultigridLevel& coarse);
+inline void MultigridProlongate(MultigridLevel& coarse, MultigridLevel& fine);
+inline void MultigridVCycle(std::vector<MultigridLevel>& levels, const unsigned int& l);
+
+//====================================
+// Function Implementations
+//====================================
+
+//Builds the level hierarchy. Each coarse cell covers 2x2x2 fine cells and is AIR if any child is
+//AIR, FLUID if any child is FLUID, and SOLID otherwise, so the free surface stays a Dirichlet
+//boundary all the way down. The finest level uses the same ghost fluid diagonal as ComputeAx.
+//Level sizes only depend on the domain, so levels left over from an earlier solve of the same 
+//domain are zeroed and reused instead of reallocated
+void BuildMultigrid(MacGrid& mgrid, const int& subcell, std::vector<MultigridLevel>& levels){
+    if(levels.empty() || levels[0].m_dimensions!=mgrid.m_dimensions){
+        AllocateMultigrid(mgrid, levels);
+    }
+    levels[0].m_A = mgrid.m_A;
+    levels[0].m_diag->SetActiveTiles(mgrid.m_A->GetActiveTiles());
+    levels[0].m_r->SetActiveTiles(mgrid.m_A->GetActiveTiles());
+    levels[0].m_diag->Clear();
+    levels[0].m_r->Clear();
+    MultigridBuildDiagonal(levels[0], mgrid.m_L, subcell);
+
+    for(unsigned int l=1; l<levels.size(); l++){
+        MultigridLevel& parent = levels[l-1];
+        MultigridLevel& coarse = levels[l];
+        coarse.m_diag->Clear();
+        coarse.m_x->Clear();
+        coarse.m_b->Clear();
+        coarse.m_r->Clear();
+
+        int fx = (int)parent.m_dimensions.x; int fy = (int)parent.m_dimensions.y;
+        int fz = (int)parent.m_dimensions.z;
+        int cx = (int)coarse.m_dimensions.x; int cy = (int)coarse.m_dimensions.y;
+        int cz = (int)coarse.m_dimensions.z;
+        Grid<celltype>* fineA = parent.m_A;
+        Grid<celltype>* coarseA = coarse.m_A;
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cx),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    for(int j=0; j<cy; ++j){
+                        for(int k=0; k<cz; ++k){
+                            bool air = false;
+                            bool fluid = false;
+                            for(int ci=2*i; ci<glm::min(2*(int)i+2,fx); ci++){
+                                for(int cj=2*j; cj<glm::min(2*j+2,fy); cj++){
+                                    for(int ck=2*k; ck<glm::min(2*k+2,fz); ck++){
+                                        int type = fineA->GetCell(ci,cj,ck);
+                                        air = air || type==AIR;
+                                        fluid = fluid || type==FLUID;
+                                    }
+                                }
+                            }
+                            if(air){
+                                coarseA->SetCell(i,j,k,AIR);
+                            }else if(fluid){
+                                coarseA->SetCell(i,j,k,FLUID);
+                            }else{
+                                coarseA->SetCell(i,j,k,SOLID);
+                            }
+                        }
+                    }
+                }
+            }
+        );
+        MultigridBuildDiagonal(coarse, NULL, 0);
+    }
+}
+
+//Creates zeroed levels down to MULTIGRID_MIN_DIMENSION for mgrid's domain
+void AllocateMultigrid(MacGrid& mgrid, std::vector<MultigridLevel>& levels){
+    DeleteMultigrid(levels);
+    float n = glm::max(glm::max(mgrid.m_dimensions.x, mgrid.m_dimensions.y),
+                       mgrid.m_dimensions.z);
+
+    MultigridLevel fine;
+    fine.m_dimensions = mgrid.m_dimensions;
+    fine.m_scale = n*n;
+    fine.m_A = mgrid.m_A;
+    fine.m_diag = new Grid<float>(fine.m_dimensions, 0.0f, mgrid.m_sparse);
+    fine.m_r = new Grid<float>(fine.m_dimensions, 0.0f, mgrid.m_sparse);
+    fine.m_x = NULL;
+    fine.m_b = NULL;
+    levels.push_back(fine);
+
+    while(glm::min(glm::min(levels.back().m_dimensions.x, levels.back().m_dimensions.y),
+                   levels.back().m_dimensions.z) >= MULTIGRID_MIN_DIMENSION){
+        MultigridLevel& parent = levels.back();
+        MultigridLevel coarse;
+        coarse.m_dimensions = glm::ceil(parent.m_dimensions/2.0f);
+        //with piecewise constant transfers the Galerkin coarse operator is the 7 point stencil at
+        //half the fine scale, not the quarter a straight rediscretization would give
+        coarse.m_scale = parent.m_scale/2.0f;
+        coarse.m_A = new Grid<celltype>(coarse.m_dimensions, AIR);
+        coarse.m_diag = new Grid<float>(coarse.m_dimensions, 0.0f);
+        coarse.m_x = new Grid<float>(coarse.m_dimensions, 0.0f);
+        coarse.m_b = new Grid<float>(coarse.m_dimensions, 0.0f);
+        coarse.m_r = new Grid<float>(coarse.m_dimensions, 0.0f);
+        levels.push_back(coarse);
+    }
+}
+
+void DeleteMultigrid(std::vector<MultigridLevel>& levels){
+    for(unsigned int l=0; l<levels.size(); l++){
+        //level 0 borrows A, x and b
+        if(l>0){
+            delete levels[l].m_A;
+            delete levels[l].m_x;
+            delete levels[l].m_b;
+        }
+        delete levels[l].m_diag;
+        delete levels[l].m_r;
+    }
+    levels.clear();
+}
+
+//Z = M^-1 R, where M^-1 is one symmetric V-cycle with a zero initial guess
+void ApplyMultigridPreconditioner(std::vector<MultigridLevel>& levels, Grid<float>* Z,
+                                  Grid<float>* R){
+    levels[0].m_x = Z;
+    levels[0].m_b = R;
+    MultigridVCycle(levels, 0);
+    levels[0].m_x = NULL;
+    levels[0].m_b = NULL;
+}
+
+void MultigridBuildDiagonal(MultigridLevel& level, Grid<auxfloat>* L, const int& subcell){
+    Grid<celltype>* A = level.m_A;
+    Grid<float>* diag = level.m_diag;
+    glm::vec3 dimensions = level.m_dimensions;
+    A->ForEachActiveBlock(dimensions,
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            for(unsigned int i=lo.x; i<hi.x; ++i){
+                for(unsigned int j=lo.y; j<hi.y; ++j){
+                    for(unsigned int k=lo.z; k<hi.z; ++k){
+                        if(A->GetCell(i,j,k)==FLUID){
+                            diag->SetCell(i,j,k, ADiag(A,L,i,j,k,dimensions,subcell));
+                        }
+                    }
+                }
+            }
+        }
+    );
+}
+
+//r = b - Ax on FLUID cells, 0 elsewhere
+void MultigridResidual(MultigridLevel& level){
+    Grid<celltype>* A = level.m_A;
+    Grid<float>* diag = level.m_diag;
+    Grid<float>* X = level.m_x;
+    Grid<float>* B = level.m_b;
+    Grid<float>* R = level.m_r;
+    float scale = level.m_scale;
+    int x = (int)level.m_dimensions.x; int y = (int)level.m_dimensions.y;
+    int z = (int)level.m_dimensions.z;
+    A->ForEachActiveBlock(level.m_dimensions,
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            for(int i=lo.x; i<hi.x; ++i){
+                for(int j=lo.y; j<hi.y; ++j){
+                    for(int k=lo.z; k<hi.z; ++k){
+                        if(A->GetCell(i,j,k)!=FLUID){
+                            R->SetCell(i,j,k,0.0f);
+                            continue;
+                        }
+                        float ax = diag->GetCell(i,j,k)*X->GetCell(i,j,k);
+                        if(i>0 && A->GetCell(i-1,j,k)==FLUID){ ax -= X->GetCell(i-1,j,k); }
+                        if(i<x-1 && A->GetCell(i+1,j,k)==FLUID){ ax -= X->GetCell(i+1,j,k); }
+                        if(j>0 && A->GetCell(i,j-1,k)==FLUID){ ax -= X->GetCell(i,j-1,k); }
+                        if(j<y-1 && A->GetCell(i,j+1,k)==FLUID){ ax -= X->GetCell(i,j+1,k); }
+                        if(k>0 && A->GetCell(i,j,k-1)==FLUID){ ax -= X->GetCell(i,j,k-1); }
+                        if(k<z-1 && A->GetCell(i,j,k+1)==FLUID){ ax -= X->GetCell(i,j,k+1); }
+                        R->SetCell(i,j,k, B->GetCell(i,j,k) - scale*ax);
+                    }
+                }
+            }
+        }
+    );
+}
+
+//Weighted Jacobi. Each sweep computes the full residual before updating, so the result does not
+//depend on thread scheduling and the smoother stays symmetric
+void MultigridSmooth(MultigridLevel& level, const int& iterations){
+    Grid<celltype>* A = level.m_A;
+    Grid<float>* diag = level.m_diag;
+    Grid<float>* X = level.m_x;
+    Grid<float>* R = level.m_r;
+    float scale = level.m_scale;
+    for(int iteration=0; iteration<iterations; iteration++){
+        MultigridResidual(level);
+        A->ForEachActiveBlock(level.m_dimensions,
+            [=](const glm::vec3& lo, const glm::vec3& hi){
+                for(unsigned int i=lo.x; i<hi.x; ++i){
+                    for(unsigned int j=lo.y; j<hi.y; ++j){
+                        for(unsigned int k=lo.z; k<hi.z; ++k){
+                            float d = diag->GetCell(i,j,k);
+                            if(A->GetCell(i,j,k)==FLUID && d>0.0f){
+                                X->SetCell(i,j,k, X->GetCell(i,j,k) + MULTIGRID_JACOBI_WEIGHT*
+                                                  R->GetCell(i,j,k)/(scale*d));
+                            }
+                        }
+                    }
+                }
+            }
+        );
+    }
+}
+
+//coarse b = average of the fine residuals under each coarse cell, and clears coarse x
+void MultigridRestrict(MultigridLevel& fine, MultigridLevel& coarse){
+    Grid<float>* fineR = fine.m_r;
+    Grid<float>* coarseB = coarse.m_b;
+    Grid<float>* coarseX = coarse.m_x;
+    int fx = (int)fine.m_dimensions.x; int fy = (int)fine.m_dimensions.y;
+    int fz = (int)fine.m_dimensions.z;
+    int cy = (int)coarse.m_dimensions.y; int cz = (int)coarse.m_dimensions.z;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,(unsigned int)coarse.m_dimensions.x),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                for(int j=0; j<cy; ++j){
+                    for(int k=0; k<cz; ++k){
+                        float sum = 0.0f;
+                        for(int ci=2*i; ci<glm::min(2*(int)i+2,fx); ci++){
+                            for(int cj=2*j; cj<glm::min(2*j+2,fy); cj++){
+                                for(int ck=2*k; ck<glm::min(2*k+2,fz); ck++){
+                                    sum += fineR->GetCell(ci,cj,ck);
+                                }
+                            }
+                        }
+                        coarseB->SetCell(i,j,k, sum/8.0f);
+                        coarseX->SetCell(i,j,k, 0.0f);
+                    }
+                }
+            }
+        }
+    );
+}
+
+//fine x += coarse x, piecewise constant over each coarse cell
+void MultigridProlongate(MultigridLevel& coarse, MultigridLevel& fine){
+    Grid<celltype>* fineA = fine.m_A;
+    Grid<float>* fineX = fine.m_x;
+    Grid<float>* coarseX = coarse.m_x;
+    fineA->ForEachActiveBlock(fine.m_dimensions,
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            for(unsigned int i=lo.x; i<hi.x; ++i){
+                for(unsigned int j=lo.y; j<hi.y; ++j){
+                    for(unsigned int k=lo.z; k<hi.z; ++k){
+                        if(fineA->GetCell(i,j,k)==FLUID){
+                            fineX->SetCell(i,j,k, fineX->GetCell(i,j,k) +
+                                                  coarseX->GetCell(i/2,j/2,k/2));
+                        }
+                    }
+                }
+            }
+        }
+    );
+}
+
+void MultigridVCycle(std::vector<MultigridLevel>& levels, const unsigned int& l){
+    MultigridLevel& level = levels[l];
+    if(l==0){
+        level.m_x->Clear();
+    }
+    if(l==levels.size()-1){
+        MultigridSmooth(level, MULTIGRID_COARSE_ITERATIONS);
+        return;
+    }
+    MultigridSmooth(level, MULTIGRID_SMOOTH_ITERATIONS);
+    MultigridResidual(level);
+    MultigridRestrict(level, levels[l+1]);
+    MultigridVCycle(levels, l+1);
+    MultigridProlongate(levels[l+1], level);
+    MultigridSmooth(level, MULTIGRID_SMOOTH_ITERATIONS);
+}
+}
+
+#endif
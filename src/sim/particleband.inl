@@ -0,0 +1,282 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: particleband.inl
+// Breakout file for narrow band FLIP, where particles are only kept near the liquid surface
+
+#ifndef PARTICLEBAND_INL
+#define PARTICLEBAND_INL
+
+#include <tbb/tbb.h>
+#include "../grid/macgrid.inl"
+#include "../grid/gridutils.inl"
+#include "../utilities/utilities.h"
+#include "particlegridoperations.inl"
+
+namespace fluidCore {
+//====================================
+// Struct and Function Declarations
+//====================================
+
+//Liquid more than m_width cells below the surface has no particles and is carried on the grid
+//instead. Depths are signed, negative in liquid, and counted in cells along the grid axes
+//(chessboard distance), which never overestimates how deep a cell is. AIR and SOLID cells
+//are all +1
+struct ParticleBand{
+    int                         m_width;
+    Grid<float>*                m_phi;      //depth advected to the current substep
+    Grid<float>*                m_depth;    //depth measured from the current substep's cell types
+    //velocities advected to the current substep, only meaningful on faces touching the interior
+    Grid<float>*                m_u_x;
+    Grid<float>*                m_u_y;
+    Grid<float>*                m_u_z;
+    //cells m_phi was last advected at, in slab order. m_phi is +1 everywhere else, so every 
+    //interior cell is in here
+    std::vector<glm::vec3>      m_cells;
+    //MeasureParticleBandDepth's per cell distances, kept across substeps
+    std::vector<unsigned char>  m_distances;
+    std::vector<unsigned char>  m_scratch;
+};
+
+//Forward declarations for externed inlineable methods
+extern inline ParticleBand CreateParticleBand(const glm::vec3& dimensions, const int& width);
+extern inline void ClearParticleBand(ParticleBand& band);
+//Cells with m_phi below this are liquid whether or not any particles are in them
+inline float GetParticleBandInteriorLevel(const ParticleBand& band);
+extern inline void MeasureParticleBandDepth(ParticleBand& band, Grid<celltype>* A,
+                                            const glm::vec3& dimensions);
+//Carries the measured depth and the grid velocity through the grid velocity over dt, into
+//m_phi and the band's face velocities. Only mgrid's narrow band cells are advected, which
+//become the band's m_cells
+extern inline void AdvectParticleBand(ParticleBand& band, MacGrid* mgrid, const float& dt);
+//Overwrites splatted velocities on faces touching the interior, where there are too few
+//particles for the splat to mean anything
+extern inline void ApplyParticleBandVelocity(ParticleBand& band, MacGrid* mgrid);
+//Rebuilds m_cells from m_phi, for when m_phi was loaded rather than advected
+extern inline void CollectParticleBandCells(ParticleBand& band, const glm::vec3& dimensions);
+//Calls visitor(n,i,j,k) once for each face along n touching an interior cell. Each face is 
+//visited by exactly one interior cell, its low faces and any high faces no other interior
+//cell owns, so visitors can write faces without colliding
+template <typename F> void ForEachParticleBandInteriorFace(const ParticleBand& band, 
+                                                           const glm::vec3& dimensions,
+                                                           const F& visitor);
+
+//====================================
+// Function Implementations
+//====================================
+
+ParticleBand CreateParticleBand(const glm::vec3& dimensions, const int& width){
+    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
+    ParticleBand band;
+    band.m_width = width;
+    band.m_phi = new Grid<float>(glm::vec3(x,y,z), 1.0f);
+    band.m_depth = new Grid<float>(glm::vec3(x,y,z), 1.0f);
+    band.m_u_x = new Grid<float>(glm::vec3(x+1,y,z), 0.0f);
+    band.m_u_y = new Grid<float>(glm::vec3(x,y+1,z), 0.0f);
+    band.m_u_z = new Grid<float>(glm::vec3(x,y,z+1), 0.0f);
+    band.m_distances.resize(x*y*z);
+    band.m_scratch.resize(x*y*z);
+    return band;
+}
+
+void ClearParticleBand(ParticleBand& band){
+    delete band.m_phi;
+    delete band.m_depth;
+    delete band.m_u_x;
+    delete band.m_u_y;
+    delete band.m_u_z;
+    band.m_cells.clear();
+    band.m_distances.clear();
+    band.m_scratch.clear();
+}
+
+float GetParticleBandInteriorLevel(const ParticleBand& band){
+    return -(float)(band.m_width-1);
+}
+
+//Separable chessboard distance to the nearest AIR cell, capped a couple of cells past the band.
+//Along z it's a scan each way per column, then y and x each take the best neighbor within the
+//cap, the same axis at a time dilation BuildCellLists does
+void MeasureParticleBandDepth(ParticleBand& band, Grid<celltype>* A,
+                              const glm::vec3& dimensions){
+    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
+    int cap = band.m_width+2;
+    unsigned char* dz = &band.m_distances[0];
+    unsigned char* dy = &band.m_scratch[0];
+    tbb::parallel_for(tbb::blocked_range<int>(0,x),
+        [=](const tbb::blocked_range<int>& r){
+            for(int i=r.begin(); i!=r.end(); ++i){
+                for(int j=0; j<y; j++){
+                    unsigned char* column = dz+(i*y+j)*z;
+                    int d = cap;
+                    for(int k=0; k<z; k++){
+                        d = A->GetCell(i,j,k)==AIR ? 0 : glm::min(d+1, cap);
+                        column[k] = d;
+                    }
+                    d = cap;
+                    for(int k=z-1; k>=0; k--){
+                        d = column[k]==0 ? 0 : glm::min(d+1, cap);
+                        column[k] = glm::min((int)column[k], d);
+                    }
+                }
+            }
+        }, tbb::static_partitioner()
+    );
+    for(unsigned int pass=0; pass<2; pass++){
+        unsigned char* src = pass==0 ? dz : dy;
+        unsigned char* dst = pass==0 ? dy : dz;
+        int stride = pass==0 ? z : y*z;
+        int extent = pass==0 ? y : x;
+        tbb::parallel_for(tbb::blocked_range<int>(0,x),
+            [=](const tbb::blocked_range<int>& r){
+                for(int i=r.begin(); i!=r.end(); ++i){
+                    for(int j=0; j<y; j++){
+                        for(int k=0; k<z; k++){
+                            int c = (i*y+j)*z+k;
+                            int a = pass==0 ? j : i;
+                            int best = src[c];
+                            for(int d=glm::max(0,a-cap); d<=glm::min(extent-1,a+cap); d++){
+                                best = glm::min(best, glm::max(glm::abs(d-a),
+                                                               (int)src[c+(d-a)*stride]));
+                            }
+                            dst[c] = best;
+                        }
+                    }
+                }
+            }, tbb::static_partitioner()
+        );
+    }
+    Grid<float>* depth = band.m_depth;
+    tbb::parallel_for(tbb::blocked_range<int>(0,x),
+        [=](const tbb::blocked_range<int>& r){
+            for(int i=r.begin(); i!=r.end(); ++i){
+                for(int j=0; j<y; j++){
+                    for(int k=0; k<z; k++){
+                        float d = A->GetCell(i,j,k)==FLUID ? -(float)dz[(i*y+j)*z+k] : 1.0f;
+                        depth->SetCell(i,j,k, d);
+                    }
+                }
+            }
+        }, tbb::static_partitioner()
+    );
+}
+
+void AdvectParticleBand(ParticleBand& band, MacGrid* mgrid, const float& dt){
+    int x = (int)mgrid->m_dimensions.x; int y = (int)mgrid->m_dimensions.y;
+    int z = (int)mgrid->m_dimensions.z;
+    float maxd = glm::max(glm::max(x,y),z);
+    glm::vec3 dimensions(x,y,z);
+    Grid<float>* phi = band.m_phi;
+    Grid<float>* depth = band.m_depth;
+
+    //cells that have left the band go back to +1 before the new band is advected, which is
+    //cheaper than sweeping the domain since the band barely moves between substeps
+    const glm::vec3* previous = band.m_cells.empty() ? NULL : &band.m_cells[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,band.m_cells.size()),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                phi->SetCell(previous[c], 1.0f);
+            }
+        }
+    );
+
+    //band cells reach m_dimensions on every axis, only the ones inside the domain are cells
+    band.m_cells.clear();
+    unsigned int bandCount = mgrid->m_bandCells.size();
+    for(unsigned int c=0; c<bandCount; c++){
+        glm::vec3 cell = mgrid->m_bandCells[c];
+        if(cell.x<x && cell.y<y && cell.z<z){
+            band.m_cells.push_back(cell);
+        }
+    }
+    const glm::vec3* cells = band.m_cells.empty() ? NULL : &band.m_cells[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,band.m_cells.size()),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                glm::vec3 p = (cells[c]+glm::vec3(0.5f))/maxd;
+                glm::vec3 back = p - dt*InterpolateVelocity(p, mgrid);
+                phi->SetCell(cells[c], Interpolate(depth, back*maxd-glm::vec3(0.5f), 
+                                                   dimensions));
+            }
+        }
+    );
+
+    //faces only carry a velocity where they border the interior, the rest are never read
+    Grid<float>* faces[3] = {band.m_u_x, band.m_u_y, band.m_u_z};
+    ForEachParticleBandInteriorFace(band, dimensions,
+        [=](const int& n, const int& i, const int& j, const int& k){
+            glm::vec3 p = glm::vec3(i,j,k) + glm::vec3(0.5f);
+            p[n] -= 0.5f;
+            p = p/maxd;
+            glm::vec3 back = p - dt*InterpolateVelocity(p, mgrid);
+            faces[n]->SetCell(i,j,k, InterpolateVelocity(back, mgrid)[n]);
+        }
+    );
+}
+
+void ApplyParticleBandVelocity(ParticleBand& band, MacGrid* mgrid){
+    Grid<float>* source[3] = {band.m_u_x, band.m_u_y, band.m_u_z};
+    Grid<float>* target[3] = {mgrid->m_u_x, mgrid->m_u_y, mgrid->m_u_z};
+    ForEachParticleBandInteriorFace(band, mgrid->m_dimensions,
+        [=](const int& n, const int& i, const int& j, const int& k){
+            target[n]->SetCell(i,j,k, source[n]->GetCell(i,j,k));
+        }
+    );
+}
+
+void CollectParticleBandCells(ParticleBand& band, const glm::vec3& dimensions){
+    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
+    Grid<float>* phi = band.m_phi;
+    std::vector< std::vector<glm::vec3> > slabs(x);
+    tbb::parallel_for(tbb::blocked_range<int>(0,x),
+        [&](const tbb::blocked_range<int>& r){
+            for(int i=r.begin(); i!=r.end(); ++i){
+                for(int j=0; j<y; j++){
+                    for(int k=0; k<z; k++){
+                        if(phi->GetCell(i,j,k)<1.0f){
+                            slabs[i].push_back(glm::vec3(i,j,k));
+                        }
+                    }
+                }
+            }
+        }
+    );
+    band.m_cells.clear();
+    for(int i=0; i<x; i++){
+        band.m_cells.insert(band.m_cells.end(), slabs[i].begin(), slabs[i].end());
+    }
+}
+
+//====================================
+// Template Implementations
+//====================================
+
+template <typename F> void ForEachParticleBandInteriorFace(const ParticleBand& band, 
+                                                           const glm::vec3& dimensions,
+                                                           const F& visitor){
+    float level = GetParticleBandInteriorLevel(band);
+    Grid<float>* phi = band.m_phi;
+    const glm::vec3* cells = band.m_cells.empty() ? NULL : &band.m_cells[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,band.m_cells.size()),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                glm::vec3 cell = cells[c];
+                if(phi->GetCell(cell)>=level){
+                    continue;
+                }
+                int i = cell.x; int j = cell.y; int k = cell.z;
+                for(int n=0; n<3; n++){
+                    visitor(n, i, j, k);
+                    glm::vec3 above = cell;
+                    above[n] += 1.0f;
+                    if(above[n]>=dimensions[n] || phi->GetCell(above)>=level){
+                        visitor(n, (int)above.x, (int)above.y, (int)above.z);
+                    }
+                }
+            }
+        }
+    );
+}
+}
+
+#endif
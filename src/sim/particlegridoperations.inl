@@ -13,28 +13,49 @@
 #include "../grid/levelset.hpp"
 #include "../utilities/utilities.h"
 #include "../grid/gridutils.inl"
+#include "simdinterpolation.inl"
+#include "flipsettings.hpp"
 
 namespace fluidCore {
 //====================================
 // Struct and Function Declarations
 //====================================
 
+//Weight and momentum accumulators ScatterParticlesToMACGrid works in, one pair per face axis.
+//Owned by the sim and kept across substeps like the SolverWorkspace; grids are created on 
+//first use
+struct SplatWorkspace{
+    Grid<float>*    m_sumw[3];
+    Grid<float>*    m_sumu[3];
+};
+
 //Forward declarations for externed inlineable methods
-extern inline void SplatParticlesToMACGrid(ParticleGrid* sgrid, 
-                                           std::vector<Particle*>& particles,
-                                           MacGrid* mgrid);
-extern inline void SplatMACGridToParticles(std::vector<Particle*>& particles, 
+extern inline SplatWorkspace CreateSplatWorkspace();
+extern inline void ClearSplatWorkspace(SplatWorkspace& workspace);
+extern inline void SplatParticlesToMACGrid(ParticleGrid* sgrid, ParticleSet& particles,
                                            MacGrid* mgrid);
+extern inline void ScatterParticlesToMACGrid(ParticleGrid* sgrid, ParticleSet& particles,
+                                             MacGrid* mgrid, SplatWorkspace& workspace);
+extern inline void SplatMACGridToParticles(ParticleSet& particles, MacGrid* mgrid);
+extern inline void AdvectParticlePositions(ParticleSet& particles, MacGrid* mgrid, 
+                                           const float& dt, const AdvectionScheme& scheme);
+extern inline float MaxGridSpeed(MacGrid* mgrid);
+inline float MaxFaceVelocity(Grid<float>* u, const glm::vec3& extent);
 extern inline void EnforceBoundaryVelocity(MacGrid* mgrid);
 extern inline glm::vec3 InterpolateVelocity(glm::vec3 p, MacGrid* mgrid);
-inline float CheckWall(Grid<int>* A, const int& x, const int& y, const int& z);
+inline float CheckWall(Grid<celltype>* A, const int& x, const int& y, const int& z);
 inline float Interpolate(Grid<float>* q, glm::vec3 p, glm::vec3 n);
+inline void ScatterToFaces(Grid<float>* sumw, Grid<float>* sumu, const glm::vec3& pos, 
+                           const float& mass, const float& u, const glm::vec3& lo, 
+                           const glm::vec3& hi, const glm::vec3& offset);
+inline void NormalizeFaces(Grid<float>* target, Grid<float>* sumw, Grid<float>* sumu, 
+                           const glm::vec3& extent);
     
 //====================================
 // Function Implementations
 //====================================
 
-float CheckWall(Grid<int>* A, const int& x, const int& y, const int& z){
+float CheckWall(Grid<celltype>* A, const int& x, const int& y, const int& z){
     if(A->GetCell(x,y,z)==SOLID){ //inside wall
         return 1.0f;
     }else{
@@ -42,63 +63,40 @@ float CheckWall(Grid<int>* A, const int& x, const int& y, const int& z){
     }
 }
 
+//Only band faces can be nonzero, so only those are visited. Each band cell owns its low x, y and z
+//faces, so no two iterations touch the same face
 void EnforceBoundaryVelocity(MacGrid* mgrid){
     unsigned int x = (unsigned int)mgrid->m_dimensions.x;
     unsigned int y = (unsigned int)mgrid->m_dimensions.y;
     unsigned int z = (unsigned int)mgrid->m_dimensions.z;
-
-    //for every x face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
+    const glm::vec3* cells = mgrid->m_bandCells.empty() ? NULL : &mgrid->m_bandCells[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,mgrid->m_bandCells.size()),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        if(i==0 || i==x){
-                            mgrid->m_u_x->SetCell(i,j,k, 0.0f);
-                        }
-                        if( i<x && i>0 && CheckWall(mgrid->m_A, i, j, k)*
-                            CheckWall(mgrid->m_A, i-1, j, k) < 0 ) {
-                            mgrid->m_u_x->SetCell(i,j,k, 0.0f);
-                        }
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                unsigned int i = cells[c].x; unsigned int j = cells[c].y; 
+                unsigned int k = cells[c].z;
+                //x face
+                if(j<y && k<z){
+                    if(i==0 || i==x || CheckWall(mgrid->m_A, i, j, k)*
+                                       CheckWall(mgrid->m_A, i-1, j, k) < 0){
+                        mgrid->m_u_x->SetCell(i,j,k, 0.0f);
                     }
                 }
-            } 
-        }
-    );
-    //for every y face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y+1; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        if(j==0 || j==y){
-                            mgrid->m_u_y->SetCell(i,j,k, 0.0f);
-                        }
-                        if( j<y && j>0 && CheckWall(mgrid->m_A, i, j, k)*
-                                          CheckWall(mgrid->m_A, i, j-1, k) < 0 ) {
-                            mgrid->m_u_y->SetCell(i,j,k, 0.0f);
-                        }
+                //y face
+                if(i<x && k<z){
+                    if(j==0 || j==y || CheckWall(mgrid->m_A, i, j, k)*
+                                       CheckWall(mgrid->m_A, i, j-1, k) < 0){
+                        mgrid->m_u_y->SetCell(i,j,k, 0.0f);
                     }
                 }
-            } 
-        }
-    );
-    //for every z face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        if(k==0 || k==z){
-                            mgrid->m_u_z->SetCell(i,j,k, 0.0f);
-                        }
-                        if( k<z && k>0 && CheckWall(mgrid->m_A, i, j, k)*
-                                          CheckWall(mgrid->m_A, i, j, k-1) < 0 ) {
-                            mgrid->m_u_z->SetCell(i,j,k, 0.0f);
-                        }
+                //z face
+                if(i<x && j<y){
+                    if(k==0 || k==z || CheckWall(mgrid->m_A, i, j, k)*
+                                       CheckWall(mgrid->m_A, i, j, k-1) < 0){
+                        mgrid->m_u_z->SetCell(i,j,k, 0.0f);
                     }
                 }
-            } 
+            }
         }
     );
 }
@@ -110,10 +108,27 @@ float Interpolate(Grid<float>* q, glm::vec3 p, glm::vec3 n){
     int i = glm::min(x,n.x-2);
     int j = glm::min(y,n.y-2);
     int k = glm::min(z,n.z-2);
-    float term1 = ((i+1-x)*q->GetCell(i,j,k)+(x-i)*q->GetCell(i+1,j,k))*(j+1-y);
-    float term2 = ((i+1-x)*q->GetCell(i,j+1,k)+(x-i)*q->GetCell(i+1,j+1,k))*(y-j);
-    float term3 = ((i+1-x)*q->GetCell(i,j,k+1)+(x-i)*q->GetCell(i+1,j,k+1))*(j+1-y);
-    float term4 = ((i+1-x)*q->GetCell(i,j+1,k+1)+(x-i)*q->GetCell(i+1,j+1,k+1))*(y-j);
+    //fetch the eight corners, straight out of the flat buffer when the grid is dense
+    float d[8];
+    if(q->IsSparse()){
+        d[0] = q->GetCell(i,j,k);       d[1] = q->GetCell(i+1,j,k);
+        d[2] = q->GetCell(i,j+1,k);     d[3] = q->GetCell(i+1,j+1,k);
+        d[4] = q->GetCell(i,j,k+1);     d[5] = q->GetCell(i+1,j,k+1);
+        d[6] = q->GetCell(i,j+1,k+1);   d[7] = q->GetCell(i+1,j+1,k+1);
+    }else{
+        float* raw = q->GetRawData();
+        unsigned int sx = q->GetSlabStride();
+        unsigned int sy = q->GetRowStride();
+        unsigned int c = q->GetIndex(i,j,k);
+        d[0] = raw[c];                  d[1] = raw[c+sx];
+        d[2] = raw[c+sy];               d[3] = raw[c+sx+sy];
+        d[4] = raw[c+1];                d[5] = raw[c+sx+1];
+        d[6] = raw[c+sy+1];             d[7] = raw[c+sx+sy+1];
+    }
+    float term1 = ((i+1-x)*d[0]+(x-i)*d[1])*(j+1-y);
+    float term2 = ((i+1-x)*d[2]+(x-i)*d[3])*(y-j);
+    float term3 = ((i+1-x)*d[4]+(x-i)*d[5])*(j+1-y);
+    float term4 = ((i+1-x)*d[6]+(x-i)*d[7])*(y-j);
     return (k+1-z)*(term1 + term2) + (z-k)*(term3 + term4);
 }
 
@@ -132,115 +147,251 @@ glm::vec3 InterpolateVelocity(glm::vec3 p, MacGrid* mgrid){
     return u;
 }
 
-void SplatMACGridToParticles(std::vector<Particle*>& particles, MacGrid* mgrid){
-    unsigned int particleCount = particles.size();
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
+float MaxFaceVelocity(Grid<float>* u, const glm::vec3& extent){
+    tbb::combinable<float> partialmax(0.0f);
+    u->ForEachActiveBlock(extent,
+        [&](const glm::vec3& lo, const glm::vec3& hi){
+            unsigned int k0 = lo.z;
+            float result = 0.0f;
+            for(unsigned int i=lo.x; i<hi.x; i++){
+                for(unsigned int j=lo.y; j<hi.y; j++){
+                    float* urow = u->GetRowSpan(i,j,k0);
+                    for(unsigned int k=k0; k<hi.z; k++){
+                        result = glm::max(result, glm::abs(urow[k-k0]));
+                    }
+                }
+            }
+            partialmax.local() = glm::max(partialmax.local(), result);
+        }
+    );
+    return partialmax.combine([](const float& a, const float& b){ return glm::max(a,b); });
+}
+
+//Upper bound on the speed anything samples out of the grid, in domain units per second
+float MaxGridSpeed(MacGrid* mgrid){
+    int x = (int)mgrid->m_dimensions.x; int y = (int)mgrid->m_dimensions.y; 
+    int z = (int)mgrid->m_dimensions.z;
+    glm::vec3 umax;
+    umax.x = MaxFaceVelocity(mgrid->m_u_x, glm::vec3(x+1,y,z));
+    umax.y = MaxFaceVelocity(mgrid->m_u_y, glm::vec3(x,y+1,z));
+    umax.z = MaxFaceVelocity(mgrid->m_u_z, glm::vec3(x,y,z+1));
+    return glm::length(umax);
+}
+
+//Moves fluid particles dt through the grid velocity. RK2 is the midpoint method and RK3 is 
+//Ralston's third order scheme. Velocities are sampled a batch at a time
+void AdvectParticlePositions(ParticleSet& particles, MacGrid* mgrid, const float& dt, 
+                             const AdvectionScheme& scheme){
+    unsigned int particleCount = particles.Size();
+    glm::vec3* pp = particles.m_p; int* ptype = particles.m_type;
+    unsigned int batchCount = (particleCount+INTERPOLATION_BATCH-1)/INTERPOLATION_BATCH;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,batchCount),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                particles[i]->m_u = InterpolateVelocity(particles[i]->m_p, mgrid);
+            glm::vec3 k1[INTERPOLATION_BATCH];
+            glm::vec3 k2[INTERPOLATION_BATCH];
+            glm::vec3 k3[INTERPOLATION_BATCH];
+            glm::vec3 midpoint[INTERPOLATION_BATCH];
+            for(unsigned int t=r.begin(); t!=r.end(); ++t){
+                unsigned int b = t*INTERPOLATION_BATCH;
+                unsigned int batch = std::min((unsigned int)INTERPOLATION_BATCH, 
+                                              particleCount-b);
+                InterpolateVelocities(&pp[b], k1, batch, mgrid);
+                if(scheme==FORWARD_EULER){
+                    for(unsigned int i=0; i<batch; ++i){ 
+                        if(ptype[b+i] == FLUID){
+                            pp[b+i] += dt*k1[i];
+                        }
+                    }
+                    continue;
+                }
+                for(unsigned int i=0; i<batch; ++i){
+                    midpoint[i] = pp[b+i] + 0.5f*dt*k1[i];
+                }
+                InterpolateVelocities(midpoint, k2, batch, mgrid);
+                if(scheme==RK2){
+                    for(unsigned int i=0; i<batch; ++i){ 
+                        if(ptype[b+i] == FLUID){
+                            pp[b+i] += dt*k2[i];
+                        }
+                    }
+                    continue;
+                }
+                for(unsigned int i=0; i<batch; ++i){
+                    midpoint[i] = pp[b+i] + 0.75f*dt*k2[i];
+                }
+                InterpolateVelocities(midpoint, k3, batch, mgrid);
+                for(unsigned int i=0; i<batch; ++i){ 
+                    if(ptype[b+i] == FLUID){
+                        pp[b+i] += dt*((2.0f/9.0f)*k1[i] + (3.0f/9.0f)*k2[i] + 
+                                       (4.0f/9.0f)*k3[i]);
+                    }
+                }
             }
         }
     );
 }
 
-void SplatParticlesToMACGrid(ParticleGrid* sgrid, std::vector<Particle*>& particles, 
-                             MacGrid* mgrid){
+void SplatMACGridToParticles(ParticleSet& particles, MacGrid* mgrid){
+    unsigned int particleCount = particles.Size();
+    glm::vec3* p = particles.m_p; glm::vec3* u = particles.m_u;
+    unsigned int batchCount = (particleCount+INTERPOLATION_BATCH-1)/INTERPOLATION_BATCH;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,batchCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            unsigned int first = r.begin()*INTERPOLATION_BATCH;
+            unsigned int last = std::min(r.end()*INTERPOLATION_BATCH, particleCount);
+            InterpolateVelocities(&p[first], &u[first], last-first, mgrid);
+        }
+    );
+}
+
+void SplatParticlesToMACGrid(ParticleGrid* sgrid, ParticleSet& particles, MacGrid* mgrid){
     
     float RE = 1.4f; //sharpen kernel weight
+    glm::vec3* pp = particles.m_p; glm::vec3* pu = particles.m_u; 
+    float* pmass = particles.m_mass; int* ptype = particles.m_type;
 
     int x = (int)mgrid->m_dimensions.x; int y = (int)mgrid->m_dimensions.y; 
     int z = (int)mgrid->m_dimensions.z;
     float maxd = glm::max(glm::max(x,y),z);
 
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y+1; ++j){
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        std::vector<Particle*> neighbors;
+    mgrid->m_u_x->ForEachActiveBlock(glm::vec3(x+1,y+1,z+1),
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            unsigned int k0 = lo.z;
+            for(unsigned int i=lo.x; i<hi.x; ++i){ 
+                for(unsigned int j=lo.y; j<hi.y; ++j){
+                    float* uxrow = mgrid->m_u_x->GetRowSpan(i,j,k0);
+                    float* uyrow = mgrid->m_u_y->GetRowSpan(i,j,k0);
+                    float* uzrow = mgrid->m_u_z->GetRowSpan(i,j,k0);
+                    for(unsigned int k=k0; k<hi.z; ++k){
                         //Splat X direction
                         if(j<y && k<z){
                             glm::vec3 px = glm::vec3(i, j+0.5f, k+0.5f);
                             float sumw = 0.0f;
                             float sumx = 0.0f;
-                            neighbors = sgrid->GetWallNeighbors(glm::vec3(i,j,k), 
-                                                                glm::vec3(1,2,2));
-                            for(unsigned int n=0; n<neighbors.size(); n++){
-                                Particle* p = neighbors[n];
-                                if(p->m_type == FLUID){
-                                    glm::vec3 pos;
-                                    pos.x = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.x));
-                                    pos.y = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.y));
-                                    pos.z = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.z));
-                                    float w = p->m_mass * mathCore::Sharpen(
-                                                        mathCore::Sqrlength(pos,px),RE);
-                                    sumx += w*p->m_u.x;
-                                    sumw += w;
+                            sgrid->ForEachWallNeighborIndex(glm::vec3(i,j,k), glm::vec3(1,2,2),
+                                [&](const unsigned int& p){
+                                    if(ptype[p] == FLUID){
+                                        glm::vec3 pos;
+                                        pos.x = glm::max(0.0f,glm::min(maxd,maxd*pp[p].x));
+                                        pos.y = glm::max(0.0f,glm::min(maxd,maxd*pp[p].y));
+                                        pos.z = glm::max(0.0f,glm::min(maxd,maxd*pp[p].z));
+                                        float w = pmass[p] * mathCore::Sharpen(
+                                                            mathCore::Sqrlength(pos,px),RE);
+                                        sumx += w*pu[p].x;
+                                        sumw += w;
+                                    }
                                 }
-                            }
+                            );
                             float uxsum = 0.0f;
                             if(sumw>0){ 
                                 uxsum = sumx/sumw;
                             }
-                            mgrid->m_u_x->SetCell(i,j,k,uxsum);
+                            uxrow[k-k0] = uxsum;
                         }
-                        neighbors.clear();
 
                         //Splat Y direction
                         if(i<x && k<z){
                             glm::vec3 py = glm::vec3(i+0.5f, j, k+0.5f);
                             float sumw = 0.0f;
                             float sumy = 0.0f;
-                            neighbors = sgrid->GetWallNeighbors(glm::vec3(i,j,k), 
-                                                                glm::vec3(2,1,2));
-                            for(unsigned int n=0; n<neighbors.size(); n++){
-                                Particle* p = neighbors[n];
-                                if(p->m_type == FLUID){
-                                    glm::vec3 pos;
-                                    pos.x = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.x));
-                                    pos.y = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.y));
-                                    pos.z = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.z));
-                                    float w = p->m_mass * mathCore::Sharpen(
-                                                        mathCore::Sqrlength(pos,py),RE);
-                                    sumy += w*p->m_u.y;
-                                    sumw += w;
+                            sgrid->ForEachWallNeighborIndex(glm::vec3(i,j,k), glm::vec3(2,1,2),
+                                [&](const unsigned int& p){
+                                    if(ptype[p] == FLUID){
+                                        glm::vec3 pos;
+                                        pos.x = glm::max(0.0f,glm::min(maxd,maxd*pp[p].x));
+                                        pos.y = glm::max(0.0f,glm::min(maxd,maxd*pp[p].y));
+                                        pos.z = glm::max(0.0f,glm::min(maxd,maxd*pp[p].z));
+                                        float w = pmass[p] * mathCore::Sharpen(
+                                                            mathCore::Sqrlength(pos,py),RE);
+                                        sumy += w*pu[p].y;
+                                        sumw += w;
+                                    }
                                 }
-                            }
+                            );
                             float uysum = 0.0f;
                             if(sumw>0){
                                 uysum = sumy/sumw;
                             }
-                            mgrid->m_u_y->SetCell(i,j,k,uysum);
+                            uyrow[k-k0] = uysum;
                         }
-                        neighbors.clear();
 
                         //Splat Z direction
                         if(i<x && j<y){
                             glm::vec3 pz = glm::vec3(i+0.5f, j+0.5f, k);
                             float sumw = 0.0f;
                             float sumz = 0.0f;
-                            neighbors = sgrid->GetWallNeighbors(glm::vec3(i,j,k), 
-                                                                glm::vec3(2,2,1));
-                            for(unsigned int n=0; n<neighbors.size(); n++){
-                                Particle* p = neighbors[n];
-                                if(p->m_type == FLUID){
-                                    glm::vec3 pos;
-                                    pos.x = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.x));
-                                    pos.y = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.y));
-                                    pos.z = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.z));
-                                    float w = p->m_mass * mathCore::Sharpen(
-                                                        mathCore::Sqrlength(pos,pz),RE);
-                                    sumz += w*p->m_u.z;
-                                    sumw += w;
+                            sgrid->ForEachWallNeighborIndex(glm::vec3(i,j,k), glm::vec3(2,2,1),
+                                [&](const unsigned int& p){
+                                    if(ptype[p] == FLUID){
+                                        glm::vec3 pos;
+                                        pos.x = glm::max(0.0f,glm::min(maxd,maxd*pp[p].x));
+                                        pos.y = glm::max(0.0f,glm::min(maxd,maxd*pp[p].y));
+                                        pos.z = glm::max(0.0f,glm::min(maxd,maxd*pp[p].z));
+                                        float w = pmass[p] * mathCore::Sharpen(
+                                                            mathCore::Sqrlength(pos,pz),RE);
+                                        sumz += w*pu[p].z;
+                                        sumw += w;
+                                    }
                                 }
-                            }
+                            );
                             float uzsum = 0.0f;
                             if(sumw>0){
                                 uzsum = sumz/sumw;
                             }
-                            mgrid->m_u_z->SetCell(i,j,k,uzsum);
+                            uzrow[k-k0] = uzsum;
+                        }
+                    }
+                }
+            }
+        }
+    );
+}
+
+//Adds one particle's sharpened kernel weight and weighted velocity to every face from lo to hi
+//inclusive. offset places a face index at the face center in cell units. Both accumulators must 
+//share a layout, and in sparse mode faces outside the active tiles are skipped
+void ScatterToFaces(Grid<float>* sumw, Grid<float>* sumu, const glm::vec3& pos, 
+                    const float& mass, const float& u, const glm::vec3& lo, 
+                    const glm::vec3& hi, const glm::vec3& offset){
+    float RE = 1.4f; //sharpen kernel weight, must match SplatParticlesToMACGrid
+    float* w = sumw->GetRawData();
+    float* wu = sumu->GetRawData();
+    bool sparse = sumw->IsSparse();
+    //faces further than RE along any axis get zero weight, so trim the range to the kernel
+    glm::vec3 klo = glm::max(lo, glm::ceil(pos-offset-glm::vec3(RE)));
+    glm::vec3 khi = glm::min(hi, glm::floor(pos-offset+glm::vec3(RE)));
+    for(int i=klo.x; i<=khi.x; i++){
+        for(int j=klo.y; j<=khi.y; j++){
+            for(int k=klo.z; k<=khi.z; k++){
+                unsigned int index = sumw->GetIndex(i,j,k);
+                if(sparse && index<GRID_TILE_CELLS){
+                    continue;
+                }
+                float weight = mass * mathCore::Sharpen(mathCore::Sqrlength(pos, 
+                                                        glm::vec3(i,j,k)+offset), RE);
+                w[index] += weight;
+                wu[index] += weight*u;
+            }
+        }
+    }
+}
+
+void NormalizeFaces(Grid<float>* target, Grid<float>* sumw, Grid<float>* sumu, 
+                    const glm::vec3& extent){
+    target->ForEachActiveBlock(extent,
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            unsigned int k0 = lo.z;
+            for(unsigned int i=lo.x; i<hi.x; ++i){ 
+                for(unsigned int j=lo.y; j<hi.y; ++j){
+                    float* urow = target->GetRowSpan(i,j,k0);
+                    float* wrow = sumw->GetRowSpan(i,j,k0);
+                    float* wurow = sumu->GetRowSpan(i,j,k0);
+                    for(unsigned int k=k0; k<hi.z; ++k){
+                        float usum = 0.0f;
+                        if(wrow[k-k0]>0){
+                            usum = wurow[k-k0]/wrow[k-k0];
                         }
-                        neighbors.clear();
+                        urow[k-k0] = usum;
                     }
                 }
             }
@@ -248,6 +399,109 @@ void SplatParticlesToMACGrid(ParticleGrid* sgrid, std::vector<Particle*>& partic
     );
 }
 
+//Scatter version of SplatParticlesToMACGrid. Each fluid particle is read once and pushed onto the
+//same faces the gather version would have found it from. Work is split into 4x4 blocks of cell
+//columns, and a block's particles only reach one cell past its low side and two past its high 
+//side, so blocks of the same color in a 2x2 coloring never write the same face and need no atomics
+void ScatterParticlesToMACGrid(ParticleGrid* sgrid, ParticleSet& particles, MacGrid* mgrid,
+                               SplatWorkspace& workspace){
+    int x = (int)mgrid->m_dimensions.x; int y = (int)mgrid->m_dimensions.y; 
+    int z = (int)mgrid->m_dimensions.z;
+    float maxd = glm::max(glm::max(x,y),z);
+    bool sparse = mgrid->m_sparse;
+
+    //weight and momentum accumulators, sharing the velocity grids' tiles when sparse, and
+    //zeroed so they read like fresh grids
+    Grid<float>** sumw = workspace.m_sumw; Grid<float>** sumu = workspace.m_sumu;
+    Grid<float>* faces[3] = {mgrid->m_u_x, mgrid->m_u_y, mgrid->m_u_z};
+    glm::vec3 facedims[3] = {glm::vec3(x+1,y,z), glm::vec3(x,y+1,z), glm::vec3(x,y,z+1)};
+    for(unsigned int a=0; a<3; a++){
+        if(sumw[a]==NULL){
+            sumw[a] = new Grid<float>(facedims[a], 0.0f, sparse);
+            sumu[a] = new Grid<float>(facedims[a], 0.0f, sparse);
+        }
+        sumw[a]->SetActiveTiles(faces[a]->GetActiveTiles());
+        sumu[a]->SetActiveTiles(faces[a]->GetActiveTiles());
+        sumw[a]->Clear();
+        sumu[a]->Clear();
+    }
+
+    glm::vec3* pp = particles.m_p; glm::vec3* pu = particles.m_u; 
+    float* pmass = particles.m_mass; int* ptype = particles.m_type;
+    int blockwidth = 4;
+    int blocksx = (x+blockwidth-1)/blockwidth;
+    int blocksy = (y+blockwidth-1)/blockwidth;
+    for(int color=0; color<4; color++){
+        int cx = color%2; int cy = color/2;
+        int colorx = (blocksx-cx+1)/2; int colory = (blocksy-cy+1)/2;
+        tbb::parallel_for(tbb::blocked_range<int>(0,colorx*colory),
+            [=](const tbb::blocked_range<int>& r){
+                for(int b=r.begin(); b!=r.end(); ++b){
+                    int ilo = (2*(b/colory)+cx)*blockwidth;
+                    int jlo = (2*(b%colory)+cy)*blockwidth;
+                    int ihi = glm::min(x, ilo+blockwidth);
+                    int jhi = glm::min(y, jlo+blockwidth);
+                    for(int ci=ilo; ci<ihi; ci++){
+                        for(int cj=jlo; cj<jhi; cj++){
+                            for(int ck=0; ck<z; ck++){
+                                unsigned int begin, end;
+                                sgrid->GetCellRange(ci, cj, ck, begin, end);
+                                for(unsigned int p=begin; p<end; p++){
+                                    if(ptype[p] != FLUID){
+                                        continue;
+                                    }
+                                    glm::vec3 pos;
+                                    pos.x = glm::max(0.0f,glm::min(maxd,maxd*pp[p].x));
+                                    pos.y = glm::max(0.0f,glm::min(maxd,maxd*pp[p].y));
+                                    pos.z = glm::max(0.0f,glm::min(maxd,maxd*pp[p].z));
+                                    //x faces
+                                    ScatterToFaces(sumw[0], sumu[0], pos, pmass[p], pu[p].x,
+                                        glm::vec3(ci, glm::max(0,cj-1), glm::max(0,ck-1)), 
+                                        glm::vec3(glm::min(x,ci+1), glm::min(y-1,cj+2), 
+                                                  glm::min(z-1,ck+2)),
+                                        glm::vec3(0.0f, 0.5f, 0.5f));
+                                    //y faces
+                                    ScatterToFaces(sumw[1], sumu[1], pos, pmass[p], pu[p].y,
+                                        glm::vec3(glm::max(0,ci-1), cj, glm::max(0,ck-1)), 
+                                        glm::vec3(glm::min(x-1,ci+2), glm::min(y,cj+1), 
+                                                  glm::min(z-1,ck+2)),
+                                        glm::vec3(0.5f, 0.0f, 0.5f));
+                                    //z faces
+                                    ScatterToFaces(sumw[2], sumu[2], pos, pmass[p], pu[p].z,
+                                        glm::vec3(glm::max(0,ci-1), glm::max(0,cj-1), ck), 
+                                        glm::vec3(glm::min(x-1,ci+2), glm::min(y-1,cj+2), 
+                                                  glm::min(z,ck+1)),
+                                        glm::vec3(0.5f, 0.5f, 0.0f));
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        );
+    }
+
+    for(unsigned int a=0; a<3; a++){
+        NormalizeFaces(faces[a], sumw[a], sumu[a], facedims[a]);
+    }
+}
+
+SplatWorkspace CreateSplatWorkspace(){
+    SplatWorkspace w;
+    for(unsigned int a=0; a<3; a++){
+        w.m_sumw[a] = NULL;
+        w.m_sumu[a] = NULL;
+    }
+    return w;
+}
+
+void ClearSplatWorkspace(SplatWorkspace& workspace){
+    for(unsigned int a=0; a<3; a++){
+        delete workspace.m_sumw[a];
+        delete workspace.m_sumu[a];
+    }
+    workspace = CreateSplatWorkspace();
+}
 }
 
 #endif
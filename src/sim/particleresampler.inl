@@ -20,10 +20,21 @@ namespace fluidCore {
 //====================================
 
 //Forward declarations for externed inlineable methods
+//With a tolerance above zero, only particles within a cell of one whose density is further
+//than tolerance from the rest density are moved. Densities are the ones ComputeDensity left.
+//activeCells and activeParticles are the caller's scratch, kept across calls; activeCells
+//has one flag per cell and is left all clear
 extern inline void ResampleParticles(ParticleGrid* pgrid, 
                                      std::vector<Particle*>& particles, 
                                      sceneCore::Scene* scene, const float& frame, const float& dt,
-                                     const float& re, const glm::vec3& dimensions);
+                                     const float& re, const glm::vec3& dimensions,
+                                     const float& tolerance, std::vector<char>& activeCells,
+                                     std::vector<char>& activeParticles);
+//Sets every cell holding a FLUID particle off the rest density by more than tolerance to value,
+//or every occupied cell when value is 0
+inline void MarkResampleCells(ParticleGrid* pgrid, std::vector<Particle*>& particles, 
+                              char* cells, const glm::vec3& dimensions, const float& tolerance,
+                              const char& value);
 inline glm::vec3 Resample(ParticleGrid* pgrid, const glm::vec3& p, const glm::vec3& u, float re, 
                           const glm::vec3& dimensions);
 
@@ -34,49 +45,97 @@ inline glm::vec3 Resample(ParticleGrid* pgrid, const glm::vec3& p, const glm::ve
 
 void ResampleParticles(ParticleGrid* pgrid, std::vector<Particle*>& particles,
                        sceneCore::Scene* scene, const float& frame, const float& dt, 
-                       const float& re, const glm::vec3& dimensions){
+                       const float& re, const glm::vec3& dimensions, const float& tolerance,
+                       std::vector<char>& activeCells, std::vector<char>& activeParticles){
     int nx = (int)dimensions.x; int ny = (int)dimensions.y; int nz = (int)dimensions.z;
     float maxd = glm::max(glm::max(nx, ny), nz);
     pgrid->Sort(particles);
 
+    //settled liquid sits at the rest density, and springs between evenly spaced particles
+    //barely move them, so only the neighborhood of cells that are off target gets resampled
+    activeParticles.clear();
+    if(tolerance>0.0f){
+        if(activeCells.size()!=(unsigned int)(nx*ny*nz)){
+            activeCells.assign(nx*ny*nz, 0);
+        }
+        char* cells = &activeCells[0];
+        MarkResampleCells(pgrid, particles, cells, dimensions, tolerance, 1);
+        unsigned int particleCount = particles.size();
+        activeParticles.assign(particleCount, 0);
+        char* active = particleCount>0 ? &activeParticles[0] : NULL;
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int n=r.begin(); n!=r.end(); ++n){
+                    if(particles[n]->m_type!=FLUID){
+                        continue;
+                    }
+                    glm::vec3 c = glm::clamp(maxd*particles[n]->m_p, glm::vec3(0.0f),
+                                             glm::vec3(nx-1, ny-1, nz-1));
+                    int ci = c.x; int cj = c.y; int ck = c.z;
+                    for(int i=glm::max(ci-1,0); i<=glm::min(ci+1,nx-1) && !active[n]; i++){
+                        for(int j=glm::max(cj-1,0); j<=glm::min(cj+1,ny-1) && !active[n]; j++){
+                            for(int k=glm::max(ck-1,0); k<=glm::min(ck+1,nz-1); k++){
+                                if(cells[(i*ny+j)*nz+k]){
+                                    active[n] = 1;
+                                    break;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        );
+        //particles haven't moved since marking, so the same cells get cleared
+        MarkResampleCells(pgrid, particles, cells, dimensions, tolerance, 0);
+    }
+    const char* active = activeParticles.empty() ? NULL : &activeParticles[0];
+
     float springforce = 50.0f;
+    //jitter is drawn per sorted particle index from a counter based generator seeded by the 
+    //frame time, so it needs no lock and repeats exactly when particle order does
+    unsigned int seed;
+    memcpy(&seed, &frame, sizeof(float));
 
     //use springs to temporarily displace particles
     unsigned int particleCount = particles.size();
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int n0=r.begin(); n0!=r.end(); ++n0){  
-                if(particles[n0]->m_type==FLUID){
+                if(particles[n0]->m_type==FLUID && (active==NULL || active[n0])){
                     Particle* p = particles[n0];
                     glm::vec3 spring(0.0f, 0.0f, 0.0f);
+                    unsigned int key = utilityCore::hashUInt(seed) + n0;
+                    unsigned int draws = 0;
                     float x = glm::max(0.0f,glm::min((float)maxd,maxd*p->m_p.x));
                     float y = glm::max(0.0f,glm::min((float)maxd,maxd*p->m_p.y));
                     float z = glm::max(0.0f,glm::min((float)maxd,maxd*p->m_p.z));
-                    std::vector<Particle*> neighbors = pgrid->GetCellNeighbors(glm::vec3(x,y,z),
-                                                                               glm::vec3(1));
-                    unsigned int neighborsCount = neighbors.size();
-                    for(unsigned int n1=0; n1<neighborsCount; ++n1){
-                        Particle* np = neighbors[n1];
-                        if(p!=np){
-                            float dist = glm::length(p->m_p-np->m_p);
-                            float w = springforce * np->m_mass * mathCore::Smooth(dist*dist,re);
-                            if(dist > 0.1f*re){
-                                spring.x += w * (p->m_p.x-np->m_p.x) / dist * re;
-                                spring.y += w * (p->m_p.y-np->m_p.y) / dist * re;
-                                spring.z += w * (p->m_p.z-np->m_p.z) / dist * re;
-                            }else{
-                                if(np->m_type == FLUID){
-                                    spring.x += 0.01f*re/dt*(rand()%101)/100.0f;
-                                    spring.y += 0.01f*re/dt*(rand()%101)/100.0f;
-                                    spring.z += 0.01f*re/dt*(rand()%101)/100.0f;
+                    pgrid->ForEachCellNeighbor(glm::vec3(x,y,z), glm::vec3(1),
+                        [&](Particle* np){
+                            if(p!=np){
+                                float dist = glm::length(p->m_p-np->m_p);
+                                float w = springforce * np->m_mass * 
+                                          mathCore::Smooth(dist*dist,re);
+                                if(dist > 0.1f*re){
+                                    spring.x += w * (p->m_p.x-np->m_p.x) / dist * re;
+                                    spring.y += w * (p->m_p.y-np->m_p.y) / dist * re;
+                                    spring.z += w * (p->m_p.z-np->m_p.z) / dist * re;
                                 }else{
-                                    spring.x += 0.05f*re/dt*np->m_n.x;
-                                    spring.y += 0.05f*re/dt*np->m_n.y;
-                                    spring.z += 0.05f*re/dt*np->m_n.z;
+                                    if(np->m_type == FLUID){
+                                        spring.x += 0.01f*re/dt*
+                                                    utilityCore::counterRandom(key, draws++);
+                                        spring.y += 0.01f*re/dt*
+                                                    utilityCore::counterRandom(key, draws++);
+                                        spring.z += 0.01f*re/dt*
+                                                    utilityCore::counterRandom(key, draws++);
+                                    }else{
+                                        spring.x += 0.05f*re/dt*np->m_n.x;
+                                        spring.y += 0.05f*re/dt*np->m_n.y;
+                                        spring.z += 0.05f*re/dt*np->m_n.z;
+                                    }
                                 }
                             }
                         }
-                    }
+                    );
                     p->m_t.x = p->m_p.x + dt*spring.x;
                     p->m_t.y = p->m_p.y + dt*spring.y;
                     p->m_t.z = p->m_p.z + dt*spring.z;
@@ -89,7 +148,7 @@ void ResampleParticles(ParticleGrid* pgrid, std::vector<Particle*>& particles,
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int n=r.begin(); n!=r.end(); ++n){ 
-                if(particles[n]->m_type == FLUID){
+                if(particles[n]->m_type == FLUID && (active==NULL || active[n])){
                     Particle* p = particles[n];
                     p->m_t2.x = p->m_u.x;
                     p->m_t2.y = p->m_u.y;
@@ -104,7 +163,7 @@ void ResampleParticles(ParticleGrid* pgrid, std::vector<Particle*>& particles,
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int n=r.begin(); n!=r.end(); ++n){ 
-                if(particles[n]->m_type == FLUID){
+                if(particles[n]->m_type == FLUID && (active==NULL || active[n])){
                     Particle *p = particles[n];
                     unsigned int solidGeomID = 0;
                     if(scene->CheckPointInsideSolidGeom(p->m_t*maxd, frame, solidGeomID)==false){
@@ -117,6 +176,41 @@ void ResampleParticles(ParticleGrid* pgrid, std::vector<Particle*>& particles,
     );
 }
 
+//Each cell is written only by the first particle sorted into it, which finds the rest through
+//the sort's cell range, so no two threads write the same flag. Only cells holding particles
+//are touched, never the rest of the domain
+void MarkResampleCells(ParticleGrid* pgrid, std::vector<Particle*>& particles, char* cells,
+                       const glm::vec3& dimensions, const float& tolerance, const char& value){
+    int nx = (int)dimensions.x; int ny = (int)dimensions.y; int nz = (int)dimensions.z;
+    float maxd = glm::max(glm::max(nx, ny), nz);
+    char mark = value;
+    float limit = tolerance;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particles.size()),
+        [=,&particles](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int n=r.begin(); n!=r.end(); ++n){
+                //same cell the sort put the particle in
+                glm::vec3 p = particles[n]->m_p;
+                int i = glm::max(0.0f, glm::min(nx-1.0f, int(maxd)*p.x));
+                int j = glm::max(0.0f, glm::min(ny-1.0f, int(maxd)*p.y));
+                int k = glm::max(0.0f, glm::min(nz-1.0f, int(maxd)*p.z));
+                unsigned int begin, end;
+                pgrid->GetCellRange(i, j, k, begin, end);
+                if(n!=begin){
+                    continue;
+                }
+                char flag = 0;
+                for(unsigned int m=begin; m<end && mark!=0 && flag==0; m++){
+                    if(particles[m]->m_type==FLUID && 
+                       glm::abs(particles[m]->m_density-1.0f)>limit){
+                        flag = mark;
+                    }
+                }
+                cells[(i*ny+j)*nz+k] = flag;
+            }
+        }
+    );
+}
+
 glm::vec3 Resample(ParticleGrid* pgrid, const glm::vec3& p, const glm::vec3& u, float re, 
                    const glm::vec3& dimensions){
     int nx = (int)dimensions.x; int ny = (int)dimensions.y; int nz = (int)dimensions.z;
@@ -128,17 +222,16 @@ glm::vec3 Resample(ParticleGrid* pgrid, const glm::vec3& p, const glm::vec3& u,
     float x = glm::max(0.0f,glm::min((float)maxd-1,maxd*p.x));
     float y = glm::max(0.0f,glm::min((float)maxd-1,maxd*p.y));
     float z = glm::max(0.0f,glm::min((float)maxd-1,maxd*p.z));
-    std::vector<Particle*> neighbors = pgrid->GetCellNeighbors(glm::vec3(x,y,z),glm::vec3(1));
-
-    for(int n=0; n<neighbors.size(); n++){
-        Particle *np = neighbors[n];
-        if(np->m_type == FLUID){
-            float dist2 = mathCore::Sqrlength(p,np->m_p);
-            float w = np->m_mass * mathCore::Sharpen(dist2,re);
-            ru += w * np->m_u;
-            wsum += w;
+    pgrid->ForEachCellNeighbor(glm::vec3(x,y,z), glm::vec3(1),
+        [&](Particle* np){
+            if(np->m_type == FLUID){
+                float dist2 = mathCore::Sqrlength(p,np->m_p);
+                float w = np->m_mass * mathCore::Sharpen(dist2,re);
+                ru += w * np->m_u;
+                wsum += w;
+            }
         }
-    }
+    );
     if(wsum){
         ru /= wsum;
     } else {
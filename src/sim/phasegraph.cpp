@@ -0,0 +1,67 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: phasegraph.cpp
+// Implements phasegraph.hpp
+
+#include <algorithm>
+#include "phasegraph.hpp"
+
+namespace fluidCore {
+
+PhaseGraph::PhaseGraph(Profiler& profiler): m_profiler(profiler), m_start(m_graph){
+}
+
+PhaseGraph::~PhaseGraph(){
+    for(unsigned int i=0; i<m_nodes.size(); i++){
+        delete m_nodes[i];
+    }
+}
+
+unsigned int PhaseGraph::AddPhase(const ProfilePhase& phase,
+                                  const std::vector<unsigned int>& dependencies,
+                                  const std::function<void()>& body){
+    unsigned int id = m_nodes.size();
+    m_times.push_back(0.0);
+    m_dependencies.push_back(dependencies);
+    Profiler* profiler = &m_profiler;
+    std::vector<double>* times = &m_times;
+    PhaseNode* node = new PhaseNode(m_graph,
+        [=](const tbb::flow::continue_msg&){
+            ProfileScope scope(*profiler, phase);
+            tbb::tick_count start = tbb::tick_count::now();
+            body();
+            (*times)[id] = (tbb::tick_count::now()-start).seconds();
+        }
+    );
+    m_nodes.push_back(node);
+    if(dependencies.empty()){
+        tbb::flow::make_edge(m_start, *node);
+    }
+    for(unsigned int d=0; d<dependencies.size(); d++){
+        tbb::flow::make_edge(*m_nodes[dependencies[d]], *node);
+    }
+    return id;
+}
+
+void PhaseGraph::Run(){
+    m_start.try_put(tbb::flow::continue_msg());
+    m_graph.wait_for_all();
+    if(m_profiler.IsEnabled()==false){
+        return;
+    }
+    //dependencies always come earlier in the list, so one pass finds every phase's longest
+    //chain of predecessors
+    std::vector<double> path(m_nodes.size(), 0.0);
+    double critical = 0.0;
+    for(unsigned int i=0; i<m_nodes.size(); i++){
+        double longest = 0.0;
+        for(unsigned int d=0; d<m_dependencies[i].size(); d++){
+            longest = std::max(longest, path[m_dependencies[i][d]]);
+        }
+        path[i] = longest + m_times[i];
+        critical = std::max(critical, path[i]);
+    }
+    m_profiler.AddCriticalPath(critical);
+}
+}
@@ -0,0 +1,50 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: phasegraph.hpp
+// Runs sim phases as a dependency graph so independent phases overlap
+
+#ifndef PHASEGRAPH_HPP
+#define PHASEGRAPH_HPP
+
+#include <tbb/tbb.h>
+#include <tbb/flow_graph.h>
+#include <functional>
+#include <vector>
+#include "profiler.hpp"
+
+namespace fluidCore {
+
+//====================================
+// Class Declarations
+//====================================
+
+//Each phase starts as soon as every phase it depends on has finished, instead of waiting on
+//whatever happened to be called before it. Phases have to be added after the phases they
+//depend on, and two phases timed under the same ProfilePhase must not be able to run at once.
+//Run adds the longest chain of phase times through the graph to the profiler's critical path
+class PhaseGraph {
+    public:
+        PhaseGraph(Profiler& profiler);
+        ~PhaseGraph();
+
+        //Returns the phase's id, for use in later phases' dependencies
+        unsigned int AddPhase(const ProfilePhase& phase,
+                              const std::vector<unsigned int>& dependencies,
+                              const std::function<void()>& body);
+        //Runs every phase once and waits for all of them
+        void Run();
+
+    private:
+        typedef tbb::flow::continue_node<tbb::flow::continue_msg> PhaseNode;
+
+        Profiler&                                   m_profiler;
+        tbb::flow::graph                            m_graph;
+        tbb::flow::broadcast_node<tbb::flow::continue_msg> m_start;
+        std::vector<PhaseNode*>                     m_nodes;
+        std::vector< std::vector<unsigned int> >    m_dependencies;
+        std::vector<double>                         m_times;
+};
+}
+
+#endif
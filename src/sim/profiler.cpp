@@ -0,0 +1,145 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: profiler.cpp
+// Implements profiler.hpp
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+#include <cstring>
+#include <iostream>
+#include "profiler.hpp"
+
+namespace fluidCore {
+
+static const char* profilePhaseNames[PROFILE_PHASES] = {"build_solids", "refit", "generate",
+                                                        "adjust", "sort", "tiles", "density",
+                                                        "forces", "splat", "mark_cells", "project",
+                                                        "extrapolate", "picflip", "advect",
+                                                        "constraints", "resample",
+                                                        "particle_band", "export", "checkpoint"};
+
+static const char* profileCounterNames[PROFILE_COUNTERS] = {"particles", "liquid_particles",
+                                                            "fluid_cells", "cg_iterations",
+                                                            "substeps", "sdf_solid_tests",
+                                                            "ray_solid_tests",
+                                                            "band_removed", "band_seeded"};
+
+Profiler::Profiler(){
+    m_file = NULL;
+    m_enabled = false;
+    m_json = false;
+    m_frame = 0;
+    memset(m_times, 0, sizeof(m_times));
+    memset(m_counts, 0, sizeof(m_counts));
+    m_criticalPath = 0.0;
+}
+
+Profiler::~Profiler(){
+    if(m_file!=NULL){
+        fclose(m_file);
+    }
+}
+
+bool Profiler::Open(const std::string& filename){
+    if(m_file!=NULL){
+        fclose(m_file);
+    }
+    m_file = fopen(filename.c_str(), "w");
+    if(m_file==NULL){
+        std::cout << "Error: Unable to write stats to " << filename << std::endl;
+        return false;
+    }
+    m_enabled = true;
+    size_t dot = filename.find_last_of('.');
+    m_json = dot!=std::string::npos && strcmp(filename.c_str()+dot, ".json")==0;
+    if(m_json==false){
+        fprintf(m_file, "frame,total_ms,critical_path_ms");
+        for(unsigned int p=0; p<PROFILE_PHASES; p++){
+            fprintf(m_file, ",%s_ms", profilePhaseNames[p]);
+        }
+        for(unsigned int c=0; c<PROFILE_COUNTERS; c++){
+            fprintf(m_file, ",%s", profileCounterNames[c]);
+        }
+        fprintf(m_file, ",peak_memory_mb\n");
+        fflush(m_file);
+    }
+    return true;
+}
+
+void Profiler::Enable(){
+    m_enabled = true;
+}
+
+void Profiler::BeginFrame(const int& frame){
+    if(m_enabled==false){
+        return;
+    }
+    m_frame = frame;
+    memset(m_times, 0, sizeof(m_times));
+    memset(m_counts, 0, sizeof(m_counts));
+    m_criticalPath = 0.0;
+    m_frameStart = tbb::tick_count::now();
+}
+
+void Profiler::EndFrame(){
+    if(m_enabled==false){
+        return;
+    }
+    double total = (tbb::tick_count::now()-m_frameStart).seconds()*1000.0;
+    double memory = GetPeakMemory();
+    char field[256];
+    snprintf(field, sizeof(field), "{\"frame\": %d, \"total_ms\": %.3f, "
+             "\"critical_path_ms\": %.3f, \"phases_ms\": {", m_frame, total,
+             m_criticalPath*1000.0);
+    m_record = field;
+    for(unsigned int p=0; p<PROFILE_PHASES; p++){
+        snprintf(field, sizeof(field), "%s\"%s\": %.3f", p>0 ? ", " : "", profilePhaseNames[p],
+                 m_times[p]*1000.0);
+        m_record += field;
+    }
+    m_record += "}, \"counters\": {";
+    for(unsigned int c=0; c<PROFILE_COUNTERS; c++){
+        snprintf(field, sizeof(field), "%s\"%s\": %llu", c>0 ? ", " : "", 
+                 profileCounterNames[c], m_counts[c]);
+        m_record += field;
+    }
+    snprintf(field, sizeof(field), "}, \"peak_memory_mb\": %.1f}", memory);
+    m_record += field;
+    if(m_file==NULL){
+        return;
+    }
+    if(m_json){
+        fprintf(m_file, "%s\n", m_record.c_str());
+    }else{
+        fprintf(m_file, "%d,%.3f,%.3f", m_frame, total, m_criticalPath*1000.0);
+        for(unsigned int p=0; p<PROFILE_PHASES; p++){
+            fprintf(m_file, ",%.3f", m_times[p]*1000.0);
+        }
+        for(unsigned int c=0; c<PROFILE_COUNTERS; c++){
+            fprintf(m_file, ",%llu", m_counts[c]);
+        }
+        fprintf(m_file, ",%.1f\n", memory);
+    }
+    //flushed every frame so dashboards can tail the file and a killed job keeps its stats
+    fflush(m_file);
+}
+
+//0 where getrusage isn't available
+double Profiler::GetPeakMemory(){
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage)!=0){
+        return 0.0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss/(1024.0*1024.0);     //bytes on osx
+#else
+    return usage.ru_maxrss/1024.0;              //kilobytes on linux
+#endif
+#else
+    return 0.0;
+#endif
+}
+}
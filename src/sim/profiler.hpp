@@ -0,0 +1,112 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: profiler.hpp
+// Per frame phase timers and counters, written out as one stats record per frame
+
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <tbb/tbb.h>
+#include <cstdio>
+#include <string>
+
+namespace fluidCore {
+
+//====================================
+// Enums
+//====================================
+
+enum ProfilePhase{PROFILE_BUILDSOLIDS=0, PROFILE_REFIT, PROFILE_GENERATE, PROFILE_ADJUST,
+                  PROFILE_SORT, PROFILE_TILES, PROFILE_DENSITY, PROFILE_FORCES, PROFILE_SPLAT,
+                  PROFILE_MARKCELLS, PROFILE_PROJECT, PROFILE_EXTRAPOLATE, PROFILE_PICFLIP,
+                  PROFILE_ADVECT, PROFILE_CONSTRAINTS, PROFILE_RESAMPLE, PROFILE_PARTICLEBAND,
+                  PROFILE_EXPORT, PROFILE_CHECKPOINT, PROFILE_PHASES};
+
+enum ProfileCounter{PROFILE_PARTICLES=0, PROFILE_LIQUIDPARTICLES, PROFILE_FLUIDCELLS,
+                    PROFILE_CGITERATIONS, PROFILE_SUBSTEPS, PROFILE_SDFSOLIDTESTS,
+                    PROFILE_RAYSOLIDTESTS, PROFILE_BANDREMOVED, PROFILE_BANDSEEDED,
+                    PROFILE_COUNTERS};
+
+//====================================
+// Class Declarations
+//====================================
+
+//Disabled until Open or Enable is called. While disabled, scopes and counters only test one 
+//flag, so instrumented code costs next to nothing. A filename ending in .json writes one json 
+//object per line, anything else writes csv with a header row
+class Profiler {
+    public:
+        Profiler();
+        ~Profiler();
+
+        bool Open(const std::string& filename);
+        //Collects records without writing them anywhere, for GetFrameRecord
+        void Enable();
+        inline bool IsEnabled(){
+            return m_enabled;
+        }
+
+        void BeginFrame(const int& frame);
+        //Writes the frame's record, including the process's peak resident memory so far
+        void EndFrame();
+
+        inline void AddTime(const ProfilePhase& phase, const double& seconds){
+            m_times[phase] += seconds;
+        }
+        //Times accumulate over every substep in a frame, counters either accumulate or hold
+        //the last value set
+        inline void AddCount(const ProfileCounter& counter, const unsigned long long& count){
+            m_counts[counter] += count;
+        }
+        inline void SetCount(const ProfileCounter& counter, const unsigned long long& count){
+            m_counts[counter] = count;
+        }
+        //Adds the longest chain of dependent phases from one PhaseGraph run. Where phases
+        //overlap, the critical path comes out shorter than the sum of phase times
+        inline void AddCriticalPath(const double& seconds){
+            m_criticalPath += seconds;
+        }
+        //The last finished frame's record as one line of json, empty until a frame ends
+        inline const std::string& GetFrameRecord(){
+            return m_record;
+        }
+
+    private:
+        double GetPeakMemory();
+
+        FILE*                   m_file;
+        bool                    m_enabled;
+        bool                    m_json;
+        std::string             m_record;
+        int                     m_frame;
+        tbb::tick_count         m_frameStart;
+        double                  m_times[PROFILE_PHASES];
+        double                  m_criticalPath;
+        unsigned long long      m_counts[PROFILE_COUNTERS];
+};
+
+//Adds the time until it goes out of scope to a phase
+class ProfileScope {
+    public:
+        inline ProfileScope(Profiler& profiler, const ProfilePhase& phase){
+            m_profiler = profiler.IsEnabled() ? &profiler : NULL;
+            m_phase = phase;
+            if(m_profiler!=NULL){
+                m_start = tbb::tick_count::now();
+            }
+        }
+        inline ~ProfileScope(){
+            if(m_profiler!=NULL){
+                m_profiler->AddTime(m_phase, (tbb::tick_count::now()-m_start).seconds());
+            }
+        }
+
+    private:
+        Profiler*               m_profiler;
+        ProfilePhase            m_phase;
+        tbb::tick_count         m_start;
+};
+}
+
+#endif
@@ -0,0 +1,345 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: simdinterpolation.inl
+// Batched trilinear velocity interpolation with SSE2/AVX2/AVX-512 kernels picked at runtime
+
+#ifndef SIMDINTERPOLATION_INL
+#define SIMDINTERPOLATION_INL
+
+#include <tbb/tbb.h>
+#include "../grid/macgrid.inl"
+#include "../utilities/utilities.h"
+#include <cstdlib>
+#include <cstring>
+
+//The wide kernels are built with per function target attributes, so the rest of the build can
+//stay at the -msse2 baseline and still use AVX2/AVX-512 on machines that have them
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ARIEL_SIMD_DISPATCH
+#include <immintrin.h>
+#define ARIEL_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+//Batched callers cut their particles into batches of this size counted from particle 0. The wide
+//kernels and the scalar tail can round differently, so fixing which particles land in a tail
+//keeps results independent of how TBB split the range
+#define INTERPOLATION_BATCH 256
+
+namespace fluidCore {
+//====================================
+// Struct and Function Declarations
+//====================================
+
+enum InterpolationISA{ISA_SCALAR, ISA_SSE2, ISA_AVX2, ISA_AVX512};
+
+//Forward declarations for externed inlineable methods
+extern inline glm::vec3 InterpolateVelocity(glm::vec3 p, MacGrid* mgrid);
+extern inline InterpolationISA GetInterpolationISA();
+extern inline InterpolationISA SelectInterpolationISA();
+extern inline std::string GetInterpolationISAName(const InterpolationISA& isa);
+extern inline void InterpolateVelocities(const glm::vec3* positions, glm::vec3* velocities,
+                                         const unsigned int& count, MacGrid* mgrid);
+
+//Per component sample setup, shared by every kernel. Matches the offsets and clamp extents
+//InterpolateVelocity uses
+struct InterpolationComponent{
+    const float*    m_raw;
+    int             m_slabstride;
+    int             m_rowstride;
+    glm::vec3       m_offset;
+    glm::vec3       m_extent;
+};
+
+//====================================
+// Function Implementations
+//====================================
+
+//Picks the widest kernel the CPU supports. Setting ARIEL_SIMD to scalar, sse2, avx2 or avx512 
+//caps it lower, which is handy for comparing kernels on one machine
+InterpolationISA GetInterpolationISA(){
+#ifdef ARIEL_SIMD_DISPATCH
+    static InterpolationISA isa = SelectInterpolationISA();
+    return isa;
+#else
+    return ISA_SCALAR;
+#endif
+}
+
+InterpolationISA SelectInterpolationISA(){
+    InterpolationISA isa = ISA_SCALAR;
+#ifdef ARIEL_SIMD_DISPATCH
+    isa = __builtin_cpu_supports("avx512f") ? ISA_AVX512 :
+          __builtin_cpu_supports("avx2") ? ISA_AVX2 : ISA_SSE2;
+    const char* requested = getenv("ARIEL_SIMD");
+    if(requested!=NULL){
+        InterpolationISA cap = isa;
+        for(int i=ISA_SCALAR; i<=ISA_AVX512; i++){
+            if(strcmp(requested, GetInterpolationISAName((InterpolationISA)i).c_str())==0){
+                cap = (InterpolationISA)i;
+            }
+        }
+        isa = (InterpolationISA)glm::min((int)isa, (int)cap);
+    }
+#endif
+    return isa;
+}
+
+std::string GetInterpolationISAName(const InterpolationISA& isa){
+    if(isa==ISA_AVX512){
+        return "avx512";
+    }else if(isa==ISA_AVX2){
+        return "avx2";
+    }else if(isa==ISA_SSE2){
+        return "sse2";
+    }
+    return "scalar";
+}
+
+#ifdef ARIEL_SIMD_DISPATCH
+
+//SSE2 has no gathers, so corners are fetched with scalar loads and only the setup and blend
+//run four wide
+ARIEL_TARGET("sse2") inline __m128 InterpolateSSE2(const InterpolationComponent& c, __m128 x,
+                                                   __m128 y, __m128 z){
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    x = _mm_max_ps(zero, _mm_min_ps(_mm_set1_ps(c.m_extent.x), x));
+    y = _mm_max_ps(zero, _mm_min_ps(_mm_set1_ps(c.m_extent.y), y));
+    z = _mm_max_ps(zero, _mm_min_ps(_mm_set1_ps(c.m_extent.z), z));
+    __m128i i = _mm_cvttps_epi32(_mm_min_ps(x, _mm_set1_ps(c.m_extent.x-2)));
+    __m128i j = _mm_cvttps_epi32(_mm_min_ps(y, _mm_set1_ps(c.m_extent.y-2)));
+    __m128i k = _mm_cvttps_epi32(_mm_min_ps(z, _mm_set1_ps(c.m_extent.z-2)));
+    int ii[4], jj[4], kk[4];
+    _mm_storeu_si128((__m128i*)ii, i);
+    _mm_storeu_si128((__m128i*)jj, j);
+    _mm_storeu_si128((__m128i*)kk, k);
+    int sx = c.m_slabstride; int sy = c.m_rowstride;
+    float d[8][4];
+    for(unsigned int l=0; l<4; l++){
+        const float* cell = c.m_raw + ii[l]*sx + jj[l]*sy + kk[l];
+        d[0][l] = cell[0];          d[1][l] = cell[sx];
+        d[2][l] = cell[sy];         d[3][l] = cell[sx+sy];
+        d[4][l] = cell[1];          d[5][l] = cell[sx+1];
+        d[6][l] = cell[sy+1];       d[7][l] = cell[sx+sy+1];
+    }
+    __m128 fi = _mm_cvtepi32_ps(i); __m128 fj = _mm_cvtepi32_ps(j);
+    __m128 fk = _mm_cvtepi32_ps(k);
+    __m128 ax = _mm_sub_ps(_mm_add_ps(fi, one), x); __m128 bx = _mm_sub_ps(x, fi);
+    __m128 ay = _mm_sub_ps(_mm_add_ps(fj, one), y); __m128 by = _mm_sub_ps(y, fj);
+    __m128 az = _mm_sub_ps(_mm_add_ps(fk, one), z); __m128 bz = _mm_sub_ps(z, fk);
+    __m128 term1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(ax, _mm_loadu_ps(d[0])),
+                                         _mm_mul_ps(bx, _mm_loadu_ps(d[1]))), ay);
+    __m128 term2 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(ax, _mm_loadu_ps(d[2])),
+                                         _mm_mul_ps(bx, _mm_loadu_ps(d[3]))), by);
+    __m128 term3 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(ax, _mm_loadu_ps(d[4])),
+                                         _mm_mul_ps(bx, _mm_loadu_ps(d[5]))), ay);
+    __m128 term4 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(ax, _mm_loadu_ps(d[6])),
+                                         _mm_mul_ps(bx, _mm_loadu_ps(d[7]))), by);
+    return _mm_add_ps(_mm_mul_ps(az, _mm_add_ps(term1, term2)),
+                      _mm_mul_ps(bz, _mm_add_ps(term3, term4)));
+}
+
+ARIEL_TARGET("avx2") inline __m256 InterpolateAVX2(const InterpolationComponent& c, __m256 x,
+                                                   __m256 y, __m256 z){
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.0f);
+    x = _mm256_max_ps(zero, _mm256_min_ps(_mm256_set1_ps(c.m_extent.x), x));
+    y = _mm256_max_ps(zero, _mm256_min_ps(_mm256_set1_ps(c.m_extent.y), y));
+    z = _mm256_max_ps(zero, _mm256_min_ps(_mm256_set1_ps(c.m_extent.z), z));
+    __m256i i = _mm256_cvttps_epi32(_mm256_min_ps(x, _mm256_set1_ps(c.m_extent.x-2)));
+    __m256i j = _mm256_cvttps_epi32(_mm256_min_ps(y, _mm256_set1_ps(c.m_extent.y-2)));
+    __m256i k = _mm256_cvttps_epi32(_mm256_min_ps(z, _mm256_set1_ps(c.m_extent.z-2)));
+    __m256i sx = _mm256_set1_epi32(c.m_slabstride);
+    __m256i sy = _mm256_set1_epi32(c.m_rowstride);
+    __m256i unit = _mm256_set1_epi32(1);
+    __m256i c0 = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(i, sx),
+                                                   _mm256_mullo_epi32(j, sy)), k);
+    __m256i c1 = _mm256_add_epi32(c0, sx);
+    __m256i c2 = _mm256_add_epi32(c0, sy);
+    __m256i c3 = _mm256_add_epi32(c1, sy);
+    __m256 d0 = _mm256_i32gather_ps(c.m_raw, c0, 4);
+    __m256 d1 = _mm256_i32gather_ps(c.m_raw, c1, 4);
+    __m256 d2 = _mm256_i32gather_ps(c.m_raw, c2, 4);
+    __m256 d3 = _mm256_i32gather_ps(c.m_raw, c3, 4);
+    __m256 d4 = _mm256_i32gather_ps(c.m_raw, _mm256_add_epi32(c0, unit), 4);
+    __m256 d5 = _mm256_i32gather_ps(c.m_raw, _mm256_add_epi32(c1, unit), 4);
+    __m256 d6 = _mm256_i32gather_ps(c.m_raw, _mm256_add_epi32(c2, unit), 4);
+    __m256 d7 = _mm256_i32gather_ps(c.m_raw, _mm256_add_epi32(c3, unit), 4);
+    __m256 fi = _mm256_cvtepi32_ps(i); __m256 fj = _mm256_cvtepi32_ps(j);
+    __m256 fk = _mm256_cvtepi32_ps(k);
+    __m256 ax = _mm256_sub_ps(_mm256_add_ps(fi, one), x); __m256 bx = _mm256_sub_ps(x, fi);
+    __m256 ay = _mm256_sub_ps(_mm256_add_ps(fj, one), y); __m256 by = _mm256_sub_ps(y, fj);
+    __m256 az = _mm256_sub_ps(_mm256_add_ps(fk, one), z); __m256 bz = _mm256_sub_ps(z, fk);
+    __m256 term1 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(ax, d0), _mm256_mul_ps(bx, d1)), ay);
+    __m256 term2 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(ax, d2), _mm256_mul_ps(bx, d3)), by);
+    __m256 term3 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(ax, d4), _mm256_mul_ps(bx, d5)), ay);
+    __m256 term4 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(ax, d6), _mm256_mul_ps(bx, d7)), by);
+    return _mm256_add_ps(_mm256_mul_ps(az, _mm256_add_ps(term1, term2)),
+                         _mm256_mul_ps(bz, _mm256_add_ps(term3, term4)));
+}
+
+ARIEL_TARGET("avx512f") inline __m512 InterpolateAVX512(const InterpolationComponent& c,
+                                                        __m512 x, __m512 y, __m512 z){
+    __m512 zero = _mm512_setzero_ps();
+    __m512 one = _mm512_set1_ps(1.0f);
+    x = _mm512_max_ps(zero, _mm512_min_ps(_mm512_set1_ps(c.m_extent.x), x));
+    y = _mm512_max_ps(zero, _mm512_min_ps(_mm512_set1_ps(c.m_extent.y), y));
+    z = _mm512_max_ps(zero, _mm512_min_ps(_mm512_set1_ps(c.m_extent.z), z));
+    __m512i i = _mm512_cvttps_epi32(_mm512_min_ps(x, _mm512_set1_ps(c.m_extent.x-2)));
+    __m512i j = _mm512_cvttps_epi32(_mm512_min_ps(y, _mm512_set1_ps(c.m_extent.y-2)));
+    __m512i k = _mm512_cvttps_epi32(_mm512_min_ps(z, _mm512_set1_ps(c.m_extent.z-2)));
+    __m512i sx = _mm512_set1_epi32(c.m_slabstride);
+    __m512i sy = _mm512_set1_epi32(c.m_rowstride);
+    __m512i unit = _mm512_set1_epi32(1);
+    __m512i c0 = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(i, sx),
+                                                   _mm512_mullo_epi32(j, sy)), k);
+    __m512i c1 = _mm512_add_epi32(c0, sx);
+    __m512i c2 = _mm512_add_epi32(c0, sy);
+    __m512i c3 = _mm512_add_epi32(c1, sy);
+    __m512 d0 = _mm512_i32gather_ps(c0, c.m_raw, 4);
+    __m512 d1 = _mm512_i32gather_ps(c1, c.m_raw, 4);
+    __m512 d2 = _mm512_i32gather_ps(c2, c.m_raw, 4);
+    __m512 d3 = _mm512_i32gather_ps(c3, c.m_raw, 4);
+    __m512 d4 = _mm512_i32gather_ps(_mm512_add_epi32(c0, unit), c.m_raw, 4);
+    __m512 d5 = _mm512_i32gather_ps(_mm512_add_epi32(c1, unit), c.m_raw, 4);
+    __m512 d6 = _mm512_i32gather_ps(_mm512_add_epi32(c2, unit), c.m_raw, 4);
+    __m512 d7 = _mm512_i32gather_ps(_mm512_add_epi32(c3, unit), c.m_raw, 4);
+    __m512 fi = _mm512_cvtepi32_ps(i); __m512 fj = _mm512_cvtepi32_ps(j);
+    __m512 fk = _mm512_cvtepi32_ps(k);
+    __m512 ax = _mm512_sub_ps(_mm512_add_ps(fi, one), x); __m512 bx = _mm512_sub_ps(x, fi);
+    __m512 ay = _mm512_sub_ps(_mm512_add_ps(fj, one), y); __m512 by = _mm512_sub_ps(y, fj);
+    __m512 az = _mm512_sub_ps(_mm512_add_ps(fk, one), z); __m512 bz = _mm512_sub_ps(z, fk);
+    __m512 term1 = _mm512_mul_ps(_mm512_add_ps(_mm512_mul_ps(ax, d0), _mm512_mul_ps(bx, d1)), ay);
+    __m512 term2 = _mm512_mul_ps(_mm512_add_ps(_mm512_mul_ps(ax, d2), _mm512_mul_ps(bx, d3)), by);
+    __m512 term3 = _mm512_mul_ps(_mm512_add_ps(_mm512_mul_ps(ax, d4), _mm512_mul_ps(bx, d5)), ay);
+    __m512 term4 = _mm512_mul_ps(_mm512_add_ps(_mm512_mul_ps(ax, d6), _mm512_mul_ps(bx, d7)), by);
+    return _mm512_add_ps(_mm512_mul_ps(az, _mm512_add_ps(term1, term2)),
+                         _mm512_mul_ps(bz, _mm512_add_ps(term3, term4)));
+}
+
+//Each batch kernel transposes its positions out of the packed vec3 array, samples all three
+//components and writes packed velocities back. Returns how many particles it handled, the
+//caller finishes the tail with the scalar path
+ARIEL_TARGET("sse2") inline unsigned int InterpolateBatchSSE2(const InterpolationComponent* c,
+                                                              const float& maxd,
+                                                              const glm::vec3* positions,
+                                                              glm::vec3* velocities,
+                                                              const unsigned int& count){
+    __m128 scale = _mm_set1_ps(maxd);
+    unsigned int n = 0;
+    for(; n+4<=count; n+=4){
+        const glm::vec3* p = positions+n;
+        __m128 px = _mm_mul_ps(scale, _mm_setr_ps(p[0].x, p[1].x, p[2].x, p[3].x));
+        __m128 py = _mm_mul_ps(scale, _mm_setr_ps(p[0].y, p[1].y, p[2].y, p[3].y));
+        __m128 pz = _mm_mul_ps(scale, _mm_setr_ps(p[0].z, p[1].z, p[2].z, p[3].z));
+        float u[3][4];
+        for(unsigned int a=0; a<3; a++){
+            __m128 x = _mm_sub_ps(px, _mm_set1_ps(c[a].m_offset.x));
+            __m128 y = _mm_sub_ps(py, _mm_set1_ps(c[a].m_offset.y));
+            __m128 z = _mm_sub_ps(pz, _mm_set1_ps(c[a].m_offset.z));
+            _mm_storeu_ps(u[a], InterpolateSSE2(c[a], x, y, z));
+        }
+        for(unsigned int l=0; l<4; l++){
+            velocities[n+l] = glm::vec3(u[0][l], u[1][l], u[2][l]);
+        }
+    }
+    return n;
+}
+
+ARIEL_TARGET("avx2") inline unsigned int InterpolateBatchAVX2(const InterpolationComponent* c,
+                                                              const float& maxd,
+                                                              const glm::vec3* positions,
+                                                              glm::vec3* velocities,
+                                                              const unsigned int& count){
+    __m256 scale = _mm256_set1_ps(maxd);
+    __m256i lanes = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    unsigned int n = 0;
+    for(; n+8<=count; n+=8){
+        const float* p = &positions[n].x;
+        __m256 px = _mm256_mul_ps(scale, _mm256_i32gather_ps(p, lanes, 4));
+        __m256 py = _mm256_mul_ps(scale, _mm256_i32gather_ps(p+1, lanes, 4));
+        __m256 pz = _mm256_mul_ps(scale, _mm256_i32gather_ps(p+2, lanes, 4));
+        float u[3][8];
+        for(unsigned int a=0; a<3; a++){
+            __m256 x = _mm256_sub_ps(px, _mm256_set1_ps(c[a].m_offset.x));
+            __m256 y = _mm256_sub_ps(py, _mm256_set1_ps(c[a].m_offset.y));
+            __m256 z = _mm256_sub_ps(pz, _mm256_set1_ps(c[a].m_offset.z));
+            _mm256_storeu_ps(u[a], InterpolateAVX2(c[a], x, y, z));
+        }
+        for(unsigned int l=0; l<8; l++){
+            velocities[n+l] = glm::vec3(u[0][l], u[1][l], u[2][l]);
+        }
+    }
+    return n;
+}
+
+ARIEL_TARGET("avx512f") inline unsigned int InterpolateBatchAVX512(
+                                                              const InterpolationComponent* c,
+                                                              const float& maxd,
+                                                              const glm::vec3* positions,
+                                                              glm::vec3* velocities,
+                                                              const unsigned int& count){
+    __m512 scale = _mm512_set1_ps(maxd);
+    __m512i lanes = _mm512_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21, 24, 27, 30, 33, 36, 39, 42, 45);
+    unsigned int n = 0;
+    for(; n+16<=count; n+=16){
+        const float* p = &positions[n].x;
+        __m512 px = _mm512_mul_ps(scale, _mm512_i32gather_ps(lanes, p, 4));
+        __m512 py = _mm512_mul_ps(scale, _mm512_i32gather_ps(lanes, p+1, 4));
+        __m512 pz = _mm512_mul_ps(scale, _mm512_i32gather_ps(lanes, p+2, 4));
+        float u[3][16];
+        for(unsigned int a=0; a<3; a++){
+            __m512 x = _mm512_sub_ps(px, _mm512_set1_ps(c[a].m_offset.x));
+            __m512 y = _mm512_sub_ps(py, _mm512_set1_ps(c[a].m_offset.y));
+            __m512 z = _mm512_sub_ps(pz, _mm512_set1_ps(c[a].m_offset.z));
+            _mm512_storeu_ps(u[a], InterpolateAVX512(c[a], x, y, z));
+        }
+        for(unsigned int l=0; l<16; l++){
+            velocities[n+l] = glm::vec3(u[0][l], u[1][l], u[2][l]);
+        }
+    }
+    return n;
+}
+
+#endif
+
+//Samples the macgrid velocity at count packed positions. Dense grids go through the widest
+//kernel the CPU supports, sparse grids and leftover particles take the scalar path
+void InterpolateVelocities(const glm::vec3* positions, glm::vec3* velocities,
+                           const unsigned int& count, MacGrid* mgrid){
+    unsigned int n = 0;
+#ifdef ARIEL_SIMD_DISPATCH
+    InterpolationISA isa = GetInterpolationISA();
+    if(!mgrid->m_sparse && isa!=ISA_SCALAR){
+        int x = (int)mgrid->m_dimensions.x; int y = (int)mgrid->m_dimensions.y;
+        int z = (int)mgrid->m_dimensions.z;
+        float maxd = glm::max(glm::max(x,y),z);
+        Grid<float>* faces[3] = {mgrid->m_u_x, mgrid->m_u_y, mgrid->m_u_z};
+        InterpolationComponent c[3];
+        for(unsigned int a=0; a<3; a++){
+            c[a].m_raw = faces[a]->GetRawData();
+            c[a].m_slabstride = faces[a]->GetSlabStride();
+            c[a].m_rowstride = faces[a]->GetRowStride();
+            c[a].m_offset = glm::vec3(0.5f);
+            c[a].m_extent = glm::vec3(maxd);
+        }
+        c[0].m_offset.x = 0.0f; c[0].m_extent.x += 1.0f;
+        c[1].m_offset.y = 0.0f; c[1].m_extent.y += 1.0f;
+        c[2].m_offset.z = 0.0f; c[2].m_extent.z += 1.0f;
+        if(isa==ISA_AVX512){
+            n = InterpolateBatchAVX512(c, maxd, positions, velocities, count);
+        }else if(isa==ISA_AVX2){
+            n = InterpolateBatchAVX2(c, maxd, positions, velocities, count);
+        }else{
+            n = InterpolateBatchSSE2(c, maxd, positions, velocities, count);
+        }
+    }
+#endif
+    for(; n<count; n++){
+        velocities[n] = InterpolateVelocity(positions[n], mgrid);
+    }
+}
+}
+
+#endif
@@ -0,0 +1,313 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: simstream.cpp
+// Implements simstream.hpp
+
+#include <cstring>
+#include <iostream>
+#include "simstream.hpp"
+
+//streaming needs BSD sockets, other platforms get the stubs at the bottom of the file
+#ifndef _WIN32
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0      //osx, where SO_NOSIGPIPE is set on the socket instead
+#endif
+
+namespace fluidCore {
+
+//====================================
+// SimStreamServer Class
+//====================================
+
+SimStreamServer::SimStreamServer(){
+    m_listenSocket = -1;
+    m_stride = 1;
+    m_clientCount = 0;
+    m_sendThread = NULL;
+}
+
+SimStreamServer::~SimStreamServer(){
+    if(m_sendThread!=NULL){
+        m_sendQueue.push(NULL);
+        m_sendThread->join();
+        delete m_sendThread;
+    }
+    for(unsigned int i=0; i<m_clients.size(); i++){
+        close(m_clients[i]);
+    }
+    if(m_listenSocket>=0){
+        close(m_listenSocket);
+    }
+    StreamFrame* frame;
+    while(m_freeFrames.try_pop(frame)){
+        delete frame;
+    }
+}
+
+bool SimStreamServer::Open(const int& port, const unsigned int& stride){
+    m_stride = glm::max(stride, 1u);
+    m_listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if(m_listenSocket<0){
+        std::cout << "Error: Unable to create stream socket" << std::endl;
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(m_listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if(bind(m_listenSocket, (struct sockaddr*)&address, sizeof(address))!=0 ||
+       listen(m_listenSocket, 4)!=0){
+        std::cout << "Error: Unable to listen for viewers on port " << port << std::endl;
+        close(m_listenSocket);
+        m_listenSocket = -1;
+        return false;
+    }
+    //one frame waiting plus one being sent, anything past that is dropped
+    m_sendQueue.set_capacity(1);
+    m_sendThread = new std::thread([=](){
+        SendLoop();
+    });
+    std::cout << "Streaming to viewers on port " << port << std::endl;
+    return true;
+}
+
+void SimStreamServer::Publish(const int& frame, const std::vector<Particle*>& particles,
+                              const unsigned int& liquidCount, const float& maxd,
+                              const std::string& stats){
+    if(m_sendThread==NULL || m_clientCount==0){
+        return;
+    }
+    StreamFrame* streamFrame;
+    if(m_freeFrames.try_pop(streamFrame)==false){
+        streamFrame = new StreamFrame();
+    }
+    unsigned int lpsize = glm::min(liquidCount, (unsigned int)particles.size());
+    streamFrame->m_positions.clear();
+    streamFrame->m_attributes.clear();
+    for(unsigned int j=0; j<lpsize; j+=m_stride){
+        const Particle* p = particles[j];
+        if(p->m_invalid){
+            continue;
+        }
+        streamFrame->m_positions.push_back(p->m_p*maxd);
+        float speed = p->m_type==SOLID ? -2.0f : glm::length(p->m_u);
+        streamFrame->m_attributes.push_back(glm::vec2(speed, p->m_density));
+    }
+    streamFrame->m_stats = stats;
+    streamFrame->m_header.m_magic = SIMSTREAM_MAGIC;
+    streamFrame->m_header.m_frame = frame;
+    streamFrame->m_header.m_count = streamFrame->m_positions.size();
+    streamFrame->m_header.m_statsLength = stats.size();
+    if(m_sendQueue.try_push(streamFrame)==false){
+        m_freeFrames.push(streamFrame);
+    }
+}
+
+void SimStreamServer::SendLoop(){
+    while(1){
+        //waiting on new viewers doubles as the wait for the next frame
+        AcceptClients(50);
+        StreamFrame* frame;
+        if(m_sendQueue.try_pop(frame)==false){
+            continue;
+        }
+        if(frame==NULL){
+            return;
+        }
+        for(unsigned int i=0; i<m_clients.size(); i++){
+            if(SendFrame(m_clients[i], *frame)==false){
+                close(m_clients[i]);
+                m_clients.erase(m_clients.begin()+i);
+                i--;
+                std::cout << "Viewer disconnected from stream" << std::endl;
+            }
+        }
+        m_clientCount = m_clients.size();
+        m_freeFrames.push(frame);
+    }
+}
+
+void SimStreamServer::AcceptClients(const int& timeout){
+    struct pollfd listener;
+    listener.fd = m_listenSocket;
+    listener.events = POLLIN;
+    while(poll(&listener, 1, timeout)>0 && (listener.revents & POLLIN)){
+        int client = accept(m_listenSocket, NULL, NULL);
+        if(client<0){
+            return;
+        }
+        int nodelay = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+#ifdef SO_NOSIGPIPE
+        int nosigpipe = 1;
+        setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+#endif
+        m_clients.push_back(client);
+        m_clientCount = m_clients.size();
+        std::cout << "Viewer attached to stream" << std::endl;
+    }
+}
+
+static bool SendBytes(const int& client, const void* data, const size_t& size){
+    const char* bytes = (const char*)data;
+    size_t sent = 0;
+    while(sent<size){
+        ssize_t result = send(client, bytes+sent, size-sent, MSG_NOSIGNAL);
+        if(result<=0){
+            return false;
+        }
+        sent += result;
+    }
+    return true;
+}
+
+bool SimStreamServer::SendFrame(const int& client, const StreamFrame& frame){
+    unsigned int count = frame.m_header.m_count;
+    return SendBytes(client, &frame.m_header, sizeof(StreamFrameHeader)) &&
+           SendBytes(client, frame.m_stats.c_str(), frame.m_stats.size()) &&
+           (count==0 || SendBytes(client, &frame.m_positions[0], count*sizeof(glm::vec3))) &&
+           (count==0 || SendBytes(client, &frame.m_attributes[0], count*sizeof(glm::vec2)));
+}
+
+//====================================
+// SimStreamClient Class
+//====================================
+
+SimStreamClient::SimStreamClient(){
+    m_socket = -1;
+}
+
+SimStreamClient::~SimStreamClient(){
+    if(m_socket>=0){
+        close(m_socket);
+    }
+}
+
+bool SimStreamClient::Connect(const std::string& address){
+    size_t colon = address.find_last_of(':');
+    if(colon==std::string::npos){
+        std::cout << "Error: stream address should be host:port, got " << address << std::endl;
+        return false;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon+1);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* results = NULL;
+    if(getaddrinfo(host.c_str(), port.c_str(), &hints, &results)!=0){
+        std::cout << "Error: Unable to resolve stream host " << host << std::endl;
+        return false;
+    }
+    for(struct addrinfo* r=results; r!=NULL && m_socket<0; r=r->ai_next){
+        m_socket = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+        if(m_socket>=0 && connect(m_socket, r->ai_addr, r->ai_addrlen)!=0){
+            close(m_socket);
+            m_socket = -1;
+        }
+    }
+    freeaddrinfo(results);
+    if(m_socket<0){
+        std::cout << "Error: Unable to attach to stream at " << address << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool SimStreamClient::ReceiveBytes(void* data, const size_t& size){
+    char* bytes = (char*)data;
+    size_t received = 0;
+    while(received<size){
+        ssize_t result = recv(m_socket, bytes+received, size-received, 0);
+        if(result<=0){
+            return false;
+        }
+        received += result;
+    }
+    return true;
+}
+
+bool SimStreamClient::Receive(unsigned int& frame, unsigned int& count,
+                              std::vector<glm::vec3>& positions,
+                              std::vector<glm::vec2>& attributes, std::string& stats){
+    StreamFrameHeader header;
+    if(ReceiveBytes(&header, sizeof(header))==false || header.m_magic!=SIMSTREAM_MAGIC){
+        return false;
+    }
+    stats.resize(header.m_statsLength);
+    if(header.m_statsLength>0 && ReceiveBytes(&stats[0], header.m_statsLength)==false){
+        return false;
+    }
+    count = header.m_count;
+    if(positions.size()<count){
+        positions.resize(count);
+        attributes.resize(count);
+    }
+    if(count>0 && (ReceiveBytes(&positions[0], count*sizeof(glm::vec3))==false ||
+                   ReceiveBytes(&attributes[0], count*sizeof(glm::vec2))==false)){
+        return false;
+    }
+    frame = header.m_frame;
+    return true;
+}
+}
+
+#else
+
+namespace fluidCore {
+
+SimStreamServer::SimStreamServer(){
+    m_listenSocket = -1;
+    m_stride = 1;
+    m_clientCount = 0;
+    m_sendThread = NULL;
+}
+
+SimStreamServer::~SimStreamServer(){
+}
+
+bool SimStreamServer::Open(const int& port, const unsigned int& stride){
+    std::cout << "Error: sim streaming isn't supported on this platform" << std::endl;
+    return false;
+}
+
+void SimStreamServer::Publish(const int& frame, const std::vector<Particle*>& particles,
+                              const unsigned int& liquidCount, const float& maxd,
+                              const std::string& stats){
+}
+
+SimStreamClient::SimStreamClient(){
+    m_socket = -1;
+}
+
+SimStreamClient::~SimStreamClient(){
+}
+
+bool SimStreamClient::Connect(const std::string& address){
+    std::cout << "Error: sim streaming isn't supported on this platform" << std::endl;
+    return false;
+}
+
+bool SimStreamClient::Receive(unsigned int& frame, unsigned int& count, 
+                              std::vector<glm::vec3>& positions, 
+                              std::vector<glm::vec2>& attributes, std::string& stats){
+    return false;
+}
+}
+
+#endif
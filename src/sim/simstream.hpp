@@ -0,0 +1,98 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: simstream.hpp
+// Streams decimated particle snapshots and per frame stats from a running sim to remote viewers
+
+#ifndef SIMSTREAM_HPP
+#define SIMSTREAM_HPP
+
+#include <tbb/tbb.h>
+#include <thread>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "../grid/macgrid.inl"
+
+#define SIMSTREAM_MAGIC 0x54535241    //"ARST"
+
+namespace fluidCore {
+
+//====================================
+// Struct Declarations
+//====================================
+
+//Every frame on the wire is this header, then m_statsLength bytes of the profiler's json record,
+//then m_count positions in cell units and m_count (speed, density) pairs. Speed is -1 for out
+//of bounds and -2 for solid particles, matching what the viewer draws. Both ends are assumed to
+//share byte order
+struct StreamFrameHeader {
+    unsigned int        m_magic;
+    unsigned int        m_frame;
+    unsigned int        m_count;
+    unsigned int        m_statsLength;
+};
+
+struct StreamFrame {
+    StreamFrameHeader           m_header;
+    std::string                 m_stats;
+    std::vector<glm::vec3>      m_positions;
+    std::vector<glm::vec2>      m_attributes;
+};
+
+//====================================
+// Class Declarations
+//====================================
+
+//Listens on a tcp port and sends each published frame to every connected viewer. Publish only
+//copies every m_stride'th liquid particle and hands the copy to the sender thread; if the
+//sender is still busy with the last frame the new one is dropped, so a slow viewer never holds
+//up the sim. Nothing is copied while no viewer is connected
+class SimStreamServer {
+    public:
+        SimStreamServer();
+        ~SimStreamServer();
+
+        bool Open(const int& port, const unsigned int& stride);
+        void Publish(const int& frame, const std::vector<Particle*>& particles,
+                     const unsigned int& liquidCount, const float& maxd,
+                     const std::string& stats);
+
+    private:
+        void SendLoop();
+        void AcceptClients(const int& timeout);
+        bool SendFrame(const int& client, const StreamFrame& frame);
+
+        int                                         m_listenSocket;
+        unsigned int                                m_stride;
+        std::vector<int>                            m_clients;
+        tbb::atomic<unsigned int>                   m_clientCount;
+
+        //frames waiting on the sender, a NULL frame tells the sender to stop. Sent frames are
+        //kept around for reuse
+        tbb::concurrent_bounded_queue<StreamFrame*> m_sendQueue;
+        tbb::concurrent_queue<StreamFrame*>         m_freeFrames;
+        std::thread*                                m_sendThread;
+};
+
+//Connects to a SimStreamServer and blocks in Receive until the next frame arrives
+class SimStreamClient {
+    public:
+        SimStreamClient();
+        ~SimStreamClient();
+
+        //address is host:port
+        bool Connect(const std::string& address);
+        //Fills positions and attributes, which only ever grow, with count entries. Returns
+        //false once the server goes away or sends something that isn't a frame
+        bool Receive(unsigned int& frame, unsigned int& count, std::vector<glm::vec3>& positions,
+                     std::vector<glm::vec2>& attributes, std::string& stats);
+
+    private:
+        bool ReceiveBytes(void* data, const size_t& size);
+
+        int                                         m_socket;
+};
+}
+
+#endif
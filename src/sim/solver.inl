@@ -13,50 +13,126 @@
 #include "../grid/levelset.hpp"
 #include "../utilities/utilities.h"
 #include "../grid/gridutils.inl"
+#include "flipsettings.hpp"
+#include "solverstats.hpp"
+#include "multigrid.inl"
+
+//cells or blocks per leaf of a deterministic reduction
+#define DETERMINISTIC_GRAIN 1024
 
 namespace fluidCore {
 //====================================
 // Struct and Function Declarations
 //====================================
 
+//Compact entry for a FLUID cell: its buffer index plus the buffer indices of its six neighbors 
+//(+x,-x,+y,-y,+z,-z), clamped back onto the cell at the domain bounds
+struct FluidCell{
+    unsigned int    m_index;
+    unsigned int    m_neighbors[6];
+};
+
+//Whichever preconditioner the scene asked for, built once per solve
+struct Preconditioner{
+    PreconditionerType              m_type;
+    Grid<float>*                    m_mic;
+    Grid<float>*                    m_q; //intermediate of the two MIC triangular solves
+    std::vector<MultigridLevel>     m_multigrid;
+    std::vector<glm::vec3>          m_wavefrontcells; //FLUID cells bucketed by i+j+k
+    std::vector<unsigned int>       m_wavefrontoffsets; //start of each bucket, plus an end entry
+};
+
+//Grids and lists the pressure solve works in. Owned by the sim and kept across steps, so steady
+//state solves reuse them instead of allocating; grids are created on first use
+struct SolverWorkspace{
+    Preconditioner                  m_preconditioner;
+    Grid<float>*                    m_r;
+    Grid<float>*                    m_z;
+    Grid<float>*                    m_s;
+    std::vector<FluidCell>          m_cells;
+};
+
+//Sums kernel(range, sum) over [0,count). In deterministic mode the range is always cut into the 
+//same pieces and the partial sums are combined in the same tree, so the result does not depend 
+//on the thread count or on scheduling
+template <typename F> float ReduceSum(const unsigned int& count, const bool& deterministic, 
+                                      const F& kernel){
+    if(deterministic){
+        return tbb::parallel_deterministic_reduce(
+            tbb::blocked_range<unsigned int>(0,count,DETERMINISTIC_GRAIN), 0.0f, kernel, 
+            std::plus<float>());
+    }
+    return tbb::parallel_reduce(tbb::blocked_range<unsigned int>(0,count), 0.0f, kernel,
+                                std::plus<float>());
+}
+
 //Forward declarations for externed inlineable methods
-extern inline void Solve(MacGrid& mgrid, const int& subcell, const bool& verbose);
+extern inline SolverStats Solve(MacGrid& mgrid, const int& subcell, const FlipSettings& settings,
+                                SolverWorkspace& workspace, const bool& verbose);
+extern inline SolverWorkspace CreateSolverWorkspace();
+extern inline void ClearSolverWorkspace(SolverWorkspace& workspace);
+inline Grid<float>* PrepareScratchGrid(Grid<float>*& grid, MacGrid& mgrid);
+inline void FlipGrid(Grid<float>* grid, const std::vector<glm::vec3>& cells);
+inline float ARef(Grid<celltype>* A, int i, int j, int k, int qi, int qj, int qk, glm::vec3 dimensions);
+inline float PRef(Grid<float>* p, int i, int j, int k, glm::vec3 dimensions);
 inline void BuildPreconditioner(Grid<float>* pc, MacGrid& mgrid, int subcell);
-inline void SolveConjugateGradient(MacGrid& mgrid, Grid<float>* pc, int subcell, 
-                                   const bool& verbose);
-inline void ComputeAx(Grid<int>* A, Grid<float>* L, Grid<float>* X, Grid<float>* target, 
+inline void SolveConjugateGradient(MacGrid& mgrid, SolverWorkspace& workspace, int subcell, 
+                                   const bool& deterministic, const bool& verbose, 
+                                   SolverStats& stats);
+inline void SolveFusedConjugateGradient(MacGrid& mgrid, SolverWorkspace& workspace, int subcell,
+                                        const bool& deterministic, const bool& verbose, 
+                                        SolverStats& stats);
+inline void Precondition(Preconditioner& pc, Grid<float>* Z, Grid<float>* R, MacGrid& mgrid);
+inline void BuildFluidCellList(MacGrid& mgrid, std::vector<FluidCell>& cells);
+inline float FusedApplyA(const std::vector<FluidCell>& cells, celltype* A, auxfloat* L, float* X, 
+                         float* target, float h, int subcell, const bool& deterministic);
+inline float FusedUpdate(const std::vector<FluidCell>& cells, float* P, float* S, float* R, 
+                         float* Z, float alpha, const bool& deterministic);
+inline float FusedProduct(const std::vector<FluidCell>& cells, float* X, float* Y, 
+                          const bool& deterministic);
+inline void FusedOp(const std::vector<FluidCell>& cells, float* X, float* Y, float* target, 
+                    float alpha);
+inline void ComputeAx(Grid<celltype>* A, Grid<auxfloat>* L, Grid<float>* X, Grid<float>* target, 
                       glm::vec3 dimensions, int subcell);
-inline float XRef(Grid<int>* A, Grid<float>* L, Grid<float>* X, glm::vec3 f, glm::vec3 p, 
-                  glm::vec3 dimensions, int subcell);
-inline void Op(Grid<int>* A, Grid<float>* X, Grid<float>* Y, Grid<float>* target, float alpha, 
+inline float XRef(celltype* A, auxfloat* L, float* X, const unsigned int& f, const unsigned int& q, 
+                  int subcell);
+inline void Op(Grid<celltype>* A, Grid<float>* X, Grid<float>* Y, Grid<float>* target, float alpha, 
                glm::vec3 dimensions);
-inline float Product(Grid<int>* A, Grid<float>* X, Grid<float>* Y, glm::vec3 dimensions);
-inline void ApplyPreconditioner(Grid<float>* Z, Grid<float>* R, Grid<float>* P, Grid<float>* L, 
-                                Grid<int>* A, glm::vec3 dimensions);
+inline float Product(Grid<celltype>* A, Grid<float>* X, Grid<float>* Y, glm::vec3 dimensions,
+                     const bool& deterministic);
+inline void ApplyPreconditioner(Grid<float>* Z, Grid<float>* R, Grid<float>* P, Grid<float>* Q,
+                                Grid<auxfloat>* L, Grid<celltype>* A, glm::vec3 dimensions);
+inline void BuildWavefronts(Grid<celltype>* A, glm::vec3 dimensions, std::vector<glm::vec3>& cells,
+                            std::vector<unsigned int>& offsets);
+inline void BuildWavefrontPreconditioner(Grid<float>* pc, MacGrid& mgrid, int subcell,
+                                         const std::vector<glm::vec3>& cells,
+                                         const std::vector<unsigned int>& offsets);
+inline void ApplyWavefrontPreconditioner(Grid<float>* Z, Grid<float>* R, Grid<float>* P, 
+                                         Grid<float>* Q, Grid<celltype>* A, glm::vec3 dimensions,
+                                         const std::vector<glm::vec3>& cells,
+                                         const std::vector<unsigned int>& offsets);
 
 //====================================
 // Function Implementations
 //====================================
 
-//Takes a grid, multiplies everything by -1
-void FlipGrid(Grid<float>* grid, glm::vec3 dimensions){
-    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
+//Multiplies the given cells by -1. The solver only reads the divergence in FLUID cells, so that
+//is all it flips
+void FlipGrid(Grid<float>* grid, const std::vector<glm::vec3>& cells){
+    const glm::vec3* list = cells.empty() ? NULL : &cells[0];
+    float* raw = grid->GetRawData();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cells.size()),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                for(unsigned int j=0; j<y; ++j){
-                    for(unsigned int k=0; k<z; ++k){
-                        float flipped = -grid->GetCell(i,j,k);
-                        grid->SetCell(i,j,k,flipped);
-                    }
-                }       
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                unsigned int index = grid->GetIndex(list[c].x, list[c].y, list[c].z);
+                raw[index] = -raw[index];
             }
         }
     );
 }
 
 //Helper for preconditioner builder
-float ARef(Grid<int>* A, int i, int j, int k, int qi, int qj, int qk, glm::vec3 dimensions){
+float ARef(Grid<celltype>* A, int i, int j, int k, int qi, int qj, int qk, glm::vec3 dimensions){
     int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
     if( i<0 || i>x-1 || j<0 || j>y-1 || k<0 || k>z-1 || A->GetCell(i,j,k)!=FLUID ){ //if not liquid
         return 0.0;
@@ -78,7 +154,7 @@ float PRef(Grid<float>* p, int i, int j, int k, glm::vec3 dimensions){
 }
 
 //Helper for preconditioner builder
-float ADiag(Grid<int>* A, Grid<float>* L, int i, int j, int k, glm::vec3 dimensions, int subcell){
+float ADiag(Grid<celltype>* A, Grid<auxfloat>* L, int i, int j, int k, glm::vec3 dimensions, int subcell){
     int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
     float diag = 6.0;
     if( A->GetCell(i,j,k) != FLUID ){
@@ -93,7 +169,9 @@ float ADiag(Grid<int>* A, Grid<float>* L, int i, int j, int k, glm::vec3 dimensi
             diag -= 1.0;
         }
         else if( A->GetCell(qi,qj,qk)==AIR && subcell ) {
-            diag -= L->GetCell(qi,qj,qk)/glm::min(1.0e-6f,L->GetCell(i,j,k));
+            float lq = L->GetCell(qi,qj,qk);
+            float lf = L->GetCell(i,j,k);
+            diag -= lq/glm::min(1.0e-6f,lf);
         }
     }
     
@@ -102,14 +180,12 @@ float ADiag(Grid<int>* A, Grid<float>* L, int i, int j, int k, glm::vec3 dimensi
 
 //Does what it says
 void BuildPreconditioner(Grid<float>* pc, MacGrid& mgrid, int subcell){
-    int x = (int)mgrid.m_dimensions.x; int y = (int)mgrid.m_dimensions.y; 
-    int z = (int)mgrid.m_dimensions.z;
     float a = 0.25f;
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                for(unsigned int j=0; j<y; ++j){
-                    for(unsigned int k=0; k<z; ++k){
+    mgrid.m_A->ForEachActiveBlock(mgrid.m_dimensions,
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            for(unsigned int i=lo.x; i<hi.x; ++i){
+                for(unsigned int j=lo.y; j<hi.y; ++j){
+                    for(unsigned int k=lo.z; k<hi.z; ++k){
                         if(mgrid.m_A->GetCell(i,j,k)==FLUID){   
                             float left = ARef(mgrid.m_A,i-1,j,k,i,j,k,mgrid.m_dimensions) * 
                                          PRef(pc,i-1,j,k,mgrid.m_dimensions);
@@ -134,93 +210,152 @@ void BuildPreconditioner(Grid<float>* pc, MacGrid& mgrid, int subcell){
     );
 }
 
-//Helper for PCG solver: read X with clamped bounds
-float XRef(Grid<int>* A, Grid<float>* L, Grid<float>* X, glm::vec3 f, glm::vec3 p, 
-           glm::vec3 dimensions, int subcell){
-    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
-    int i = glm::min(glm::max(0,(int)p.x),x-1); int fi = (int)f.x;
-    int j = glm::min(glm::max(0,(int)p.y),y-1); int fj = (int)f.y;
-    int k = glm::min(glm::max(0,(int)p.z),z-1); int fk = (int)f.z;
-    if(A->GetCell(i,j,k) == FLUID){
-        return X->GetCell(i,j,k);
-    }else if(A->GetCell(i,j,k) == SOLID){
-        return X->GetCell(fi,fj,fk);
+//Helper for PCG solver: read X at buffer index q of neighbor of cell f. At the domain bounds
+//callers pass q==f, which is the same as clamping the neighbor back onto the cell
+float XRef(celltype* A, auxfloat* L, float* X, const unsigned int& f, const unsigned int& q, 
+           int subcell){
+    if(A[q] == FLUID){
+        return X[q];
+    }else if(A[q] == SOLID){
+        return X[f];
     } 
     if(subcell){
-        return L->GetCell(i,j,k)/glm::min(1.0e-6f,L->GetCell(fi,fj,fk))*X->GetCell(fi,fj,fk);
+        float lq = L[q];
+        float lf = L[f];
+        return lq/glm::min(1.0e-6f,lf)*X[f];
     }else{
         return 0.0f;
     }
 }
 
 // target = X + alpha*Y
-void Op(Grid<int>* A, Grid<float>* X, Grid<float>* Y, Grid<float>* target, float alpha, 
+void Op(Grid<celltype>* A, Grid<float>* X, Grid<float>* Y, Grid<float>* target, float alpha, 
         glm::vec3 dimensions){
-    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
-    for(unsigned int j=0; j<y; ++j){
-        for(unsigned int k=0; k<z; ++k){
-            //this parallel loop has to be the inner loop or else MSVC will barf
-            tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-                [=](const tbb::blocked_range<unsigned int>& r){
-                    for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                        if(A->GetCell(i,j,k)==FLUID){
-                            float targetval = X->GetCell(i,j,k)+alpha*Y->GetCell(i,j,k);
-                            target->SetCell(i,j,k,targetval);
+    A->ForEachActiveBlock(dimensions,
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            unsigned int k0 = lo.z;
+            for(unsigned int i=lo.x; i<hi.x; ++i){
+                for(unsigned int j=lo.y; j<hi.y; ++j){
+                    celltype* arow = A->GetRowSpan(i,j,k0);
+                    float* xrow = X->GetRowSpan(i,j,k0);
+                    float* yrow = Y->GetRowSpan(i,j,k0);
+                    float* trow = target->GetRowSpan(i,j,k0);
+                    for(unsigned int k=k0; k<hi.z; ++k){
+                        if(arow[k-k0]==FLUID){
+                            trow[k-k0] = xrow[k-k0]+alpha*yrow[k-k0];
                         }else{
-                            target->SetCell(i,j,k,0.0f);
-                        }               
+                            trow[k-k0] = 0.0f;
+                        }
                     }
                 }
-            );
+            }
         }
-    }
+    );
 }
 
-// ans = x^T * x
-float Product(Grid<int>* A, Grid<float>* X, Grid<float>* Y, glm::vec3 dimensions){
-    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
-    float result = 0.0f;
-    for(unsigned int i=0; i<x; i++){
-        for(unsigned int j=0; j<y; j++){
-            for(unsigned int k=0; k<z; k++){
-                if(A->GetCell(i,j,k)==FLUID){
-                    result += X->GetCell(i,j,k) * Y->GetCell(i,j,k);
+// ans = x^T * x. Deterministic mode sums per x slab, or per tile when sparse, in a fixed order
+float Product(Grid<celltype>* A, Grid<float>* X, Grid<float>* Y, glm::vec3 dimensions,
+              const bool& deterministic){
+    auto blockproduct = [=](const glm::vec3& lo, const glm::vec3& hi)->float{
+        unsigned int k0 = lo.z;
+        float result = 0.0f;
+        for(unsigned int i=lo.x; i<hi.x; i++){
+            for(unsigned int j=lo.y; j<hi.y; j++){
+                celltype* arow = A->GetRowSpan(i,j,k0);
+                float* xrow = X->GetRowSpan(i,j,k0);
+                float* yrow = Y->GetRowSpan(i,j,k0);
+                for(unsigned int k=k0; k<hi.z; k++){
+                    if(arow[k-k0]==FLUID){
+                        result += xrow[k-k0] * yrow[k-k0];
+                    }
                 }
             }
         }
+        return result;
+    };
+    if(deterministic){
+        bool sparse = A->IsSparse();
+        std::vector<glm::vec3>* tiles = &A->GetActiveTiles();
+        unsigned int blocks = sparse ? tiles->size() : (unsigned int)dimensions.x;
+        return tbb::parallel_deterministic_reduce(tbb::blocked_range<unsigned int>(0,blocks,1), 
+            0.0f,
+            [=](const tbb::blocked_range<unsigned int>& r, float sum)->float{
+                for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                    glm::vec3 lo = glm::vec3(b,0,0);
+                    glm::vec3 hi = glm::vec3(b+1,dimensions.y,dimensions.z);
+                    if(sparse){
+                        lo = (*tiles)[b]*(float)GRID_TILE_WIDTH;
+                        hi = glm::min(lo+glm::vec3(GRID_TILE_WIDTH), dimensions);
+                        if(lo.x>=hi.x || lo.y>=hi.y || lo.z>=hi.z){
+                            continue;
+                        }
+                    }
+                    sum += blockproduct(lo, hi);
+                }
+                return sum;
+            },
+            std::plus<float>()
+        );
     }
-    return result;
+    tbb::combinable<float> partialsums(0.0f);
+    A->ForEachActiveBlock(dimensions,
+        [&](const glm::vec3& lo, const glm::vec3& hi){
+            partialsums.local() += blockproduct(lo, hi);
+        }
+    );
+    return partialsums.combine(std::plus<float>());
 }
 
 //Helper for PCG solver: target = AX
-void ComputeAx(Grid<int>* A, Grid<float>* L, Grid<float>* X, Grid<float>* target, 
+void ComputeAx(Grid<celltype>* A, Grid<auxfloat>* L, Grid<float>* X, Grid<float>* target, 
                glm::vec3 dimensions, int subcell){
     int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
     float n = (float)glm::max(glm::max(x,y),z);
     float h = 1.0f/(n*n);
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                for(unsigned int j=0; j<y; ++j){
-                    for(unsigned int k=0; k<z; ++k){
-                        if(A->GetCell(i,j,k) == FLUID){
-                            float result = (6.0f*X->GetCell(i,j,k)
-                                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i+1,j,k), 
-                                                  dimensions, subcell)
-                                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i-1,j,k), 
-                                                  dimensions, subcell)
-                                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i,j+1,k), 
-                                                  dimensions, subcell)
-                                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i,j-1,k), 
-                                                  dimensions, subcell)
-                                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i,j,k+1), 
-                                                  dimensions, subcell)
-                                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i,j,k-1), 
-                                                  dimensions, subcell)
+    //all cell centered grids share one layout (and one tile pool layout when sparse), so we 
+    //can walk them with A's indices. Within a dense row neighbors are fixed strides away, 
+    //sparse neighbors may sit in another tile so they get looked up
+    celltype* a = A->GetRawData();
+    auxfloat* l = L->GetRawData();
+    float* xd = X->GetRawData();
+    float* t = target->GetRawData();
+    bool sparse = A->IsSparse();
+    unsigned int sx = A->GetSlabStride();
+    unsigned int sy = A->GetRowStride();
+    A->ForEachActiveBlock(dimensions,
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            for(unsigned int i=lo.x; i<hi.x; ++i){
+                for(unsigned int j=lo.y; j<hi.y; ++j){
+                    for(unsigned int k=lo.z; k<hi.z; ++k){
+                        unsigned int c = A->GetIndex(i,j,k);
+                        if(a[c] == FLUID){
+                            unsigned int q[6];
+                            if(sparse){
+                                q[0] = i<x-1 ? A->GetIndex(i+1,j,k) : c;
+                                q[1] = i>0 ? A->GetIndex(i-1,j,k) : c;
+                                q[2] = j<y-1 ? A->GetIndex(i,j+1,k) : c;
+                                q[3] = j>0 ? A->GetIndex(i,j-1,k) : c;
+                                q[4] = k<z-1 ? A->GetIndex(i,j,k+1) : c;
+                                q[5] = k>0 ? A->GetIndex(i,j,k-1) : c;
+                            }else{
+                                q[0] = i<x-1 ? c+sx : c;
+                                q[1] = i>0 ? c-sx : c;
+                                q[2] = j<y-1 ? c+sy : c;
+                                q[3] = j>0 ? c-sy : c;
+                                q[4] = k<z-1 ? c+1 : c;
+                                q[5] = k>0 ? c-1 : c;
+                            }
+                            float result = (6.0f*xd[c]
+                                            -XRef(a, l, xd, c, q[0], subcell)
+                                            -XRef(a, l, xd, c, q[1], subcell)
+                                            -XRef(a, l, xd, c, q[2], subcell)
+                                            -XRef(a, l, xd, c, q[3], subcell)
+                                            -XRef(a, l, xd, c, q[4], subcell)
+                                            -XRef(a, l, xd, c, q[5], subcell)
                                             )/h;
-                            target->SetCell(i,j,k,result);
+                            t[c] = result;
                         } else {
-                            target->SetCell(i,j,k,0.0f);
+                            t[c] = 0.0f;
                         }
                     }
                 }
@@ -229,18 +364,24 @@ void ComputeAx(Grid<int>* A, Grid<float>* L, Grid<float>* X, Grid<float>* target
     );
 }
 
-void ApplyPreconditioner(Grid<float>* Z, Grid<float>* R, Grid<float>* P, Grid<float>* L, 
-                         Grid<int>* A, glm::vec3 dimensions){
-    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
-    Grid<float>* Q = new Grid<float>(dimensions, 0.0f);
+//Q is scratch. Cells on a block's low faces read Q from neighboring blocks that may not have 
+//run yet, so Q is zeroed every call to keep those reads at 0 instead of the last iteration's Q
+void ApplyPreconditioner(Grid<float>* Z, Grid<float>* R, Grid<float>* P, Grid<float>* Q,
+                         Grid<auxfloat>* L, Grid<celltype>* A, glm::vec3 dimensions){
+    Q->Clear();
 
     // LQ = R
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                for(unsigned int j=0; j<y; ++j){
-                    for(unsigned int k=0; k<z; ++k){
-                        if(A->GetCell(i,j,k) == FLUID) {
+    A->ForEachActiveBlock(dimensions,
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            unsigned int k0 = lo.z;
+            for(unsigned int i=lo.x; i<hi.x; ++i){
+                for(unsigned int j=lo.y; j<hi.y; ++j){
+                    celltype* arow = A->GetRowSpan(i,j,k0);
+                    float* rrow = R->GetRowSpan(i,j,k0);
+                    float* prow = P->GetRowSpan(i,j,k0);
+                    float* qrow = Q->GetRowSpan(i,j,k0);
+                    for(unsigned int k=k0; k<hi.z; ++k){
+                        if(arow[k-k0] == FLUID) {
                             float left = ARef(A,i-1,j,k,i,j,k,dimensions)*
                                          PRef(P,i-1,j,k,dimensions)*PRef(Q,i-1,j,k,dimensions);
                             float bottom = ARef(A,i,j-1,k,i,j,k,dimensions)*
@@ -248,9 +389,8 @@ void ApplyPreconditioner(Grid<float>* Z, Grid<float>* R, Grid<float>* P, Grid<fl
                             float back = ARef(A,i,j,k-1,i,j,k,dimensions)*
                                          PRef(P,i,j,k-1,dimensions)*PRef(Q,i,j,k-1,dimensions);
                             
-                            float t = R->GetCell(i,j,k) - left - bottom - back;
-                            float qVal = t * P->GetCell(i,j,k);
-                            Q->SetCell(i,j,k,qVal);
+                            float t = rrow[k-k0] - left - bottom - back;
+                            qrow[k-k0] = t * prow[k-k0];
                         }
                     }
                 }
@@ -259,12 +399,11 @@ void ApplyPreconditioner(Grid<float>* Z, Grid<float>* R, Grid<float>* P, Grid<fl
     );
 
     // L^T Z = Q
-    for(int j=y-1; j>=0; j--){
-        for(int k=z-1; k>=0; k--){
-            //this parallel loop has to be the inner loop or else MSVC will barf
-            tbb::parallel_for(tbb::blocked_range<int>(-1,x-1),
-                [=](const tbb::blocked_range<int>& r){
-                    for(int i=r.end(); i!=r.begin(); i--){
+    A->ForEachActiveBlock(dimensions,
+        [=](const glm::vec3& lo, const glm::vec3& hi){
+            for(int j=hi.y-1; j>=(int)lo.y; j--){
+                for(int k=hi.z-1; k>=(int)lo.z; k--){
+                    for(int i=hi.x-1; i>=(int)lo.x; i--){
                         if(A->GetCell(i,j,k) == FLUID){
                             float right = ARef(A,i,j,k,i+1,j,k,dimensions)*
                                           PRef(P,i,j,k,dimensions)*PRef(Z,i+1,j,k,dimensions);
@@ -279,81 +418,441 @@ void ApplyPreconditioner(Grid<float>* Z, Grid<float>* R, Grid<float>* P, Grid<fl
                         }
                     }
                 }
-            );
+            }
         }
-    }
-    delete Q;
+    );
 }
 
-//Does what it says
-void SolveConjugateGradient(MacGrid& mgrid, Grid<float>* PC, int subcell, const bool& verbose){
+//Builds the compact list of FLUID cells the fused solver iterates over from the fluid list 
+//MarkCellTypes already gathered, so it keeps that list's slab order and never sweeps air or 
+//solid. Also zeroes pressure on the non-FLUID band cells, which the full-grid Op does as a side 
+//effect on the first x = x + alpha*s update; past the band pressure was never written
+void BuildFluidCellList(MacGrid& mgrid, std::vector<FluidCell>& cells){
     int x = (int)mgrid.m_dimensions.x; int y = (int)mgrid.m_dimensions.y; 
     int z = (int)mgrid.m_dimensions.z;
+    Grid<celltype>* A = mgrid.m_A;
+    Grid<float>* P = mgrid.m_P;
+    bool sparse = A->IsSparse();
+    unsigned int sx = A->GetSlabStride();
+    unsigned int sy = A->GetRowStride();
+    cells.resize(mgrid.m_fluidCells.size());
+    const glm::vec3* fluid = mgrid.m_fluidCells.empty() ? NULL : &mgrid.m_fluidCells[0];
+    FluidCell* list = cells.empty() ? NULL : &cells[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cells.size()),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int f=r.begin(); f!=r.end(); ++f){
+                int i = fluid[f].x; int j = fluid[f].y; int k = fluid[f].z;
+                FluidCell& cell = list[f];
+                unsigned int c = A->GetIndex(i,j,k);
+                cell.m_index = c;
+                if(sparse){
+                    cell.m_neighbors[0] = i<x-1 ? A->GetIndex(i+1,j,k) : c;
+                    cell.m_neighbors[1] = i>0 ? A->GetIndex(i-1,j,k) : c;
+                    cell.m_neighbors[2] = j<y-1 ? A->GetIndex(i,j+1,k) : c;
+                    cell.m_neighbors[3] = j>0 ? A->GetIndex(i,j-1,k) : c;
+                    cell.m_neighbors[4] = k<z-1 ? A->GetIndex(i,j,k+1) : c;
+                    cell.m_neighbors[5] = k>0 ? A->GetIndex(i,j,k-1) : c;
+                }else{
+                    cell.m_neighbors[0] = i<x-1 ? c+sx : c;
+                    cell.m_neighbors[1] = i>0 ? c-sx : c;
+                    cell.m_neighbors[2] = j<y-1 ? c+sy : c;
+                    cell.m_neighbors[3] = j>0 ? c-sy : c;
+                    cell.m_neighbors[4] = k<z-1 ? c+1 : c;
+                    cell.m_neighbors[5] = k>0 ? c-1 : c;
+                }
+            }
+        }
+    );
+    const glm::vec3* band = mgrid.m_bandCells.empty() ? NULL : &mgrid.m_bandCells[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,mgrid.m_bandCells.size()),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                int i = band[b].x; int j = band[b].y; int k = band[b].z;
+                if(i<x && j<y && k<z && A->GetCell(i,j,k)!=FLUID){
+                    P->SetCell(i,j,k,0.0f);
+                }
+            }
+        }
+    );
+}
 
-    Grid<float>* R = new Grid<float>(mgrid.m_dimensions, 0.0f);
-    Grid<float>* Z = new Grid<float>(mgrid.m_dimensions, 0.0f);
-    Grid<float>* S = new Grid<float>(mgrid.m_dimensions, 0.0f);
+//Fused solver kernel: target = AX, returns target . X. The matrix is never stored, each row is 
+//rebuilt from the cell flags and level set on the fly
+float FusedApplyA(const std::vector<FluidCell>& cells, celltype* A, auxfloat* L, float* X, 
+                  float* target, float h, int subcell, const bool& deterministic){
+    return ReduceSum(cells.size(), deterministic,
+        [=,&cells](const tbb::blocked_range<unsigned int>& r, float sum)->float{
+            for(unsigned int f=r.begin(); f!=r.end(); ++f){
+                const FluidCell& cell = cells[f];
+                unsigned int c = cell.m_index;
+                float ax = 6.0f*X[c];
+                for(unsigned int m=0; m<6; m++){
+                    ax -= XRef(A, L, X, c, cell.m_neighbors[m], subcell);
+                }
+                ax = ax/h;
+                target[c] = ax;
+                sum += ax*X[c];
+            }
+            return sum;
+        }
+    );
+}
 
-    //note: we're calling pressure "mgrid.P" instead of x
+//Fused solver kernel: P = P + alpha*S, R = R - alpha*Z, returns R . R
+float FusedUpdate(const std::vector<FluidCell>& cells, float* P, float* S, float* R, float* Z, 
+                  float alpha, const bool& deterministic){
+    return ReduceSum(cells.size(), deterministic,
+        [=,&cells](const tbb::blocked_range<unsigned int>& r, float sum)->float{
+            for(unsigned int f=r.begin(); f!=r.end(); ++f){
+                unsigned int c = cells[f].m_index;
+                P[c] += alpha*S[c];
+                R[c] -= alpha*Z[c];
+                sum += R[c]*R[c];
+            }
+            return sum;
+        }
+    );
+}
 
-    ComputeAx(mgrid.m_A, mgrid.m_L, mgrid.m_P, Z, mgrid.m_dimensions, subcell); // z = apply A(x)
-    Op(mgrid.m_A, mgrid.m_D, Z, R, -1.0f, mgrid.m_dimensions);                // r = b-Ax
-    float error0 = Product(mgrid.m_A, R, R, mgrid.m_dimensions);            // error0 = product(r,r)
+//Fused solver kernel: returns X . Y over the fluid cells
+float FusedProduct(const std::vector<FluidCell>& cells, float* X, float* Y, 
+                   const bool& deterministic){
+    return ReduceSum(cells.size(), deterministic,
+        [=,&cells](const tbb::blocked_range<unsigned int>& r, float sum)->float{
+            for(unsigned int f=r.begin(); f!=r.end(); ++f){
+                unsigned int c = cells[f].m_index;
+                sum += X[c]*Y[c];
+            }
+            return sum;
+        }
+    );
+}
 
-    // z = f(r), aka preconditioner step
-    ApplyPreconditioner(Z, R, PC, mgrid.m_L, mgrid.m_A, mgrid.m_dimensions);    
+//Fused solver kernel: target = X + alpha*Y over the fluid cells
+void FusedOp(const std::vector<FluidCell>& cells, float* X, float* Y, float* target, 
+             float alpha){
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cells.size()),
+        [=,&cells](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int f=r.begin(); f!=r.end(); ++f){
+                unsigned int c = cells[f].m_index;
+                target[c] = X[c]+alpha*Y[c];
+            }
+        }
+    );
+}
 
-    //s = z. TODO: replace with VDB deep copy?
+//Buckets FLUID cells by i+j+k. MIC(0)'s triangular solves only couple a cell to its -x,-y,-z 
+//(or +x,+y,+z) neighbors, which all sit on the previous (or next) diagonal, so every cell on one 
+//diagonal can be processed in parallel once the diagonals before it are done. Buckets are 
+//filled in x-major order so the result does not depend on the thread count
+void BuildWavefronts(Grid<celltype>* A, glm::vec3 dimensions, std::vector<glm::vec3>& cells,
+                     std::vector<unsigned int>& offsets){
+    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
+    std::vector< std::vector<glm::vec3> > slabs(x);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                for(int j=0; j<y; ++j){
+                    for(int k=0; k<z; ++k){
+                        if(A->GetCell(i,j,k)==FLUID){
+                            slabs[i].push_back(glm::vec3(i,j,k));
+                        }
+                    }
+                }
+            }
+        }
+    );
+    unsigned int wavecount = x+y+z-2;
+    offsets.assign(wavecount+1, 0);
+    for(int i=0; i<x; i++){
+        unsigned int slabcount = slabs[i].size();
+        for(unsigned int c=0; c<slabcount; c++){
+            glm::vec3 cell = slabs[i][c];
+            offsets[(unsigned int)(cell.x+cell.y+cell.z)+1]++;
+        }
+    }
+    for(unsigned int w=0; w<wavecount; w++){
+        offsets[w+1] += offsets[w];
+    }
+    cells.resize(offsets[wavecount]);
+    std::vector<unsigned int> cursor(offsets.begin(), offsets.end()-1);
+    for(int i=0; i<x; i++){
+        unsigned int slabcount = slabs[i].size();
+        for(unsigned int c=0; c<slabcount; c++){
+            glm::vec3 cell = slabs[i][c];
+            cells[cursor[(unsigned int)(cell.x+cell.y+cell.z)]++] = cell;
+        }
+    }
+}
 
-    for(unsigned int j=0; j<y; ++j ){
-        for(unsigned int k=0; k<z; ++k ){
-            //this parallel loop has to be the inner loop or else MSVC will barf
-            tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-                [=](const tbb::blocked_range<unsigned int>& r){
-                    for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                        S->SetCell(i,j,k,Z->GetCell(i,j,k));
+//Same as BuildPreconditioner, but walks the diagonals in order so every cell sees finished 
+//-x,-y,-z neighbors
+void BuildWavefrontPreconditioner(Grid<float>* pc, MacGrid& mgrid, int subcell,
+                                  const std::vector<glm::vec3>& cells,
+                                  const std::vector<unsigned int>& offsets){
+    float a = 0.25f;
+    unsigned int wavecount = offsets.size()-1;
+    for(unsigned int w=0; w<wavecount; w++){
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(offsets[w],offsets[w+1],256),
+            [=,&cells](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                    int i = cells[c].x; int j = cells[c].y; int k = cells[c].z;
+                    float left = ARef(mgrid.m_A,i-1,j,k,i,j,k,mgrid.m_dimensions) * 
+                                 PRef(pc,i-1,j,k,mgrid.m_dimensions);
+                    float bottom = ARef(mgrid.m_A,i,j-1,k,i,j,k,mgrid.m_dimensions) * 
+                                   PRef(pc,i,j-1,k,mgrid.m_dimensions);
+                    float back = ARef(mgrid.m_A,i,j,k-1,i,j,k,mgrid.m_dimensions) * 
+                                 PRef(pc,i,j,k-1,mgrid.m_dimensions);
+                    float diag = ADiag(mgrid.m_A, mgrid.m_L,i,j,k,mgrid.m_dimensions,subcell);
+                    float e = diag - (left*left) - (bottom*bottom) - (back*back);
+                    if(diag>0){
+                        if( e < a*diag ){
+                            e = diag;
+                        }
+                        pc->SetCell(i,j,k, 1.0f/glm::sqrt(e));
                     }
                 }
-            );  
+            }
+        );
+    }
+}
+
+//Same as ApplyPreconditioner, but each triangular solve walks the diagonals in order (forward 
+//for LQ = R, backward for L^T Z = Q), so the result matches a serial sweep exactly
+void ApplyWavefrontPreconditioner(Grid<float>* Z, Grid<float>* R, Grid<float>* P, Grid<float>* Q,
+                                  Grid<celltype>* A, glm::vec3 dimensions, 
+                                  const std::vector<glm::vec3>& cells,
+                                  const std::vector<unsigned int>& offsets){
+    unsigned int wavecount = offsets.size()-1;
+
+    // LQ = R
+    for(unsigned int w=0; w<wavecount; w++){
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(offsets[w],offsets[w+1],256),
+            [=,&cells](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                    int i = cells[c].x; int j = cells[c].y; int k = cells[c].z;
+                    float left = ARef(A,i-1,j,k,i,j,k,dimensions)*
+                                 PRef(P,i-1,j,k,dimensions)*PRef(Q,i-1,j,k,dimensions);
+                    float bottom = ARef(A,i,j-1,k,i,j,k,dimensions)*
+                                   PRef(P,i,j-1,k,dimensions)*PRef(Q,i,j-1,k,dimensions);
+                    float back = ARef(A,i,j,k-1,i,j,k,dimensions)*
+                                 PRef(P,i,j,k-1,dimensions)*PRef(Q,i,j,k-1,dimensions);
+                    float t = R->GetCell(i,j,k) - left - bottom - back;
+                    Q->SetCell(i,j,k, t * P->GetCell(i,j,k));
+                }
+            }
+        );
+    }
+
+    // L^T Z = Q
+    for(int w=wavecount-1; w>=0; w--){
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(offsets[w],offsets[w+1],256),
+            [=,&cells](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                    int i = cells[c].x; int j = cells[c].y; int k = cells[c].z;
+                    float right = ARef(A,i,j,k,i+1,j,k,dimensions)*
+                                  PRef(P,i,j,k,dimensions)*PRef(Z,i+1,j,k,dimensions);
+                    float top = ARef(A,i,j,k,i,j+1,k,dimensions)*
+                                PRef(P,i,j,k,dimensions)*PRef(Z,i,j+1,k,dimensions);
+                    float front = ARef(A,i,j,k,i,j,k+1,dimensions)*
+                                  PRef(P,i,j,k,dimensions)*PRef(Z,i,j,k+1,dimensions);
+                    float t = Q->GetCell(i,j,k) - right - top - front;
+                    Z->SetCell(i,j,k, t * P->GetCell(i,j,k));
+                }
+            }
+        );
+    }
+}
+
+//z = M^-1 r with whichever preconditioner was built
+void Precondition(Preconditioner& pc, Grid<float>* Z, Grid<float>* R, MacGrid& mgrid){
+    if(pc.m_type==MULTIGRID){
+        ApplyMultigridPreconditioner(pc.m_multigrid, Z, R);
+    }else if(pc.m_type==WAVEFRONT_MIC){
+        ApplyWavefrontPreconditioner(Z, R, pc.m_mic, pc.m_q, mgrid.m_A, mgrid.m_dimensions, 
+                                     pc.m_wavefrontcells, pc.m_wavefrontoffsets);
+    }else{
+        ApplyPreconditioner(Z, R, pc.m_mic, pc.m_q, mgrid.m_L, mgrid.m_A, mgrid.m_dimensions);
+    }
+}
+
+//Same PCG as SolveConjugateGradient, but the vector updates and dot products are fused into 
+//single passes over a compact FLUID cell list instead of separate full-grid sweeps per op
+void SolveFusedConjugateGradient(MacGrid& mgrid, SolverWorkspace& workspace, int subcell, 
+                                 const bool& deterministic, const bool& verbose, 
+                                 SolverStats& stats){
+    Preconditioner& PC = workspace.m_preconditioner;
+    int x = (int)mgrid.m_dimensions.x; int y = (int)mgrid.m_dimensions.y; 
+    int z = (int)mgrid.m_dimensions.z;
+    float n = (float)glm::max(glm::max(x,y),z);
+    float h = 1.0f/(n*n);
+
+    tbb::tick_count setupstart = tbb::tick_count::now();
+
+    Grid<float>* R = PrepareScratchGrid(workspace.m_r, mgrid);
+    Grid<float>* Z = PrepareScratchGrid(workspace.m_z, mgrid);
+    Grid<float>* S = PrepareScratchGrid(workspace.m_s, mgrid);
+
+    std::vector<FluidCell>& cells = workspace.m_cells;
+    BuildFluidCellList(mgrid, cells);
+
+    //all cell centered grids share A's layout, so one index addresses every vector
+    celltype* ad = mgrid.m_A->GetRawData();
+    auxfloat* l = mgrid.m_L->GetRawData();
+    float* p = mgrid.m_P->GetRawData();
+    float* d = mgrid.m_D->GetRawData();
+    float* r = R->GetRawData();
+    float* zd = Z->GetRawData();
+    float* sd = S->GetRawData();
+
+    FusedApplyA(cells, ad, l, p, zd, h, subcell, deterministic);        // z = apply A(x)
+    FusedOp(cells, d, zd, r, -1.0f);                                    // r = b-Ax
+    float error0 = FusedProduct(cells, r, r, deterministic);            // error0 = product(r,r)
+
+    // z = f(r), aka preconditioner step
+    Precondition(PC, Z, R, mgrid);
+
+    //s = z
+    S->Copy(Z);
+
+    float eps = 1.0e-2f * (x*y*z);
+    float a = FusedProduct(cells, zd, r, deterministic);                // a = product(z,r)
+
+    stats.m_setupTime = (tbb::tick_count::now()-setupstart).seconds()*1000.0f;
+
+    for( int k=0; k<x*y*z; k++){
+        tbb::tick_count iterationstart = tbb::tick_count::now();
+        //Solve current iteration
+        float zs = FusedApplyA(cells, ad, l, sd, zd, h, subcell,        // z = applyA(s), z . s
+                               deterministic);
+        float alpha = a/zs;                                             // alpha = a/(z . s)
+        float error1 = FusedUpdate(cells, p, sd, r, zd, alpha,          // x += alpha*s, 
+                                    deterministic);
+                                                                        // r -= alpha*z, r . r
+        error0 = glm::max(error0, error1);
+        stats.m_iterations = k+1;
+        //Output progress
+        if(verbose){
+            float rate = 1.0f - glm::max(0.0f,glm::min(1.0f,(error1-eps)/(error0-eps)));
+            std::cout << "PCG Iteration " << k+1 << ": " << 100.0f*pow(rate,6) << "% solved" 
+                      << std::endl;
         }
+        if(error1<=eps){
+            stats.m_iterationTimes.push_back((tbb::tick_count::now()-iterationstart).seconds()*
+                                             1000.0f);
+            break;
+        }
+        //Prep next iteration
+        // z = f(r)
+        Precondition(PC, Z, R, mgrid);
+        float a2 = FusedProduct(cells, zd, r, deterministic);           // a2 = product(z,r)
+        float beta = a2/a;                                              // beta = a2/a
+        FusedOp(cells, zd, sd, sd, beta);                               // s = z + beta*s
+        a = a2;
+        stats.m_iterationTimes.push_back((tbb::tick_count::now()-iterationstart).seconds()*
+                                         1000.0f);
     }
+}
 
+//Does what it says
+void SolveConjugateGradient(MacGrid& mgrid, SolverWorkspace& workspace, int subcell, 
+                            const bool& deterministic, const bool& verbose, 
+                            SolverStats& stats){
+    int x = (int)mgrid.m_dimensions.x; int y = (int)mgrid.m_dimensions.y; 
+    int z = (int)mgrid.m_dimensions.z;
+    Preconditioner& PC = workspace.m_preconditioner;
+
+    Grid<float>* R = PrepareScratchGrid(workspace.m_r, mgrid);
+    Grid<float>* Z = PrepareScratchGrid(workspace.m_z, mgrid);
+    Grid<float>* S = PrepareScratchGrid(workspace.m_s, mgrid);
+
+    //note: we're calling pressure "mgrid.P" instead of x
+
+    ComputeAx(mgrid.m_A, mgrid.m_L, mgrid.m_P, Z, mgrid.m_dimensions, subcell); // z = apply A(x)
+    Op(mgrid.m_A, mgrid.m_D, Z, R, -1.0f, mgrid.m_dimensions);                // r = b-Ax
+    float error0 = Product(mgrid.m_A, R, R, mgrid.m_dimensions, deterministic); // error0 = r . r
+
+    // z = f(r), aka preconditioner step
+    Precondition(PC, Z, R, mgrid);
+
+    //s = z
+    S->Copy(Z);
 
     float eps = 1.0e-2f * (x*y*z);
-    float a = Product(mgrid.m_A, Z, R, mgrid.m_dimensions);                 // a = product(z,r)
+    float a = Product(mgrid.m_A, Z, R, mgrid.m_dimensions, deterministic);      // a = z . r
 
     for( int k=0; k<x*y*z; k++){
+        tbb::tick_count iterationstart = tbb::tick_count::now();
         //Solve current iteration
         ComputeAx(mgrid.m_A, mgrid.m_L, S, Z, mgrid.m_dimensions, subcell); // z = applyA(s)
-        float alpha = a/Product(mgrid.m_A, Z, S, mgrid.m_dimensions);       // alpha = a/(z . s)
+        float alpha = a/Product(mgrid.m_A, Z, S, mgrid.m_dimensions,        // alpha = a/(z . s)
+                                deterministic);
         Op(mgrid.m_A, mgrid.m_P, S, mgrid.m_P, alpha, mgrid.m_dimensions);  // x = x + alpha*s
         Op(mgrid.m_A, R, Z, R, -alpha, mgrid.m_dimensions);                 // r = r - alpha*z;
-        float error1 = Product(mgrid.m_A, R, R, mgrid.m_dimensions);        // error1 = product(r,r)
+        float error1 = Product(mgrid.m_A, R, R, mgrid.m_dimensions,         // error1 = r . r
+                               deterministic);
         error0 = glm::max(error0, error1);
+        stats.m_iterations = k+1;
         //Output progress
-        float rate = 1.0f - glm::max(0.0f,glm::min(1.0f,(error1-eps)/(error0-eps)));
-        // if(verbose){
+        if(verbose){
+            float rate = 1.0f - glm::max(0.0f,glm::min(1.0f,(error1-eps)/(error0-eps)));
             std::cout << "PCG Iteration " << k+1 << ": " << 100.0f*pow(rate,6) << "% solved" 
                       << std::endl;
-        // }
+        }
         if(error1<=eps){
+            stats.m_iterationTimes.push_back((tbb::tick_count::now()-iterationstart).seconds()*
+                                             1000.0f);
             break;
         }
         //Prep next iteration
         // z = f(r)
-        ApplyPreconditioner(Z, R, PC, mgrid.m_L, mgrid.m_A, mgrid.m_dimensions);
-        float a2 = Product(mgrid.m_A, Z, R, mgrid.m_dimensions);            // a2 = product(z,r)
+        Precondition(PC, Z, R, mgrid);
+        float a2 = Product(mgrid.m_A, Z, R, mgrid.m_dimensions, deterministic); // a2 = z . r
         float beta = a2/a;                                                  // beta = a2/a
         Op(mgrid.m_A, Z, S, S, beta, mgrid.m_dimensions);                   // s = z + beta*s
         a = a2;
+        stats.m_iterationTimes.push_back((tbb::tick_count::now()-iterationstart).seconds()*
+                                         1000.0f);
+    }
+}
+
+//Hands back grid ready for a solve: created on first use, otherwise given A's current tiles and 
+//zeroed, so it reads exactly like a freshly allocated grid
+Grid<float>* PrepareScratchGrid(Grid<float>*& grid, MacGrid& mgrid){
+    if(grid==NULL){
+        grid = new Grid<float>(mgrid.m_dimensions, 0.0f, mgrid.m_sparse);
+        grid->SetActiveTiles(mgrid.m_A->GetActiveTiles());
+        return grid;
     }
+    grid->SetActiveTiles(mgrid.m_A->GetActiveTiles());
+    grid->Clear();
+    return grid;
+}
 
-    delete R;
-    delete Z;
-    delete S;
+SolverWorkspace CreateSolverWorkspace(){
+    SolverWorkspace w;
+    w.m_preconditioner.m_mic = NULL;
+    w.m_preconditioner.m_q = NULL;
+    w.m_r = NULL;
+    w.m_z = NULL;
+    w.m_s = NULL;
+    return w;
 }
 
-void Solve(MacGrid& mgrid, const int& subcell, const bool& verbose){
+void ClearSolverWorkspace(SolverWorkspace& workspace){
+    delete workspace.m_preconditioner.m_mic;
+    delete workspace.m_preconditioner.m_q;
+    DeleteMultigrid(workspace.m_preconditioner.m_multigrid);
+    delete workspace.m_r;
+    delete workspace.m_z;
+    delete workspace.m_s;
+    workspace = CreateSolverWorkspace();
+}
+
+SolverStats Solve(MacGrid& mgrid, const int& subcell, const FlipSettings& settings, 
+                  SolverWorkspace& workspace, const bool& verbose){
+    SolverStats stats;
+    tbb::tick_count solvestart = tbb::tick_count::now();
 
     //if in VDB mode, force to single threaded to prevent VDB write issues. 
     //this is a kludgey fix for now.
@@ -362,20 +861,48 @@ void Solve(MacGrid& mgrid, const int& subcell, const bool& verbose){
     // }
 
     //flip divergence
-    FlipGrid(mgrid.m_D, mgrid.m_dimensions);
+    FlipGrid(mgrid.m_D, mgrid.m_fluidCells);
 
     //build preconditioner
-    Grid<float>* preconditioner = new Grid<float>(mgrid.m_dimensions, 0.0f);
-    BuildPreconditioner(preconditioner, mgrid, subcell);
+    Preconditioner& preconditioner = workspace.m_preconditioner;
+    preconditioner.m_type = settings.m_preconditioner;
+    //the slab parallel MIC sweeps race, the wavefront build applies the same factorization safely.
+    //sparse grids hand out tiles in any order, which cuts every tile face instead of just slab
+    //boundaries, so they always take the wavefront build
+    if((settings.m_deterministic || mgrid.m_sparse) && preconditioner.m_type==MIC){
+        preconditioner.m_type = WAVEFRONT_MIC;
+    }
+    if(preconditioner.m_type==MULTIGRID){
+        BuildMultigrid(mgrid, subcell, preconditioner.m_multigrid);
+    }else{
+        PrepareScratchGrid(preconditioner.m_mic, mgrid);
+        PrepareScratchGrid(preconditioner.m_q, mgrid);
+        if(preconditioner.m_type==WAVEFRONT_MIC){
+            BuildWavefronts(mgrid.m_A, mgrid.m_dimensions, preconditioner.m_wavefrontcells,
+                            preconditioner.m_wavefrontoffsets);
+            BuildWavefrontPreconditioner(preconditioner.m_mic, mgrid, subcell, 
+                                         preconditioner.m_wavefrontcells,
+                                         preconditioner.m_wavefrontoffsets);
+        }else{
+            BuildPreconditioner(preconditioner.m_mic, mgrid, subcell);
+        }
+    }
 
     //solve conjugate gradient
-    SolveConjugateGradient(mgrid, preconditioner, subcell, verbose);
+    if(settings.m_fusedSolver){
+        SolveFusedConjugateGradient(mgrid, workspace, subcell, settings.m_deterministic, 
+                                    verbose, stats);
+    }else{
+        SolveConjugateGradient(mgrid, workspace, subcell, settings.m_deterministic, verbose, 
+                               stats);
+    }
 
-    delete preconditioner;
+    stats.m_totalTime = (tbb::tick_count::now()-solvestart).seconds()*1000.0f;
 
     // if(mgrid.type==VDB){
     //  omp_set_num_threads(omp_get_num_procs());
     // }
+    return stats;
 }
 }
 
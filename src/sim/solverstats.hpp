@@ -0,0 +1,28 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: solverstats.hpp
+// Timing and convergence info reported back by the pressure solver
+
+#ifndef SOLVERSTATS_HPP
+#define SOLVERSTATS_HPP
+
+#include <vector>
+
+namespace fluidCore {
+//====================================
+// Struct Declarations
+//====================================
+
+struct SolverStats{
+    unsigned int        m_iterations;
+    float               m_setupTime; //ms
+    float               m_totalTime; //ms
+    std::vector<float>  m_iterationTimes; //ms
+
+    //Initializer
+    SolverStats(): m_iterations(0), m_setupTime(0.0f), m_totalTime(0.0f){};
+};
+}
+
+#endif
@@ -17,6 +17,8 @@
 #define SHARED
 #endif
 
+#include <tbb/tbb.h>
+#include <vector>
 #include "aabb.hpp"
 #include "spatial.hpp"
 #include "../ray/ray.hpp"
@@ -24,19 +26,34 @@
 
 enum Axis{axis_x, axis_y, axis_z};
 
+//rays per packet in packet traversal
+#define BVH_PACKET_WIDTH 4
+//children per node in the flattened traversal tree
+#define BVH_WIDTH 4
+//a 4 wide tree can leave up to three siblings per level on the stack. Deeper trees spill the
+//rest to the heap
+#define BVH_STACK_SIZE 128
+#define BVH_INVALID_NODE 0xffffffff
+//centroid bins per axis for SAH splits
+#define BVH_SAH_BINS 16
+//nodes with this many references or fewer are never split
+#define BVH_LEAF_SIZE 5
+//subtrees with more references than this are built as their own task
+#define BVH_PARALLEL_BUILD_SIZE 4096
+
 namespace spaceCore {
 
 //====================================
 // Struct Declarations
 //====================================
 
+//Binary node, only used while building. BuildBvh collapses these into Bvh4Nodes
 struct BvhNode {
     Aabb m_bounds;
     unsigned int m_referenceOffset; //offset into bvh-wide reference index 
     unsigned int m_numberOfReferences;
     unsigned int m_left;
     unsigned int m_right;
-    unsigned int m_nodeid;
 
     BvhNode(){
         m_bounds = Aabb();
@@ -53,12 +70,119 @@ struct BvhNode {
             return false;
         }
     }
+};
+
+//Traversal node holding four children's bounds as SoA, so one ray tests all four children 
+//in a single pass over two cache lines. A child slot is either an inner node, holding the 
+//index of its Bvh4Node, or a leaf, holding an offset and count into the reference indices
+struct Bvh4Node {
+    float           m_minX[BVH_WIDTH];
+    float           m_minY[BVH_WIDTH];
+    float           m_minZ[BVH_WIDTH];
+    float           m_maxX[BVH_WIDTH];
+    float           m_maxY[BVH_WIDTH];
+    float           m_maxZ[BVH_WIDTH];
+    unsigned int    m_children[BVH_WIDTH];      //node index, reference offset, or invalid
+    unsigned int    m_numberOfReferences[BVH_WIDTH]; //0 for inner nodes
+
+    Bvh4Node(){
+        for(unsigned int c=0; c<BVH_WIDTH; c++){
+            m_minX[c] = 0.0f; m_minY[c] = 0.0f; m_minZ[c] = 0.0f;
+            m_maxX[c] = 0.0f; m_maxY[c] = 0.0f; m_maxZ[c] = 0.0f;
+            m_children[c] = BVH_INVALID_NODE;
+            m_numberOfReferences[c] = 0;
+        }
+    }
+
+    HOST DEVICE bool IsLeaf(const unsigned int& child) const{
+        return m_numberOfReferences[child]>0;
+    }
+
+    HOST DEVICE void SetBounds(const unsigned int& child, const Aabb& box){
+        m_minX[child] = box.m_min.x; m_minY[child] = box.m_min.y; m_minZ[child] = box.m_min.z;
+        m_maxX[child] = box.m_max.x; m_maxY[child] = box.m_max.y; m_maxZ[child] = box.m_max.z;
+    }
+
+    //Union of every valid child's bounds
+    HOST DEVICE Aabb GetBounds() const{
+        Aabb box;
+        for(unsigned int c=0; c<BVH_WIDTH; c++){
+            if(m_children[c]!=BVH_INVALID_NODE){
+                box.ExpandAabb(glm::vec3(m_minX[c], m_minY[c], m_minZ[c]), 
+                               glm::vec3(m_maxX[c], m_maxY[c], m_maxZ[c]));
+            }
+        }
+        return box;
+    }
+
+    //Slab tests a ray against all four children. Returns one bit per child hit, and each hit
+    //child's entry distance in ray parameters. Origins inside a child count as hits
+    HOST DEVICE unsigned int IntersectChildren(const glm::vec3& origin, 
+                                               const glm::vec3& inverseDirection,
+                                               float* distances) const{
+        float tfar[BVH_WIDTH];
+        for(unsigned int c=0; c<BVH_WIDTH; c++){
+            float t1 = (m_minX[c] - origin.x)*inverseDirection.x;
+            float t2 = (m_maxX[c] - origin.x)*inverseDirection.x;
+            float t3 = (m_minY[c] - origin.y)*inverseDirection.y;
+            float t4 = (m_maxY[c] - origin.y)*inverseDirection.y;
+            float t5 = (m_minZ[c] - origin.z)*inverseDirection.z;
+            float t6 = (m_maxZ[c] - origin.z)*inverseDirection.z;
+            distances[c] = glm::max(glm::max(glm::min(t1, t2), glm::min(t3, t4)), 
+                                    glm::min(t5, t6));
+            tfar[c] = glm::min(glm::min(glm::max(t1, t2), glm::max(t3, t4)), glm::max(t5, t6));
+        }
+        unsigned int hits = 0;
+        for(unsigned int c=0; c<BVH_WIDTH; c++){
+            if(m_children[c]!=BVH_INVALID_NODE && tfar[c]>=0.0f && distances[c]<=tfar[c]){
+                hits |= 1u<<c;
+            }
+        }
+        return hits;
+    }
+};
+
+//Traversal stack. The first BVH_STACK_SIZE entries live in the stack frame, anything past that
+//goes to a heap vector, so a deep tree never loses children
+template <typename E> struct BvhStack {
+    E               m_local[BVH_STACK_SIZE];
+    std::vector<E>  m_spill;
+    unsigned int    m_top;
+
+    BvhStack(){
+        m_top = 0;
+    }
+
+    bool IsEmpty() const{
+        return m_top==0;
+    }
+
+    void Push(const E& entry){
+        if(m_top<BVH_STACK_SIZE){
+            m_local[m_top] = entry;
+        }else{
+            m_spill.push_back(entry);
+        }
+        m_top++;
+    }
 
-    HOST DEVICE float FastIntersectionTest(const rayCore::Ray& r){
-        return m_bounds.FastIntersectionTest(r);
+    E Pop(){
+        m_top--;
+        if(m_top<BVH_STACK_SIZE){
+            return m_local[m_top];
+        }
+        E entry = m_spill.back();
+        m_spill.pop_back();
+        return entry;
     }
 };
 
+//Packet traversal stack entry, a node and the lanes whose rays hit it
+struct BvhPacketEntry {
+    unsigned int    m_node;
+    unsigned int    m_lanes;
+};
+
 //====================================
 // Class Declarations
 //===================================
@@ -67,27 +191,66 @@ template <typename T> class Bvh {
     public:
         Bvh(T basegeom);
         Bvh();
+        //Copies get their own nodes and references, except references shared with a topology
+        //and arrays kept by someone else, which stay shared
+        Bvh(const Bvh<T>& source);
+        Bvh<T>& operator=(const Bvh<T>& source);
         ~Bvh();
 
         void BuildBvh(const unsigned int& maxDepth);
+        //Takes the tree of a bvh over identical topology and refits it to this bvh's elements.
+        //The reference indices are shared with topology, not copied, so topology has to 
+        //outlive this bvh
+        void BuildFromTopology(const Bvh<T>& topology);
+        //Recomputes every node's bounds from the current element bounds, keeping the tree
+        void Refit();
         HOST DEVICE void Traverse(const rayCore::Ray& r, TraverseAccumulator& result);
+        //Traverses rays BVH_PACKET_WIDTH at a time, recording into one accumulator per ray
+        HOST DEVICE void TraversePacket(const rayCore::Ray* rays, TraverseAccumulator** results,
+                                        const unsigned int& count);
+        //Returns as soon as anything is hit within maxDistance along the ray
+        HOST DEVICE bool TraverseAnyHit(const rayCore::Ray& r, const float& maxDistance);
+        //Calls visit(primID) for every element in a leaf the ray enters within maxDistance,
+        //without testing the elements themselves, and stops once visit returns true. Meant
+        //for bvhs over instances that run their own exact test
+        template <typename F> HOST DEVICE void VisitElements(const rayCore::Ray& r, 
+                                                             const float& maxDistance,
+                                                             F& visit);
 
-        BvhNode*                    m_nodes;
+        Aabb                        m_bounds;
+        Bvh4Node*                   m_nodes;
         unsigned int                m_numberOfNodes;
         unsigned int*               m_referenceIndices;
         unsigned int                m_numberOfReferenceIndices;
         unsigned int                m_id;
         unsigned int                m_depth;
         T                           m_basegeom;
+        //if set, m_nodes and m_referenceIndices belong to someone else, like a mapped mesh
+        //cache, and are never freed
+        bool                        m_keep;
 
     private:
-        float FindBestSplit(BvhNode& Node, std::vector<unsigned int>& references,
-                            const Axis& direction, const unsigned int& quality, Aabb* aabbs,
-                            unsigned int& leftCount, unsigned int& rightCount);
-        Axis FindLongestAxis(const Aabb& box);
-        double CalculateSplitCost(const float& split, const BvhNode& node, 
-                                  std::vector<unsigned int>& references, const Axis& direction,
-                                  Aabb* aabbs, unsigned int& leftCount, unsigned int& rightCount);
+        //Frees whatever arrays this bvh owns and empties it
+        void Release();
+        void CopyFrom(const Bvh<T>& source);
+
+        HOST DEVICE void IntersectLeaf(const unsigned int& referenceOffset, 
+                                       const unsigned int& numberOfReferences,
+                                       const rayCore::Ray& r, const unsigned int& nodeid,
+                                       TraverseAccumulator& result);
+        unsigned int CollapseNode(std::vector<BvhNode>& tree, const unsigned int& nodeID,
+                                  std::vector<Bvh4Node>& wideNodes);
+        void BuildNode(tbb::concurrent_vector<BvhNode>& tree, const unsigned int& nodeID,
+                       const unsigned int& depth, const unsigned int& maxDepth, Aabb* aabbs,
+                       tbb::atomic<unsigned int>& layerCount);
+        bool FindBinnedSplit(const unsigned int& referenceOffset, const unsigned int& refCount,
+                             Aabb* aabbs, Axis& splitAxis, unsigned int& splitBin,
+                             Aabb& centroidBounds);
+        static unsigned int BinIndex(const float& centroid, const float& axisMin, 
+                                     const float& axisExtent);
+
+        //set when m_referenceIndices came from a topology bvh, which frees them
+        bool                        m_sharedReferences;
 };
 }
 
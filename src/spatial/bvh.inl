@@ -9,6 +9,7 @@
 
 #include "bvh.hpp"
 #include "../utilities/datastructures.hpp"
+#include <algorithm>
 
 namespace spaceCore {
    
@@ -17,6 +18,8 @@ template <typename T> Bvh<T>::Bvh(T basegeom){
     m_numberOfNodes = 0;
     m_referenceIndices = NULL;
     m_numberOfReferenceIndices = 0;
+    m_keep = false;
+    m_sharedReferences = false;
     m_basegeom = basegeom;
 }
 
@@ -25,341 +28,540 @@ template <typename T> Bvh<T>::Bvh(){
     m_numberOfNodes = 0;
     m_referenceIndices = NULL;
     m_numberOfReferenceIndices = 0;
+    m_keep = false;
+    m_sharedReferences = false;
+}
+
+template <typename T> Bvh<T>::Bvh(const Bvh<T>& source){
+    m_nodes = NULL;
+    m_numberOfNodes = 0;
+    m_referenceIndices = NULL;
+    m_numberOfReferenceIndices = 0;
+    m_keep = false;
+    m_sharedReferences = false;
+    CopyFrom(source);
+}
+
+template <typename T> Bvh<T>& Bvh<T>::operator=(const Bvh<T>& source){
+    if(this!=&source){
+        Release();
+        CopyFrom(source);
+    }
+    return *this;
 }
 
 template <typename T> Bvh<T>::~Bvh(){
-    /*if(m_nodes!=NULL){
-        delete [] m_nodes;
+    Release();
+}
+
+template <typename T> void Bvh<T>::Release(){
+    if(m_keep==false){
+        if(m_nodes!=NULL){
+            tbb::cache_aligned_allocator<Bvh4Node>().deallocate(m_nodes, m_numberOfNodes);
+        }
+        if(m_referenceIndices!=NULL && m_sharedReferences==false){
+            delete [] m_referenceIndices;
+        }
     }
-    if(m_referenceIndices!=NULL){
-        delete [] m_referenceIndices;
-    }*/
+    m_nodes = NULL;
+    m_numberOfNodes = 0;
+    m_referenceIndices = NULL;
+    m_numberOfReferenceIndices = 0;
+    m_keep = false;
+    m_sharedReferences = false;
 }
 
-template <typename T> void Bvh<T>::Traverse(const rayCore::Ray& r, TraverseAccumulator& result){
-    ShortStack<BvhNode*> stack;
-    stack.Push(&m_nodes[1]);
-    BvhNode* current = &m_nodes[1];
-    //check for root node hit/miss
-    float distanceToCurrent = current->FastIntersectionTest(r);
-    if(distanceToCurrent<-0.5f){
+//Expects this bvh to be empty
+template <typename T> void Bvh<T>::CopyFrom(const Bvh<T>& source){
+    m_bounds = source.m_bounds;
+    m_id = source.m_id;
+    m_depth = source.m_depth;
+    m_basegeom = source.m_basegeom;
+    m_keep = source.m_keep;
+    m_sharedReferences = source.m_sharedReferences;
+    m_numberOfNodes = source.m_numberOfNodes;
+    m_numberOfReferenceIndices = source.m_numberOfReferenceIndices;
+    if(m_keep==true){
+        m_nodes = source.m_nodes;
+        m_referenceIndices = source.m_referenceIndices;
         return;
+    }
+    if(source.m_nodes!=NULL){
+        m_nodes = tbb::cache_aligned_allocator<Bvh4Node>().allocate(m_numberOfNodes);
+        std::copy(source.m_nodes, source.m_nodes+m_numberOfNodes, m_nodes);
+    }
+    if(m_sharedReferences==true || source.m_referenceIndices==NULL){
+        m_referenceIndices = source.m_referenceIndices;
     }else{
-        float distanceToCurrent = 10000000000000.0f;
-        while(stack.Empty()==false){
-            //traverse and push back to stack until leaf node is reached
-            bool empty = false;
-            while(current->IsLeaf()==false && empty==false){
-                BvhNode* left = &m_nodes[current->m_left];
-                BvhNode* right = &m_nodes[current->m_right];
-                //find nearest and farthest child
-                float distanceToLeft = left->FastIntersectionTest(r);
-                float distanceToRight = right->FastIntersectionTest(r);
-                //if ray intersects both children, push current node onto stack and set current
-                //to nearest child
-                if(distanceToLeft>-0.5f && distanceToRight>-0.5f){
-                    stack.Push(current);
-                    if(distanceToLeft<distanceToRight){
-                        current = left;
-                    }else{
-                        current = right;
-                    }
-                //else if intersect only the left or right child
-                }else if(distanceToLeft>-0.5f && distanceToRight<-0.5f){
-                    current = left;
-                }else if(distanceToRight>-0.5f && distanceToLeft<-0.5f){
-                    current = right;
-                //else if intersect neither children, abort loop and move onto next node in stack
+        m_referenceIndices = new unsigned int[m_numberOfReferenceIndices];
+        std::copy(source.m_referenceIndices, 
+                  source.m_referenceIndices+m_numberOfReferenceIndices, m_referenceIndices);
+    }
+}
+
+//Same in front of origin check every traversal makes on leaf hits
+HOST DEVICE inline bool IsHitInFront(const rayCore::Intersection& hit, const rayCore::Ray& r){
+    glm::vec3 n = glm::normalize(hit.m_point-r.m_origin);
+    float degree = glm::acos(glm::dot(n, r.m_direction));
+    return degree<(PI/2.0f) || degree!=degree;
+}
+
+template <typename T> void Bvh<T>::IntersectLeaf(const unsigned int& referenceOffset, 
+                                                 const unsigned int& numberOfReferences,
+                                                 const rayCore::Ray& r, 
+                                                 const unsigned int& nodeid,
+                                                 TraverseAccumulator& result){
+    for(unsigned int i=0; i<numberOfReferences; i++){
+        unsigned int primID = m_referenceIndices[referenceOffset+i];
+        rayCore::Intersection rhit = m_basegeom.IntersectElement(primID, r); 
+        //make sure hit is actually in front of origin
+        if(rhit.m_hit && IsHitInFront(rhit, r)){
+            result.RecordIntersection(rhit, nodeid);
+        }
+    }
+}
+
+//Every intersected leaf is visited, since accumulators like the hit counter need all hits
+template <typename T> void Bvh<T>::Traverse(const rayCore::Ray& r, TraverseAccumulator& result){
+    if(m_numberOfNodes==0){
+        return;
+    }
+    glm::vec3 inverseDirection = 1.0f/r.m_direction;
+    BvhStack<unsigned int> stack;
+    stack.Push(0);
+    while(stack.IsEmpty()==false){
+        unsigned int nodeid = stack.Pop();
+        const Bvh4Node& node = m_nodes[nodeid];
+        float distances[BVH_WIDTH];
+        unsigned int hits = node.IntersectChildren(r.m_origin, inverseDirection, distances);
+        for(unsigned int c=0; c<BVH_WIDTH; c++){
+            if((hits>>c)&1){
+                if(node.IsLeaf(c)){
+                    IntersectLeaf(node.m_children[c], node.m_numberOfReferences[c], r, nodeid,
+                                  result);
                 }else{
-                    empty = true;
+                    stack.Push(node.m_children[c]);
                 }
             }
-            if(current->IsLeaf()){
-                for(unsigned int i=0; i<current->m_numberOfReferences; i++){
-                    unsigned int primID = m_referenceIndices[current->m_referenceOffset+i];
-                    rayCore::Intersection rhit = m_basegeom.IntersectElement(primID, r); 
-                    if(rhit.m_hit){
-                        //make sure hit is actually in front of origin
-                        glm::vec3 n = glm::normalize(rhit.m_point-r.m_origin);
-                        float degree = glm::acos(glm::dot(n, r.m_direction));
-                        if(degree<(PI/2.0f) || degree!=degree){
-                            result.RecordIntersection(rhit, current->m_nodeid);
-                        }
+        }
+    }
+}
+
+template <typename T> void Bvh<T>::TraversePacket(const rayCore::Ray* rays, 
+                                                  TraverseAccumulator** results,
+                                                  const unsigned int& count){
+    if(m_numberOfNodes==0){
+        return;
+    }
+    for(unsigned int first=0; first<count; first+=BVH_PACKET_WIDTH){
+        unsigned int lanes = glm::min((unsigned int)BVH_PACKET_WIDTH, count-first);
+        glm::vec3 inverseDirections[BVH_PACKET_WIDTH];
+        for(unsigned int l=0; l<lanes; l++){
+            inverseDirections[l] = 1.0f/rays[first+l].m_direction;
+        }
+        //each node is fetched once for the whole packet, and carries down the lanes that hit it
+        BvhStack<BvhPacketEntry> stack;
+        BvhPacketEntry root;
+        root.m_node = 0;
+        root.m_lanes = (1u<<lanes)-1;
+        stack.Push(root);
+        while(stack.IsEmpty()==false){
+            BvhPacketEntry entry = stack.Pop();
+            unsigned int nodeid = entry.m_node;
+            unsigned int activeLanes = entry.m_lanes;
+            const Bvh4Node& node = m_nodes[nodeid];
+            unsigned int childLanes[BVH_WIDTH] = {0, 0, 0, 0};
+            for(unsigned int l=0; l<lanes; l++){
+                if((activeLanes>>l)&1){
+                    float distances[BVH_WIDTH];
+                    unsigned int hits = node.IntersectChildren(rays[first+l].m_origin, 
+                                                               inverseDirections[l], distances);
+                    for(unsigned int c=0; c<BVH_WIDTH; c++){
+                        childLanes[c] |= ((hits>>c)&1)<<l;
                     }
                 }
             }
-            //if stack is not empty, pop current node and pick farthest child
-            if(stack.Empty()==false){
-                current = stack.Pop();
-                BvhNode* left = &m_nodes[current->m_left];
-                BvhNode* right = &m_nodes[current->m_right];
-                //find nearest and farthest child
-                float distanceToLeft = left->FastIntersectionTest(r);
-                float distanceToRight = right->FastIntersectionTest(r);
-                if(distanceToLeft>=distanceToRight){
-                    current = left;
+            for(unsigned int c=0; c<BVH_WIDTH; c++){
+                if(childLanes[c]==0){
+                    continue;
+                }
+                if(node.IsLeaf(c)){
+                    for(unsigned int l=0; l<lanes; l++){
+                        if((childLanes[c]>>l)&1){
+                            IntersectLeaf(node.m_children[c], node.m_numberOfReferences[c], 
+                                          rays[first+l], nodeid, *results[first+l]);
+                        }
+                    }
                 }else{
-                    current = right;
+                    BvhPacketEntry child;
+                    child.m_node = node.m_children[c];
+                    child.m_lanes = childLanes[c];
+                    stack.Push(child);
+                }
+            }
+        }
+    }
+}
+
+template <typename T> bool Bvh<T>::TraverseAnyHit(const rayCore::Ray& r, 
+                                                  const float& maxDistance){
+    if(m_numberOfNodes==0){
+        return false;
+    }
+    //box tests return ray parameters, which are only distances for unit length directions
+    float directionLength = glm::length(r.m_direction);
+    glm::vec3 inverseDirection = 1.0f/r.m_direction;
+    BvhStack<unsigned int> stack;
+    stack.Push(0);
+    while(stack.IsEmpty()==false){
+        const Bvh4Node& node = m_nodes[stack.Pop()];
+        float distances[BVH_WIDTH];
+        unsigned int hits = node.IntersectChildren(r.m_origin, inverseDirection, distances);
+        for(unsigned int c=0; c<BVH_WIDTH; c++){
+            if(((hits>>c)&1)==0 || distances[c]*directionLength>maxDistance){
+                continue;
+            }
+            if(node.IsLeaf(c)){
+                for(unsigned int i=0; i<node.m_numberOfReferences[c]; i++){
+                    unsigned int primID = m_referenceIndices[node.m_children[c]+i];
+                    rayCore::Intersection rhit = m_basegeom.IntersectElement(primID, r); 
+                    if(rhit.m_hit && IsHitInFront(rhit, r) && 
+                       glm::length(rhit.m_point-r.m_origin)<=maxDistance){
+                        return true;
+                    }
                 }
+            }else{
+                stack.Push(node.m_children[c]);
             }
         }
+    }
+    return false;
+}
+
+template <typename T> template <typename F> void Bvh<T>::VisitElements(const rayCore::Ray& r,
+                                                                       const float& maxDistance,
+                                                                       F& visit){
+    if(m_numberOfNodes==0){
         return;
     }
+    float directionLength = glm::length(r.m_direction);
+    glm::vec3 inverseDirection = 1.0f/r.m_direction;
+    BvhStack<unsigned int> stack;
+    stack.Push(0);
+    while(stack.IsEmpty()==false){
+        const Bvh4Node& node = m_nodes[stack.Pop()];
+        float distances[BVH_WIDTH];
+        unsigned int hits = node.IntersectChildren(r.m_origin, inverseDirection, distances);
+        for(unsigned int c=0; c<BVH_WIDTH; c++){
+            if(((hits>>c)&1)==0 || distances[c]*directionLength>maxDistance){
+                continue;
+            }
+            if(node.IsLeaf(c)){
+                for(unsigned int i=0; i<node.m_numberOfReferences[c]; i++){
+                    if(visit(m_referenceIndices[node.m_children[c]+i])==true){
+                        return;
+                    }
+                }
+            }else{
+                stack.Push(node.m_children[c]);
+            }
+        }
+    }
+}
+
+//Collapses the binary subtree at nodeID into 4 wide nodes, pulling up grandchildren by
+//opening the largest inner child until the node is full. Returns the new node's index
+template <typename T> unsigned int Bvh<T>::CollapseNode(std::vector<BvhNode>& tree, 
+                                                        const unsigned int& nodeID,
+                                                        std::vector<Bvh4Node>& wideNodes){
+    unsigned int children[BVH_WIDTH];
+    unsigned int childCount = 0;
+    if(tree[nodeID].IsLeaf()){
+        children[childCount++] = nodeID;
+    }else{
+        children[childCount++] = tree[nodeID].m_left;
+        children[childCount++] = tree[nodeID].m_right;
+        while(childCount<BVH_WIDTH){
+            int largest = -1;
+            double largestArea = -1.0;
+            for(unsigned int c=0; c<childCount; c++){
+                if(tree[children[c]].IsLeaf()==false){
+                    double area = tree[children[c]].m_bounds.CalculateSurfaceArea();
+                    if(area>largestArea){
+                        largestArea = area;
+                        largest = c;
+                    }
+                }
+            }
+            if(largest<0){
+                break;
+            }
+            unsigned int opened = children[largest];
+            children[largest] = tree[opened].m_left;
+            children[childCount++] = tree[opened].m_right;
+        }
+    }
+    //wideNodes can reallocate while recursing, so only hold on to the index
+    unsigned int wideID = wideNodes.size();
+    wideNodes.push_back(Bvh4Node());
+    for(unsigned int c=0; c<childCount; c++){
+        BvhNode& child = tree[children[c]];
+        if(child.IsLeaf()){
+            if(child.m_numberOfReferences>0){
+                wideNodes[wideID].SetBounds(c, child.m_bounds);
+                wideNodes[wideID].m_children[c] = child.m_referenceOffset;
+                wideNodes[wideID].m_numberOfReferences[c] = child.m_numberOfReferences;
+            }
+        }else{
+            unsigned int childWideID = CollapseNode(tree, children[c], wideNodes);
+            wideNodes[wideID].SetBounds(c, child.m_bounds);
+            wideNodes[wideID].m_children[c] = childWideID;
+        }
+    }
+    return wideID;
 }
 
 template <typename T> void Bvh<T>::BuildBvh(const unsigned int& maxDepth){
+    //rebuilds replace the previous tree
+    Release();
     //assemble aabb list
     unsigned int numberOfAabbs = m_basegeom.GetNumberOfElements();
     spaceCore::Aabb* aabbs = new spaceCore::Aabb[numberOfAabbs];
+    T* basegeom = &m_basegeom;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,numberOfAabbs),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                aabbs[i] = basegeom->GetElementAabb(i);
+            }
+        }
+    );
+    //every node owns a contiguous range of one shared reference array, and splitting a node
+    //partitions its range in place, so leaves can point straight into the final array
+    m_numberOfReferenceIndices = numberOfAabbs;
+    m_referenceIndices = new unsigned int[m_numberOfReferenceIndices];
     for(unsigned int i=0; i<numberOfAabbs; i++){
-        aabbs[i] = m_basegeom.GetElementAabb(i);
+        m_referenceIndices[i] = aabbs[i].m_id;
     }
-    //create vectors to store nodes during construction
-    std::vector<BvhNode> tree;
-    tree.reserve(std::pow(2.0f,(int)maxDepth));
-    unsigned int nodeCount = 0;
-    unsigned int layerCount = 0;
-    std::vector< std::vector<unsigned int> > currentRefs; 
-    currentRefs.reserve(std::pow(2.0f,(int)maxDepth));
-    std::vector<BvhNode*> currentLayer; 
-    std::vector<unsigned int> finalRefList;
+    //concurrent_vector never moves elements, so subtree tasks can grow it under each other
+    tbb::concurrent_vector<BvhNode> tree;
     //create null node to place in index 0. tree begins at index 1.
     tree.push_back(BvhNode());
-    nodeCount++;
-//    BvhNode* nullnode = &tree[0];
     //create root node with aabb that is combined from all input aabbs
     tree.push_back(BvhNode());
-    nodeCount++;
-    BvhNode* root = &tree[1];
+    BvhNode& root = tree[1];
     for(unsigned int i=0; i<numberOfAabbs; i++){
-        root->m_bounds.ExpandAabb(aabbs[i].m_min, aabbs[i].m_max);
+        root.m_bounds.ExpandAabb(aabbs[i].m_min, aabbs[i].m_max);
     }
-    //populate root node with all ids
-    root->m_numberOfReferences = numberOfAabbs;
-    root->m_referenceOffset = 0;
-    root->m_nodeid = 1; 
-    std::vector<unsigned int> rootreferences;
-    rootreferences.reserve(numberOfAabbs);
-    for(unsigned int i=0; i<numberOfAabbs; i++){
-        rootreferences.push_back(aabbs[i].m_id);
+    root.m_numberOfReferences = numberOfAabbs;
+    root.m_referenceOffset = 0;
+    tbb::atomic<unsigned int> layerCount;
+    layerCount = 0;
+    BuildNode(tree, 1, 0, maxDepth, aabbs, layerCount);
+
+    //flatten into 4 wide traversal nodes, the binary tree is only needed to get there
+    m_bounds = tree[1].m_bounds;
+    std::vector<BvhNode> binaryTree(tree.begin(), tree.end());
+    std::vector<Bvh4Node> wideNodes;
+    wideNodes.reserve(binaryTree.size()/2+1);
+    CollapseNode(binaryTree, 1, wideNodes);
+    m_numberOfNodes = wideNodes.size();
+    m_nodes = tbb::cache_aligned_allocator<Bvh4Node>().allocate(m_numberOfNodes);
+    copy(wideNodes.begin(), wideNodes.end(), m_nodes);
+    m_depth = layerCount;
+
+    delete [] aabbs;
+
+    std::cout << "Built BVH with " << binaryTree.size() << " nodes (" << m_numberOfNodes 
+              << " 4 wide) and depth " << m_depth << std::endl;
+}
+
+template <typename T> void Bvh<T>::BuildFromTopology(const Bvh<T>& topology){
+    Release();
+    m_numberOfReferenceIndices = topology.m_numberOfReferenceIndices;
+    m_referenceIndices = topology.m_referenceIndices;
+    m_sharedReferences = true;
+    m_numberOfNodes = topology.m_numberOfNodes;
+    m_depth = topology.m_depth;
+    m_nodes = tbb::cache_aligned_allocator<Bvh4Node>().allocate(m_numberOfNodes);
+    std::copy(topology.m_nodes, topology.m_nodes+m_numberOfNodes, m_nodes);
+    Refit();
+}
+
+template <typename T> void Bvh<T>::Refit(){
+    if(m_numberOfNodes==0){
+        return;
     }
-    currentLayer.push_back(root);
-    currentRefs.push_back(rootreferences);
-    //for each layer, split nodes and move on to next layer
-    for(unsigned int layer=0; layer<maxDepth; layer++){
-        //set up temp storage buffers for next layer
-        std::vector< std::vector<unsigned int> > nextLayerRefs;
-        std::vector<BvhNode*> nextLayer;
-        //for each node in current layer, split and push result 
-        unsigned int numberOfNodesInLayer = currentLayer.size(); 
-        if(numberOfNodesInLayer>0){
-            layerCount++;
-        }
-        for(unsigned int i=0; i<numberOfNodesInLayer; i++){
-            //if <20 prims or last layer, make node a leaf node
-            unsigned int refCount = currentRefs[i].size();
-            BvhNode* node = currentLayer[i];
-            if(refCount <= 5 || layer==maxDepth-1){
-                node->m_left = 0;
-                node->m_right = 0;
-                node->m_numberOfReferences = refCount;
-                node->m_referenceOffset = finalRefList.size();
-                for(unsigned int j=0; j<node->m_numberOfReferences; j++){
-                    finalRefList.push_back(currentRefs[i][j]);
-                }   
-            }else{ //else, find the best split via SAH and add children to next layer
-                //split axis should be the longest axis
-                Axis splitAxis = FindLongestAxis(node->m_bounds);
-                //call SAH and get best split candidate
-                unsigned int leftCount = 0;
-                unsigned int rightCount = 0;
-                float bestSplit = FindBestSplit(*node, currentRefs[i], splitAxis, 10, aabbs,
-                                                leftCount, rightCount);
-                if(leftCount==0 || rightCount==0){
-                    leftCount = 0;
-                    rightCount = 0;
-                    if(splitAxis==axis_x){
-                        splitAxis = axis_y;
-                    }else if(splitAxis==axis_y){
-                        splitAxis = axis_z;
-                    }else if(splitAxis==axis_z){
-                        splitAxis = axis_x;
-                    }
-                    bestSplit = FindBestSplit(*node, currentRefs[i], splitAxis, 10, aabbs,
-                                                    leftCount, rightCount);
-                }
-                if(leftCount==0 || rightCount==0){
-                    leftCount = 0;
-                    rightCount = 0;
-                    if(splitAxis==axis_x){
-                        splitAxis = axis_y;
-                    }else if(splitAxis==axis_y){
-                        splitAxis = axis_z;
-                    }else if(splitAxis==axis_z){
-                        splitAxis = axis_x;
-                    }
-                    bestSplit = FindBestSplit(*node, currentRefs[i], splitAxis, 10, aabbs,
-                                              leftCount, rightCount);
-                }
-                if(leftCount==0 || rightCount==0){
-                    node->m_left = 0;
-                    node->m_right = 0;
-                    node->m_numberOfReferences = refCount;
-                    node->m_referenceOffset = finalRefList.size();
-                    for(unsigned int j=0; j<node->m_numberOfReferences; j++){
-                        finalRefList.push_back(currentRefs[i][j]);
-                    }   
-                }else{
-                    //create left and right nodes
-                    tree.push_back(BvhNode());
-                    nodeCount++;
-                    unsigned int leftID = tree.size()-1;
-                    BvhNode* left = &tree[leftID];
-                    left->m_nodeid = leftID;
-                    tree.push_back(BvhNode());
-                    nodeCount++;
-                    unsigned int rightID = tree.size()-1;
-                    BvhNode* right = &tree[rightID];
-                    right->m_nodeid = rightID;
-                    node->m_left = leftID;
-                    node->m_right = rightID;
-                    //create lists of left and right objects based on centroid location
-                    std::vector<unsigned int> leftRefs;
-                    std::vector<unsigned int> rightRefs;
-                    leftRefs.reserve(leftCount);
-                    rightRefs.reserve(rightCount);
-                    left->m_numberOfReferences = leftCount;
-                    right->m_numberOfReferences = rightCount;
-                    for(unsigned int j=0; j<node->m_numberOfReferences; j++){
-                        unsigned int referenceIndex = currentRefs[i][j];
-                        Aabb reference = aabbs[referenceIndex];
-                        if(reference.m_centroid[splitAxis]<=bestSplit){
-                            leftRefs.push_back(referenceIndex);
-                            left->m_bounds.ExpandAabb(reference.m_min, reference.m_max);
-                        }else{
-                            rightRefs.push_back(referenceIndex);
-                            right->m_bounds.ExpandAabb(reference.m_min, reference.m_max);
+    //leaf bounds only depend on their own references, so those are all refit in parallel
+    Bvh4Node* nodes = m_nodes;
+    unsigned int* referenceIndices = m_referenceIndices;
+    T* basegeom = &m_basegeom;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_numberOfNodes),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int n=r.begin(); n!=r.end(); ++n){
+                for(unsigned int c=0; c<BVH_WIDTH; c++){
+                    if(nodes[n].IsLeaf(c)){
+                        Aabb box;
+                        for(unsigned int i=0; i<nodes[n].m_numberOfReferences[c]; i++){
+                            Aabb element = basegeom->GetElementAabb(
+                                                referenceIndices[nodes[n].m_children[c]+i]);
+                            box.ExpandAabb(element.m_min, element.m_max);
                         }
+                        nodes[n].SetBounds(c, box);
                     }
-                    //add left and right children to next later
-                    nextLayer.push_back(left);
-                    nextLayerRefs.push_back(leftRefs);
-                    nextLayer.push_back(right); 
-                    nextLayerRefs.push_back(rightRefs);
-                    //cleanup
-                    leftRefs.clear();
-                    rightRefs.clear();
                 }
-            }    
+            }
         }
-        //clear current layer's temp buffers, swap in next layer
-        currentLayer.clear();
-        unsigned int numberOfCurrentRefs = currentRefs.size();
-        for(unsigned int i=0; i<numberOfCurrentRefs; i++){
-            currentRefs[i].clear();
+    );
+    //CollapseNode stores children after their parents, so a reverse sweep sees children first
+    for(int n=m_numberOfNodes-1; n>=0; n--){
+        for(unsigned int c=0; c<BVH_WIDTH; c++){
+            if(m_nodes[n].IsLeaf(c)==false && m_nodes[n].m_children[c]!=BVH_INVALID_NODE){
+                m_nodes[n].SetBounds(c, m_nodes[m_nodes[n].m_children[c]].GetBounds());
+            }
         }
-        currentRefs.clear();
-        currentLayer = nextLayer;
-        currentRefs = nextLayerRefs;
     }
-    m_numberOfNodes = tree.size();
-    m_nodes = new BvhNode[m_numberOfNodes];
-    copy(tree.begin(), tree.end(), m_nodes);
-    
-    m_numberOfReferenceIndices = finalRefList.size();
-    m_referenceIndices = new unsigned int[m_numberOfReferenceIndices];
-    copy(finalRefList.begin(), finalRefList.end(), m_referenceIndices);
-
-    delete [] aabbs;
-
-    std::cout << "Built BVH with " << nodeCount << " nodes and depth " << layerCount << std::endl;
+    m_bounds = m_nodes[0].GetBounds();
 }
 
-template <typename T> float Bvh<T>::FindBestSplit(BvhNode& node, 
-                                                  std::vector<unsigned int>& references,
-                                                  const Axis& direction, 
-                                                  const unsigned int& quality, Aabb* aabbs,
-                                                  unsigned int& leftCount, 
-                                                  unsigned int& rightCount){
-    int splitAxis = 0;
-    if(direction==axis_y){splitAxis = 1;}
-    else if(direction==axis_z){splitAxis = 2;}
-    //create N even candidates, where N = quality
-    float* candidates = new float[quality];
-    float axisLength = node.m_bounds.m_max[splitAxis]-node.m_bounds.m_min[splitAxis];
-    float evenSplitSize = (axisLength)/float(quality+1);
-    for(unsigned int i=0; i<quality; i++){ //create even splits
-        float candidate = node.m_bounds.m_min[splitAxis] + (i+1)*evenSplitSize;
-        candidates[i] = candidate;
+//Splits a node and recurses into its children. Large subtrees are built as parallel tasks
+template <typename T> void Bvh<T>::BuildNode(tbb::concurrent_vector<BvhNode>& tree, 
+                                             const unsigned int& nodeID, 
+                                             const unsigned int& depth,
+                                             const unsigned int& maxDepth, Aabb* aabbs,
+                                             tbb::atomic<unsigned int>& layerCount){
+    unsigned int seenDepth = layerCount;
+    while(depth+1>seenDepth && layerCount.compare_and_swap(depth+1, seenDepth)!=seenDepth){
+        seenDepth = layerCount;
+    }
+    BvhNode& node = tree[nodeID];
+    unsigned int referenceOffset = node.m_referenceOffset;
+    unsigned int refCount = node.m_numberOfReferences;
+    //small enough or deep enough nodes stay leaves
+    if(refCount<=BVH_LEAF_SIZE || depth+1>=maxDepth){
+        return;
     }
-    //Calculate all split costs and keep the lowest cost split
-    unsigned int left = 0; unsigned int right = 0;
-    unsigned int currentLeft = 0; unsigned int currentRight = 0;
-    double bestCost = CalculateSplitCost(candidates[0], node, references, direction, aabbs, 
-                                         left, right);
-    float bestSplit = candidates[0];    
-    for(unsigned int i=1; i<quality; i++){
-        double cost = CalculateSplitCost(candidates[i], node, references, direction, aabbs, 
-                                         currentLeft, currentRight);
-        if(cost<bestCost){
-            bestCost = cost;
-            bestSplit = candidates[i];
-            left = currentLeft;
-            right = currentRight;
+    Axis splitAxis;
+    unsigned int splitBin;
+    Aabb centroidBounds;
+    if(FindBinnedSplit(referenceOffset, refCount, aabbs, splitAxis, splitBin, 
+                       centroidBounds)==false){
+        return;
+    }
+    //partition the node's range in place around the chosen bin boundary
+    unsigned int* references = m_referenceIndices+referenceOffset;
+    float axisMin = centroidBounds.m_min[splitAxis];
+    float axisExtent = centroidBounds.m_max[splitAxis]-axisMin;
+    unsigned int* middle = std::partition(references, references+refCount, 
+        [=](const unsigned int& reference){
+            return BinIndex(aabbs[reference].m_centroid[splitAxis], axisMin, axisExtent)
+                   <=splitBin;
         }
+    );
+    unsigned int leftCount = middle-references;
+    //create left and right nodes
+    tbb::concurrent_vector<BvhNode>::iterator children = tree.grow_by(2);
+    unsigned int leftID = children-tree.begin();
+    unsigned int rightID = leftID+1;
+    BvhNode& left = tree[leftID];
+    BvhNode& right = tree[rightID];
+    left.m_referenceOffset = referenceOffset;
+    left.m_numberOfReferences = leftCount;
+    right.m_referenceOffset = referenceOffset+leftCount;
+    right.m_numberOfReferences = refCount-leftCount;
+    for(unsigned int i=0; i<leftCount; i++){
+        left.m_bounds.ExpandAabb(aabbs[references[i]].m_min, aabbs[references[i]].m_max);
+    }
+    for(unsigned int i=leftCount; i<refCount; i++){
+        right.m_bounds.ExpandAabb(aabbs[references[i]].m_min, aabbs[references[i]].m_max);
+    }
+    node.m_left = leftID;
+    node.m_right = rightID;
+    //inner nodes keep no references of their own
+    node.m_numberOfReferences = 0;
+    unsigned int childDepth = depth+1;
+    if(refCount>BVH_PARALLEL_BUILD_SIZE){
+        tbb::parallel_invoke(
+            [&](){ BuildNode(tree, leftID, childDepth, maxDepth, aabbs, layerCount); },
+            [&](){ BuildNode(tree, rightID, childDepth, maxDepth, aabbs, layerCount); }
+        );
+    }else{
+        BuildNode(tree, leftID, childDepth, maxDepth, aabbs, layerCount);
+        BuildNode(tree, rightID, childDepth, maxDepth, aabbs, layerCount);
     }
-    leftCount = left;
-    rightCount = right;
-    delete [] candidates;
-    return bestSplit;
 }
 
-template <typename T> double Bvh<T>::CalculateSplitCost(const float& split, const BvhNode& node, 
-                                                        std::vector<unsigned int>& references, 
-                                                        const Axis& direction, Aabb* aabbs, 
-                                                        unsigned int& leftCount, 
-                                                        unsigned int& rightCount){
-    int splitAxis = 0;
-    if(direction==axis_y){splitAxis = 1;}
-    else if(direction==axis_z){splitAxis = 2;}
-    Aabb leftBox; unsigned int left = 0;
-    Aabb rightBox; unsigned int right = 0;
-    //run through all references in current node and merge into either left or right
-    for(unsigned int i=0; i<node.m_numberOfReferences; i++){
-        unsigned int referenceIndex = references[i];
-        Aabb reference = aabbs[referenceIndex];
-        if(reference.m_centroid[splitAxis]<=split){
-            left++;
-            leftBox.ExpandAabb(reference.m_min, reference.m_max);
-        }else{
-            right++;
-            rightBox.ExpandAabb(reference.m_min, reference.m_max);
+//Bins reference centroids along all three axes in one pass and sweeps each axis for the 
+//lowest SAH cost bin boundary. Returns false if no boundary separates the references
+template <typename T> bool Bvh<T>::FindBinnedSplit(const unsigned int& referenceOffset,
+                                                   const unsigned int& refCount, Aabb* aabbs,
+                                                   Axis& splitAxis, unsigned int& splitBin,
+                                                   Aabb& centroidBounds){
+    unsigned int* references = m_referenceIndices+referenceOffset;
+    centroidBounds = Aabb();
+    for(unsigned int i=0; i<refCount; i++){
+        glm::vec3 centroid = aabbs[references[i]].m_centroid;
+        centroidBounds.ExpandAabb(centroid, centroid);
+    }
+    Aabb bins[3][BVH_SAH_BINS];
+    unsigned int binCounts[3][BVH_SAH_BINS];
+    for(unsigned int axis=0; axis<3; axis++){
+        for(unsigned int b=0; b<BVH_SAH_BINS; b++){
+            binCounts[axis][b] = 0;
         }
     }
-    double leftCost = left * leftBox.CalculateSurfaceArea();
-    double rightCost = right * rightBox.CalculateSurfaceArea();
-    leftCount = left; rightCount = right;
-    // std::cout << left << " "  << right << " " << fabs(leftCost-rightCost) << std::endl;
-    if(left==0 || right==0){
-        return pow(10.0f,100);
-    }else{
-        return fabs(leftCost-rightCost);
+    glm::vec3 axisMin = centroidBounds.m_min;
+    glm::vec3 axisExtent = centroidBounds.m_max-centroidBounds.m_min;
+    for(unsigned int i=0; i<refCount; i++){
+        const Aabb& reference = aabbs[references[i]];
+        for(unsigned int axis=0; axis<3; axis++){
+            unsigned int b = BinIndex(reference.m_centroid[axis], axisMin[axis], 
+                                      axisExtent[axis]);
+            binCounts[axis][b]++;
+            bins[axis][b].ExpandAabb(reference.m_min, reference.m_max);
+        }
     }
+    double bestCost = -1.0;
+    for(unsigned int axis=0; axis<3; axis++){
+        if(axisExtent[axis]<=0.0f){
+            continue;
+        }
+        //sweep right to left to get the area and count right of every boundary
+        double rightCosts[BVH_SAH_BINS];
+        Aabb rightBox;
+        unsigned int rightCount = 0;
+        for(unsigned int b=BVH_SAH_BINS-1; b>0; b--){
+            rightBox.ExpandAabb(bins[axis][b].m_min, bins[axis][b].m_max);
+            rightCount += binCounts[axis][b];
+            rightCosts[b-1] = rightCount>0 ? rightCount*rightBox.CalculateSurfaceArea() : 0.0;
+        }
+        Aabb leftBox;
+        unsigned int leftCount = 0;
+        for(unsigned int b=0; b<BVH_SAH_BINS-1; b++){
+            leftBox.ExpandAabb(bins[axis][b].m_min, bins[axis][b].m_max);
+            leftCount += binCounts[axis][b];
+            if(leftCount==0 || leftCount==refCount){
+                continue;
+            }
+            double cost = leftCount*leftBox.CalculateSurfaceArea() + rightCosts[b];
+            if(bestCost<0.0 || cost<bestCost){
+                bestCost = cost;
+                splitAxis = Axis(axis);
+                splitBin = b;
+            }
+        }
+    }
+    return bestCost>=0.0;
 }
 
-template <typename T> Axis Bvh<T>::FindLongestAxis(const Aabb& box){
-    //find max axis and return. pretty simple.
-    float axisXlength = box.m_max.x - box.m_min.x;
-    float axisYlength = box.m_max.y - box.m_min.y; 
-    float axisZlength = box.m_max.z - box.m_min.z;
-    if(axisXlength>=axisYlength && axisXlength>=axisZlength){
-        return axis_x;
-    }else if(axisYlength>=axisXlength && axisYlength>=axisZlength){
-        return axis_y;
-    }else{
-        return axis_z;
-    }   
+template <typename T> unsigned int Bvh<T>::BinIndex(const float& centroid, const float& axisMin,
+                                                    const float& axisExtent){
+    if(axisExtent<=0.0f){
+        return 0;
+    }
+    int b = int(BVH_SAH_BINS*(centroid-axisMin)/axisExtent);
+    return glm::clamp(b, 0, BVH_SAH_BINS-1);
 }
+
 }
 
 #endif
@@ -0,0 +1,71 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: threadpinner.hpp
+// Pins TBB threads to cores so NUMA first touch placement holds up between passes
+
+#ifndef THREADPINNER_HPP
+#define THREADPINNER_HPP
+
+#include <tbb/tbb.h>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace utilityCore {
+
+//====================================
+// Class Declarations
+//====================================
+
+//Every thread that joins the scheduler while this is observing gets the next core the process
+//is allowed on, in the order the OS numbers them, which on most dual socket machines fills one
+//socket before the next. Statically partitioned passes then keep landing on the same cores, and
+//on the memory they first touched. Only does anything on linux
+class ThreadPinner: public tbb::task_scheduler_observer {
+    public:
+        ThreadPinner(){
+            m_nextCpu = 0;
+#ifdef __linux__
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            if(sched_getaffinity(0, sizeof(cpu_set_t), &allowed)==0){
+                for(int c=0; c<CPU_SETSIZE; c++){
+                    if(CPU_ISSET(c, &allowed)){
+                        m_cpus.push_back(c);
+                    }
+                }
+            }
+#endif
+            observe(true);
+        }
+        ~ThreadPinner(){
+            observe(false);
+        }
+
+        void on_scheduler_entry(bool isWorker){
+            if(m_cpus.empty()){
+                return;
+            }
+#ifdef __linux__
+            unsigned int cpu = m_cpus[m_nextCpu.fetch_and_increment()%m_cpus.size()];
+            cpu_set_t target;
+            CPU_ZERO(&target);
+            CPU_SET(cpu, &target);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &target);
+#endif
+        }
+
+        unsigned int GetCpuCount(){
+            return m_cpus.size();
+        }
+
+    private:
+        std::vector<unsigned int>                   m_cpus;
+        tbb::atomic<unsigned int>                   m_nextCpu;
+};
+}
+
+#endif
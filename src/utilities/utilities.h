@@ -49,6 +49,14 @@ extern inline glm::vec3 clampRGB(glm::vec3 color);
 HOST DEVICE extern inline bool epsilonCheck(float a, float b);
 HOST DEVICE extern inline float toRadian(float degree);
 HOST DEVICE extern inline float toDegree(float radian);
+//IEEE half floats, rounded to nearest even. Out of range values become infinity
+extern inline unsigned short floatToHalf(float f);
+extern inline float halfToFloat(unsigned short h);
+//Counter based random numbers in [0,1). The same key and counter always give the same number
+//and nothing is shared, so parallel loops can draw per element without locks or ordering
+HOST DEVICE extern inline unsigned int hashUInt(unsigned int n);
+HOST DEVICE extern inline float counterRandom(const unsigned int& key, 
+                                              const unsigned int& counter);
 
 //String wrangling stuff
 extern inline bool replaceString(std::string& str, const std::string& from, const std::string& to);
@@ -87,6 +95,10 @@ extern inline void fovToPerspective(float fovy, float aspect, float zNear, glm::
 //IO Stuff
 extern inline std::string readFileAsString(std::string filename);
 extern inline std::string getRelativePath(std::string path);
+//Maps a whole file into memory, or returns NULL with a size of 0. Writable maps are copy on
+//write, so writes never reach the file
+extern inline char* mapFile(const std::string& filename, size_t& size, const bool& writable);
+extern inline void unmapFile(char* data, const size_t& size);
 
 }
 
@@ -25,6 +25,12 @@
 #include <cstdio>
 #include <cstring>
 #include <fstream>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include <rmsd/rmsd.h>
 
 //====================================
@@ -68,6 +74,80 @@ glm::vec3 utilityCore::clampRGB(glm::vec3 color){
     return color;
 }
 
+unsigned short utilityCore::floatToHalf(float f){
+    unsigned int bits;
+    memcpy(&bits, &f, sizeof(float));
+    unsigned int sign = (bits>>16) & 0x8000;
+    unsigned int floatExponent = (bits>>23) & 0xff;
+    unsigned int mantissa = bits & 0x7fffff;
+    if(floatExponent==0xff){
+        //infinity stays infinity, nan stays a quiet nan
+        return sign | 0x7c00 | (mantissa!=0 ? 0x200 : 0);
+    }
+    int exponent = (int)floatExponent - 127 + 15;
+    if(exponent>=31){
+        return sign | 0x7c00;
+    }
+    if(exponent<=0){
+        //half denormals, anything under half the smallest one flushes to zero
+        if(exponent<-10){
+            return sign;
+        }
+        mantissa = mantissa | 0x800000;
+        unsigned int shift = 14 - exponent;
+        unsigned int half = mantissa>>shift;
+        unsigned int remainder = mantissa & ((1u<<shift)-1);
+        unsigned int halfway = 1u<<(shift-1);
+        if(remainder>halfway || (remainder==halfway && (half&1))){
+            half++;
+        }
+        return sign | half;
+    }
+    unsigned int half = ((unsigned int)exponent<<10) | (mantissa>>13);
+    unsigned int remainder = mantissa & 0x1fff;
+    //a carry out of the mantissa correctly bumps the exponent, up to infinity
+    if(remainder>0x1000 || (remainder==0x1000 && (half&1))){
+        half++;
+    }
+    return sign | half;
+}
+
+float utilityCore::halfToFloat(unsigned short h){
+    unsigned int sign = ((unsigned int)h & 0x8000)<<16;
+    unsigned int exponent = (h>>10) & 0x1f;
+    unsigned int mantissa = h & 0x3ff;
+    unsigned int bits;
+    if(exponent==0){
+        if(mantissa==0){
+            bits = sign;
+        }else{
+            float f = (float)mantissa * (1.0f/16777216.0f);
+            return sign!=0 ? -f : f;
+        }
+    }else if(exponent==31){
+        bits = sign | 0x7f800000 | (mantissa<<13);
+    }else{
+        bits = sign | ((exponent+112)<<23) | (mantissa<<13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(float));
+    return f;
+}
+
+//Wang's integer hash
+HOST DEVICE unsigned int utilityCore::hashUInt(unsigned int n){
+    n = (n ^ 61) ^ (n >> 16);
+    n = n + (n << 3);
+    n = n ^ (n >> 4);
+    n = n * 0x27d4eb2d;
+    n = n ^ (n >> 15);
+    return n;
+}
+
+HOST DEVICE float utilityCore::counterRandom(const unsigned int& key, const unsigned int& counter){
+    return (hashUInt(hashUInt(key) + counter) & 0xffffff)/16777216.0f;
+}
+
 HOST DEVICE bool utilityCore::epsilonCheck(float a, float b){
     if(glm::abs(glm::abs(a)-glm::abs(b))<EPSILON){
         return true;
@@ -309,4 +389,55 @@ std::string utilityCore::getRelativePath(std::string path){
     return relativePath;
 }
 
+char* utilityCore::mapFile(const std::string& filename, size_t& size, const bool& writable){
+    size = 0;
+#ifdef _WIN32
+    //no mmap here, so the file is read into a buffer, which is writable and never written back
+    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+    if(!file.is_open()){
+        return NULL;
+    }
+    std::streamoff fileSize = file.tellg();
+    if(fileSize<=0){
+        return NULL;
+    }
+    char* data = new char[(size_t)fileSize];
+    file.seekg(0, std::ios::beg);
+    if(!file.read(data, fileSize)){
+        delete [] data;
+        return NULL;
+    }
+    size = (size_t)fileSize;
+    return data;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd<0){
+        return NULL;
+    }
+    struct stat fileStat;
+    if(fstat(fd, &fileStat)!=0 || fileStat.st_size==0){
+        close(fd);
+        return NULL;
+    }
+    int protection = writable ? PROT_READ|PROT_WRITE : PROT_READ;
+    void* data = mmap(NULL, fileStat.st_size, protection, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data==MAP_FAILED){
+        return NULL;
+    }
+    size = fileStat.st_size;
+    return (char*)data;
+#endif
+}
+
+void utilityCore::unmapFile(char* data, const size_t& size){
+    if(data!=NULL){
+#ifdef _WIN32
+        delete [] data;
+#else
+        munmap(data, size);
+#endif
+    }
+}
+
 #endif
@@ -6,6 +6,9 @@
 
 #include <stb_image/stb_image_write.h>
 #include <sstream>
+#include <cstring>
+#include <climits>
+#include <algorithm>
 #include "viewer.hpp"
 #include "../utilities/utilities.h"
 #include "../camera/cameralist.hpp"
@@ -14,10 +17,14 @@ namespace viewerCore{
 
 Viewer::Viewer(){
     m_loaded = false;
+    m_stream = NULL;
+    m_voxelOwners = NULL;
+    m_voxelOwnerCount = 0;
 }
 
 Viewer::~Viewer(){
-
+    delete m_stream;
+    delete [] m_voxelOwners;
 }
 
 void Viewer::Load(fluidCore::FlipSim* sim, const bool& retina){
@@ -61,18 +68,47 @@ void Viewer::Load(fluidCore::FlipSim* sim, const bool& retina, const glm::vec2&
                                        (int)resolution.y*m_framebufferScale];
 
     m_pause = false;
+
+    m_writeSnapshot = &m_snapshots[0];
+    m_readySnapshot = &m_snapshots[1];
+    m_drawSnapshot = &m_snapshots[2];
+    m_snapshotReady = false;
+    m_particleBufferIndex = 0;
+    m_persistentBuffers = false;
+    m_particleProgram = 0;
+    m_particleAttribute = -1;
+
+    m_previewLod = PREVIEW_FULL;
+    m_previewStride = 8;
+    m_previewVoxelSize = 1;
+    m_snapshotDirty = false;
+}
+
+//A factor of 0 keeps the mode's current stride or voxel size
+void Viewer::SetPreview(const PreviewLod& lod, const unsigned int& factor){
+    m_previewLod = lod;
+    if(factor==0){
+        return;
+    }
+    if(lod==PREVIEW_STRIDE){
+        m_previewStride = factor;
+    }else if(lod==PREVIEW_VOXEL){
+        m_previewVoxelSize = factor;
+    }
 }
 
 void Viewer::SimLoopThread(){
     if(m_sim->m_frame==0){
         m_sim->Init();
         m_particles = m_sim->GetParticles();
+        SnapshotParticles();
         m_siminitialized = true;
     }
     while(1){
         if(!m_pause){
             m_sim->Step(m_dumpVDB, m_dumpOBJ, m_dumpPARTIO);
             m_particles = m_sim->GetParticles();
+            SnapshotParticles();
             if(m_dumpFramebuffer && m_dumpReady){
                 m_framebufferWriteLock.lock();
                 {
@@ -80,7 +116,51 @@ void Viewer::SimLoopThread(){
                 }
                 m_framebufferWriteLock.unlock();
             }
+        }else{
+            //preview settings changed while paused, so redo the snapshot the viewer is showing
+            if(m_snapshotDirty && m_siminitialized){
+                m_snapshotDirty = false;
+                SnapshotParticles();
+            }
+            //don't spin a core away from the tbb workers while paused
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        m_siminitialized = true;
+    }
+}
+
+bool Viewer::Attach(const std::string& address){
+    fluidCore::SimStreamClient* stream = new fluidCore::SimStreamClient();
+    if(stream->Connect(address)==false){
+        delete stream;
+        return false;
+    }
+    delete m_stream;
+    m_stream = stream;
+    std::cout << "Attached to sim stream at " << address << std::endl;
+    return true;
+}
+
+//Receives straight into the write snapshot and hands it over like a local step would. Pausing
+//and exports belong to the remote sim, so those toggles do nothing here
+void Viewer::StreamLoopThread(){
+    std::string stats;
+    while(1){
+        ParticleSnapshot* snapshot = m_writeSnapshot;
+        if(m_stream->Receive(snapshot->m_frame, snapshot->m_count, snapshot->m_positions,
+                             snapshot->m_attributes, stats)==false){
+            std::cout << "\nSim stream closed.\n" << std::endl;
+            return;
+        }
+        if(stats.size()>0){
+            std::cout << stats << std::endl;
+        }
+        m_snapshotLock.lock();
+        {
+            std::swap(m_writeSnapshot, m_readySnapshot);
+            m_snapshotReady = true;
         }
+        m_snapshotLock.unlock();
         m_siminitialized = true;
     }
 }
@@ -90,7 +170,11 @@ bool Viewer::Launch(){
     if(m_loaded==true){
         if(Init()==true){
             std::thread simThread([=](){
-                SimLoopThread();
+                if(m_stream!=NULL){
+                    StreamLoopThread();
+                }else{
+                    SimLoopThread();
+                }
             });
             MainLoop();
             return true;
@@ -122,86 +206,259 @@ void Viewer::SaveFrame(){
 // Draw/Interaction Loop
 //====================================
 
-void Viewer::UpdateParticles(){
-    //rebuild particles
-    if(m_siminitialized){
-
-        m_sim->GetScene()->m_particleLock.lock();
-
-        //dummy buffer for particles
-        VboData data;
-        std::vector<glm::vec3> vertexData;
-        std::vector<glm::vec4> colorData;
-        unsigned int psize = m_particles->size();
-
-        glm::vec3 gridSize = m_sim->GetDimensions();
-        vertexData.reserve(psize);
-        colorData.reserve(psize);
-        float maxd = glm::max(glm::max(gridSize.x, gridSize.z), gridSize.y);
-
-        unsigned int lpsize = m_sim->GetScene()->GetLiquidParticleCount();
-        // lpsize = m_particles->size();
-        for(unsigned int j=0; j<lpsize; j++){
-            // if(m_particles->operator[](j)->m_type==FLUID){
-                if(!m_particles->operator[](j)->m_invalid || 
-                   (m_particles->operator[](j)->m_invalid && m_drawInvalid)){
-                    vertexData.push_back(m_particles->operator[](j)->m_p*maxd);
-                    float c = glm::length(m_particles->operator[](j)->m_u)/3.0f;
-                    c = glm::max(c, 
-                                 1.0f*glm::max((.7f-m_particles->operator[](j)->m_density),
-                                 0.0f));
-                    bool invalid = m_particles->operator[](j)->m_invalid;
-
-                    if(invalid){
-                        colorData.push_back(glm::vec4(1,1,0,0));
-                    }else if(m_particles->operator[](j)->m_type==SOLID){
-                        colorData.push_back(glm::vec4(1,0,0,0));
-                    }else{
-                        /*if(m_particles->operator[](j)->m_temp2){
-                            colorData.push_back(glm::vec4(0,1,0,0));
-                        }else if(m_particles->operator[](j)->m_temp){
-                            colorData.push_back(glm::vec4(1,0,0,0));
-                        }else{*/
-                            colorData.push_back(glm::vec4(c,c,1,0));
-                        //}
+//Runs on the sim thread between steps, when nothing else touches the particles. Particles kept
+//by the preview LOD are counted per block, then each block writes its run at its prefix offset
+void Viewer::SnapshotParticles(){
+    ParticleSnapshot* snapshot = m_writeSnapshot;
+    std::vector<fluidCore::Particle*>& particles = *m_particles;
+
+    glm::vec3 gridSize = m_sim->GetDimensions();
+    float maxd = glm::max(glm::max(gridSize.x, gridSize.z), gridSize.y);
+    unsigned int lpsize = glm::min(m_sim->GetScene()->GetLiquidParticleCount(), 
+                                   (unsigned int)particles.size());
+    bool drawInvalid = m_drawInvalid;
+    PreviewLod lod = m_previewLod;
+    unsigned int stride = lod==PREVIEW_STRIDE ? m_previewStride : 1;
+
+    fluidCore::Particle* const* source = lpsize>0 ? &particles[0] : NULL;
+    if(lod==PREVIEW_VOXEL){
+        ClaimPreviewVoxels(source, lpsize, maxd, drawInvalid);
+    }
+    tbb::atomic<unsigned int>* owners = lod==PREVIEW_VOXEL ? m_voxelOwners : NULL;
+    glm::ivec3 voxels = m_voxelDimensions;
+    float voxelscale = maxd/(float)m_previewVoxelSize;
+    auto keep = [=](const unsigned int& j){
+        const fluidCore::Particle* p = source[j];
+        if(p->m_invalid && !drawInvalid){
+            return false;
+        }
+        if(owners!=NULL){
+            glm::ivec3 v = glm::clamp(glm::ivec3(p->m_p*voxelscale), glm::ivec3(0), 
+                                      voxels-glm::ivec3(1));
+            return owners[(v.x*voxels.y + v.y)*voxels.z + v.z]==j;
+        }
+        return j%stride==0;
+    };
+
+    const unsigned int blocksize = 4096;
+    unsigned int blockcount = (lpsize+blocksize-1)/blocksize;
+    std::vector<unsigned int> offsets(blockcount+1, 0);
+    unsigned int* blockoffsets = &offsets[0];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,blockcount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                unsigned int end = glm::min(lpsize, (b+1)*blocksize);
+                unsigned int count = 0;
+                for(unsigned int j=b*blocksize; j<end; j++){
+                    if(keep(j)){
+                        count++;
                     }
                 }
-            // }
-        }
-        glDeleteBuffers(1, &data.m_vboID);
-        glDeleteBuffers(1, &data.m_cboID);
-        std::string key = "fluid";
-        data = CreateVBO(data, (float*)&vertexData[0], vertexData.size()*3, 
-                         (float*)&colorData[0], colorData.size()*4, GL_POINTS, key);
-        glm::mat4 m;
-        for(int x=0; x<4; x++){
-            for(int y=0; y<4; y++){
-                data.m_transform[x][y] = m[x][y];
+                blockoffsets[b+1] = count;
             }
         }
-        vertexData.clear();
-        colorData.clear();
-        m_vbos.push_back(data);
-        m_vbokeys["fluid"] = m_vbos.size()-1;
+    );
+    for(unsigned int b=0; b<blockcount; b++){
+        offsets[b+1] = offsets[b+1] + offsets[b];
+    }
+    unsigned int count = offsets[blockcount];
 
-        m_sim->GetScene()->m_particleLock.unlock();
+    //buffers only ever grow, so a steady particle count never reallocates
+    if(snapshot->m_positions.size()<count){
+        snapshot->m_positions.resize(count);
+        snapshot->m_attributes.resize(count);
     }
-}
+    if(count>0){
+        glm::vec3* positions = &snapshot->m_positions[0];
+        glm::vec2* attributes = &snapshot->m_attributes[0];
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,blockcount),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                    unsigned int end = glm::min(lpsize, (b+1)*blocksize);
+                    unsigned int n = blockoffsets[b];
+                    for(unsigned int j=b*blocksize; j<end; j++){
+                        if(!keep(j)){
+                            continue;
+                        }
+                        const fluidCore::Particle* p = source[j];
+                        positions[n] = p->m_p*maxd;
+                        float speed = glm::length(p->m_u);
+                        if(p->m_invalid){
+                            speed = -1.0f;
+                        }else if(p->m_type==SOLID){
+                            speed = -2.0f;
+                        }
+                        attributes[n] = glm::vec2(speed, p->m_density);
+                        n++;
+                    }
+                }
+            }
+        );
+    }
+    snapshot->m_count = count;
+    snapshot->m_frame = m_sim->m_frame;
 
-void Viewer::MainLoop(){
-    while (!glfwWindowShouldClose(m_window)){
+    m_snapshotLock.lock();
+    {
+        std::swap(m_writeSnapshot, m_readySnapshot);
+        m_snapshotReady = true;
+    }
+    m_snapshotLock.unlock();
+}
 
-        if(m_currentFrame==0 && m_siminitialized==true){
-            UpdateParticles();
+//Marks each preview voxel with the lowest index of the drawn particles inside it, so the voxel
+//preview keeps the same particles regardless of how the claims were scheduled
+void Viewer::ClaimPreviewVoxels(fluidCore::Particle* const* particles, const unsigned int& count,
+                                const float& maxd, const bool& drawInvalid){
+    glm::vec3 gridSize = m_sim->GetDimensions();
+    float voxelSize = (float)m_previewVoxelSize;
+    m_voxelDimensions = glm::max(glm::ivec3(glm::ceil(gridSize/voxelSize)), glm::ivec3(1));
+    unsigned int voxelcount = m_voxelDimensions.x*m_voxelDimensions.y*m_voxelDimensions.z;
+    if(voxelcount!=m_voxelOwnerCount){
+        delete [] m_voxelOwners;
+        m_voxelOwners = new tbb::atomic<unsigned int>[voxelcount];
+        m_voxelOwnerCount = voxelcount;
+    }
+    tbb::atomic<unsigned int>* owners = m_voxelOwners;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,voxelcount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int v=r.begin(); v!=r.end(); ++v){
+                owners[v] = UINT_MAX;
+            }
+        }
+    );
+    glm::ivec3 voxels = m_voxelDimensions;
+    float voxelscale = maxd/voxelSize;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,count),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int j=r.begin(); j!=r.end(); ++j){
+                if(particles[j]->m_invalid && !drawInvalid){
+                    continue;
+                }
+                glm::ivec3 v = glm::clamp(glm::ivec3(particles[j]->m_p*voxelscale), 
+                                          glm::ivec3(0), voxels-glm::ivec3(1));
+                tbb::atomic<unsigned int>& owner = owners[(v.x*voxels.y + v.y)*voxels.z + v.z];
+                unsigned int current = owner;
+                while(j<current){
+                    unsigned int seen = owner.compare_and_swap(j, current);
+                    if(seen==current){
+                        break;
+                    }
+                    current = seen;
+                }
+            }
         }
+    );
+}
 
-        //check if frame has incremented; if yes, rebuild vbos
-        if(m_currentFrame!=m_sim->m_frame){
-            m_vbos.clear();
-            m_currentFrame = m_sim->m_frame;
-            UpdateParticles();
+void Viewer::UpdateParticles(){
+    //take the newest snapshot if the sim has handed one over since the last check
+    bool fresh = false;
+    m_snapshotLock.lock();
+    {
+        if(m_snapshotReady){
+            std::swap(m_readySnapshot, m_drawSnapshot);
+            m_snapshotReady = false;
+            fresh = true;
+        }
+    }
+    m_snapshotLock.unlock();
+    if(fresh){
+        UploadParticles(*m_drawSnapshot);
+        if(m_currentFrame!=m_drawSnapshot->m_frame){
+            m_currentFrame = m_drawSnapshot->m_frame;
             UpdateMeshes();
         }
+    }
+}
+
+void Viewer::UploadParticles(const ParticleSnapshot& snapshot){
+    m_particleBufferIndex = 1-m_particleBufferIndex;
+    ParticleUploadBuffer& buffer = m_particleBuffers[m_particleBufferIndex];
+    //the fence is from the last frame that drew this buffer, and has normally long passed
+    if(buffer.m_fence!=0){
+        glClientWaitSync(buffer.m_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        glDeleteSync(buffer.m_fence);
+        buffer.m_fence = 0;
+    }
+    unsigned int count = snapshot.m_count;
+    ReserveParticleBuffer(buffer, count);
+    if(count>0){
+        if(m_persistentBuffers){
+            memcpy(buffer.m_positions, &snapshot.m_positions[0], count*sizeof(glm::vec3));
+            memcpy(buffer.m_attributes, &snapshot.m_attributes[0], count*sizeof(glm::vec2));
+        }else{
+            glBindBuffer(GL_ARRAY_BUFFER, buffer.m_vboID);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, count*sizeof(glm::vec3), &snapshot.m_positions[0]);
+            glBindBuffer(GL_ARRAY_BUFFER, buffer.m_aboID);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, count*sizeof(glm::vec2), 
+                            &snapshot.m_attributes[0]);
+        }
+    }
+
+    VboData data;
+    data.m_vboID = buffer.m_vboID;
+    data.m_cboID = buffer.m_aboID;
+    data.m_size = count*3;
+    data.m_type = GL_POINTS;
+    data.m_key = "fluid";
+    glm::mat4 m;
+    for(int x=0; x<4; x++){
+        for(int y=0; y<4; y++){
+            data.m_transform[x][y] = m[x][y];
+        }
+    }
+    SetVBO(data);
+}
+
+void Viewer::ReserveParticleBuffer(ParticleUploadBuffer& buffer, const unsigned int& count){
+    if(buffer.m_vboID!=0 && buffer.m_capacity>=count){
+        return;
+    }
+    ReleaseParticleBuffer(buffer);
+    //leave headroom so a filling tank doesn't reallocate every frame
+    buffer.m_capacity = glm::max(count+count/2, 1024u);
+    GLsizeiptr positionsize = buffer.m_capacity*sizeof(glm::vec3);
+    GLsizeiptr attributesize = buffer.m_capacity*sizeof(glm::vec2);
+    glGenBuffers(1, &buffer.m_vboID);
+    glGenBuffers(1, &buffer.m_aboID);
+    if(m_persistentBuffers){
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBindBuffer(GL_ARRAY_BUFFER, buffer.m_vboID);
+        glBufferStorage(GL_ARRAY_BUFFER, positionsize, NULL, flags);
+        buffer.m_positions = (glm::vec3*)glMapBufferRange(GL_ARRAY_BUFFER, 0, positionsize, flags);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer.m_aboID);
+        glBufferStorage(GL_ARRAY_BUFFER, attributesize, NULL, flags);
+        buffer.m_attributes = (glm::vec2*)glMapBufferRange(GL_ARRAY_BUFFER, 0, attributesize, 
+                                                           flags);
+    }else{
+        glBindBuffer(GL_ARRAY_BUFFER, buffer.m_vboID);
+        glBufferData(GL_ARRAY_BUFFER, positionsize, NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer.m_aboID);
+        glBufferData(GL_ARRAY_BUFFER, attributesize, NULL, GL_STREAM_DRAW);
+    }
+}
+
+void Viewer::ReleaseParticleBuffer(ParticleUploadBuffer& buffer){
+    if(buffer.m_fence!=0){
+        glDeleteSync(buffer.m_fence);
+    }
+    if(buffer.m_positions!=NULL){
+        glBindBuffer(GL_ARRAY_BUFFER, buffer.m_vboID);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer.m_aboID);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+    glDeleteBuffers(1, &buffer.m_vboID);
+    glDeleteBuffers(1, &buffer.m_aboID);
+    buffer = ParticleUploadBuffer();
+}
+
+void Viewer::MainLoop(){
+    while (!glfwWindowShouldClose(m_window)){
+
+        //picks up a new particle snapshot if there is one, and updates meshes on a frame change
+        UpdateParticles();
 
         glClearColor(0.325, 0.325, 0.325, 1.0);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -221,15 +478,26 @@ void Viewer::MainLoop(){
             glm::vec3 res = m_sim->GetDimensions();
 
             for(unsigned int i=0; i<m_vbos.size(); i++){
+                if(m_vbos[i].m_visible==false){
+                    continue;
+                }
                 glPushMatrix();       
                     glTranslatef(-res.x/2, 0, -res.y/2);
                     glMultMatrixf(m_vbos[i].m_transform[0]);
+                    //particle colors are worked out by the particle shader from its attributes
+                    bool shaded = m_vbos[i].m_type==GL_POINTS && m_particleAttribute>=0;
                     glBindBuffer(GL_ARRAY_BUFFER, m_vbos[i].m_vboID);
                     glVertexPointer(3, GL_FLOAT, 0, NULL);
-                    glBindBuffer(GL_ARRAY_BUFFER, m_vbos[i].m_cboID);
-                    glColorPointer(4, GL_FLOAT, 0, NULL);
                     glEnableClientState(GL_VERTEX_ARRAY);
-                    glEnableClientState(GL_COLOR_ARRAY);
+                    glBindBuffer(GL_ARRAY_BUFFER, m_vbos[i].m_cboID);
+                    if(shaded){
+                        glUseProgram(m_particleProgram);
+                        glVertexAttribPointer(m_particleAttribute, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+                        glEnableVertexAttribArray(m_particleAttribute);
+                    }else if(m_vbos[i].m_type!=GL_POINTS){
+                        glColorPointer(4, GL_FLOAT, 0, NULL);
+                        glEnableClientState(GL_COLOR_ARRAY);
+                    }
                     glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
                     
                     if(i==m_vbokeys["boundingbox"]){
@@ -260,9 +528,21 @@ void Viewer::MainLoop(){
                     }
                     glDisableClientState(GL_VERTEX_ARRAY);
                     glDisableClientState(GL_COLOR_ARRAY);
+                    if(shaded){
+                        glDisableVertexAttribArray(m_particleAttribute);
+                        glUseProgram(0);
+                    }
 
                 glPopMatrix();
             }
+            //fence the particle buffer just drawn, so the next upload into it waits for the GPU
+            if(m_persistentBuffers){
+                ParticleUploadBuffer& buffer = m_particleBuffers[m_particleBufferIndex];
+                if(buffer.m_fence!=0){
+                    glDeleteSync(buffer.m_fence);
+                }
+                buffer.m_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            }
 
             /*glPushMatrix();
                 glTranslatef(-res.x/2, 0, -res.y/2);
@@ -314,6 +594,8 @@ void Viewer::MainLoop(){
             m_dumpReady = true; 
         }
     }
+    ReleaseParticleBuffer(m_particleBuffers[0]);
+    ReleaseParticleBuffer(m_particleBuffers[1]);
     glfwDestroyWindow(m_window);
     glfwTerminate();
 }
@@ -474,6 +756,7 @@ void Viewer::UpdateInputs(){
     }else if(glfwGetKey(m_window, GLFW_KEY_I) == GLFW_PRESS){
         if(m_cam.m_currentKey!=GLFW_KEY_I){
             m_drawInvalid = !m_drawInvalid;
+            m_snapshotDirty = true;
             m_cam.m_currentKey = GLFW_KEY_I;
             if(m_drawInvalid){
                 std::cout << "\nDraw out of bound particles ON.\n" << std::endl;
@@ -481,69 +764,116 @@ void Viewer::UpdateInputs(){
                 std::cout << "\nDraw out of bound particles OFF.\n" << std::endl;
             }
         }
+    }else if(glfwGetKey(m_window, GLFW_KEY_L) == GLFW_PRESS){
+        if(m_cam.m_currentKey!=GLFW_KEY_L){
+            m_previewLod = (PreviewLod)((m_previewLod+1)%3);
+            m_snapshotDirty = true;
+            m_cam.m_currentKey = GLFW_KEY_L;
+            if(m_previewLod==PREVIEW_FULL){
+                std::cout << "\nPreview LOD: all particles.\n" << std::endl;
+            }else if(m_previewLod==PREVIEW_STRIDE){
+                std::cout << "\nPreview LOD: every " << m_previewStride << " particles.\n" 
+                          << std::endl;
+            }else{
+                std::cout << "\nPreview LOD: one particle per " << m_previewVoxelSize 
+                          << " cell voxel.\n" << std::endl;
+            }
+        }
+    }else if(glfwGetKey(m_window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS ||
+             glfwGetKey(m_window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS){
+        int key = glfwGetKey(m_window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS ? 
+                  GLFW_KEY_LEFT_BRACKET : GLFW_KEY_RIGHT_BRACKET;
+        if(m_cam.m_currentKey!=key && m_previewLod!=PREVIEW_FULL){
+            //[ and ] halve and double how coarse the current preview LOD is
+            unsigned int& factor = m_previewLod==PREVIEW_STRIDE ? m_previewStride : 
+                                                                  m_previewVoxelSize;
+            factor = key==GLFW_KEY_RIGHT_BRACKET ? factor*2 : glm::max(factor/2, 1u);
+            m_snapshotDirty = true;
+            std::cout << "\nPreview LOD factor: " << factor << "\n" << std::endl;
+        }
+        m_cam.m_currentKey = key;
     }else{
         m_cam.m_currentKey = 0;
     }
 }
 
 void Viewer::UpdateMeshes(){
-    //buffer for sim bounding box
+    //buffer for sim bounding box, which never changes
     std::string key = "boundingbox";
-    glm::vec3 res = m_sim->GetDimensions();
-    geomCore::CubeGen cubebuilder;
-    objCore::Obj* simboundingbox = new objCore::Obj();
-    cubebuilder.Tesselate(simboundingbox, glm::vec3(0), res);
-    VboData data = CreateVBOFromObj(simboundingbox, glm::vec4(.2,.2,.2,0), key);
-    glm::mat4 m;
-    for(int x=0; x<4; x++){
-        for(int y=0; y<4; y++){
-            data.m_transform[x][y] = m[x][y];
+    if(m_vbokeys.find(key)==m_vbokeys.end()){
+        glm::vec3 res = m_sim->GetDimensions();
+        geomCore::CubeGen cubebuilder;
+        objCore::Obj* simboundingbox = new objCore::Obj();
+        cubebuilder.Tesselate(simboundingbox, glm::vec3(0), res);
+        VboData data = CreateVBOFromObj(simboundingbox, glm::vec4(.2,.2,.2,0), key);
+        glm::mat4 m;
+        for(int x=0; x<4; x++){
+            for(int y=0; y<4; y++){
+                data.m_transform[x][y] = m[x][y];
+            }
         }
+        SetVBO(data);
     }
-    m_vbos.push_back(data);
-    m_vbokeys["boundingbox"] = m_vbos.size()-1;
 
     std::vector<geomCore::Geom*> solids = m_sim->GetScene()->GetSolidGeoms();
     unsigned int numberOfSolidObjects = solids.size();
     for(unsigned int i=0; i<numberOfSolidObjects; i++){
         key = "solid_"+utilityCore::convertIntToString(i);
-        if(solids[i]->GetType()==MESH){
-            if(CreateVBOFromMeshContainer(dynamic_cast<geomCore::MeshContainer*>
-                                          (solids[i]->m_geom), (float)m_currentFrame, 
-                                          glm::vec4(1,0,0,.75), key, data)==true){
-                m_vbos.push_back(data);
-                m_vbokeys[key] = m_vbos.size()-1;
-            }
-        }else if(solids[i]->GetType()==ANIMMESH){
-            if(CreateVBOFromAnimmeshContainer(dynamic_cast<geomCore::AnimatedMeshContainer*>
-                                              (solids[i]->m_geom), (float)m_currentFrame, 
-                                              glm::vec4(1,0,0,.75), key, data)==true){
-                m_vbos.push_back(data);
-                m_vbokeys[key] = m_vbos.size()-1;
-            }
-        }
+        UpdateGeomVBO(solids[i], glm::vec4(1,0,0,.75), key);
     }
 
     std::vector<geomCore::Geom*> liquids = m_sim->GetScene()->GetLiquidGeoms();
     unsigned int numberOfLiquidObjects = liquids.size();
     for(unsigned int i=0; i<numberOfLiquidObjects; i++){
         key = "liquid_"+utilityCore::convertIntToString(i);
-        if(liquids[i]->GetType()==MESH){
-            if(CreateVBOFromMeshContainer(dynamic_cast<geomCore::MeshContainer*>
-                                          (liquids[i]->m_geom), (float)m_currentFrame, 
-                                          glm::vec4(0,0,1,.75), key, data)==true){
-                m_vbos.push_back(data);
-                m_vbokeys[key] = m_vbos.size()-1;
-            }
-        }else if(liquids[i]->GetType()==ANIMMESH){
-            if(CreateVBOFromAnimmeshContainer(dynamic_cast<geomCore::AnimatedMeshContainer*>
-                                              (liquids[i]->m_geom), (float)m_currentFrame, 
-                                              glm::vec4(0,0,1,.75), key, data)==true){
-                m_vbos.push_back(data);
-                m_vbokeys[key] = m_vbos.size()-1;
-            }
+        UpdateGeomVBO(liquids[i], glm::vec4(0,0,1,.75), key);
+    }
+}
+
+//Brings a geom's buffers to m_currentFrame. Buffers are only rebuilt when the mesh they came 
+//from changes; otherwise just the transform and visibility are updated
+void Viewer::UpdateGeomVBO(geomCore::Geom* geom, const glm::vec4& color, const std::string& key){
+    VboData data;
+    std::map<std::string, int>::iterator it = m_vbokeys.find(key);
+    if(it!=m_vbokeys.end()){
+        //static geoms look the same on every frame, so their first buffers are kept for good
+        if(geom->m_geom->IsDynamic()==false){
+            return;
         }
+        data = m_vbos[it->second];
+    }
+    bool visible = false;
+    if(geom->GetType()==MESH){
+        visible = CreateVBOFromMeshContainer(dynamic_cast<geomCore::MeshContainer*>
+                                             (geom->m_geom), (float)m_currentFrame, color, key,
+                                             data);
+    }else if(geom->GetType()==ANIMMESH){
+        visible = CreateVBOFromAnimmeshContainer(dynamic_cast<geomCore::AnimatedMeshContainer*>
+                                                 (geom->m_geom), (float)m_currentFrame, color,
+                                                 key, data);
+    }
+    if(visible==false && it==m_vbokeys.end()){
+        return;
     }
+    data.m_visible = visible;
+    SetVBO(data);
+}
+
+void Viewer::SetVBO(const VboData& data){
+    std::map<std::string, int>::iterator it = m_vbokeys.find(data.m_key);
+    if(it!=m_vbokeys.end()){
+        m_vbos[it->second] = data;
+    }else{
+        m_vbos.push_back(data);
+        m_vbokeys[data.m_key] = m_vbos.size()-1;
+    }
+}
+
+void Viewer::ReleaseVBO(VboData& data){
+    glDeleteBuffers(1, &data.m_vboID);
+    glDeleteBuffers(1, &data.m_cboID);
+    data.m_vboID = 0;
+    data.m_cboID = 0;
 }
 
 //====================================
@@ -573,6 +903,12 @@ bool Viewer::Init(){
     if(glewInit()!=GLEW_OK){
         return false;   
     }
+    //particle uploads write straight into mapped buffers where the driver allows it
+    m_persistentBuffers = GLEW_ARB_buffer_storage ? true : false;
+    if(BuildParticleProgram()==false){
+        std::cout << "Warning: particle shader unavailable, particles will draw uncolored.\n" 
+                  << std::endl;
+    }
 
     //camera stuff
     glMatrixMode(GL_PROJECTION);
@@ -590,6 +926,70 @@ bool Viewer::Init(){
     return true;
 }
 
+//Particle colors used to be built per particle on the CPU; the shader does the same mapping
+//from speed and density, with negative speeds flagging out of bounds and solid particles
+static const char* s_particleVertexShader =
+    "#version 120\n"
+    "attribute vec2 shade;\n"
+    "void main(){\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix*gl_Vertex;\n"
+    "    if(shade.x<-1.5){\n"
+    "        gl_FrontColor = vec4(1.0, 0.0, 0.0, 0.0);\n"
+    "    }else if(shade.x<-0.5){\n"
+    "        gl_FrontColor = vec4(1.0, 1.0, 0.0, 0.0);\n"
+    "    }else{\n"
+    "        float c = max(shade.x/3.0, max(0.7-shade.y, 0.0));\n"
+    "        gl_FrontColor = vec4(c, c, 1.0, 0.0);\n"
+    "    }\n"
+    "}\n";
+
+static const char* s_particleFragmentShader =
+    "#version 120\n"
+    "void main(){\n"
+    "    gl_FragColor = gl_Color;\n"
+    "}\n";
+
+static GLuint CompileShader(const GLenum& type, const char* source){
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    GLint compiled = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if(compiled!=GL_TRUE){
+        char log[1024];
+        glGetShaderInfoLog(shader, 1024, NULL, log);
+        std::cout << "Error: particle shader failed to compile: " << log << std::endl;
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+bool Viewer::BuildParticleProgram(){
+    GLuint vertex = CompileShader(GL_VERTEX_SHADER, s_particleVertexShader);
+    GLuint fragment = CompileShader(GL_FRAGMENT_SHADER, s_particleFragmentShader);
+    if(vertex==0 || fragment==0){
+        glDeleteShader(vertex);
+        glDeleteShader(fragment);
+        return false;
+    }
+    m_particleProgram = glCreateProgram();
+    glAttachShader(m_particleProgram, vertex);
+    glAttachShader(m_particleProgram, fragment);
+    glLinkProgram(m_particleProgram);
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+    GLint linked = GL_FALSE;
+    glGetProgramiv(m_particleProgram, GL_LINK_STATUS, &linked);
+    if(linked!=GL_TRUE){
+        glDeleteProgram(m_particleProgram);
+        m_particleProgram = 0;
+        return false;
+    }
+    m_particleAttribute = glGetAttribLocation(m_particleProgram, "shade");
+    return m_particleAttribute>=0;
+}
+
 VboData Viewer::CreateVBO(VboData& data, float* vertices, const unsigned int& vertexcount, 
                           float* colors, const unsigned int& colorcount, const GLenum& type, 
                           const std::string& key){
@@ -616,7 +1016,12 @@ bool Viewer::CreateVBOFromMeshContainer(geomCore::MeshContainer* o, const float&
     if(o->GetTransforms(frame, transform, inversetransform)==false){
         return false;
     }
-    data = CreateVBOFromObj(&o->GetMeshFrame(frame)->m_basegeom, color, key);
+    objCore::Obj* obj = &o->GetMeshFrame(frame)->m_basegeom;
+    if(data.m_vboID==0 || data.m_source[0]!=obj){
+        ReleaseVBO(data);
+        data = CreateVBOFromObj(obj, color, key);
+        data.m_source[0] = obj;
+    }
     for(int x=0; x<4; x++){
         for(int y=0; y<4; y++){
             data.m_transform[x][y] = transform[x][y];
@@ -638,6 +1043,19 @@ bool Viewer::CreateVBOFromAnimmeshContainer(geomCore::AnimatedMeshContainer* o,
     objCore::Obj* o0 = io->m_obj0;
     objCore::Obj* o1 = io->m_obj1;
     float lerpWeight = o->GetInterpolationWeight(frame);
+    if(data.m_vboID!=0 && data.m_source[0]==o0 && data.m_source[1]==o1 && 
+       data.m_sourceWeight==lerpWeight){
+        for(int x=0; x<4; x++){
+            for(int y=0; y<4; y++){
+                data.m_transform[x][y] = transform[x][y];
+            }
+        }
+        return true;
+    }
+    ReleaseVBO(data);
+    data.m_source[0] = o0;
+    data.m_source[1] = o1;
+    data.m_sourceWeight = lerpWeight;
 
     //build vertex buffers
     std::vector<glm::vec3> vertexData;
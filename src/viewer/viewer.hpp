@@ -26,11 +26,56 @@ namespace viewerCore {
 
 struct VboData{
     GLuint          m_vboID;
-    GLuint          m_cboID;
+    GLuint          m_cboID;        //colors, or the shader attributes for GL_POINTS
     int             m_size;
     GLenum          m_type;
     std::string     m_key;
     GLfloat         m_transform[4][4];
+    bool            m_visible;
+    //what the buffers were built from, so unchanged meshes are not rebuilt on a frame change
+    const void*     m_source[2];
+    float           m_sourceWeight;
+
+    //Initializer
+    VboData(): m_vboID(0), m_cboID(0), m_size(0), m_type(GL_POINTS), m_visible(true),
+               m_sourceWeight(0.0f){
+        m_source[0] = NULL;
+        m_source[1] = NULL;
+    };
+};
+
+//Which subset of the liquid particles the viewer draws
+enum PreviewLod{
+    PREVIEW_FULL,
+    PREVIEW_STRIDE,     //every m_previewStride'th particle
+    PREVIEW_VOXEL       //one particle per cube of m_previewVoxelSize cells
+};
+
+//Copy of the particles the viewer draws, filled by the sim thread between steps. Attributes are
+//speed and density, with speed set to -1 for out of bounds and -2 for solid particles; the 
+//particle shader turns them into colors
+struct ParticleSnapshot{
+    std::vector<glm::vec3>  m_positions;
+    std::vector<glm::vec2>  m_attributes;
+    unsigned int            m_count;
+    unsigned int            m_frame;
+
+    //Initializer
+    ParticleSnapshot(): m_count(0), m_frame(0){};
+};
+
+//Particle vertex and color buffers, persistently mapped when ARB_buffer_storage is available
+struct ParticleUploadBuffer{
+    GLuint          m_vboID;
+    GLuint          m_aboID;
+    glm::vec3*      m_positions;
+    glm::vec2*      m_attributes;
+    unsigned int    m_capacity;
+    GLsync          m_fence;
+
+    //Initializer
+    ParticleUploadBuffer(): m_vboID(0), m_aboID(0), m_positions(NULL), m_attributes(NULL),
+                            m_capacity(0), m_fence(0){};
 };
 
 //Used just for tracking OpenGL viewport camera position/keeping in sync with rendercam
@@ -73,18 +118,30 @@ class Viewer{
         void Load(fluidCore::FlipSim* sim, const bool& retina, const glm::vec2& resolution, 
                   const glm::vec3& camrotate, const glm::vec3& camtranslate, 
                   const glm::vec2& camfov, const float& camlookat);
+        void SetPreview(const PreviewLod& lod, const unsigned int& factor);
+        //Draws frames streamed from a sim running elsewhere instead of stepping the loaded
+        //sim, which then only provides the scene's dimensions and meshes
+        bool Attach(const std::string& address);
     private:
         //Initialize stuff
         bool Init();
 
         //Sim thread stuff
         void SimLoopThread();
+        void StreamLoopThread();
 
         //Main draw functions
         void MainLoop();
         void UpdateInputs();
         void UpdateParticles();
         void UpdateMeshes();
+        void SnapshotParticles();
+        void UploadParticles(const ParticleSnapshot& snapshot);
+        void ReserveParticleBuffer(ParticleUploadBuffer& buffer, const unsigned int& count);
+        void ReleaseParticleBuffer(ParticleUploadBuffer& buffer);
+        void ClaimPreviewVoxels(fluidCore::Particle* const* particles, const unsigned int& count,
+                                const float& maxd, const bool& drawInvalid);
+        bool BuildParticleProgram();
 
         //VBO stuff
         VboData CreateVBO(VboData& data, float* vertices, const unsigned int& vertexcount, 
@@ -98,6 +155,10 @@ class Viewer{
                                             const glm::vec4& color, const std::string& key,
                                             VboData& data);
 
+        void UpdateGeomVBO(geomCore::Geom* geom, const glm::vec4& color, const std::string& key);
+        void SetVBO(const VboData& data);
+        void ReleaseVBO(VboData& data);
+
         void SaveFrame();
 
         //Interface callbacks
@@ -118,6 +179,7 @@ class Viewer{
         std::vector<glm::vec3>                          m_rayendpoints;
 
         fluidCore::FlipSim*                             m_sim;
+        fluidCore::SimStreamClient*                     m_stream;
         bool                                            m_siminitialized;
         bool                                            m_drawobjects;
         bool                                            m_drawInvalid;
@@ -134,6 +196,32 @@ class Viewer{
         bool                                            m_dumpPARTIO;
 
         unsigned int                                    m_currentFrame;
+
+        //the sim thread fills m_writeSnapshot and swaps it with m_readySnapshot, the draw loop
+        //swaps m_readySnapshot with m_drawSnapshot, so neither waits on the other's copy
+        ParticleSnapshot                                m_snapshots[3];
+        ParticleSnapshot*                               m_writeSnapshot;
+        ParticleSnapshot*                               m_readySnapshot;
+        ParticleSnapshot*                               m_drawSnapshot;
+        bool                                            m_snapshotReady;
+        tbb::mutex                                      m_snapshotLock;
+        //uploads alternate between the two so the GPU can still draw last frame's particles
+        ParticleUploadBuffer                            m_particleBuffers[2];
+        unsigned int                                    m_particleBufferIndex;
+        bool                                            m_persistentBuffers;
+        GLuint                                          m_particleProgram;
+        GLint                                           m_particleAttribute;
+
+        //preview settings are read by the sim thread when it takes a snapshot; a change while
+        //paused sets m_snapshotDirty so the paused sim thread takes a fresh one
+        PreviewLod                                      m_previewLod;
+        unsigned int                                    m_previewStride;
+        unsigned int                                    m_previewVoxelSize;
+        bool                                            m_snapshotDirty;
+        //lowest particle index in each preview voxel, only touched by the sim thread
+        tbb::atomic<unsigned int>*                      m_voxelOwners;
+        unsigned int                                    m_voxelOwnerCount;
+        glm::ivec3                                      m_voxelDimensions;
 };
 }
 